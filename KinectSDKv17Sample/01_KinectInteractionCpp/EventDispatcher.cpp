@@ -0,0 +1,41 @@
+#include "EventDispatcher.h"
+
+namespace kinectbook {
+
+EventDispatcher::EventDispatcher( HANDLE stopEvent_ )
+    : stopEvent( stopEvent_ )
+{
+}
+
+EventDispatcher::~EventDispatcher()
+{
+    stop();
+}
+
+void EventDispatcher::add( HANDLE event, const Handler& handler )
+{
+    workers.push_back( std::thread( &EventDispatcher::workerMain, this, event, handler ) );
+}
+
+void EventDispatcher::stop()
+{
+    ::SetEvent( stopEvent );
+    for ( size_t i = 0; i < workers.size(); ++i ) {
+        if ( workers[i].joinable() ) {
+            workers[i].join();
+        }
+    }
+    workers.clear();
+}
+
+void EventDispatcher::workerMain( HANDLE event, Handler handler )
+{
+    // The stop event comes first so that it wins when both are signaled
+    HANDLE events[2] = { stopEvent, event };
+    while ( ::WaitForMultipleObjects( 2, events, FALSE, INFINITE ) == WAIT_OBJECT_0 + 1 ) {
+        ::ResetEvent( event );
+        handler();
+    }
+}
+
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include <Windows.h>
+
+namespace kinectbook {
+
+/// <summary>
+/// Runs a handler on a thread of its own every time its event is signaled
+/// </summary>
+/// <remarks>
+/// Every worker sleeps in WaitForMultipleObjects on the stop event and its
+/// own event, so an idle dispatcher costs no CPU and a frame is handled as
+/// soon as it is signaled, without waiting for the handlers of the other
+/// streams. The event is reset before the handler runs; a frame that
+/// arrives meanwhile signals it again.
+/// </remarks>
+class EventDispatcher
+{
+public:
+
+    typedef std::function<void ()> Handler;
+
+    /// <param name="stopEvent">Manual reset event; once signaled every worker returns</param>
+    explicit EventDispatcher( HANDLE stopEvent );
+
+    /// <summary>
+    /// Signal the stop event and wait for the workers
+    /// </summary>
+    ~EventDispatcher();
+
+    /// <summary>
+    /// Start a worker that calls handler whenever event is signaled
+    /// </summary>
+    void add( HANDLE event, const Handler& handler );
+
+    /// <summary>
+    /// Signal the stop event and wait until every handler has returned
+    /// </summary>
+    void stop();
+
+private:
+
+    EventDispatcher( const EventDispatcher& );
+    EventDispatcher& operator=( const EventDispatcher& );
+
+    void workerMain( HANDLE event, Handler handler );
+
+    HANDLE stopEvent;
+    std::vector<std::thread> workers;
+};
+
+}
@@ -0,0 +1,387 @@
+#include "HandStateClassifier.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "../common/SimdConfig.h"
+
+namespace kinectbook {
+
+namespace {
+
+// Radius around the hand joint that holds an open hand with spread fingers (m)
+const float HAND_WINDOW_RADIUS = 0.15f;
+
+// Hand pixels are within this distance of the hand joint in depth (mm)
+const int HAND_DEPTH_BAND = 100;
+
+// Fewer pixels than this are noise or an occluded hand
+const UINT MIN_HAND_PIXELS = 20;
+
+// The open hand reference never goes below this area (m^2), so a hand that
+// starts closed does not become the open reference
+const float MIN_OPEN_AREA = 0.008f;
+
+// Per frame pull of the open hand reference towards the current area while
+// the hand is clearly open
+const float OPEN_AREA_DECAY = 0.002f;
+
+// Openness below which a hand grips, and above which a gripped hand releases
+const float GRIP_OPENNESS = 0.65f;
+const float RELEASE_OPENNESS = 0.8f;
+
+// Frames a new grip state has to hold before it is reported
+const int DEBOUNCE_FRAMES = 2;
+
+// Hand in front of the shoulder where a press starts and is complete (m)
+const float PRESS_START_DISTANCE = 0.25f;
+const float PRESS_END_DISTANCE = 0.45f;
+
+// pressExtent below which a press is over
+const float PRESS_RELEASE_EXTENT = 0.8f;
+
+struct HandJoints
+{
+    NUI_SKELETON_POSITION_INDEX shoulder;
+    NUI_SKELETON_POSITION_INDEX wrist;
+    NUI_SKELETON_POSITION_INDEX hand;
+};
+
+const HandJoints JOINTS[HAND_COUNT] = {
+    { NUI_SKELETON_POSITION_SHOULDER_LEFT, NUI_SKELETON_POSITION_WRIST_LEFT, NUI_SKELETON_POSITION_HAND_LEFT },
+    { NUI_SKELETON_POSITION_SHOULDER_RIGHT, NUI_SKELETON_POSITION_WRIST_RIGHT, NUI_SKELETON_POSITION_HAND_RIGHT },
+};
+
+/// <summary>
+/// Which pixels of a row belong to the hand
+/// </summary>
+/// <remarks>
+/// x is relative to the hand joint. A pixel is part of the hand when it has
+/// the player index, its depth is inside the band and
+/// cutX * x + cutOffset >= 0, which puts it beyond the wrist.
+/// </remarks>
+struct RowTest
+{
+    int player;
+    int minDepth;       // millimeters, inclusive
+    int maxDepth;
+    float cutX;
+    float cutOffset;
+};
+
+/// <summary>
+/// Sums over the hand pixels of one row
+/// </summary>
+struct RowSums
+{
+    float count;
+    float x;
+    float xx;
+};
+
+inline bool isHandPixel( const NUI_DEPTH_IMAGE_PIXEL& pixel, float x, const RowTest& test )
+{
+    return pixel.playerIndex == test.player && pixel.depth >= test.minDepth && pixel.depth <= test.maxDepth &&
+           test.cutX * x + test.cutOffset >= 0;
+}
+
+// NUI_DEPTH_IMAGE_PIXEL is 32 bits: player index in the low, depth in the high half
+RowSums sumRow( const NUI_DEPTH_IMAGE_PIXEL* row, int count, float firstX, const RowTest& test )
+{
+    RowSums sums = { 0, 0, 0 };
+    int i = 0;
+
+#if defined(KB_SSE2)
+    {
+        const __m128i lowHalf = _mm_set1_epi32( 0xFFFF );
+        const __m128i player = _mm_set1_epi32( test.player );
+        const __m128i below = _mm_set1_epi32( test.minDepth - 1 );
+        const __m128i above = _mm_set1_epi32( test.maxDepth + 1 );
+        const __m128 cutX = _mm_set1_ps( test.cutX );
+        const __m128 cutOffset = _mm_set1_ps( test.cutOffset );
+        const __m128 one = _mm_set1_ps( 1.0f );
+        const __m128 four = _mm_set1_ps( 4.0f );
+        __m128 x = _mm_add_ps( _mm_set1_ps( firstX ), _mm_setr_ps( 0, 1, 2, 3 ) );
+        __m128 n = _mm_setzero_ps(), sx = _mm_setzero_ps(), sxx = _mm_setzero_ps();
+        for ( ; i + 4 <= count; i += 4 ) {
+            __m128i p = _mm_loadu_si128( (const __m128i*)(row + i) );
+            __m128i depth = _mm_srli_epi32( p, 16 );
+            __m128i inside = _mm_and_si128( _mm_cmpeq_epi32( _mm_and_si128( p, lowHalf ), player ),
+                _mm_and_si128( _mm_cmpgt_epi32( depth, below ), _mm_cmplt_epi32( depth, above ) ) );
+            __m128 beyond = _mm_cmpge_ps( _mm_add_ps( _mm_mul_ps( x, cutX ), cutOffset ), _mm_setzero_ps() );
+            __m128 mask = _mm_and_ps( _mm_castsi128_ps( inside ), beyond );
+            __m128 hx = _mm_and_ps( x, mask );
+            n = _mm_add_ps( n, _mm_and_ps( one, mask ) );
+            sx = _mm_add_ps( sx, hx );
+            sxx = _mm_add_ps( sxx, _mm_mul_ps( hx, hx ) );
+            x = _mm_add_ps( x, four );
+        }
+        KB_ALIGN(16) float lanes[3][4];
+        _mm_store_ps( lanes[0], n );
+        _mm_store_ps( lanes[1], sx );
+        _mm_store_ps( lanes[2], sxx );
+        sums.count = (lanes[0][0] + lanes[0][1]) + (lanes[0][2] + lanes[0][3]);
+        sums.x = (lanes[1][0] + lanes[1][1]) + (lanes[1][2] + lanes[1][3]);
+        sums.xx = (lanes[2][0] + lanes[2][1]) + (lanes[2][2] + lanes[2][3]);
+    }
+#elif defined(KB_NEON)
+    {
+        const uint32x4_t player = vdupq_n_u32( (uint32_t)test.player );
+        const uint32x4_t minDepth = vdupq_n_u32( (uint32_t)test.minDepth );
+        const uint32x4_t maxDepth = vdupq_n_u32( (uint32_t)test.maxDepth );
+        const float32x4_t cutOffset = vdupq_n_f32( test.cutOffset );
+        const float32x4_t one = vdupq_n_f32( 1.0f );
+        static const float steps[4] = { 0, 1, 2, 3 };
+        float32x4_t x = vaddq_f32( vdupq_n_f32( firstX ), vld1q_f32( steps ) );
+        float32x4_t n = vdupq_n_f32( 0 ), sx = vdupq_n_f32( 0 ), sxx = vdupq_n_f32( 0 );
+        for ( ; i + 4 <= count; i += 4 ) {
+            uint32x4_t p = vld1q_u32( (const uint32_t*)(row + i) );
+            uint32x4_t depth = vshrq_n_u32( p, 16 );
+            uint32x4_t mask = vandq_u32( vceqq_u32( vandq_u32( p, vdupq_n_u32( 0xFFFF ) ), player ),
+                vandq_u32( vcgeq_u32( depth, minDepth ), vcleq_u32( depth, maxDepth ) ) );
+            mask = vandq_u32( mask, vcgeq_f32( vmlaq_n_f32( cutOffset, x, test.cutX ), vdupq_n_f32( 0 ) ) );
+            float32x4_t hx = vreinterpretq_f32_u32( vandq_u32( vreinterpretq_u32_f32( x ), mask ) );
+            n = vaddq_f32( n, vreinterpretq_f32_u32( vandq_u32( vreinterpretq_u32_f32( one ), mask ) ) );
+            sx = vaddq_f32( sx, hx );
+            sxx = vmlaq_f32( sxx, hx, hx );
+            x = vaddq_f32( x, vdupq_n_f32( 4.0f ) );
+        }
+        float lanes[3][4];
+        vst1q_f32( lanes[0], n );
+        vst1q_f32( lanes[1], sx );
+        vst1q_f32( lanes[2], sxx );
+        sums.count = (lanes[0][0] + lanes[0][1]) + (lanes[0][2] + lanes[0][3]);
+        sums.x = (lanes[1][0] + lanes[1][1]) + (lanes[1][2] + lanes[1][3]);
+        sums.xx = (lanes[2][0] + lanes[2][1]) + (lanes[2][2] + lanes[2][3]);
+    }
+#endif
+
+    for ( ; i < count; ++i ) {
+        float x = firstX + i;
+        if ( isHandPixel( row[i], x, test ) ) {
+            sums.count += 1.0f;
+            sums.x += x;
+            sums.xx += x * x;
+        }
+    }
+    return sums;
+}
+
+inline bool isJointTracked( const NUI_SKELETON_DATA& skeleton, NUI_SKELETON_POSITION_INDEX joint )
+{
+    return skeleton.eSkeletonPositionTrackingState[joint] != NUI_SKELETON_POSITION_NOT_TRACKED;
+}
+
+inline double millisecondsSince( std::chrono::high_resolution_clock::time_point start )
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::high_resolution_clock::now() - start ).count() / 1e6;
+}
+
+}
+
+HandStateClassifier::HandStateClassifier()
+{
+    reset();
+}
+
+void HandStateClassifier::reset()
+{
+    std::memset( skeletons, 0, sizeof(skeletons) );
+    std::memset( history, 0, sizeof(history) );
+    std::memset( &frame, 0, sizeof(frame) );
+    skeletonsValid = false;
+    frameReady = false;
+}
+
+HRESULT HandStateClassifier::ProcessSkeleton( UINT skeletonCount, const NUI_SKELETON_DATA* skeletonData, LONGLONG /*timestamp*/ )
+{
+    if ( skeletonData == 0 ) {
+        return E_POINTER;
+    }
+    if ( skeletonCount == 0 || skeletonCount > NUI_SKELETON_COUNT ) {
+        return E_INVALIDARG;
+    }
+
+    std::memset( skeletons, 0, sizeof(skeletons) );
+    std::memcpy( skeletons, skeletonData, skeletonCount * sizeof(NUI_SKELETON_DATA) );
+    skeletonsValid = true;
+    return S_OK;
+}
+
+HRESULT HandStateClassifier::ProcessDepth( const NUI_DEPTH_IMAGE_PIXEL* pixels, UINT width, UINT height, LONGLONG timestamp )
+{
+    if ( pixels == 0 ) {
+        return E_POINTER;
+    }
+    if ( width == 0 || height == 0 ) {
+        return E_INVALIDARG;
+    }
+
+    frameStart = Clock::now();
+    frame.timestamp = timestamp;
+
+    for ( UINT i = 0; i < NUI_SKELETON_COUNT; ++i ) {
+        for ( int h = 0; h < HAND_COUNT; ++h ) {
+            HandFeatures features = { 0, 0, 0, 0 };
+            bool segmented = skeletonsValid && segmentHand( pixels, width, height, i, (HandType)h, features );
+            classifyHand( i, (HandType)h, segmented, features, frame.hands[i][h] );
+        }
+    }
+
+    frame.processingTime = millisecondsSince( frameStart );
+    frameReady = true;
+    return S_OK;
+}
+
+HRESULT HandStateClassifier::GetNextFrame( HandFrame* nextFrame )
+{
+    if ( nextFrame == 0 ) {
+        return E_POINTER;
+    }
+
+    *nextFrame = frame;
+    if ( !frameReady ) {
+        return S_FALSE;
+    }
+    frameReady = false;
+    return S_OK;
+}
+
+bool HandStateClassifier::segmentHand( const NUI_DEPTH_IMAGE_PIXEL* pixels, UINT width, UINT height, UINT skeletonIndex,
+                                       HandType hand, HandFeatures& features ) const
+{
+    const NUI_SKELETON_DATA& skeleton = skeletons[skeletonIndex];
+    const HandJoints& joints = JOINTS[hand];
+    if ( skeleton.eTrackingState != NUI_SKELETON_TRACKED ||
+         !isJointTracked( skeleton, joints.wrist ) || !isJointTracked( skeleton, joints.hand ) ) {
+        return false;
+    }
+
+    const Vector4& handPosition = skeleton.SkeletonPositions[joints.hand];
+    const Vector4& wristPosition = skeleton.SkeletonPositions[joints.wrist];
+    if ( handPosition.z < NUI_FUSION_DEFAULT_MINIMUM_DEPTH || wristPosition.z < NUI_FUSION_DEFAULT_MINIMUM_DEPTH ) {
+        return false;
+    }
+
+    // Same projection as NuiTransformSkeletonToDepthImage
+    const float focal = NUI_CAMERA_DEPTH_NOMINAL_FOCAL_LENGTH_IN_PIXELS * width / 320.0f;
+    float handU = width * 0.5f + handPosition.x * focal / handPosition.z;
+    float handV = height * 0.5f - handPosition.y * focal / handPosition.z;
+    float wristU = width * 0.5f + wristPosition.x * focal / wristPosition.z;
+    float wristV = height * 0.5f - wristPosition.y * focal / wristPosition.z;
+
+    // Window around the hand, in pixels relative to the hand joint
+    int centerX = (int)std::floor( handU + 0.5f );
+    int centerY = (int)std::floor( handV + 0.5f );
+    int radius = (int)std::ceil( HAND_WINDOW_RADIUS * focal / handPosition.z );
+    int left = std::max( centerX - radius, 0 );
+    int right = std::min( centerX + radius + 1, (int)width );
+    int top = std::max( centerY - radius, 0 );
+    int bottom = std::min( centerY + radius + 1, (int)height );
+    if ( left >= right || top >= bottom ) {
+        return false;
+    }
+
+    // The forearm is cut off at the wrist, across the wrist to hand direction;
+    // with the hand pointing at the camera the depth band has to do
+    float cutX = handU - wristU;
+    float cutY = handV - wristV;
+    float cutZ = -(cutX * (wristU - centerX) + cutY * (wristV - centerY));
+    if ( cutX * cutX + cutY * cutY < 1.0f ) {
+        cutX = cutY = 0;
+        cutZ = 1.0f;
+    }
+
+    int handDepth = (int)(handPosition.z * 1000.0f + 0.5f);
+    RowTest test = { (int)skeletonIndex + 1, std::max( handDepth - HAND_DEPTH_BAND, 1 ), handDepth + HAND_DEPTH_BAND, cutX, 0 };
+
+    double n = 0, sx = 0, sy = 0, sxx = 0, syy = 0, sxy = 0;
+    for ( int v = top; v < bottom; ++v ) {
+        float y = (float)(v - centerY);
+        test.cutOffset = cutY * y + cutZ;
+        RowSums row = sumRow( pixels + v * width + left, right - left, (float)(left - centerX), test );
+        n += row.count;
+        sx += row.x;
+        sy += y * row.count;
+        sxx += row.xx;
+        syy += y * y * row.count;
+        sxy += y * row.x;
+    }
+    if ( n < MIN_HAND_PIXELS ) {
+        return false;
+    }
+
+    // Covariance of the pixel positions and its eigenvalues
+    double meanX = sx / n, meanY = sy / n;
+    double cxx = std::max( sxx / n - meanX * meanX, 0.0 );
+    double cyy = std::max( syy / n - meanY * meanY, 0.0 );
+    double cxy = sxy / n - meanX * meanY;
+    double halfTrace = (cxx + cyy) * 0.5;
+    double root = std::sqrt( std::max( halfTrace * halfTrace - (cxx * cyy - cxy * cxy), 0.0 ) );
+    double major = halfTrace + root;
+    double minor = std::max( halfTrace - root, 0.25 / 12 );
+
+    // One pixel covers pixelSize meters at the depth of the hand
+    double pixelSize = handPosition.z / focal;
+    features.pixelCount = (UINT)n;
+    features.area = (float)(n * pixelSize * pixelSize);
+    features.spread = (float)(std::sqrt( cxx + cyy ) * pixelSize);
+    features.elongation = (float)std::sqrt( major / minor );
+    return true;
+}
+
+void HandStateClassifier::classifyHand( UINT skeletonIndex, HandType hand, bool segmented, const HandFeatures& features,
+                                        HandState& state )
+{
+    const NUI_SKELETON_DATA& skeleton = skeletons[skeletonIndex];
+    HandHistory& past = history[skeletonIndex][hand];
+
+    // Another user in this slot starts from scratch
+    DWORD trackingId = (skeleton.eTrackingState == NUI_SKELETON_TRACKED) ? skeleton.dwTrackingID : 0;
+    if ( trackingId != past.trackingId ) {
+        std::memset( &past, 0, sizeof(past) );
+        std::memset( &state, 0, sizeof(state) );
+        past.trackingId = trackingId;
+        state.trackingId = trackingId;
+    }
+
+    state.handEvent = HAND_EVENT_NONE;
+    state.tracked = segmented;
+    state.features = features;
+
+    // A hand that is lost keeps its state, as the SDK does
+    if ( segmented ) {
+        if ( features.area > past.openArea ) {
+            past.openArea = std::max( features.area, MIN_OPEN_AREA );
+        }
+        else if ( !state.gripped && features.area > past.openArea * RELEASE_OPENNESS ) {
+            past.openArea = std::max( past.openArea + (features.area - past.openArea) * OPEN_AREA_DECAY, MIN_OPEN_AREA );
+        }
+        state.openness = std::min( features.area / past.openArea, 1.0f );
+
+        bool grip = state.openness < (state.gripped ? RELEASE_OPENNESS : GRIP_OPENNESS);
+        if ( grip != state.gripped ) {
+            if ( ++past.pendingFrames >= DEBOUNCE_FRAMES ) {
+                state.gripped = grip;
+                state.handEvent = grip ? HAND_EVENT_GRIP : HAND_EVENT_GRIP_RELEASE;
+                past.pendingFrames = 0;
+            }
+        }
+        else {
+            past.pendingFrames = 0;
+        }
+    }
+
+    const HandJoints& joints = JOINTS[hand];
+    if ( trackingId != 0 && isJointTracked( skeleton, joints.shoulder ) && isJointTracked( skeleton, joints.hand ) ) {
+        float reach = skeleton.SkeletonPositions[joints.shoulder].z - skeleton.SkeletonPositions[joints.hand].z;
+        state.pressExtent = std::min( std::max( (reach - PRESS_START_DISTANCE) / (PRESS_END_DISTANCE - PRESS_START_DISTANCE), 0.0f ), 1.0f );
+        state.pressed = state.pressed ? (state.pressExtent > PRESS_RELEASE_EXTENT) : (state.pressExtent >= 1.0f);
+    }
+
+    state.latency = millisecondsSince( frameStart );
+}
+
+}
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <chrono>
+
+#include "../common/NuiCompat.h"
+
+namespace kinectbook {
+
+/// <summary>
+/// Hand events, same values as NUI_HAND_EVENT_TYPE
+/// </summary>
+enum HandEventType
+{
+    HAND_EVENT_NONE = 0,
+    HAND_EVENT_GRIP = 1,
+    HAND_EVENT_GRIP_RELEASE = 2,
+};
+
+enum HandType
+{
+    HAND_LEFT = 0,
+    HAND_RIGHT = 1,
+    HAND_COUNT = 2,
+};
+
+/// <summary>
+/// Shape of a segmented hand, metric at the depth of the hand joint
+/// </summary>
+struct HandFeatures
+{
+    UINT pixelCount;
+    FLOAT area;             // square meters seen from the camera
+    FLOAT spread;           // radius of gyration (m)
+    FLOAT elongation;       // major / minor axis, 1 for a disc
+};
+
+/// <summary>
+/// State of one hand after a depth frame
+/// </summary>
+struct HandState
+{
+    DWORD trackingId;       // 0 for a skeleton slot without a user
+    bool tracked;           // joints tracked and enough hand pixels
+    bool gripped;
+    bool pressed;
+    HandEventType handEvent;    // change of gripped in this frame
+    FLOAT openness;         // area relative to the open hand, 0 fist .. 1 open
+    FLOAT pressExtent;      // hand in front of the shoulder, 0 .. 1 at the press distance
+    HandFeatures features;
+    double latency;         // milliseconds from ProcessDepth() until this hand was classified
+};
+
+/// <summary>
+/// Hand states of all skeleton slots for one depth frame
+/// </summary>
+struct HandFrame
+{
+    LONGLONG timestamp;     // of the depth frame
+    double processingTime;  // milliseconds for the whole frame
+    HandState hands[NUI_SKELETON_COUNT][HAND_COUNT];
+};
+
+/// <summary>
+/// Grip, release and press of the hands from the player indexed depth map
+/// </summary>
+/// <remarks>
+/// Takes the same input as INuiInteractionStream: every depth frame with
+/// player indices and every skeleton frame, unsmoothed. For each tracked
+/// hand it cuts a window around the projected hand joint out of the depth
+/// map and keeps the pixels of the same player near the depth of the hand
+/// and beyond the wrist. Their area and second moments are accumulated a
+/// row of pixels at a time with SIMD. A closed hand covers a fraction of
+/// the open one, so the area is compared to the largest area seen for that
+/// hand, which adapts to the user and the distance to the sensor; grip and
+/// release use two thresholds and have to hold for a few frames. Press is
+/// the hand reaching forward from the shoulder.
+///
+/// The calls have to be serialized by the caller.
+/// </remarks>
+class HandStateClassifier
+{
+public:
+
+    HandStateClassifier();
+
+    /// <summary>
+    /// Forget the users and their open hand sizes
+    /// </summary>
+    void reset();
+
+    /// <summary>
+    /// Skeletons used for the following depth frames
+    /// </summary>
+    HRESULT ProcessSkeleton( UINT skeletonCount, const NUI_SKELETON_DATA* skeletons, LONGLONG timestamp );
+
+    /// <summary>
+    /// Classify the hands of the last skeletons in a depth frame
+    /// </summary>
+    /// <param name="pixels">Depth with player index, any resolution of the 4:3 depth camera</param>
+    HRESULT ProcessDepth( const NUI_DEPTH_IMAGE_PIXEL* pixels, UINT width, UINT height, LONGLONG timestamp );
+
+    /// <summary>
+    /// Result of the last depth frame
+    /// </summary>
+    /// <returns>S_FALSE if it was handed out already</returns>
+    HRESULT GetNextFrame( HandFrame* frame );
+
+private:
+
+    HandStateClassifier( const HandStateClassifier& );
+    HandStateClassifier& operator=( const HandStateClassifier& );
+
+    /// <summary>
+    /// What is kept of a hand between frames
+    /// </summary>
+    struct HandHistory
+    {
+        DWORD trackingId;
+        FLOAT openArea;         // largest area seen, decays slowly
+        int pendingFrames;      // frames the opposite state has held
+    };
+
+    typedef std::chrono::high_resolution_clock Clock;
+
+    bool segmentHand( const NUI_DEPTH_IMAGE_PIXEL* pixels, UINT width, UINT height, UINT skeletonIndex,
+                      HandType hand, HandFeatures& features ) const;
+    void classifyHand( UINT skeletonIndex, HandType hand, bool segmented, const HandFeatures& features,
+                       HandState& state );
+
+    NUI_SKELETON_DATA skeletons[NUI_SKELETON_COUNT];
+    bool skeletonsValid;
+
+    HandHistory history[NUI_SKELETON_COUNT][HAND_COUNT];
+    HandFrame frame;
+    bool frameReady;
+    Clock::time_point frameStart;
+};
+
+}
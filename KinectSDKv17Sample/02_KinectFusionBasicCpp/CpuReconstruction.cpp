@@ -0,0 +1,799 @@
+#include "CpuReconstruction.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+
+#include "DepthProcessor.h"
+
+namespace kinectbook {
+
+namespace {
+
+// Correspondences further apart than this are outliers
+const float MAX_CORRESPONDENCE_DISTANCE = 0.1f;
+
+// cos(30 degrees), maximum angle between the normals of a correspondence
+const float MIN_NORMAL_COSINE = 0.866f;
+
+// Tracking is lost below this share of valid pixels with a correspondence
+const float MIN_INLIER_RATIO = 0.15f;
+
+// ... or below this part of the share of the last tracked frame: the view
+// suddenly stopped matching the model, as when ICP slid into a wrong pose
+// after frames went missing, or something stepped in front of the camera.
+// Every frame that fails lowers the share expected by INLIER_RATIO_DECAY,
+// so a lasting change of the view is tracked again after a while
+const float MIN_INLIER_RATIO_TO_LAST = 0.6f;
+const float INLIER_RATIO_DECAY = 0.9f;
+
+// ... or when more than this share of the pixels that hit the model lies
+// further than DEPTH_CONFLICT_DISTANCE behind its surface: the frame sees
+// through walls the model has. Pixels in front of the model are fine,
+// that is something new in the view
+const float MAX_DEPTH_CONFLICT_RATIO = 0.1f;
+const float DEPTH_CONFLICT_DISTANCE = 0.05f;
+
+// ... or above this point to plane error (meters)
+const float MAX_RMS_ERROR = 0.02f;
+
+// ... or when the camera jumped further than this from the initial guess
+const float MAX_TRANSLATION_DELTA = 0.15f;
+const float MAX_ROTATION_DELTA = 0.35f;
+
+// A level stops iterating once the update is below these, well under a voxel
+// and the depth noise (at full resolution; a coarser level stops at
+// proportionally larger updates, it cannot resolve less)
+const float MIN_TRANSLATION_UPDATE = 5e-4f;
+const float MIN_ROTATION_UPDATE = 2.5e-4f;
+
+// Depth pyramid: level 0 is the full frame, level 2 a quarter of its width (160x120)
+const int TRACKING_LEVELS = TrackingStatistics::MAX_LEVELS;
+
+// Depth further apart than this is not averaged into a coarser pixel
+const float PYRAMID_MAX_DEPTH_DIFFERENCE = 0.03f;
+
+// Keyframes tried per frame while tracking is lost, and the pyramid level
+// they are raycast at (the raycast is the expensive part of a try)
+const unsigned int RELOCALIZATION_CANDIDATES = 2;
+const int RELOCALIZATION_MODEL_LEVEL = 2;
+
+// Keyframes aligned against per try to close a loop, raycast at the same level
+const unsigned int LOOP_CLOSURE_CANDIDATES = 1;
+
+// Coarsest resolution CalculatePointCloud() raycasts at, 1/8 of the depth frame
+const int MAX_POINT_CLOUD_LEVEL = 3;
+
+// Rows per partial sum of the normal equations; the partial sums are added
+// in a fixed order so the result does not depend on the thread count
+const int ROWS_PER_REDUCTION = 8;
+
+// Normal equations of the point to plane error, J^T J (upper triangle) and J^T r
+struct IcpSystem
+{
+    double ata[21];
+    double atb[6];
+    double error;
+    int count;
+
+    IcpSystem() : error( 0 ), count( 0 )
+    {
+        std::fill( ata, ata + 21, 0.0 );
+        std::fill( atb, atb + 6, 0.0 );
+    }
+
+    void add( const float j[6], float r )
+    {
+        int n = 0;
+        for ( int i = 0; i < 6; ++i ) {
+            for ( int k = i; k < 6; ++k ) {
+                ata[n++] += j[i] * j[k];
+            }
+            atb[i] += j[i] * r;
+        }
+        error += r * r;
+        ++count;
+    }
+
+    void add( const IcpSystem& s )
+    {
+        for ( int i = 0; i < 21; ++i ) {
+            ata[i] += s.ata[i];
+        }
+        for ( int i = 0; i < 6; ++i ) {
+            atb[i] += s.atb[i];
+        }
+        error += s.error;
+        count += s.count;
+    }
+
+    // Solve J^T J x = -J^T r by Cholesky decomposition
+    bool solve( float x[6] ) const
+    {
+        double a[6][6];
+        int n = 0;
+        for ( int i = 0; i < 6; ++i ) {
+            for ( int k = i; k < 6; ++k ) {
+                a[i][k] = a[k][i] = ata[n++];
+            }
+        }
+
+        double l[6][6] = { { 0 } };
+        for ( int i = 0; i < 6; ++i ) {
+            for ( int k = 0; k <= i; ++k ) {
+                double sum = a[i][k];
+                for ( int m = 0; m < k; ++m ) {
+                    sum -= l[i][m] * l[k][m];
+                }
+                if ( i == k ) {
+                    if ( sum <= 1e-12 ) {
+                        return false;
+                    }
+                    l[i][i] = std::sqrt( sum );
+                }
+                else {
+                    l[i][k] = sum / l[k][k];
+                }
+            }
+        }
+
+        double y[6];
+        for ( int i = 0; i < 6; ++i ) {
+            double sum = -atb[i];
+            for ( int m = 0; m < i; ++m ) {
+                sum -= l[i][m] * y[m];
+            }
+            y[i] = sum / l[i][i];
+        }
+        for ( int i = 5; i >= 0; --i ) {
+            double sum = y[i];
+            for ( int m = i + 1; m < 6; ++m ) {
+                sum -= l[m][i] * x[m];
+            }
+            x[i] = (float)(sum / l[i][i]);
+        }
+        return true;
+    }
+};
+
+}
+
+CpuReconstruction::CpuReconstruction( const NUI_FUSION_RECONSTRUCTION_PARAMETERS& params,
+                                      const Matrix4& initialWorldToCameraTransform,
+                                      TsdfVolumeType volumeType, ThreadPool& pool_ )
+    : tsdfVolume( ITsdfVolume::create( volumeType, params, pool_ ) )
+    , pool( pool_ )
+    , camera( CameraIntrinsics::depthCamera( 640, 480 ) )
+    , integratedFrameCount( 0 )
+    , modelStamp( 0 )
+    , expectedInlierRatio( 0 )
+    , processedFrameCount( 0 )
+    , loopClosureEnabled( false )
+    , framesSinceLoopCheck( 0 )
+{
+    currentWorldToCamera = RigidTransform::fromMatrix4( initialWorldToCameraTransform );
+}
+
+HRESULT CpuReconstruction::ResetReconstruction( const Matrix4* initialWorldToCameraTransform,
+                                                const Matrix4* worldToVolumeTransform )
+{
+    tsdfVolume->reset( worldToVolumeTransform );
+
+    currentWorldToCamera = (initialWorldToCameraTransform != nullptr) ?
+        RigidTransform::fromMatrix4( *initialWorldToCameraTransform ) : RigidTransform();
+    integratedFrameCount = 0;
+    statistics = TrackingStatistics();
+    expectedInlierRatio = 0;
+    relocalizer.reset();
+    resetPoseGraph();
+    return S_OK;
+}
+
+void CpuReconstruction::enableLoopClosure( const LoopClosureOptions& options )
+{
+    loopOptions = options;
+    integratedFrames.setMaxFrames( options.maxStoredFrames );
+    loopClosureEnabled = true;
+}
+
+void CpuReconstruction::disableLoopClosure()
+{
+    loopClosureEnabled = false;
+    integratedFrames.reset();
+}
+
+void CpuReconstruction::resetPoseGraph()
+{
+    graph.reset();
+    processedFrameCount = 0;
+    loopStatistics = LoopClosureStatistics();
+    integratedFrames.reset();
+    framesSinceLoopCheck = 0;
+}
+
+HRESULT CpuReconstruction::ProcessFrame( const DepthFloatFrame* depthFloatFrame, UINT maxAlignIterationCount,
+                                         UINT maxFusionWeight, const Matrix4* worldToCameraTransform )
+{
+    return ProcessFrame( depthFloatFrame, nullptr, maxAlignIterationCount, maxFusionWeight, worldToCameraTransform );
+}
+
+HRESULT CpuReconstruction::ProcessFrame( const DepthFloatFrame* depthFloatFrame, const ColorFrame* colorFrame,
+                                         UINT maxAlignIterationCount, UINT maxFusionWeight,
+                                         const Matrix4* worldToCameraTransform )
+{
+    if ( depthFloatFrame == nullptr ) {
+        return E_POINTER;
+    }
+    if ( depthFloatFrame->width == 0 || depthFloatFrame->height == 0 || maxFusionWeight == 0 ) {
+        return E_INVALIDARG;
+    }
+    if ( colorFrame != nullptr &&
+         (colorFrame->width != depthFloatFrame->width || colorFrame->height != depthFloatFrame->height) ) {
+        return E_INVALIDARG;
+    }
+
+    if ( camera.width != depthFloatFrame->width || camera.height != depthFloatFrame->height ) {
+        camera = CameraIntrinsics::depthCamera( depthFloatFrame->width, depthFloatFrame->height );
+    }
+
+    RigidTransform worldToCamera = (worldToCameraTransform != nullptr) ?
+        RigidTransform::fromMatrix4( *worldToCameraTransform ) : currentWorldToCamera;
+    const unsigned int sequence = processedFrameCount++;
+
+    buildDepthPyramid( *depthFloatFrame );
+
+    // The very first frame defines the model, there is nothing to align to
+    statistics = TrackingStatistics();
+    if ( integratedFrameCount != 0 ) {
+        const float minInlierRatio = std::max( MIN_INLIER_RATIO, expectedInlierRatio * MIN_INLIER_RATIO_TO_LAST );
+        if ( !alignDepthToModel( maxAlignIterationCount, modelPointCloud, camera, modelWorldToCamera, minInlierRatio,
+                                 worldToCamera ) &&
+             !relocalize( maxAlignIterationCount, minInlierRatio, worldToCamera ) ) {
+            expectedInlierRatio *= INLIER_RATIO_DECAY;
+            return E_NUI_FUSION_TRACKING_ERROR;
+        }
+        expectedInlierRatio = statistics.inlierRatio;
+
+        // Before the frame is integrated, so the keyframes are raycast without it
+        if ( loopClosureEnabled && ++framesSinceLoopCheck >= loopOptions.detectionInterval ) {
+            framesSinceLoopCheck = 0;
+            closeLoop( maxAlignIterationCount, worldToCamera );
+        }
+    }
+
+    currentWorldToCamera = worldToCamera;
+    const unsigned short maxWeight = (unsigned short)std::min( maxFusionWeight, 65535u );
+    tsdfVolume->integrate( *depthFloatFrame, colorFrame, camera, currentWorldToCamera, maxWeight );
+    ++integratedFrameCount;
+
+    // Remember the view in case tracking gets lost later; the keyframes are the nodes of the pose graph
+    if ( relocalizer.addKeyframe( depthPyramid.back(), currentWorldToCamera ) ) {
+        graph.addKeyframe( currentWorldToCamera );
+    }
+    graph.addFrame( sequence, currentWorldToCamera );
+    if ( loopClosureEnabled ) {
+        integratedFrames.store( graph.frameCount() - 1, RigidTransform(), *depthFloatFrame, camera, currentWorldToCamera,
+                                maxWeight );
+    }
+
+    raycastModel();
+    return S_OK;
+}
+
+HRESULT CpuReconstruction::IntegrateFrame( const DepthFloatFrame* depthFloatFrame, UINT maxIntegrationWeight,
+                                           const Matrix4* worldToCameraTransform )
+{
+    return IntegrateFrame( depthFloatFrame, nullptr, maxIntegrationWeight, worldToCameraTransform );
+}
+
+HRESULT CpuReconstruction::IntegrateFrame( const DepthFloatFrame* depthFloatFrame, const ColorFrame* colorFrame,
+                                           UINT maxIntegrationWeight, const Matrix4* worldToCameraTransform )
+{
+    if ( depthFloatFrame == nullptr || worldToCameraTransform == nullptr ) {
+        return E_POINTER;
+    }
+    if ( depthFloatFrame->width == 0 || depthFloatFrame->height == 0 || maxIntegrationWeight == 0 ) {
+        return E_INVALIDARG;
+    }
+    if ( colorFrame != nullptr &&
+         (colorFrame->width != depthFloatFrame->width || colorFrame->height != depthFloatFrame->height) ) {
+        return E_INVALIDARG;
+    }
+
+    // Sensors of the same model share the intrinsics, only the resolution may differ
+    CameraIntrinsics intrinsics = CameraIntrinsics::depthCamera( depthFloatFrame->width, depthFloatFrame->height );
+    tsdfVolume->integrate( *depthFloatFrame, colorFrame, intrinsics, RigidTransform::fromMatrix4( *worldToCameraTransform ),
+                           (unsigned short)std::min( maxIntegrationWeight, 65535u ) );
+    return S_OK;
+}
+
+HRESULT CpuReconstruction::IntegrateRigFrame( const DepthFloatFrame* depthFloatFrame, UINT maxIntegrationWeight,
+                                              const Matrix4* referenceToCameraTransform )
+{
+    if ( depthFloatFrame == nullptr || referenceToCameraTransform == nullptr ) {
+        return E_POINTER;
+    }
+    if ( depthFloatFrame->width == 0 || depthFloatFrame->height == 0 || maxIntegrationWeight == 0 ) {
+        return E_INVALIDARG;
+    }
+
+    const RigidTransform referenceToCamera = RigidTransform::fromMatrix4( *referenceToCameraTransform );
+    const RigidTransform worldToCamera = referenceToCamera * currentWorldToCamera;
+    const unsigned short maxWeight = (unsigned short)std::min( maxIntegrationWeight, 65535u );
+    CameraIntrinsics intrinsics = CameraIntrinsics::depthCamera( depthFloatFrame->width, depthFloatFrame->height );
+    tsdfVolume->integrate( *depthFloatFrame, nullptr, intrinsics, worldToCamera, maxWeight );
+
+    // The graph ends with the tracked frame this one was taken with
+    if ( loopClosureEnabled && graph.frameCount() != 0 ) {
+        integratedFrames.store( graph.frameCount() - 1, referenceToCamera, *depthFloatFrame, intrinsics, worldToCamera,
+                                maxWeight );
+    }
+    return S_OK;
+}
+
+HRESULT CpuReconstruction::CalculatePointCloud( PointCloudFrame* pointCloudFrame, const Matrix4* worldToCameraTransform )
+{
+    if ( pointCloudFrame == nullptr || worldToCameraTransform == nullptr ) {
+        return E_POINTER;
+    }
+
+    int level = 0;
+    if ( pointCloudFrame->width != 0 || pointCloudFrame->height != 0 ) {
+        while ( level < MAX_POINT_CLOUD_LEVEL && (camera.width >> level) > pointCloudFrame->width ) {
+            ++level;
+        }
+        if ( (camera.width >> level) != pointCloudFrame->width || (camera.height >> level) != pointCloudFrame->height ) {
+            return E_INVALIDARG;
+        }
+    }
+
+    const Matrix4 modelMatrix = modelWorldToCamera.toMatrix4();
+    if ( modelPointCloud.width != camera.width || modelPointCloud.height != camera.height ||
+         modelStamp != tsdfVolume->modificationStamp() ||
+         std::memcmp( &modelMatrix, worldToCameraTransform, sizeof(Matrix4) ) != 0 ) {
+        tsdfVolume->raycast( RigidTransform::fromMatrix4( *worldToCameraTransform ), camera.level( level ), *pointCloudFrame );
+        return S_OK;
+    }
+
+    if ( level == 0 ) {
+        pointCloudFrame->width = modelPointCloud.width;
+        pointCloudFrame->height = modelPointCloud.height;
+        pointCloudFrame->data = modelPointCloud.data;
+        return S_OK;
+    }
+
+    // A coarse pixel takes the fine pixel nearest to its center
+    pointCloudFrame->resize( camera.width >> level, camera.height >> level );
+    const int offset = (1 << level) >> 1;
+    for ( int v = 0; v < pointCloudFrame->height; ++v ) {
+        for ( int u = 0; u < pointCloudFrame->width; ++u ) {
+            const float* p = modelPointCloud.pixel( (u << level) + offset, (v << level) + offset );
+            std::copy( p, p + PointCloudFrame::FLOATS_PER_PIXEL, pointCloudFrame->pixel( u, v ) );
+        }
+    }
+    return S_OK;
+}
+
+HRESULT CpuReconstruction::CalculatePointCloud( PointCloudFrame* pointCloudFrame, ColorFrame* colorFrame,
+                                                const Matrix4* worldToCameraTransform )
+{
+    if ( colorFrame == nullptr ) {
+        return E_POINTER;
+    }
+    HRESULT hr = CalculatePointCloud( pointCloudFrame, worldToCameraTransform );
+    if ( FAILED( hr ) ) {
+        return hr;
+    }
+
+    // The nearest voxel of every point; the points sit on the surface, inside the colored band
+    const RigidTransform worldToVoxels = tsdfVolume->worldToVolumeTransform();
+    const float vpm = tsdfVolume->parameters().voxelsPerMeter;
+    const int width = pointCloudFrame->width, height = pointCloudFrame->height;
+    colorFrame->resize( width, height );
+    if ( !tsdfVolume->hasColor() ) {
+        return S_OK;
+    }
+    pool.parallelFor( 0, height, [&]( int begin, int end ) {
+        for ( int v = begin; v < end; ++v ) {
+            UINT* colors = colorFrame->row( v );
+            for ( int u = 0; u < width; ++u ) {
+                const float* p = pointCloudFrame->pixel( u, v );
+                if ( PointCloudFrame::isValid( p ) ) {
+                    colors[u] = tsdfVolume->sampleColor( worldToVoxels * Float3( p[0], p[1], p[2] ) * vpm );
+                }
+            }
+        }
+    }, 16 );
+    return S_OK;
+}
+
+HRESULT CpuReconstruction::GetCurrentWorldToCameraTransform( Matrix4* worldToCameraTransform ) const
+{
+    if ( worldToCameraTransform == nullptr ) {
+        return E_POINTER;
+    }
+
+    *worldToCameraTransform = currentWorldToCamera.toMatrix4();
+    return S_OK;
+}
+
+HRESULT CpuReconstruction::SaveSnapshotAsync( const std::string& path )
+{
+    return snapshotWriter.start( *tsdfVolume, currentWorldToCamera.toMatrix4(), path ) ? S_OK : S_FALSE;
+}
+
+HRESULT CpuReconstruction::LoadSnapshot( const std::string& path )
+{
+    std::unique_ptr<VolumeSnapshotReader> snapshot;
+    try {
+        snapshot.reset( new VolumeSnapshotReader( path ) );
+    }
+    catch ( const std::runtime_error& ) {
+        return E_FAIL;
+    }
+    if ( !snapshot->matches( tsdfVolume->parameters() ) ) {
+        return E_INVALIDARG;
+    }
+
+    // A block that does not unpack leaves the volume half restored
+    try {
+        snapshot->restore( *tsdfVolume );
+    }
+    catch ( const std::runtime_error& ) {
+        ResetReconstruction( nullptr, nullptr );
+        return E_FAIL;
+    }
+    currentWorldToCamera = RigidTransform::fromMatrix4( snapshot->header().worldToCamera );
+
+    // The snapshot is the model the next frame is tracked against; the poses before it are gone
+    statistics = TrackingStatistics();
+    expectedInlierRatio = 0;
+    relocalizer.reset();
+    resetPoseGraph();
+    integratedFrameCount = 1;
+    raycastModel();
+    return S_OK;
+}
+
+void CpuReconstruction::raycastModel()
+{
+    modelWorldToCamera = currentWorldToCamera;
+    tsdfVolume->raycast( modelWorldToCamera, camera, modelPointCloud );
+    modelStamp = tsdfVolume->modificationStamp();
+}
+
+void CpuReconstruction::buildDepthPyramid( const DepthFloatFrame& depth )
+{
+    // The coarse levels are cheap and catch the large motion, the finer
+    // levels only refine it
+    int levelCount = TRACKING_LEVELS;
+    while ( levelCount > 1 && ((depth.width >> (levelCount - 1)) < 8 || (depth.height >> (levelCount - 1)) < 8) ) {
+        --levelCount;
+    }
+    depthPyramid.resize( 1 );
+    depthPyramid[0] = depth;
+    BuildDepthFloatPyramid( &depthPyramid, levelCount, PYRAMID_MAX_DEPTH_DIFFERENCE, pool );
+
+    // Vertices and normals are built when a level is first tracked
+    trackingLevels.resize( levelCount );
+    for ( int level = 0; level < levelCount; ++level ) {
+        trackingLevels[level].built = false;
+    }
+}
+
+void CpuReconstruction::buildTrackingLevel( int level )
+{
+    TrackingLevel& target = trackingLevels[level];
+    if ( target.built ) {
+        return;
+    }
+    target.built = true;
+
+    const DepthFloatFrame& depth = depthPyramid[level];
+    target.camera = camera.level( level );
+    const int width = depth.width;
+    const int height = depth.height;
+    target.camera.width = width;
+    target.camera.height = height;
+
+    // Vertices and normals in camera space
+    target.vertices.resize( (size_t)width * height );
+    target.normals.resize( (size_t)width * height );
+    pool.parallelFor( 0, height, [&]( int begin, int end ) {
+        for ( int v = begin; v < end; ++v ) {
+            const float* row = depth.row( v );
+            Float3* vertices = &target.vertices[(size_t)v * width];
+            for ( int u = 0; u < width; ++u ) {
+                vertices[u] = (row[u] > 0) ? target.camera.unproject( (float)u, (float)v, row[u] ) : Float3();
+            }
+        }
+    }, 16 );
+
+    std::atomic<int> validCount( 0 );
+    pool.parallelFor( 0, height, [&]( int begin, int end ) {
+        const Float3* vertices = &target.vertices[0];
+        int count = 0;
+        for ( int v = begin; v < end; ++v ) {
+            for ( int u = 0; u < width; ++u ) {
+                size_t i = (size_t)v * width + u;
+                target.normals[i] = Float3();
+                if ( vertices[i].z == 0 ) {
+                    continue;
+                }
+                ++count;
+                if ( u + 1 >= width || v + 1 >= height || vertices[i + 1].z == 0 || vertices[i + width].z == 0 ) {
+                    continue;
+                }
+                Float3 n = normalize( cross( vertices[i + 1] - vertices[i], vertices[i + width] - vertices[i] ) );
+                target.normals[i] = (dot( n, vertices[i] ) > 0) ? -n : n;
+            }
+        }
+        validCount += count;
+    }, 16 );
+    target.validCount = validCount;
+}
+
+bool CpuReconstruction::relocalize( UINT maxIterations, float minInlierRatio, RigidTransform& worldToCamera )
+{
+    relocalizer.findCandidates( depthPyramid.back(), RELOCALIZATION_CANDIDATES, candidates );
+
+    const CameraIntrinsics keyframeCamera = camera.level( RELOCALIZATION_MODEL_LEVEL );
+    for ( size_t i = 0; i < candidates.size(); ++i ) {
+        const RigidTransform& keyframe = candidates[i].worldToCamera;
+        tsdfVolume->raycast( keyframe, keyframeCamera, keyframePointCloud );
+
+        RigidTransform pose = keyframe;
+        if ( alignDepthToModel( maxIterations, keyframePointCloud, keyframeCamera, keyframe, minInlierRatio, pose ) ) {
+            worldToCamera = pose;
+            statistics.relocalized = true;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool CpuReconstruction::closeLoop( UINT maxIterations, RigidTransform& worldToCamera )
+{
+    typedef std::chrono::steady_clock Clock;
+
+    const int current = graph.lastKeyframe();
+    relocalizer.findCandidates( depthPyramid.back(), LOOP_CLOSURE_CANDIDATES, candidates );
+
+    // The alignments below would replace the statistics of the tracking
+    const TrackingStatistics tracking = statistics;
+    const CameraIntrinsics keyframeCamera = camera.level( RELOCALIZATION_MODEL_LEVEL );
+    bool closed = false;
+    for ( size_t i = 0; i < candidates.size() && !closed; ++i ) {
+        const Relocalizer::Candidate& candidate = candidates[i];
+        if ( candidate.keyframe + (int)loopOptions.minKeyframeGap > current ) {
+            continue;
+        }
+
+        ++loopStatistics.attempts;
+        tsdfVolume->raycast( candidate.worldToCamera, keyframeCamera, keyframePointCloud );
+        RigidTransform pose = candidate.worldToCamera;
+        if ( !alignDepthToModel( maxIterations, keyframePointCloud, keyframeCamera, candidate.worldToCamera,
+                                 MIN_INLIER_RATIO, pose ) ) {
+            continue;
+        }
+
+        // Where the old keyframe puts the camera against where tracking did
+        const RigidTransform drift = pose * worldToCamera.inverse();
+        if ( length( drift.t ) + drift.angle() < loopOptions.minCorrection ) {
+            break;
+        }
+
+        // Tracking has the frame relative to the last keyframe, the loop relative to the old one:
+        // last = (frame from last)^-1 * pose = (frame from last)^-1 * pose * old^-1 * old
+        const RigidTransform lastToCamera = worldToCamera * graph.keyframePose( current ).inverse();
+        graph.addLoopClosure( candidate.keyframe, current, lastToCamera.inverse() * pose * candidate.worldToCamera.inverse() );
+        closed = graph.optimize( loopOptions.optimizationIterations );
+        if ( closed ) {
+            worldToCamera = lastToCamera * graph.keyframePose( current );
+        }
+    }
+    statistics = tracking;
+    if ( !closed ) {
+        return false;
+    }
+
+    // Keyframes follow the graph, so relocalization and the next loops start from the corrected poses
+    Clock::time_point start = Clock::now();
+    for ( size_t k = 0; k < graph.keyframeCount(); ++k ) {
+        relocalizer.setKeyframePose( (int)k, graph.keyframePose( (int)k ) );
+    }
+    loopStatistics.reintegratedFrames += integratedFrames.reintegrate( *tsdfVolume, graph );
+    loopStatistics.reintegrationTime += std::chrono::duration<double, std::milli>( Clock::now() - start ).count();
+    ++loopStatistics.closures;
+    statistics.loopClosed = true;
+    return true;
+}
+
+bool CpuReconstruction::alignDepthToModel( UINT maxIterations, const PointCloudFrame& model, const CameraIntrinsics& modelCamera,
+                                           const RigidTransform& modelPose, float minInlierRatio,
+                                           RigidTransform& worldToCamera )
+{
+    const int levelCount = (int)trackingLevels.size();
+    const RigidTransform initialCameraToWorld = worldToCamera.inverse();
+    RigidTransform cameraToWorld = initialCameraToWorld;
+    IcpSystem total;
+    std::vector<IcpSystem> partial;
+
+    statistics = TrackingStatistics();
+    statistics.levelCount = levelCount;
+    statistics.converged = true;
+
+    // Levels in a row whose first step was already below the threshold
+    int settledLevels = 0;
+    int trackedLevel = levelCount - 1;
+    for ( int level = levelCount - 1; level >= 0; --level ) {
+        trackedLevel = level;
+        buildTrackingLevel( level );
+        const TrackingLevel& source = trackingLevels[level];
+        if ( source.validCount == 0 ) {
+            statistics.converged = false;
+            return false;
+        }
+
+        const int width = source.camera.width;
+        const int height = source.camera.height;
+        const int chunkCount = (height + ROWS_PER_REDUCTION - 1) / ROWS_PER_REDUCTION;
+        const float minTranslation = MIN_TRANSLATION_UPDATE * (1 << level);
+        const float minRotation = MIN_ROTATION_UPDATE * (1 << level);
+
+        // The full budget on the coarsest level, half of it (rounded up) on the next and so on
+        const UINT shift = levelCount - 1 - level;
+        const UINT levelIterations = (std::max( maxIterations, 1u ) + (1u << shift) - 1) >> shift;
+
+        TrackingStatistics::Level& levelStatistics = statistics.levels[level];
+        bool converged = false;
+        for ( UINT iteration = 0; iteration < levelIterations && !converged; ++iteration ) {
+            partial.assign( chunkCount, IcpSystem() );
+
+            pool.parallelFor( 0, chunkCount, [&]( int begin, int end ) {
+                for ( int chunk = begin; chunk < end; ++chunk ) {
+                    IcpSystem& local = partial[chunk];
+                    const int rowEnd = std::min( (chunk + 1) * ROWS_PER_REDUCTION, height );
+                    for ( int v = chunk * ROWS_PER_REDUCTION; v < rowEnd; ++v ) {
+                        for ( int u = 0; u < width; ++u ) {
+                            size_t i = (size_t)v * width + u;
+                            const Float3& normal = source.normals[i];
+                            if ( normal.z == 0 && normal.x == 0 && normal.y == 0 ) {
+                                continue;
+                            }
+
+                            // Projective data association with the model raycast
+                            Float3 p = cameraToWorld * source.vertices[i];
+                            Float3 pm = modelPose * p;
+                            if ( pm.z <= 0 ) {
+                                continue;
+                            }
+                            int mu = (int)(modelCamera.fx * pm.x / pm.z + modelCamera.cx + 0.5f);
+                            int mv = (int)(modelCamera.fy * pm.y / pm.z + modelCamera.cy + 0.5f);
+                            if ( mu < 0 || mv < 0 || mu >= model.width || mv >= model.height ) {
+                                continue;
+                            }
+                            const float* point = model.pixel( mu, mv );
+                            if ( !PointCloudFrame::isValid( point ) ) {
+                                continue;
+                            }
+
+                            Float3 q( point[0], point[1], point[2] );
+                            Float3 nq( point[3], point[4], point[5] );
+                            Float3 diff = p - q;
+                            if ( dot( diff, diff ) > MAX_CORRESPONDENCE_DISTANCE * MAX_CORRESPONDENCE_DISTANCE ||
+                                 dot( cameraToWorld.rotate( normal ), nq ) < MIN_NORMAL_COSINE ) {
+                                continue;
+                            }
+
+                            Float3 c = cross( p, nq );
+                            float j[6] = { c.x, c.y, c.z, nq.x, nq.y, nq.z };
+                            local.add( j, dot( nq, diff ) );
+                        }
+                    }
+                }
+            }, 1 );
+
+            total = IcpSystem();
+            for ( int chunk = 0; chunk < chunkCount; ++chunk ) {
+                total.add( partial[chunk] );
+            }
+
+            levelStatistics.iterations = iteration + 1;
+            levelStatistics.correspondences = total.count;
+            levelStatistics.residual = (total.count != 0) ? (FLOAT)std::sqrt( total.error / total.count ) : 0.0f;
+
+            float x[6];
+            if ( total.count < 6 || !total.solve( x ) ) {
+                statistics.converged = false;
+                return false;
+            }
+
+            cameraToWorld = RigidTransform::fromTwist( x ) * cameraToWorld;
+
+            converged = length( Float3( x[3], x[4], x[5] ) ) < minTranslation &&
+                        length( Float3( x[0], x[1], x[2] ) ) < minRotation;
+        }
+        if ( !converged ) {
+            statistics.converged = false;
+        }
+
+        // The camera did not move by more than two coarse levels can see
+        // (a static camera); the full resolution would not change the pose
+        settledLevels = (converged && levelStatistics.iterations == 1) ? settledLevels + 1 : 0;
+        if ( settledLevels == 2 && level > 0 ) {
+            break;
+        }
+    }
+
+    // Validate the result with the last step of the finest level tracked
+    const TrackingLevel& tracked = trackingLevels[trackedLevel];
+    statistics.inlierRatio = (FLOAT)total.count / tracked.validCount;
+    if ( statistics.inlierRatio < minInlierRatio ) {
+        statistics.converged = false;
+        return false;
+    }
+    if ( std::sqrt( total.error / total.count ) > MAX_RMS_ERROR ) {
+        statistics.converged = false;
+        return false;
+    }
+    RigidTransform delta = initialCameraToWorld.inverse() * cameraToWorld;
+    if ( length( delta.t ) > MAX_TRANSLATION_DELTA || delta.angle() > MAX_ROTATION_DELTA ) {
+        statistics.converged = false;
+        return false;
+    }
+    statistics.depthConflictRatio = depthConflictRatio( tracked, model, modelCamera, modelPose, cameraToWorld );
+    if ( statistics.depthConflictRatio > MAX_DEPTH_CONFLICT_RATIO ) {
+        statistics.converged = false;
+        return false;
+    }
+
+    worldToCamera = cameraToWorld.inverse();
+    return true;
+}
+
+float CpuReconstruction::depthConflictRatio( const TrackingLevel& source, const PointCloudFrame& model,
+                                             const CameraIntrinsics& modelCamera, const RigidTransform& modelPose,
+                                             const RigidTransform& cameraToWorld )
+{
+    // Camera to model camera, depth along the model's rays
+    const RigidTransform cameraToModel = modelPose * cameraToWorld;
+    const int width = source.camera.width;
+    std::atomic<int> compared( 0 ), conflicts( 0 );
+    pool.parallelFor( 0, source.camera.height, [&]( int begin, int end ) {
+        int localCompared = 0, localConflicts = 0;
+        for ( int v = begin; v < end; ++v ) {
+            for ( int u = 0; u < width; ++u ) {
+                const Float3& vertex = source.vertices[(size_t)v * width + u];
+                if ( vertex.z == 0 ) {
+                    continue;
+                }
+                Float3 pm = cameraToModel * vertex;
+                if ( pm.z <= 0 ) {
+                    continue;
+                }
+                int mu = (int)(modelCamera.fx * pm.x / pm.z + modelCamera.cx + 0.5f);
+                int mv = (int)(modelCamera.fy * pm.y / pm.z + modelCamera.cy + 0.5f);
+                if ( mu < 0 || mv < 0 || mu >= model.width || mv >= model.height ) {
+                    continue;
+                }
+                const float* point = model.pixel( mu, mv );
+                if ( !PointCloudFrame::isValid( point ) ) {
+                    continue;
+                }
+                ++localCompared;
+                Float3 qm = modelPose * Float3( point[0], point[1], point[2] );
+                if ( pm.z > qm.z + DEPTH_CONFLICT_DISTANCE ) {
+                    ++localConflicts;
+                }
+            }
+        }
+        compared += localCompared;
+        conflicts += localConflicts;
+    }, 16 );
+    return (compared != 0) ? (float)conflicts / compared : 0.0f;
+}
+
+}
@@ -0,0 +1,321 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../common/ThreadPool.h"
+#include "FusionTypes.h"
+#include "LoopClosure.h"
+#include "PoseGraph.h"
+#include "Relocalizer.h"
+#include "TsdfVolume.h"
+#include "VolumeSnapshot.h"
+
+namespace kinectbook {
+
+/// <summary>
+/// What the camera tracking of the last ProcessFrame() did
+/// </summary>
+/// <remarks>
+/// Level 0 is the full resolution, every further level halves it; the
+/// tracker runs from the coarsest level to level 0.
+/// </remarks>
+struct TrackingStatistics
+{
+    static const int MAX_LEVELS = 3;
+
+    struct Level
+    {
+        UINT iterations;        // Gauss-Newton steps taken
+        UINT correspondences;   // pixels used by the last step
+        FLOAT residual;         // RMS point to plane distance of the last step (m)
+    };
+
+    Level levels[MAX_LEVELS];
+    UINT levelCount;
+
+    /// <summary>
+    /// Share of the valid pixels of the finest level tracked with a correspondence
+    /// </summary>
+    FLOAT inlierRatio;
+
+    /// <summary>
+    /// Share of the pixels hitting the model that lie well behind its surface at the final pose
+    /// </summary>
+    FLOAT depthConflictRatio;
+
+    /// <summary>
+    /// true when every level stopped because the pose update became small,
+    /// false when a level used up its iterations or tracking failed
+    /// </summary>
+    bool converged;
+
+    /// <summary>
+    /// true when tracking from the last pose failed and the pose was found
+    /// again from a keyframe
+    /// </summary>
+    bool relocalized;
+
+    /// <summary>
+    /// true when the frame closed a loop: the poses of the pose graph were
+    /// corrected and the frames that moved were integrated again
+    /// </summary>
+    bool loopClosed;
+
+    TrackingStatistics()
+        : levelCount( 0 ), inlierRatio( 0 ), depthConflictRatio( 0 ), converged( false ), relocalized( false ),
+          loopClosed( false )
+    {
+        for ( int i = 0; i < MAX_LEVELS; ++i ) {
+            levels[i].iterations = 0;
+            levels[i].correspondences = 0;
+            levels[i].residual = 0;
+        }
+    }
+
+    UINT totalIterations() const
+    {
+        UINT total = 0;
+        for ( UINT i = 0; i < levelCount; ++i ) {
+            total += levels[i].iterations;
+        }
+        return total;
+    }
+};
+
+/// <summary>
+/// Kinect Fusion on the CPU
+/// </summary>
+/// <remarks>
+/// Drop-in for INuiFusionReconstruction in the C++ sample: the methods keep
+/// the names, arguments and HRESULT results of the SDK interface, but take
+/// DepthFloatFrame / PointCloudFrame instead of NUI_FUSION_IMAGE_FRAME so
+/// the engine runs wherever a C++ compiler does.
+/// </remarks>
+class CpuReconstruction
+{
+public:
+
+    CpuReconstruction( const NUI_FUSION_RECONSTRUCTION_PARAMETERS& params,
+                       const Matrix4& initialWorldToCameraTransform,
+                       TsdfVolumeType volumeType = TSDF_VOLUME_DENSE,
+                       ThreadPool& pool = ThreadPool::shared() );
+
+    /// <summary>
+    /// Clear the volume and set the camera pose
+    /// </summary>
+    /// <param name="worldToVolumeTransform">nullptr for the default placement</param>
+    HRESULT ResetReconstruction( const Matrix4* initialWorldToCameraTransform,
+                                 const Matrix4* worldToVolumeTransform );
+
+    /// <summary>
+    /// Track the camera against the volume, then integrate the frame
+    /// </summary>
+    /// <remarks>
+    /// A pose is only accepted when the frame agrees with the model: about
+    /// as large a share of its pixels has a correspondence as in the last
+    /// frame, and hardly any lies behind the model's surfaces. So a frame
+    /// after a gap that ICP slid into a wrong pose fails instead of being
+    /// integrated there.
+    ///
+    /// When the camera cannot be tracked from the last pose, the frame is
+    /// matched against the keyframes seen so far and tracking is retried
+    /// from the most similar ones, so the camera is found again once the
+    /// view is clear without resetting the volume.
+    ///
+    /// Every tracked frame is logged in poseGraph(); with enableLoopClosure()
+    /// the frame is also matched against keyframes seen long ago, and when
+    /// the camera turns out to have drifted the poses are corrected and the
+    /// recent frames moved in the volume before this one is integrated.
+    /// </remarks>
+    /// <param name="maxAlignIterationCount">Iterations on the coarsest pyramid level, every finer level gets half as many</param>
+    /// <param name="worldToCameraTransform">Initial guess for the pose, nullptr for the last pose</param>
+    /// <returns>E_NUI_FUSION_TRACKING_ERROR when the alignment fails; nothing is integrated then</returns>
+    HRESULT ProcessFrame( const DepthFloatFrame* depthFloatFrame, UINT maxAlignIterationCount,
+                          UINT maxFusionWeight, const Matrix4* worldToCameraTransform );
+
+    /// <summary>
+    /// ProcessFrame() that also fuses the color of the frame
+    /// </summary>
+    /// <remarks>Tracking uses the depth alone; the color only goes into the volume</remarks>
+    /// <param name="colorFrame">Color registered to depthFloatFrame (RegisterColorFrame), nullptr for none</param>
+    HRESULT ProcessFrame( const DepthFloatFrame* depthFloatFrame, const ColorFrame* colorFrame,
+                          UINT maxAlignIterationCount, UINT maxFusionWeight, const Matrix4* worldToCameraTransform );
+
+    /// <summary>
+    /// Integrate a frame at a known pose without tracking it
+    /// </summary>
+    /// <remarks>
+    /// The pose of the tracked camera and the model it is tracked against
+    /// stay as they are. These frames are not part of the pose graph and
+    /// stay where they were integrated when a loop is closed; the other
+    /// sensors of a rig use IntegrateRigFrame() instead.
+    /// </remarks>
+    HRESULT IntegrateFrame( const DepthFloatFrame* depthFloatFrame, UINT maxIntegrationWeight,
+                            const Matrix4* worldToCameraTransform );
+
+    HRESULT IntegrateFrame( const DepthFloatFrame* depthFloatFrame, const ColorFrame* colorFrame,
+                            UINT maxIntegrationWeight, const Matrix4* worldToCameraTransform );
+
+    /// <summary>
+    /// Integrate a frame of another sensor of a calibrated rig, at its offset from the last tracked frame
+    /// </summary>
+    /// <remarks>
+    /// Call it right after the ProcessFrame() of the tracked sensor. With
+    /// loop closure the frame is kept with the tracked frame, so a loop that
+    /// moves the tracked frame moves this one by the same correction and the
+    /// sensors of the rig stay in line in the volume.
+    /// </remarks>
+    /// <param name="referenceToCameraTransform">Tracked camera to this sensor's camera</param>
+    HRESULT IntegrateRigFrame( const DepthFloatFrame* depthFloatFrame, UINT maxIntegrationWeight,
+                               const Matrix4* referenceToCameraTransform );
+
+    /// <summary>
+    /// Raycast the volume from the given pose
+    /// </summary>
+    /// <remarks>
+    /// The size of the frame picks the resolution: the depth frame's, or
+    /// 1/2^l of it for a cheaper preview; an empty frame gets the full size.
+    /// At the pose of the last ProcessFrame() with the volume unchanged since,
+    /// the raycast the next frame is tracked against is copied instead, so
+    /// tracking and shading share one raycast.
+    /// </remarks>
+    /// <returns>E_INVALIDARG when the frame is no such size</returns>
+    HRESULT CalculatePointCloud( PointCloudFrame* pointCloudFrame, const Matrix4* worldToCameraTransform );
+
+    /// <summary>
+    /// CalculatePointCloud() with the fused color of every point
+    /// </summary>
+    /// <param name="colorFrame">Resized to the point cloud; alpha 0 where there is no point or no color</param>
+    HRESULT CalculatePointCloud( PointCloudFrame* pointCloudFrame, ColorFrame* colorFrame,
+                                 const Matrix4* worldToCameraTransform );
+
+    HRESULT GetCurrentWorldToCameraTransform( Matrix4* worldToCameraTransform ) const;
+
+    /// <summary>
+    /// Start writing the volume and the camera pose to a snapshot (.kbvol)
+    /// </summary>
+    /// <remarks>
+    /// Returns at once; the file is written on a background thread while
+    /// frames go on being processed, snapshotResult() tells how it went.
+    /// Call on the thread that processes frames.
+    /// </remarks>
+    /// <returns>S_FALSE when the last snapshot is still being written; nothing is started</returns>
+    HRESULT SaveSnapshotAsync( const std::string& path );
+
+    /// <summary>
+    /// Replace the volume and the camera pose with a snapshot
+    /// </summary>
+    /// <remarks>Tracking goes on from the pose the snapshot was taken at</remarks>
+    /// <returns>E_INVALIDARG when the snapshot is of a volume of another size, E_FAIL when it can't be read</returns>
+    HRESULT LoadSnapshot( const std::string& path );
+
+    bool snapshotBusy() const { return snapshotWriter.busy(); }
+
+    /// <summary>
+    /// The last snapshot written completely or given up
+    /// </summary>
+    VolumeSnapshotResult snapshotResult() const { return snapshotWriter.result(); }
+
+    const ITsdfVolume& volume() const { return *tsdfVolume; }
+
+    const CameraIntrinsics& intrinsics() const { return camera; }
+
+    /// <summary>
+    /// Tracking of the last ProcessFrame(); empty for the first frame after a reset
+    /// </summary>
+    const TrackingStatistics& trackingStatistics() const { return statistics; }
+
+    /// <summary>
+    /// Correct the drift of the camera when it comes back to a place seen long ago
+    /// </summary>
+    /// <remarks>
+    /// Every detectionInterval frames the frame is aligned against the
+    /// raycast of similar keyframes at least minKeyframeGap keyframes back.
+    /// When that puts the camera further than minCorrection from where
+    /// tracking put it, the pose graph gets a loop closure edge and is
+    /// optimized, and the stored frames whose pose changed are taken out of
+    /// the volume and integrated again at their new pose. The closing frame
+    /// takes as long as moving those frames does. Takes effect with the next
+    /// frame; the frames before are not stored.
+    /// </remarks>
+    void enableLoopClosure( const LoopClosureOptions& options = LoopClosureOptions() );
+
+    void disableLoopClosure();
+
+    /// <summary>
+    /// Keyframes and tracked frames since the last reset
+    /// </summary>
+    /// <remarks>
+    /// The sequence of a frame is the number of ProcessFrame() calls after
+    /// the reset before it, failed ones included, so a caller can keep the
+    /// timestamps of its frames by call to write the trajectory.
+    /// </remarks>
+    const PoseGraph& poseGraph() const { return graph; }
+
+    const LoopClosureStatistics& loopClosureStatistics() const { return loopStatistics; }
+
+private:
+
+    /// <summary>
+    /// One level of the depth pyramid, in camera space
+    /// </summary>
+    struct TrackingLevel
+    {
+        CameraIntrinsics camera;
+        std::vector<Float3> vertices;
+        std::vector<Float3> normals;
+        int validCount;
+        bool built;         // from the current frame
+    };
+
+    void buildDepthPyramid( const DepthFloatFrame& depth );
+    void buildTrackingLevel( int level );
+    bool alignDepthToModel( UINT maxIterations, const PointCloudFrame& model, const CameraIntrinsics& modelCamera,
+                            const RigidTransform& modelPose, float minInlierRatio, RigidTransform& worldToCamera );
+    float depthConflictRatio( const TrackingLevel& source, const PointCloudFrame& model, const CameraIntrinsics& modelCamera,
+                              const RigidTransform& modelPose, const RigidTransform& cameraToWorld );
+    bool relocalize( UINT maxIterations, float minInlierRatio, RigidTransform& worldToCamera );
+    bool closeLoop( UINT maxIterations, RigidTransform& worldToCamera );
+    void resetPoseGraph();
+    void raycastModel();
+
+    std::unique_ptr<ITsdfVolume> tsdfVolume;
+    ThreadPool& pool;
+    CameraIntrinsics camera;
+
+    RigidTransform currentWorldToCamera;
+    int integratedFrameCount;
+
+    // Raycast of the volume at the last pose, the reference for the next alignment
+    PointCloudFrame modelPointCloud;
+    RigidTransform modelWorldToCamera;
+    unsigned int modelStamp;        // modificationStamp() of the volume it was raycast from
+
+    std::vector<DepthFloatFrame> depthPyramid;
+    std::vector<TrackingLevel> trackingLevels;
+    TrackingStatistics statistics;
+
+    // Share of valid pixels with a correspondence the next frame is held to,
+    // that of the last tracked frame lowered for every failed one since
+    float expectedInlierRatio;
+
+    Relocalizer relocalizer;
+    std::vector<Relocalizer::Candidate> candidates;
+    PointCloudFrame keyframePointCloud;
+
+    // The relocalizer's keyframes are the nodes of the graph, with the same ids
+    PoseGraph graph;
+    unsigned int processedFrameCount;   // ProcessFrame() calls since the reset
+    bool loopClosureEnabled;
+    LoopClosureOptions loopOptions;
+    LoopClosureStatistics loopStatistics;
+    IntegratedFrames integratedFrames;
+    unsigned int framesSinceLoopCheck;
+
+    // Reads the volume, so it is declared after it and goes first
+    VolumeSnapshotWriter snapshotWriter;
+};
+
+}
@@ -0,0 +1,427 @@
+#include "DepthProcessor.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "../common/SimdConfig.h"
+
+namespace kinectbook {
+
+namespace {
+
+struct DepthRange
+{
+    int minDepth;       // millimeters
+    int maxDepth;
+};
+
+HRESULT checkDepthArguments( const void* depthImageData, UINT width, UINT height, const DepthFloatFrame* depthFloatFrame,
+                             FLOAT minDepthClip, FLOAT maxDepthClip, DepthRange& range )
+{
+    if ( depthImageData == 0 || depthFloatFrame == 0 ) {
+        return E_POINTER;
+    }
+    if ( width == 0 || height == 0 || minDepthClip < 0 || maxDepthClip < minDepthClip ) {
+        return E_INVALIDARG;
+    }
+
+    // Compare in millimeters so the loop body is integer only
+    range.minDepth = (int)(minDepthClip * 1000.0f + 0.5f);
+    range.maxDepth = (int)std::min( maxDepthClip * 1000.0f + 0.5f, 65535.0f );
+    return S_OK;
+}
+
+inline float convertDepth( const NUI_DEPTH_IMAGE_PIXEL& pixel, const DepthRange& range )
+{
+    int depth = pixel.depth;
+    return (depth >= range.minDepth && depth <= range.maxDepth) ? depth * 0.001f : 0.0f;
+}
+
+void convertDepthRowReference( const NUI_DEPTH_IMAGE_PIXEL* src, float* dst, int width, const DepthRange& range, bool mirror )
+{
+    for ( int x = 0; x < width; ++x ) {
+        dst[x] = convertDepth( src[mirror ? (width - 1 - x) : x], range );
+    }
+}
+
+// NUI_DEPTH_IMAGE_PIXEL is 32 bits: player index in the low, depth in the high half
+void convertDepthRow( const NUI_DEPTH_IMAGE_PIXEL* src, float* dst, int width, const DepthRange& range, bool mirror )
+{
+    int x = 0;
+
+#ifdef KB_AVX2
+    {
+        const __m256i below = _mm256_set1_epi32( range.minDepth - 1 );
+        const __m256i above = _mm256_set1_epi32( range.maxDepth + 1 );
+        const __m256i reverse = _mm256_setr_epi32( 7, 6, 5, 4, 3, 2, 1, 0 );
+        const __m256 scale = _mm256_set1_ps( 0.001f );
+        for ( ; x + 8 <= width; x += 8 ) {
+            __m256i p = mirror ?
+                _mm256_permutevar8x32_epi32( _mm256_loadu_si256( (const __m256i*)(src + width - 8 - x) ), reverse ) :
+                _mm256_loadu_si256( (const __m256i*)(src + x) );
+            __m256i depth = _mm256_srli_epi32( p, 16 );
+            __m256i inside = _mm256_and_si256( _mm256_cmpgt_epi32( depth, below ), _mm256_cmpgt_epi32( above, depth ) );
+            __m256 meters = _mm256_mul_ps( _mm256_cvtepi32_ps( depth ), scale );
+            _mm256_storeu_ps( dst + x, _mm256_and_ps( meters, _mm256_castsi256_ps( inside ) ) );
+        }
+    }
+#endif
+
+#if defined(KB_SSE2)
+    {
+        const __m128i below = _mm_set1_epi32( range.minDepth - 1 );
+        const __m128i above = _mm_set1_epi32( range.maxDepth + 1 );
+        const __m128 scale = _mm_set1_ps( 0.001f );
+        for ( ; x + 4 <= width; x += 4 ) {
+            __m128i p = mirror ?
+                _mm_shuffle_epi32( _mm_loadu_si128( (const __m128i*)(src + width - 4 - x) ), _MM_SHUFFLE( 0, 1, 2, 3 ) ) :
+                _mm_loadu_si128( (const __m128i*)(src + x) );
+            __m128i depth = _mm_srli_epi32( p, 16 );
+            __m128i inside = _mm_and_si128( _mm_cmpgt_epi32( depth, below ), _mm_cmplt_epi32( depth, above ) );
+            __m128 meters = _mm_mul_ps( _mm_cvtepi32_ps( depth ), scale );
+            _mm_storeu_ps( dst + x, _mm_and_ps( meters, _mm_castsi128_ps( inside ) ) );
+        }
+    }
+#elif defined(KB_NEON)
+    {
+        const uint32x4_t minDepth = vdupq_n_u32( (uint32_t)range.minDepth );
+        const uint32x4_t maxDepth = vdupq_n_u32( (uint32_t)range.maxDepth );
+        for ( ; x + 4 <= width; x += 4 ) {
+            uint32x4_t p;
+            if ( mirror ) {
+                p = vrev64q_u32( vld1q_u32( (const uint32_t*)(src + width - 4 - x) ) );
+                p = vcombine_u32( vget_high_u32( p ), vget_low_u32( p ) );
+            }
+            else {
+                p = vld1q_u32( (const uint32_t*)(src + x) );
+            }
+            uint32x4_t depth = vshrq_n_u32( p, 16 );
+            uint32x4_t inside = vandq_u32( vcgeq_u32( depth, minDepth ), vcleq_u32( depth, maxDepth ) );
+            float32x4_t meters = vmulq_n_f32( vcvtq_f32_u32( depth ), 0.001f );
+            vst1q_f32( dst + x, vreinterpretq_f32_u32( vandq_u32( vreinterpretq_u32_f32( meters ), inside ) ) );
+        }
+    }
+#endif
+
+    for ( ; x < width; ++x ) {
+        dst[x] = convertDepth( src[mirror ? (width - 1 - x) : x], range );
+    }
+}
+
+/// <summary>
+/// Weights shared by the reference and the SIMD bilateral filter
+/// </summary>
+struct BilateralKernel
+{
+    int radius;
+    int size;                       // 2 * radius + 1
+    std::vector<float> spatial;     // size * size, row major
+    float inverseSupport;           // 1 / (3 sigmaDepth)^2
+
+    explicit BilateralKernel( const BilateralFilterParameters& filter )
+        : radius( (int)filter.radius )
+        , size( 2 * (int)filter.radius + 1 )
+        , spatial( size * size )
+    {
+        float sigma = std::max( filter.sigmaSpace, 1e-3f );
+        for ( int ky = -radius; ky <= radius; ++ky ) {
+            for ( int kx = -radius; kx <= radius; ++kx ) {
+                spatial[(ky + radius) * size + kx + radius] = std::exp( -(kx * kx + ky * ky) / (2 * sigma * sigma) );
+            }
+        }
+
+        float support = 3 * std::max( filter.sigmaDepth, 1e-4f );
+        inverseSupport = 1.0f / (support * support);
+    }
+};
+
+/// <summary>
+/// Filter one row; rows[ky] points at the input pixel above/below x = 0 for
+/// ky = 0 .. size - 1 and may be read from -radius to width + radius
+/// </summary>
+void filterDepthRow( const float* const* rows, float* dst, int width, const BilateralKernel& kernel, bool simd )
+{
+    const int r = kernel.radius;
+    const float* center = rows[r];
+    int x = 0;
+
+#if defined(KB_SSE2)
+    if ( simd ) {
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 one = _mm_set1_ps( 1.0f );
+        const __m128 inverseSupport = _mm_set1_ps( kernel.inverseSupport );
+        for ( ; x + 4 <= width; x += 4 ) {
+            __m128 c = _mm_loadu_ps( center + x );
+            __m128 sum = zero;
+            __m128 sumWeight = zero;
+            for ( int ky = 0; ky < kernel.size; ++ky ) {
+                const float* row = rows[ky] + x - r;
+                const float* spatial = &kernel.spatial[ky * kernel.size];
+                for ( int kx = 0; kx < kernel.size; ++kx ) {
+                    __m128 d = _mm_loadu_ps( row + kx );
+                    __m128 diff = _mm_sub_ps( d, c );
+                    __m128 t = _mm_max_ps( _mm_sub_ps( one, _mm_mul_ps( _mm_mul_ps( diff, diff ), inverseSupport ) ), zero );
+                    __m128 w = _mm_mul_ps( _mm_mul_ps( t, t ), _mm_set1_ps( spatial[kx] ) );
+                    w = _mm_and_ps( w, _mm_cmpgt_ps( d, zero ) );
+                    sumWeight = _mm_add_ps( sumWeight, w );
+                    sum = _mm_add_ps( sum, _mm_mul_ps( w, d ) );
+                }
+            }
+            // A valid center weighs at least its own spatial weight, so the division is safe
+            __m128 valid = _mm_cmpgt_ps( c, zero );
+            __m128 result = _mm_div_ps( sum, _mm_or_ps( sumWeight, _mm_andnot_ps( valid, one ) ) );
+            _mm_storeu_ps( dst + x, _mm_and_ps( result, valid ) );
+        }
+    }
+#elif defined(KB_NEON)
+    if ( simd ) {
+        const float32x4_t zero = vdupq_n_f32( 0.0f );
+        const float32x4_t one = vdupq_n_f32( 1.0f );
+        for ( ; x + 4 <= width; x += 4 ) {
+            float32x4_t c = vld1q_f32( center + x );
+            float32x4_t sum = zero;
+            float32x4_t sumWeight = zero;
+            for ( int ky = 0; ky < kernel.size; ++ky ) {
+                const float* row = rows[ky] + x - r;
+                const float* spatial = &kernel.spatial[ky * kernel.size];
+                for ( int kx = 0; kx < kernel.size; ++kx ) {
+                    float32x4_t d = vld1q_f32( row + kx );
+                    float32x4_t diff = vsubq_f32( d, c );
+                    float32x4_t t = vmaxq_f32( vsubq_f32( one, vmulq_n_f32( vmulq_f32( diff, diff ), kernel.inverseSupport ) ), zero );
+                    float32x4_t w = vmulq_n_f32( vmulq_f32( t, t ), spatial[kx] );
+                    w = vreinterpretq_f32_u32( vandq_u32( vreinterpretq_u32_f32( w ), vcgtq_f32( d, zero ) ) );
+                    sumWeight = vaddq_f32( sumWeight, w );
+                    sum = vaddq_f32( sum, vmulq_f32( w, d ) );
+                }
+            }
+            float KB_ALIGN(16) s[4];
+            float KB_ALIGN(16) w[4];
+            vst1q_f32( s, sum );
+            vst1q_f32( w, sumWeight );
+            for ( int i = 0; i < 4; ++i ) {
+                dst[x + i] = (center[x + i] > 0) ? s[i] / w[i] : 0.0f;
+            }
+        }
+    }
+#endif
+
+    for ( ; x < width; ++x ) {
+        float c = center[x];
+        float sum = 0;
+        float sumWeight = 0;
+        for ( int ky = 0; ky < kernel.size; ++ky ) {
+            const float* row = rows[ky] + x - r;
+            const float* spatial = &kernel.spatial[ky * kernel.size];
+            for ( int kx = 0; kx < kernel.size; ++kx ) {
+                float d = row[kx];
+                float diff = d - c;
+                float t = std::max( 1.0f - diff * diff * kernel.inverseSupport, 0.0f );
+                float w = (d > 0) ? t * t * spatial[kx] : 0.0f;
+                sumWeight += w;
+                sum += w * d;
+            }
+        }
+        dst[x] = (c > 0) ? sum / sumWeight : 0.0f;
+    }
+}
+
+}
+
+HRESULT DepthToDepthFloatFrame( const NUI_DEPTH_IMAGE_PIXEL* depthImageData, UINT width, UINT height,
+                                DepthFloatFrame* depthFloatFrame,
+                                FLOAT minDepthClip, FLOAT maxDepthClip, BOOL mirrorDepth, ThreadPool& pool )
+{
+    DepthRange range;
+    HRESULT hr = checkDepthArguments( depthImageData, width, height, depthFloatFrame, minDepthClip, maxDepthClip, range );
+    if ( FAILED( hr ) ) {
+        return hr;
+    }
+
+    depthFloatFrame->resize( width, height );
+    pool.parallelFor( 0, height, [&]( int begin, int end ) {
+        for ( int y = begin; y < end; ++y ) {
+            convertDepthRow( depthImageData + (size_t)y * width, depthFloatFrame->row( y ), width, range, mirrorDepth != FALSE );
+        }
+    }, 16 );
+
+    return S_OK;
+}
+
+HRESULT DepthToDepthFloatFrameReference( const NUI_DEPTH_IMAGE_PIXEL* depthImageData, UINT width, UINT height,
+                                         DepthFloatFrame* depthFloatFrame,
+                                         FLOAT minDepthClip, FLOAT maxDepthClip, BOOL mirrorDepth, ThreadPool& pool )
+{
+    DepthRange range;
+    HRESULT hr = checkDepthArguments( depthImageData, width, height, depthFloatFrame, minDepthClip, maxDepthClip, range );
+    if ( FAILED( hr ) ) {
+        return hr;
+    }
+
+    depthFloatFrame->resize( width, height );
+    pool.parallelFor( 0, height, [&]( int begin, int end ) {
+        for ( int y = begin; y < end; ++y ) {
+            convertDepthRowReference( depthImageData + (size_t)y * width, depthFloatFrame->row( y ), width, range, mirrorDepth != FALSE );
+        }
+    }, 16 );
+
+    return S_OK;
+}
+
+HRESULT DepthToFilteredDepthFloatFrame( const NUI_DEPTH_IMAGE_PIXEL* depthImageData, UINT width, UINT height,
+                                        DepthFloatFrame* depthFloatFrame,
+                                        FLOAT minDepthClip, FLOAT maxDepthClip, BOOL mirrorDepth,
+                                        const BilateralFilterParameters& filter, ThreadPool& pool )
+{
+    DepthRange range;
+    HRESULT hr = checkDepthArguments( depthImageData, width, height, depthFloatFrame, minDepthClip, maxDepthClip, range );
+    if ( FAILED( hr ) ) {
+        return hr;
+    }
+
+    depthFloatFrame->resize( width, height );
+    const BilateralKernel kernel( filter );
+    const int r = kernel.radius;
+    const int stride = (int)width + 2 * r;
+
+    pool.parallelFor( 0, height, [&]( int begin, int end ) {
+        // Rows begin - r .. end + r with r invalid pixels left and right; outside the image stays 0
+        int stripRows = end - begin + 2 * r;
+        std::vector<float> strip( (size_t)stripRows * stride, 0.0f );
+        for ( int i = 0; i < stripRows; ++i ) {
+            int y = begin - r + i;
+            if ( y >= 0 && y < (int)height ) {
+                convertDepthRow( depthImageData + (size_t)y * width, &strip[(size_t)i * stride + r], width, range, mirrorDepth != FALSE );
+            }
+        }
+
+        std::vector<const float*> rows( kernel.size );
+        for ( int y = begin; y < end; ++y ) {
+            for ( int ky = 0; ky < kernel.size; ++ky ) {
+                rows[ky] = &strip[(size_t)(y - begin + ky) * stride + r];
+            }
+            filterDepthRow( &rows[0], depthFloatFrame->row( y ), width, kernel, true );
+        }
+    }, 16 );
+
+    return S_OK;
+}
+
+HRESULT FilterDepthFloatFrameReference( const DepthFloatFrame* input, DepthFloatFrame* output,
+                                        const BilateralFilterParameters& filter, ThreadPool& pool )
+{
+    if ( input == 0 || output == 0 ) {
+        return E_POINTER;
+    }
+    if ( input == output || input->width == 0 || input->height == 0 ) {
+        return E_INVALIDARG;
+    }
+
+    output->resize( input->width, input->height );
+    const BilateralKernel kernel( filter );
+    const int r = kernel.radius;
+    const int width = input->width;
+    const int height = input->height;
+
+    pool.parallelFor( 0, height, [&]( int begin, int end ) {
+        // Pad the rows the same way the fused filter does
+        std::vector<float> padded( (size_t)kernel.size * (width + 2 * r), 0.0f );
+        std::vector<const float*> rows( kernel.size );
+        for ( int y = begin; y < end; ++y ) {
+            for ( int ky = 0; ky < kernel.size; ++ky ) {
+                float* row = &padded[(size_t)ky * (width + 2 * r) + r];
+                int sy = y + ky - r;
+                if ( sy >= 0 && sy < height ) {
+                    std::copy( input->row( sy ), input->row( sy ) + width, row );
+                }
+                else {
+                    std::fill( row, row + width, 0.0f );
+                }
+                rows[ky] = row;
+            }
+            filterDepthRow( &rows[0], output->row( y ), width, kernel, false );
+        }
+    }, 16 );
+
+    return S_OK;
+}
+
+HRESULT RegisterColorFrame( const BYTE* colorImageData, UINT colorWidth, UINT colorHeight,
+                            const NUI_COLOR_IMAGE_POINT* colorCoordinates, UINT width, UINT height,
+                            ColorFrame* colorFrame, BOOL mirrorDepth, ThreadPool& pool )
+{
+    if ( colorImageData == 0 || colorCoordinates == 0 || colorFrame == 0 ) {
+        return E_POINTER;
+    }
+    if ( colorWidth == 0 || colorHeight == 0 || width == 0 || height == 0 ) {
+        return E_INVALIDARG;
+    }
+
+    // The X byte of the color camera is not an alpha, every color seen gets 0xFF
+    const UINT* colors = (const UINT*)colorImageData;
+    colorFrame->resize( width, height );
+    pool.parallelFor( 0, height, [&]( int begin, int end ) {
+        for ( int y = begin; y < end; ++y ) {
+            const NUI_COLOR_IMAGE_POINT* src = colorCoordinates + (size_t)y * width;
+            UINT* dst = colorFrame->row( y );
+            for ( UINT x = 0; x < width; ++x ) {
+                const NUI_COLOR_IMAGE_POINT& c = src[mirrorDepth ? (width - 1 - x) : x];
+                dst[x] = ((UINT)c.x < colorWidth && (UINT)c.y < colorHeight) ?
+                         (colors[(size_t)c.y * colorWidth + c.x] | 0xFF000000u) : 0u;
+            }
+        }
+    }, 16 );
+
+    return S_OK;
+}
+
+HRESULT BuildDepthFloatPyramid( std::vector<DepthFloatFrame>* pyramid, UINT levelCount,
+                                FLOAT maxDepthDifference, ThreadPool& pool )
+{
+    if ( pyramid == 0 ) {
+        return E_POINTER;
+    }
+    if ( pyramid->empty() || levelCount == 0 ) {
+        return E_INVALIDARG;
+    }
+
+    pyramid->resize( levelCount );
+    for ( UINT level = 1; level < levelCount; ++level ) {
+        const DepthFloatFrame& fine = (*pyramid)[level - 1];
+        DepthFloatFrame& coarse = (*pyramid)[level];
+        coarse.resize( std::max( fine.width / 2, 1 ), std::max( fine.height / 2, 1 ) );
+
+        pool.parallelFor( 0, coarse.height, [&]( int begin, int end ) {
+            for ( int y = begin; y < end; ++y ) {
+                const float* row0 = fine.row( std::min( 2 * y, fine.height - 1 ) );
+                const float* row1 = fine.row( std::min( 2 * y + 1, fine.height - 1 ) );
+                float* dst = coarse.row( y );
+                for ( int x = 0; x < coarse.width; ++x ) {
+                    int x0 = std::min( 2 * x, fine.width - 1 ), x1 = std::min( 2 * x + 1, fine.width - 1 );
+                    const float d[4] = { row0[x0], row0[x1], row1[x0], row1[x1] };
+
+                    // The nearest surface wins at depth edges
+                    float nearest = 0;
+                    for ( int i = 0; i < 4; ++i ) {
+                        if ( d[i] > 0 && (nearest == 0 || d[i] < nearest) ) {
+                            nearest = d[i];
+                        }
+                    }
+
+                    float sum = 0;
+                    int count = 0;
+                    for ( int i = 0; i < 4; ++i ) {
+                        if ( d[i] > 0 && d[i] - nearest <= maxDepthDifference ) {
+                            sum += d[i];
+                            ++count;
+                        }
+                    }
+                    dst[x] = (count != 0) ? sum / count : 0.0f;
+                }
+            }
+        }, 8 );
+    }
+
+    return S_OK;
+}
+
+}
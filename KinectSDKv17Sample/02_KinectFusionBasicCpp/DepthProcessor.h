@@ -0,0 +1,103 @@
+#pragma once
+
+#include <vector>
+
+#include "../common/ThreadPool.h"
+#include "FusionTypes.h"
+
+namespace kinectbook {
+
+/// <summary>
+/// Convert NUI_DEPTH_IMAGE_PIXEL (depth in millimeters) to depth in meters
+/// </summary>
+/// <remarks>
+/// Same contract as NuiFusionDepthToDepthFloatFrame: pixels outside
+/// [minDepthClip, maxDepthClip] become 0, mirrorDepth flips every row.
+/// Uses the widest SIMD unit the build targets (AVX2, SSE2 or NEON).
+/// </remarks>
+HRESULT DepthToDepthFloatFrame( const NUI_DEPTH_IMAGE_PIXEL* depthImageData, UINT width, UINT height,
+                                DepthFloatFrame* depthFloatFrame,
+                                FLOAT minDepthClip, FLOAT maxDepthClip, BOOL mirrorDepth,
+                                ThreadPool& pool = ThreadPool::shared() );
+
+/// <summary>
+/// Scalar DepthToDepthFloatFrame, the reference the SIMD kernels are checked against
+/// </summary>
+HRESULT DepthToDepthFloatFrameReference( const NUI_DEPTH_IMAGE_PIXEL* depthImageData, UINT width, UINT height,
+                                         DepthFloatFrame* depthFloatFrame,
+                                         FLOAT minDepthClip, FLOAT maxDepthClip, BOOL mirrorDepth,
+                                         ThreadPool& pool = ThreadPool::shared() );
+
+/// <summary>
+/// Edge preserving smoothing of depth
+/// </summary>
+/// <remarks>
+/// The weight of a neighbor is a spatial Gaussian times a biweight of the
+/// depth difference, (1 - (d / (3 * sigmaDepth))^2)^2. The biweight is close
+/// to a Gaussian but exactly 0 beyond 3 sigma, so pixels across a depth
+/// edge never mix, and it needs no exp() per sample. Invalid (0) pixels
+/// stay invalid and do not contribute.
+/// </remarks>
+struct BilateralFilterParameters
+{
+    UINT radius;            // pixels, the window is (2 * radius + 1)^2
+    FLOAT sigmaSpace;       // pixels
+    FLOAT sigmaDepth;       // meters
+
+    BilateralFilterParameters()
+        : radius( 2 )
+        , sigmaSpace( 2.0f )
+        , sigmaDepth( 0.01f )
+    {
+    }
+};
+
+/// <summary>
+/// DepthToDepthFloatFrame followed by the bilateral filter in one pass
+/// </summary>
+/// <remarks>
+/// Every task converts its rows plus the filter margin into a small strip
+/// and filters them while they are still in the cache.
+/// </remarks>
+HRESULT DepthToFilteredDepthFloatFrame( const NUI_DEPTH_IMAGE_PIXEL* depthImageData, UINT width, UINT height,
+                                        DepthFloatFrame* depthFloatFrame,
+                                        FLOAT minDepthClip, FLOAT maxDepthClip, BOOL mirrorDepth,
+                                        const BilateralFilterParameters& filter,
+                                        ThreadPool& pool = ThreadPool::shared() );
+
+/// <summary>
+/// Scalar bilateral filter, the reference for DepthToFilteredDepthFloatFrame
+/// </summary>
+HRESULT FilterDepthFloatFrameReference( const DepthFloatFrame* input, DepthFloatFrame* output,
+                                        const BilateralFilterParameters& filter,
+                                        ThreadPool& pool = ThreadPool::shared() );
+
+/// <summary>
+/// Pick the color of every depth pixel out of a color image
+/// </summary>
+/// <remarks>
+/// colorCoordinates holds the color pixel of every depth pixel in the
+/// order of depthImageData, as INuiCoordinateMapper::MapDepthFrameToColorFrame
+/// returns it. mirrorDepth has to match DepthToDepthFloatFrame, so pixel
+/// (x, y) of colorFrame is the color of pixel (x, y) of the depth float frame.
+/// Depth pixels that map outside the color image get no color (alpha 0).
+/// </remarks>
+/// <param name="colorImageData">BGRX, 4 bytes per pixel, colorWidth * 4 bytes per row</param>
+HRESULT RegisterColorFrame( const BYTE* colorImageData, UINT colorWidth, UINT colorHeight,
+                            const NUI_COLOR_IMAGE_POINT* colorCoordinates, UINT width, UINT height,
+                            ColorFrame* colorFrame, BOOL mirrorDepth,
+                            ThreadPool& pool = ThreadPool::shared() );
+
+/// <summary>
+/// Fill levels 1 .. levelCount - 1 of a depth pyramid; (*pyramid)[0] has to hold the full frame
+/// </summary>
+/// <remarks>
+/// Every level halves the resolution. A pixel is the mean of the valid
+/// pixels of its 2x2 block that are within maxDepthDifference of the
+/// nearest one, so depth edges are not blurred into phantom surfaces.
+/// </remarks>
+HRESULT BuildDepthFloatPyramid( std::vector<DepthFloatFrame>* pyramid, UINT levelCount,
+                                FLOAT maxDepthDifference,
+                                ThreadPool& pool = ThreadPool::shared() );
+
+}
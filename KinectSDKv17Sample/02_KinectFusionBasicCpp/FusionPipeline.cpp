@@ -0,0 +1,235 @@
+#include "FusionPipeline.h"
+
+#include <cstring>
+
+#include "DepthProcessor.h"
+
+namespace kinectbook {
+
+namespace {
+
+const unsigned int WAIT_FOREVER = FrameQueue<FusionPipelineFrame*>::WAIT_FOREVER;
+
+}
+
+FusionPipeline::FusionPipeline( CpuReconstruction& reconstruction_, const FusionPipelineOptions& options_,
+                                const ShadeFunction& shade_ )
+    : reconstruction( reconstruction_ )
+    , options( options_ )
+    , shade( shade_ )
+    , freeFrames( options_.frameCount )
+    , convertQueue( options_.frameCount )
+    , trackQueue( options_.frameCount )
+    , shadeQueue( options_.frameCount )
+    , presentQueue( options_.frameCount )
+    , stopping( false )
+    , droppedFrames( 0 )
+    , framesInFlight( 0 )
+    , submittedFrames( 0 )
+    , profiler( options_.profiler != 0 ? *options_.profiler : Profiler::shared() )
+    , upkeep( reconstruction_, options_, true, profiler )
+{
+    if ( options.frameCount < 2 ) {
+        options.frameCount = 2;
+    }
+
+    ids.submit = profiler.stage( "fusion.submit" );
+    ids.depthFloat = profiler.stage( "fusion.depth_float" );
+    ids.processFrame = profiler.stage( "fusion.process_frame" );
+    ids.pointCloud = profiler.stage( "fusion.point_cloud" );
+    ids.shade = profiler.stage( "fusion.shade" );
+    ids.latency = profiler.stage( "fusion.latency" );
+    ids.droppedFrames = profiler.counter( "fusion.dropped_frames" );
+
+    for ( unsigned int i = 0; i < options.frameCount; ++i ) {
+        frames.push_back( std::unique_ptr<FusionPipelineFrame>( new FusionPipelineFrame() ) );
+        freeFrames.push( frames.back().get() );
+    }
+
+    threads.push_back( std::thread( &FusionPipeline::convertStage, this ) );
+    threads.push_back( std::thread( &FusionPipeline::trackStage, this ) );
+    threads.push_back( std::thread( &FusionPipeline::shadeStage, this ) );
+}
+
+FusionPipeline::~FusionPipeline()
+{
+    stopping = true;
+
+    Queue* queues[] = { &freeFrames, &convertQueue, &trackQueue, &shadeQueue, &presentQueue };
+    for ( size_t i = 0; i < sizeof(queues) / sizeof(queues[0]); ++i ) {
+        queues[i]->close();
+    }
+
+    for ( size_t i = 0; i < threads.size(); ++i ) {
+        threads[i].join();
+    }
+}
+
+void FusionPipeline::push( Queue& queue, FusionPipelineFrame* frame )
+{
+    // Every queue can hold all frames, so this cannot fail
+    queue.push( frame );
+}
+
+FusionPipelineFrame* FusionPipeline::pop( Queue& queue, bool newestOnly, unsigned int timeoutMilliseconds )
+{
+    FusionPipelineFrame* frame = 0;
+    if ( stopping || !queue.pop( frame, timeoutMilliseconds ) ) {
+        return 0;
+    }
+
+    // Older frames are stale once a newer one is waiting
+    FusionPipelineFrame* newer = 0;
+    while ( newestOnly && queue.tryPop( newer ) ) {
+        recycle( frame );
+        dropFrame();
+        if ( &queue != &presentQueue ) {
+            --framesInFlight;
+        }
+        frame = newer;
+    }
+    return frame;
+}
+
+void FusionPipeline::recycle( FusionPipelineFrame* frame )
+{
+    push( freeFrames, frame );
+}
+
+void FusionPipeline::dropFrame()
+{
+    ++droppedFrames;
+    profiler.add( ids.droppedFrames );
+}
+
+bool FusionPipeline::submit( const NUI_DEPTH_IMAGE_PIXEL* pixels, UINT width, UINT height, LONGLONG timestamp )
+{
+    return submit( pixels, width, height, timestamp, nullptr, 0, 0, nullptr );
+}
+
+bool FusionPipeline::submit( const NUI_DEPTH_IMAGE_PIXEL* pixels, UINT width, UINT height, LONGLONG timestamp,
+                             const BYTE* colorPixels, UINT colorWidth, UINT colorHeight,
+                             const NUI_COLOR_IMAGE_POINT* colorCoordinates )
+{
+    FusionPipelineFrame* frame = pop( freeFrames, false, options.dropStaleFrames ? 0 : WAIT_FOREVER );
+    if ( frame == 0 ) {
+        dropFrame();
+        return false;
+    }
+
+    ScopedTimer timer( ids.submit, profiler );
+
+    frame->sequence = submittedFrames++;
+    frame->timestamp = timestamp;
+    frame->submitTime = FusionPipelineFrame::Clock::now();
+    frame->width = width;
+    frame->height = height;
+    frame->depthPixels.resize( (size_t)width * height );
+    std::memcpy( &frame->depthPixels[0], pixels, frame->depthPixels.size() * sizeof(NUI_DEPTH_IMAGE_PIXEL) );
+
+    frame->hasColor = colorPixels != nullptr && colorCoordinates != nullptr;
+    if ( frame->hasColor ) {
+        frame->colorWidth = colorWidth;
+        frame->colorHeight = colorHeight;
+        frame->colorImage.assign( colorPixels, colorPixels + (size_t)colorWidth * colorHeight * 4 );
+        frame->colorCoordinates.assign( colorCoordinates, colorCoordinates + frame->depthPixels.size() );
+    }
+
+    ++framesInFlight;
+    push( convertQueue, frame );
+    return true;
+}
+
+FusionPipelineFrame* FusionPipeline::receive( unsigned int timeoutMilliseconds )
+{
+    return pop( presentQueue, options.dropStaleFrames, timeoutMilliseconds );
+}
+
+void FusionPipeline::release( FusionPipelineFrame* frame )
+{
+    if ( frame != 0 ) {
+        recycle( frame );
+    }
+}
+
+void FusionPipeline::flush()
+{
+    while ( framesInFlight.load() != 0 && !stopping ) {
+        std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+    }
+}
+
+void FusionPipeline::convertStage()
+{
+    while ( FusionPipelineFrame* frame = pop( convertQueue, false, WAIT_FOREVER ) ) {
+        ScopedTimer timer( ids.depthFloat, profiler );
+        DepthToDepthFloatFrame( &frame->depthPixels[0], frame->width, frame->height, &frame->depthFloat,
+                                options.minimumDepth, options.maximumDepth, options.mirrorDepth );
+        if ( frame->hasColor ) {
+            RegisterColorFrame( &frame->colorImage[0], frame->colorWidth, frame->colorHeight,
+                                &frame->colorCoordinates[0], frame->width, frame->height, &frame->color,
+                                options.mirrorDepth );
+        }
+        push( trackQueue, frame );
+    }
+}
+
+void FusionPipeline::trackStage()
+{
+    // Stale frames are skipped here, where a frame costs the most
+    while ( FusionPipelineFrame* frame = pop( trackQueue, options.dropStaleFrames, WAIT_FOREVER ) ) {
+        Matrix4 worldToCamera;
+        reconstruction.GetCurrentWorldToCameraTransform( &worldToCamera );
+        upkeep.frameStarted( frame->timestamp );
+        FusionPipelineFrame::Clock::time_point start = FusionPipelineFrame::Clock::now();
+        frame->trackingResult = reconstruction.ProcessFrame( &frame->depthFloat, frame->hasColor ? &frame->color : nullptr,
+                                                             options.alignIterationCount, options.integrationWeight,
+                                                             &worldToCamera );
+        FusionPipelineFrame::Clock::time_point end = FusionPipelineFrame::Clock::now();
+        frame->trackingTime = std::chrono::duration<double, std::milli>( end - start ).count();
+        profiler.record( ids.processFrame, start, end );
+        frame->tracking = reconstruction.trackingStatistics();
+        upkeep.frameTracked( frame->trackingResult );
+
+        if ( FAILED( frame->trackingResult ) ) {
+            // Nothing new to show
+            recycle( frame );
+            --framesInFlight;
+            continue;
+        }
+
+        reconstruction.GetCurrentWorldToCameraTransform( &frame->worldToCamera );
+        {
+            ScopedTimer timer( ids.pointCloud, profiler );
+            frame->sizePointCloud( options.pointCloudLevel );
+            if ( frame->hasColor ) {
+                reconstruction.CalculatePointCloud( &frame->pointCloud, &frame->pointCloudColors, &frame->worldToCamera );
+            }
+            else {
+                reconstruction.CalculatePointCloud( &frame->pointCloud, &frame->worldToCamera );
+            }
+        }
+        push( shadeQueue, frame );
+        upkeep.frameIntegrated();
+    }
+
+    upkeep.finish();
+}
+
+void FusionPipeline::shadeStage()
+{
+    while ( FusionPipelineFrame* frame = pop( shadeQueue, false, WAIT_FOREVER ) ) {
+        if ( shade ) {
+            ScopedTimer timer( ids.shade, profiler );
+            shade( *frame );
+        }
+
+        FusionPipelineFrame::Clock::time_point end = FusionPipelineFrame::Clock::now();
+        frame->latency = std::chrono::duration<double, std::milli>( end - frame->submitTime ).count();
+        profiler.record( ids.latency, frame->submitTime, end );
+        --framesInFlight;
+        push( presentQueue, frame );
+    }
+}
+
+}
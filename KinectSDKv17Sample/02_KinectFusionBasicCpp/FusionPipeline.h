@@ -0,0 +1,305 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../common/FrameQueue.h"
+#include "../common/Profiler.h"
+#include "CpuReconstruction.h"
+#include "MeshExtractor.h"
+#include "ReconstructionUpkeep.h"
+
+namespace kinectbook {
+
+/// <summary>
+/// One frame travelling through the FusionPipeline
+/// </summary>
+/// <remarks>
+/// Frames are allocated once and recycled, so the buffers keep their
+/// capacity and nothing is allocated per frame in steady state.
+/// </remarks>
+struct FusionPipelineFrame
+{
+    typedef std::chrono::steady_clock Clock;
+
+    unsigned int sequence;              // submit order
+    LONGLONG timestamp;                 // liTimeStamp of the depth frame
+    Clock::time_point submitTime;
+
+    UINT width;
+    UINT height;
+    std::vector<NUI_DEPTH_IMAGE_PIXEL> depthPixels;
+
+    // Color image and the color pixel of every depth pixel, when submitted with color
+    bool hasColor;
+    UINT colorWidth;
+    UINT colorHeight;
+    std::vector<BYTE> colorImage;
+    std::vector<NUI_COLOR_IMAGE_POINT> colorCoordinates;
+
+    DepthFloatFrame depthFloat;
+    ColorFrame color;                   // registered to depthFloat
+
+    HRESULT trackingResult;             // result of ProcessFrame
+    TrackingStatistics tracking;        // iterations and residuals of the tracker
+    double trackingTime;                // milliseconds spent in ProcessFrame
+    Matrix4 worldToCamera;              // pose after tracking
+    PointCloudFrame pointCloud;         // valid when trackingResult succeeded
+    ColorFrame pointCloudColors;        // fused color of every point, with hasColor
+
+    /// <summary>
+    /// Milliseconds from submit() to the end of the shade stage
+    /// </summary>
+    double latency;
+
+    /// <summary>
+    /// Give pointCloud the size CalculatePointCloud() raycasts at, 1/2^level of the depth frame
+    /// </summary>
+    void sizePointCloud( unsigned int level )
+    {
+        int w = (int)(width >> level), h = (int)(height >> level);
+        if ( pointCloud.width != w || pointCloud.height != h ) {
+            pointCloud.resize( w, h );
+        }
+    }
+};
+
+/// <summary>
+/// Settings of a FusionPipeline
+/// </summary>
+struct FusionPipelineOptions
+{
+    /// <summary>
+    /// Frames in flight, including the ones the caller holds
+    /// </summary>
+    unsigned int frameCount;
+
+    /// <summary>
+    /// true: every stage skips to the newest frame waiting for it and
+    /// submit() refuses frames while all are in flight (live sensor).
+    /// false: every frame goes through every stage and submit() waits (replay).
+    /// </summary>
+    bool dropStaleFrames;
+
+    /// <summary>
+    /// Reset the reconstruction after this many tracking errors in a row, 0 never
+    /// </summary>
+    /// <remarks>
+    /// The reconstruction relocalizes the camera by itself once the view is
+    /// clear again; the reset is the last resort for a camera that went
+    /// somewhere the volume has never seen. 300 is about 10 seconds.
+    /// </remarks>
+    unsigned int resetAfterTrackingErrors;
+
+    float minimumDepth;
+    float maximumDepth;
+    bool mirrorDepth;
+
+    UINT alignIterationCount;
+    UINT integrationWeight;
+
+    /// <summary>
+    /// Bring the mesh up to date after this many tracked frames, 0 = no mesh
+    /// </summary>
+    /// <remarks>Only the blocks changed since the last update are meshed again</remarks>
+    unsigned int meshUpdateInterval;
+
+    /// <summary>
+    /// Resolution of the point cloud handed to shading: 0 = the depth frame's,
+    /// every level up to 3 halves it
+    /// </summary>
+    /// <remarks>
+    /// At level 0 the point cloud is the raycast the next frame is tracked
+    /// against and costs a copy; a coarser preview is subsampled from it.
+    /// </remarks>
+    unsigned int pointCloudLevel;
+
+    /// <summary>
+    /// Snapshot of the volume and the camera pose (.kbvol), empty = no snapshots
+    /// </summary>
+    /// <remarks>
+    /// Taken every snapshotInterval tracked frames, on requestSnapshot() and
+    /// before a reset after tracking errors. The file is written in the
+    /// background; a snapshot due while the last one is still being
+    /// written is taken after the next tracked frame.
+    /// </remarks>
+    std::string snapshotPath;
+
+    /// <summary>
+    /// Tracked frames between snapshots, 0 = only on request
+    /// </summary>
+    unsigned int snapshotInterval;
+
+    /// <summary>
+    /// Camera poses of the tracked frames as a TUM RGB-D trajectory, empty = none
+    /// </summary>
+    /// <remarks>
+    /// The poses of CpuReconstruction::poseGraph(), corrected by the loops
+    /// closed since, are appended before a reset after tracking errors and
+    /// when the pipeline stops. Reset the reconstruction through the
+    /// pipeline only, or the frames no longer match their timestamps.
+    /// </remarks>
+    std::string trajectoryPath;
+
+    /// <summary>
+    /// Where the stages record their times and the dropped frames, nullptr = Profiler::shared()
+    /// </summary>
+    /// <remarks>
+    /// Stages "fusion.submit", "fusion.depth_float", "fusion.process_frame",
+    /// "fusion.point_cloud", "fusion.shade", "fusion.mesh_update",
+    /// "fusion.snapshot" (starting one; the file is written in the
+    /// background) and "fusion.latency" (submit to shaded); counters "fusion.dropped_frames",
+    /// "fusion.tracking_errors", "fusion.tracking_resets" and "fusion.loop_closures".
+    /// </remarks>
+    Profiler* profiler;
+
+    FusionPipelineOptions()
+        : frameCount( 4 )
+        , dropStaleFrames( true )
+        , resetAfterTrackingErrors( 300 )
+        , minimumDepth( NUI_FUSION_DEFAULT_MINIMUM_DEPTH )
+        , maximumDepth( NUI_FUSION_DEFAULT_MAXIMUM_DEPTH )
+        , mirrorDepth( true )
+        , alignIterationCount( NUI_FUSION_DEFAULT_ALIGN_ITERATION_COUNT )
+        , integrationWeight( NUI_FUSION_DEFAULT_INTEGRATION_WEIGHT )
+        , meshUpdateInterval( 0 )
+        , pointCloudLevel( 0 )
+        , snapshotInterval( 0 )
+        , profiler( 0 )
+    {
+    }
+};
+
+/// <summary>
+/// Kinect Fusion split into stages that run at the same time on their own threads
+/// </summary>
+/// <remarks>
+///   acquisition (caller, submit) -> depth float conversion -> tracking, integration
+///   and point cloud -> shading (callback) -> presentation (caller, receive)
+///
+/// Stages hand frames over through lock-free RingBuffers; a stage with
+/// nothing to do spins briefly and then sleeps until the previous stage
+/// wakes it. The point cloud is raycast by the tracking stage because it is
+/// the only thread touching the volume, so integration never races a raycast.
+/// </remarks>
+class FusionPipeline
+{
+public:
+
+    typedef std::function<void ( FusionPipelineFrame& frame )> ShadeFunction;
+
+    /// <param name="shade">
+    /// Called on the shade stage for every tracked frame to draw it for
+    /// display, e.g. into a TripleBuffer; may be empty
+    /// </param>
+    FusionPipeline( CpuReconstruction& reconstruction, const FusionPipelineOptions& options,
+                    const ShadeFunction& shade );
+    ~FusionPipeline();
+
+    /// <summary>
+    /// Copy a depth frame into the pipeline
+    /// </summary>
+    /// <returns>false when the frame was dropped because every frame is in flight</returns>
+    bool submit( const NUI_DEPTH_IMAGE_PIXEL* pixels, UINT width, UINT height, LONGLONG timestamp );
+
+    /// <summary>
+    /// Copy a depth frame and the color image it maps to into the pipeline; the color is fused into the volume
+    /// </summary>
+    /// <param name="colorPixels">BGRX, 4 bytes per pixel</param>
+    /// <param name="colorCoordinates">Color pixel of every depth pixel (MapDepthFrameToColorFrame)</param>
+    bool submit( const NUI_DEPTH_IMAGE_PIXEL* pixels, UINT width, UINT height, LONGLONG timestamp,
+                 const BYTE* colorPixels, UINT colorWidth, UINT colorHeight,
+                 const NUI_COLOR_IMAGE_POINT* colorCoordinates );
+
+    /// <summary>
+    /// Newest finished frame; hand it back with release() when done with it
+    /// </summary>
+    /// <param name="timeoutMilliseconds">0 to poll</param>
+    /// <returns>nullptr when nothing finished in time</returns>
+    FusionPipelineFrame* receive( unsigned int timeoutMilliseconds );
+
+    void release( FusionPipelineFrame* frame );
+
+    /// <summary>
+    /// Block until every submitted frame has been processed or dropped
+    /// </summary>
+    /// <remarks>
+    /// Finished frames may still be waiting for receive() afterwards, and
+    /// with dropStaleFrames some of them are never handed out at all.
+    /// </remarks>
+    void flush();
+
+    /// <summary>
+    /// Frames dropped by submit() or skipped by a stage
+    /// </summary>
+    unsigned int droppedFrameCount() const { return droppedFrames.load(); }
+
+    /// <summary>
+    /// Call read with the mesh while the tracking stage does not update it
+    /// </summary>
+    /// <returns>false when meshUpdateInterval is 0</returns>
+    bool readMesh( const std::function<void ( const MeshExtractor& mesh )>& read ) { return upkeep.readMesh( read ); }
+
+    /// <summary>
+    /// Take a snapshot after the next tracked frame (needs snapshotPath)
+    /// </summary>
+    void requestSnapshot() { upkeep.requestSnapshot(); }
+
+private:
+
+    FusionPipeline( const FusionPipeline& );
+    FusionPipeline& operator=( const FusionPipeline& );
+
+    typedef FrameQueue<FusionPipelineFrame*> Queue;
+
+    void push( Queue& queue, FusionPipelineFrame* frame );
+    FusionPipelineFrame* pop( Queue& queue, bool newestOnly, unsigned int timeoutMilliseconds );
+    void recycle( FusionPipelineFrame* frame );
+
+    void convertStage();
+    void trackStage();
+    void shadeStage();
+    void dropFrame();
+
+    CpuReconstruction& reconstruction;
+    FusionPipelineOptions options;
+    ShadeFunction shade;
+
+    std::vector<std::unique_ptr<FusionPipelineFrame> > frames;
+    Queue freeFrames;
+    Queue convertQueue;
+    Queue trackQueue;
+    Queue shadeQueue;
+    Queue presentQueue;
+
+    std::atomic<bool> stopping;
+    std::atomic<unsigned int> droppedFrames;
+    std::atomic<unsigned int> framesInFlight;
+    unsigned int submittedFrames;
+
+    // Ids in the profiler
+    Profiler& profiler;
+    struct ProfilerIds
+    {
+        unsigned int submit;
+        unsigned int depthFloat;
+        unsigned int processFrame;
+        unsigned int pointCloud;
+        unsigned int shade;
+        unsigned int latency;
+        unsigned int droppedFrames;
+    } ids;
+
+    // Used by the tracking stage, the only thread touching the volume
+    ReconstructionUpkeep upkeep;
+
+    std::vector<std::thread> threads;
+};
+
+}
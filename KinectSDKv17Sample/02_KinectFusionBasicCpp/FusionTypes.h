@@ -0,0 +1,291 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+
+#include "../common/NuiCompat.h"
+
+namespace kinectbook {
+
+/// <summary>
+/// 3 component float vector
+/// </summary>
+struct Float3
+{
+    float x, y, z;
+
+    Float3() : x( 0 ), y( 0 ), z( 0 ) {}
+    Float3( float x_, float y_, float z_ ) : x( x_ ), y( y_ ), z( z_ ) {}
+
+    Float3 operator + ( const Float3& v ) const { return Float3( x + v.x, y + v.y, z + v.z ); }
+    Float3 operator - ( const Float3& v ) const { return Float3( x - v.x, y - v.y, z - v.z ); }
+    Float3 operator * ( float s ) const { return Float3( x * s, y * s, z * s ); }
+    Float3 operator - () const { return Float3( -x, -y, -z ); }
+    Float3& operator += ( const Float3& v ) { x += v.x; y += v.y; z += v.z; return *this; }
+};
+
+inline float dot( const Float3& a, const Float3& b )
+{
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+inline Float3 cross( const Float3& a, const Float3& b )
+{
+    return Float3( a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x );
+}
+
+inline float length( const Float3& v )
+{
+    return std::sqrt( dot( v, v ) );
+}
+
+inline Float3 normalize( const Float3& v )
+{
+    float len = length( v );
+    return (len > 0) ? v * (1.0f / len) : Float3();
+}
+
+/// <summary>
+/// Rigid transform p' = R * p + t
+/// </summary>
+/// <remarks>
+/// Matrix4 of the SDK uses row vectors (p' = p * M, translation in M41..M43);
+/// fromMatrix4()/toMatrix4() convert between the two conventions.
+/// </remarks>
+struct RigidTransform
+{
+    float r[3][3];
+    Float3 t;
+
+    RigidTransform()
+    {
+        r[0][0] = 1; r[0][1] = 0; r[0][2] = 0;
+        r[1][0] = 0; r[1][1] = 1; r[1][2] = 0;
+        r[2][0] = 0; r[2][1] = 0; r[2][2] = 1;
+    }
+
+    Float3 operator * ( const Float3& p ) const
+    {
+        return Float3( r[0][0] * p.x + r[0][1] * p.y + r[0][2] * p.z + t.x,
+                       r[1][0] * p.x + r[1][1] * p.y + r[1][2] * p.z + t.y,
+                       r[2][0] * p.x + r[2][1] * p.y + r[2][2] * p.z + t.z );
+    }
+
+    Float3 rotate( const Float3& v ) const
+    {
+        return Float3( r[0][0] * v.x + r[0][1] * v.y + r[0][2] * v.z,
+                       r[1][0] * v.x + r[1][1] * v.y + r[1][2] * v.z,
+                       r[2][0] * v.x + r[2][1] * v.y + r[2][2] * v.z );
+    }
+
+    Float3 column( int c ) const
+    {
+        return Float3( r[0][c], r[1][c], r[2][c] );
+    }
+
+    RigidTransform operator * ( const RigidTransform& b ) const
+    {
+        RigidTransform m;
+        for ( int i = 0; i < 3; ++i ) {
+            for ( int j = 0; j < 3; ++j ) {
+                m.r[i][j] = r[i][0] * b.r[0][j] + r[i][1] * b.r[1][j] + r[i][2] * b.r[2][j];
+            }
+        }
+        m.t = rotate( b.t ) + t;
+        return m;
+    }
+
+    RigidTransform inverse() const
+    {
+        RigidTransform m;
+        for ( int i = 0; i < 3; ++i ) {
+            for ( int j = 0; j < 3; ++j ) {
+                m.r[i][j] = r[j][i];
+            }
+        }
+        m.t = -m.rotate( t );
+        return m;
+    }
+
+    static RigidTransform fromMatrix4( const Matrix4& m )
+    {
+        RigidTransform rt;
+        rt.r[0][0] = m.M11; rt.r[0][1] = m.M21; rt.r[0][2] = m.M31;
+        rt.r[1][0] = m.M12; rt.r[1][1] = m.M22; rt.r[1][2] = m.M32;
+        rt.r[2][0] = m.M13; rt.r[2][1] = m.M23; rt.r[2][2] = m.M33;
+        rt.t = Float3( m.M41, m.M42, m.M43 );
+        return rt;
+    }
+
+    Matrix4 toMatrix4() const
+    {
+        Matrix4 m;
+        m.M11 = r[0][0]; m.M12 = r[1][0]; m.M13 = r[2][0]; m.M14 = 0;
+        m.M21 = r[0][1]; m.M22 = r[1][1]; m.M23 = r[2][1]; m.M24 = 0;
+        m.M31 = r[0][2]; m.M32 = r[1][2]; m.M33 = r[2][2]; m.M34 = 0;
+        m.M41 = t.x;     m.M42 = t.y;     m.M43 = t.z;     m.M44 = 1;
+        return m;
+    }
+
+    /// <summary>
+    /// Small motion (rx, ry, rz, tx, ty, tz) applied as exp(twist)
+    /// </summary>
+    static RigidTransform fromTwist( const float twist[6] )
+    {
+        RigidTransform m;
+        Float3 w( twist[0], twist[1], twist[2] );
+        float theta = length( w );
+        if ( theta > 1e-12f ) {
+            // Rodrigues
+            Float3 k = w * (1.0f / theta);
+            float c = std::cos( theta ), s = std::sin( theta ), v = 1 - c;
+            m.r[0][0] = k.x * k.x * v + c;       m.r[0][1] = k.x * k.y * v - k.z * s; m.r[0][2] = k.x * k.z * v + k.y * s;
+            m.r[1][0] = k.y * k.x * v + k.z * s; m.r[1][1] = k.y * k.y * v + c;       m.r[1][2] = k.y * k.z * v - k.x * s;
+            m.r[2][0] = k.z * k.x * v - k.y * s; m.r[2][1] = k.z * k.y * v + k.x * s; m.r[2][2] = k.z * k.z * v + c;
+        }
+        m.t = Float3( twist[3], twist[4], twist[5] );
+        return m;
+    }
+
+    /// <summary>
+    /// Rotation angle in radians
+    /// </summary>
+    float angle() const
+    {
+        float c = (r[0][0] + r[1][1] + r[2][2] - 1) * 0.5f;
+        c = (c > 1) ? 1 : ((c < -1) ? -1 : c);
+        return std::acos( c );
+    }
+};
+
+/// <summary>
+/// Pinhole model of the depth camera
+/// </summary>
+struct CameraIntrinsics
+{
+    float fx, fy;
+    float cx, cy;
+    int width;
+    int height;
+
+    /// <summary>
+    /// Nominal Kinect depth camera parameters for a given resolution
+    /// </summary>
+    static CameraIntrinsics depthCamera( int width, int height )
+    {
+        CameraIntrinsics k;
+        k.fx = k.fy = NUI_CAMERA_DEPTH_NOMINAL_FOCAL_LENGTH_IN_PIXELS * width / 320.0f;
+        k.cx = width * 0.5f;
+        k.cy = height * 0.5f;
+        k.width = width;
+        k.height = height;
+        return k;
+    }
+
+    /// <summary>
+    /// Same camera at a lower resolution (level 1 = half size)
+    /// </summary>
+    /// <remarks>
+    /// A coarse pixel covers 2^l fine pixels, so its center lies half a
+    /// fine pixel less than 2^l times away from the principal point.
+    /// </remarks>
+    CameraIntrinsics level( int l ) const
+    {
+        CameraIntrinsics k = *this;
+        float s = 1.0f / (1 << l);
+        k.fx *= s; k.fy *= s;
+        k.cx = (cx + 0.5f) * s - 0.5f;
+        k.cy = (cy + 0.5f) * s - 0.5f;
+        k.width = width >> l;
+        k.height = height >> l;
+        return k;
+    }
+
+    Float3 unproject( float u, float v, float depth ) const
+    {
+        return Float3( (u - cx) / fx * depth, (v - cy) / fy * depth, depth );
+    }
+};
+
+/// <summary>
+/// Depth in meters, 0 = invalid (NUI_FUSION_IMAGE_TYPE_FLOAT)
+/// </summary>
+struct DepthFloatFrame
+{
+    int width;
+    int height;
+    std::vector<float> pixels;
+
+    DepthFloatFrame() : width( 0 ), height( 0 ) {}
+
+    void resize( int w, int h )
+    {
+        width = w;
+        height = h;
+        pixels.resize( (size_t)w * h );
+    }
+
+    float* row( int y ) { return &pixels[(size_t)y * width]; }
+    const float* row( int y ) const { return &pixels[(size_t)y * width]; }
+};
+
+/// <summary>
+/// Color registered to the pixels of a depth frame (NUI_FUSION_IMAGE_TYPE_COLOR)
+/// </summary>
+/// <remarks>
+/// One BGRA UINT per pixel like the SDK frame. Alpha 0 marks pixels
+/// without a color: depth pixels the color camera does not see, or
+/// points nothing was integrated at.
+/// </remarks>
+struct ColorFrame
+{
+    int width;
+    int height;
+    std::vector<UINT> pixels;
+
+    ColorFrame() : width( 0 ), height( 0 ) {}
+
+    void resize( int w, int h )
+    {
+        width = w;
+        height = h;
+        pixels.assign( (size_t)w * h, 0u );
+    }
+
+    UINT* row( int y ) { return &pixels[(size_t)y * width]; }
+    const UINT* row( int y ) const { return &pixels[(size_t)y * width]; }
+
+    static bool isValid( UINT pixel ) { return (pixel >> 24) != 0; }
+};
+
+/// <summary>
+/// Points and normals in world space (NUI_FUSION_IMAGE_TYPE_POINT_CLOUD)
+/// </summary>
+/// <remarks>
+/// Six floats per pixel (x, y, z, nx, ny, nz), the same layout as the SDK frame,
+/// so the data can be copied straight into an SDK texture. Invalid pixels are all zero.
+/// </remarks>
+struct PointCloudFrame
+{
+    static const int FLOATS_PER_PIXEL = 6;
+
+    int width;
+    int height;
+    std::vector<float> data;
+
+    PointCloudFrame() : width( 0 ), height( 0 ) {}
+
+    void resize( int w, int h )
+    {
+        width = w;
+        height = h;
+        data.assign( (size_t)w * h * FLOATS_PER_PIXEL, 0.0f );
+    }
+
+    float* pixel( int x, int y ) { return &data[((size_t)y * width + x) * FLOATS_PER_PIXEL]; }
+    const float* pixel( int x, int y ) const { return &data[((size_t)y * width + x) * FLOATS_PER_PIXEL]; }
+
+    static bool isValid( const float* p ) { return p[0] != 0 || p[1] != 0 || p[2] != 0; }
+};
+
+}
@@ -0,0 +1,637 @@
+#include "HashedTsdfVolume.h"
+
+#include <algorithm>
+#include <mutex>
+
+#include "../common/ThreadPool.h"
+#include "TsdfKernels.h"
+
+namespace kinectbook {
+
+namespace {
+
+const long long EMPTY_KEY = -1;
+const size_t INITIAL_TABLE_SIZE = 1 << 16;
+const size_t INITIAL_CELL_TABLE_SIZE = 1 << 10;
+const long long KEY_COORDINATE_MASK = (1 << 21) - 1;
+
+// Pixels sampled in each direction when looking for blocks to allocate.
+// A block is 3cm at 256 voxels per meter, two pixels are 7mm at 2m.
+const int ALLOCATION_PIXEL_STEP = 2;
+
+}
+
+HashedTsdfVolume::HashedTsdfVolume( const NUI_FUSION_RECONSTRUCTION_PARAMETERS& params_, ThreadPool& pool_ )
+    : params( params_ )
+    , truncation( defaultTruncationDistance( params_.voxelsPerMeter ) )
+    , blockCountX( (params_.voxelCountX + VOXEL_BLOCK_SIZE - 1) / VOXEL_BLOCK_SIZE )
+    , blockCountY( (params_.voxelCountY + VOXEL_BLOCK_SIZE - 1) / VOXEL_BLOCK_SIZE )
+    , blockCountZ( (params_.voxelCountZ + VOXEL_BLOCK_SIZE - 1) / VOXEL_BLOCK_SIZE )
+    , colored( false )
+    , tableMask( 0 )
+    , cellTableMask( 0 )
+    , cellCount( 0 )
+    , stamp( 0 )
+    , resetStamp( 0 )
+    , pool( pool_ )
+{
+    reset( nullptr );
+}
+
+void HashedTsdfVolume::reset( const Matrix4* worldToVolumeTransform )
+{
+    if ( view ) {
+        view->preserveAll();
+        releaseView();
+    }
+
+    worldToVolume = worldToVolumeInMeters( params, worldToVolumeTransform );
+
+    std::deque<VoxelBlock>().swap( blocks );
+    std::deque<ColorVoxelBlock>().swap( colorBlocks );
+    colored = false;
+    std::vector<HashEntry>().swap( table );
+    resizeTable( INITIAL_TABLE_SIZE );
+    std::vector<long long>().swap( cellTable );
+    cellCount = 0;
+    resizeCellTable( INITIAL_CELL_TABLE_SIZE );
+    resetStamp = ++stamp;
+}
+
+size_t HashedTsdfVolume::memoryUsage() const
+{
+    return blocks.size() * sizeof(VoxelBlock) + colorBlocks.size() * sizeof(ColorVoxelBlock) +
+           table.size() * sizeof(HashEntry) + cellTable.size() * sizeof(long long);
+}
+
+void HashedTsdfVolume::resizeTable( size_t capacity )
+{
+    std::vector<HashEntry> old;
+    old.swap( table );
+
+    HashEntry empty = { EMPTY_KEY, -1 };
+    table.assign( capacity, empty );
+    tableMask = capacity - 1;
+
+    for ( size_t i = 0; i < old.size(); ++i ) {
+        if ( old[i].key == EMPTY_KEY ) {
+            continue;
+        }
+        const VoxelBlock& b = blocks[old[i].block];
+        size_t slot = hashSlot( b.x, b.y, b.z );
+        while ( table[slot].key != EMPTY_KEY ) {
+            slot = (slot + 1) & tableMask;
+        }
+        table[slot] = old[i];
+    }
+}
+
+void HashedTsdfVolume::resizeCellTable( size_t capacity )
+{
+    std::vector<long long> old;
+    old.swap( cellTable );
+
+    cellTable.assign( capacity, EMPTY_KEY );
+    cellTableMask = capacity - 1;
+
+    for ( size_t i = 0; i < old.size(); ++i ) {
+        if ( old[i] == EMPTY_KEY ) {
+            continue;
+        }
+        size_t slot = hashSlot( (int)(old[i] & KEY_COORDINATE_MASK), (int)((old[i] >> 21) & KEY_COORDINATE_MASK),
+                                (int)(old[i] >> 42) ) & cellTableMask;
+        while ( cellTable[slot] != EMPTY_KEY ) {
+            slot = (slot + 1) & cellTableMask;
+        }
+        cellTable[slot] = old[i];
+    }
+}
+
+bool HashedTsdfVolume::cellOccupied( int cx, int cy, int cz ) const
+{
+    long long key = blockKey( cx, cy, cz );
+    for ( size_t slot = hashSlot( cx, cy, cz ) & cellTableMask; ; slot = (slot + 1) & cellTableMask ) {
+        if ( cellTable[slot] == key ) {
+            return true;
+        }
+        if ( cellTable[slot] == EMPTY_KEY ) {
+            return false;
+        }
+    }
+}
+
+void HashedTsdfVolume::occupyCell( int cx, int cy, int cz )
+{
+    if ( cellOccupied( cx, cy, cz ) ) {
+        return;
+    }
+    if ( (cellCount + 1) * 2 > cellTable.size() ) {
+        resizeCellTable( cellTable.size() * 2 );
+    }
+
+    size_t slot = hashSlot( cx, cy, cz ) & cellTableMask;
+    while ( cellTable[slot] != EMPTY_KEY ) {
+        slot = (slot + 1) & cellTableMask;
+    }
+    cellTable[slot] = blockKey( cx, cy, cz );
+    ++cellCount;
+}
+
+int HashedTsdfVolume::findBlock( int x, int y, int z ) const
+{
+    long long key = blockKey( x, y, z );
+    for ( size_t slot = hashSlot( x, y, z ); ; slot = (slot + 1) & tableMask ) {
+        const HashEntry& e = table[slot];
+        if ( e.key == key ) {
+            return e.block;
+        }
+        if ( e.key == EMPTY_KEY ) {
+            return -1;
+        }
+    }
+}
+
+int HashedTsdfVolume::allocateBlock( int x, int y, int z )
+{
+    // Keep the load factor at or below one half
+    if ( (blocks.size() + 1) * 2 > table.size() ) {
+        resizeTable( table.size() * 2 );
+    }
+
+    long long key = blockKey( x, y, z );
+    size_t slot = hashSlot( x, y, z );
+    for ( ; table[slot].key != EMPTY_KEY; slot = (slot + 1) & tableMask ) {
+        if ( table[slot].key == key ) {
+            return table[slot].block;
+        }
+    }
+
+    blocks.push_back( VoxelBlock() );
+    VoxelBlock& b = blocks.back();
+    b.x = x;
+    b.y = y;
+    b.z = z;
+    b.stamp = 0;
+    b.writeStamp = 0;
+    b.leastTsdf = (short)TSDF_SCALE;
+    TsdfVoxel empty = { (short)TSDF_SCALE, 0 };
+    std::fill( b.voxels, b.voxels + VOXELS_PER_BLOCK, empty );
+    if ( colored ) {
+        colorBlocks.push_back( ColorVoxelBlock() );
+    }
+    occupyCell( x >> CELL_BLOCK_SHIFT, y >> CELL_BLOCK_SHIFT, z >> CELL_BLOCK_SHIFT );
+
+    table[slot].key = key;
+    table[slot].block = (int)blocks.size() - 1;
+    return table[slot].block;
+}
+
+void HashedTsdfVolume::collectBandBlocks( const DepthFloatFrame& depth, const CameraIntrinsics& k,
+                                          const RigidTransform& cameraToVolume, std::vector<long long>& keys ) const
+{
+    const float vpm = params.voxelsPerMeter;
+    const float blockStep = VOXEL_BLOCK_SIZE * 0.5f;
+    std::mutex keysMutex;
+
+    pool.parallelFor( 0, (depth.height + ALLOCATION_PIXEL_STEP - 1) / ALLOCATION_PIXEL_STEP, [&]( int begin, int end ) {
+        std::vector<long long> local;
+        long long lastKey = EMPTY_KEY;
+
+        for ( int row = begin; row < end; ++row ) {
+            int v = row * ALLOCATION_PIXEL_STEP;
+            const float* depthRow = depth.row( v );
+            for ( int u = 0; u < depth.width; u += ALLOCATION_PIXEL_STEP ) {
+                float d = depthRow[u];
+                if ( d <= 0 ) {
+                    continue;
+                }
+
+                // Walk the truncation band around the measurement in half block steps
+                Float3 a = cameraToVolume * k.unproject( (float)u, (float)v, d - truncation ) * vpm;
+                Float3 b = cameraToVolume * k.unproject( (float)u, (float)v, d + truncation ) * vpm;
+                int steps = (int)std::ceil( length( b - a ) / blockStep );
+                Float3 delta = (b - a) * (1.0f / std::max( steps, 1 ));
+                for ( int i = 0; i <= steps; ++i ) {
+                    Float3 p = a + delta * (float)i;
+                    if ( p.x < 0 || p.y < 0 || p.z < 0 ) {
+                        continue;
+                    }
+                    int bx = (int)p.x >> VOXEL_BLOCK_SHIFT, by = (int)p.y >> VOXEL_BLOCK_SHIFT, bz = (int)p.z >> VOXEL_BLOCK_SHIFT;
+                    if ( bx >= blockCountX || by >= blockCountY || bz >= blockCountZ ) {
+                        continue;
+                    }
+                    long long key = blockKey( bx, by, bz );
+                    if ( key != lastKey ) {
+                        local.push_back( key );
+                        lastKey = key;
+                    }
+                }
+            }
+        }
+
+        std::sort( local.begin(), local.end() );
+        local.erase( std::unique( local.begin(), local.end() ), local.end() );
+
+        std::lock_guard<std::mutex> lock( keysMutex );
+        keys.insert( keys.end(), local.begin(), local.end() );
+    }, 4 );
+
+    std::sort( keys.begin(), keys.end() );
+    keys.erase( std::unique( keys.begin(), keys.end() ), keys.end() );
+}
+
+void HashedTsdfVolume::integrate( const DepthFloatFrame& depth, const ColorFrame* color, const CameraIntrinsics& intrinsics,
+                                  const RigidTransform& worldToCamera, unsigned short maxWeight )
+{
+    const RigidTransform volumeToCamera = worldToCamera * worldToVolume.inverse();
+
+    // Blocks allocated from now on get their colors with them
+    if ( color != nullptr && !colored ) {
+        colorBlocks.resize( blocks.size() );
+        colored = true;
+    }
+
+    // Allocation is serial but only touches the few thousand blocks of the band
+    std::vector<long long> keys;
+    collectBandBlocks( depth, intrinsics, volumeToCamera.inverse(), keys );
+
+    visibleBlocks.resize( keys.size() );
+    for ( size_t i = 0; i < keys.size(); ++i ) {
+        visibleBlocks[i] = allocateBlock( (int)(keys[i] & KEY_COORDINATE_MASK), (int)((keys[i] >> 21) & KEY_COORDINATE_MASK),
+                                          (int)(keys[i] >> 42) );
+    }
+
+    if ( view && (view->settled() || view.unique()) ) {
+        releaseView();
+    }
+    VoxelBlockView* const snapshot = view.get();
+    const int viewBlockCount = (int)viewSlots.size();
+
+    // Every block belongs to exactly one task, so the update needs no locking
+    const unsigned int integrateStamp = ++stamp;
+    const float vs = voxelSize();
+    const Float3 dx = volumeToCamera.column( 0 ) * vs;
+    pool.parallelFor( 0, (int)visibleBlocks.size(), [&]( int begin, int end ) {
+        for ( int i = begin; i < end; ++i ) {
+            if ( snapshot != nullptr && visibleBlocks[i] < viewBlockCount && viewSlots[visibleBlocks[i]] >= 0 ) {
+                snapshot->beforeWrite( viewSlots[visibleBlocks[i]] );
+            }
+            VoxelBlock& block = blocks[visibleBlocks[i]];
+            ColorVoxelBlock* colorBlock = (color != nullptr) ? &colorBlocks[visibleBlocks[i]] : nullptr;
+            block.writeStamp = integrateStamp;
+            int x0 = block.x * VOXEL_BLOCK_SIZE, y0 = block.y * VOXEL_BLOCK_SIZE, z0 = block.z * VOXEL_BLOCK_SIZE;
+            for ( int z = 0; z < VOXEL_BLOCK_SIZE; ++z ) {
+                for ( int y = 0; y < VOXEL_BLOCK_SIZE; ++y ) {
+                    Float3 p0 = volumeToCamera * (Float3( (float)x0, (float)(y0 + y), (float)(z0 + z) ) * vs);
+                    int first, last;
+                    if ( clipVoxelRow( p0, dx, VOXEL_BLOCK_SIZE, intrinsics, first, last ) &&
+                         integrateVoxelRow( &block.voxel( 0, y, z ), colorBlock ? &colorBlock->voxel( 0, y, z ) : nullptr,
+                                            first, last, p0, dx, depth, color, intrinsics, truncation, (float)maxWeight ) ) {
+                        block.stamp = integrateStamp;
+                    }
+                }
+            }
+            if ( block.stamp == integrateStamp ) {
+                block.leastTsdf = leastObservedTsdf( block.voxels, VOXELS_PER_BLOCK, (short)TSDF_SCALE );
+            }
+        }
+    }, 16 );
+}
+
+void HashedTsdfVolume::deintegrate( const DepthFloatFrame& depth, const CameraIntrinsics& intrinsics,
+                                    const RigidTransform& worldToCamera, unsigned short maxWeight )
+{
+    const RigidTransform volumeToCamera = worldToCamera * worldToVolume.inverse();
+
+    // The band integrate() allocated for the frame; blocks that are not there were never written
+    std::vector<long long> keys;
+    collectBandBlocks( depth, intrinsics, volumeToCamera.inverse(), keys );
+
+    visibleBlocks.clear();
+    for ( size_t i = 0; i < keys.size(); ++i ) {
+        int block = findBlock( (int)(keys[i] & KEY_COORDINATE_MASK), (int)((keys[i] >> 21) & KEY_COORDINATE_MASK),
+                               (int)(keys[i] >> 42) );
+        if ( block >= 0 ) {
+            visibleBlocks.push_back( block );
+        }
+    }
+
+    if ( view && (view->settled() || view.unique()) ) {
+        releaseView();
+    }
+    VoxelBlockView* const snapshot = view.get();
+    const int viewBlockCount = (int)viewSlots.size();
+
+    const unsigned int deintegrateStamp = ++stamp;
+    const float vs = voxelSize();
+    const Float3 dx = volumeToCamera.column( 0 ) * vs;
+    pool.parallelFor( 0, (int)visibleBlocks.size(), [&]( int begin, int end ) {
+        for ( int i = begin; i < end; ++i ) {
+            if ( snapshot != nullptr && visibleBlocks[i] < viewBlockCount && viewSlots[visibleBlocks[i]] >= 0 ) {
+                snapshot->beforeWrite( viewSlots[visibleBlocks[i]] );
+            }
+            VoxelBlock& block = blocks[visibleBlocks[i]];
+            block.writeStamp = deintegrateStamp;
+            int x0 = block.x * VOXEL_BLOCK_SIZE, y0 = block.y * VOXEL_BLOCK_SIZE, z0 = block.z * VOXEL_BLOCK_SIZE;
+            for ( int z = 0; z < VOXEL_BLOCK_SIZE; ++z ) {
+                for ( int y = 0; y < VOXEL_BLOCK_SIZE; ++y ) {
+                    Float3 p0 = volumeToCamera * (Float3( (float)x0, (float)(y0 + y), (float)(z0 + z) ) * vs);
+                    int first, last;
+                    if ( clipVoxelRow( p0, dx, VOXEL_BLOCK_SIZE, intrinsics, first, last ) &&
+                         deintegrateVoxelRow( &block.voxel( 0, y, z ), first, last, p0, dx, depth, intrinsics,
+                                              truncation, (float)maxWeight ) ) {
+                        block.stamp = deintegrateStamp;
+                    }
+                }
+            }
+            if ( block.stamp == deintegrateStamp ) {
+                block.leastTsdf = leastObservedTsdf( block.voxels, VOXELS_PER_BLOCK, (short)TSDF_SCALE );
+            }
+        }
+    }, 16 );
+}
+
+bool HashedTsdfVolume::changedBlocks( unsigned int since, std::vector<VoxelBlockIndex>& changed ) const
+{
+    changed.clear();
+
+    for ( std::deque<VoxelBlock>::const_iterator b = blocks.begin(); b != blocks.end(); ++b ) {
+        if ( b->stamp > since ) {
+            VoxelBlockIndex block = { b->x, b->y, b->z, 0 };
+            changed.push_back( block );
+        }
+    }
+    return resetStamp <= since;
+}
+
+std::shared_ptr<VoxelBlockView> HashedTsdfVolume::viewChangedBlocks( unsigned int since, bool& complete )
+{
+    if ( view ) {
+        view->preserveAll();
+        releaseView();
+    }
+
+    // The view keeps pointers, the table may be resized while it is read
+    std::vector<VoxelBlockIndex> changed;
+    std::vector<const VoxelBlock*> changedBlocks;
+    viewSlots.assign( blocks.size(), -1 );
+    for ( size_t i = 0; i < blocks.size(); ++i ) {
+        const VoxelBlock& b = blocks[i];
+        if ( b.writeStamp > since ) {
+            VoxelBlockIndex block = { b.x, b.y, b.z, 0 };
+            viewSlots[i] = (int)changed.size();
+            changed.push_back( block );
+            changedBlocks.push_back( &b );
+        }
+    }
+    complete = resetStamp <= since;
+
+    view = std::make_shared<VoxelBlockView>( changed, [changedBlocks]( size_t slot, const VoxelBlockIndex&, TsdfVoxel* out ) {
+        std::copy( changedBlocks[slot]->voxels, changedBlocks[slot]->voxels + VOXELS_PER_BLOCK, out );
+    } );
+    return view;
+}
+
+void HashedTsdfVolume::releaseView()
+{
+    view.reset();
+    std::vector<int>().swap( viewSlots );
+}
+
+void HashedTsdfVolume::writeBlocks( const std::vector<VoxelBlockIndex>& written,
+                                    const std::function<void ( size_t i, TsdfVoxel* voxels )>& fill )
+{
+    if ( view ) {
+        view->preserveAll();
+        releaseView();
+    }
+
+    std::vector<int> indices( written.size(), -1 );
+    for ( size_t i = 0; i < written.size(); ++i ) {
+        const VoxelBlockIndex& b = written[i];
+        if ( b.level == 0 && b.x >= 0 && b.y >= 0 && b.z >= 0 && b.x < blockCountX && b.y < blockCountY && b.z < blockCountZ ) {
+            indices[i] = allocateBlock( b.x, b.y, b.z );
+        }
+    }
+
+    const unsigned int writeStamp = ++stamp;
+    pool.parallelFor( 0, (int)written.size(), [&]( int begin, int end ) {
+        for ( int i = begin; i < end; ++i ) {
+            if ( indices[i] >= 0 ) {
+                VoxelBlock& block = blocks[indices[i]];
+                fill( i, block.voxels );
+                if ( colored ) {
+                    colorBlocks[indices[i]] = ColorVoxelBlock();
+                }
+                block.leastTsdf = leastObservedTsdf( block.voxels, VOXELS_PER_BLOCK, (short)TSDF_SCALE );
+                block.stamp = writeStamp;
+                block.writeStamp = writeStamp;
+            }
+        }
+    }, 16 );
+}
+
+void HashedTsdfVolume::readVoxels( int x0, int y0, int z0, int size, TsdfVoxel* out ) const
+{
+    const TsdfVoxel empty = { (short)TSDF_SCALE, 0 };
+    std::fill( out, out + (size_t)size * size * size, empty );
+
+    // One lookup per overlapped block, then copy the overlap row by row
+    int xBegin = std::max( x0, 0 ), xEnd = std::min( x0 + size, (int)params.voxelCountX );
+    int yBegin = std::max( y0, 0 ), yEnd = std::min( y0 + size, (int)params.voxelCountY );
+    int zBegin = std::max( z0, 0 ), zEnd = std::min( z0 + size, (int)params.voxelCountZ );
+    if ( xBegin >= xEnd || yBegin >= yEnd || zBegin >= zEnd ) {
+        return;
+    }
+
+    const int m = VOXEL_BLOCK_SIZE - 1;
+    for ( int bz = zBegin >> VOXEL_BLOCK_SHIFT; bz <= (zEnd - 1) >> VOXEL_BLOCK_SHIFT; ++bz ) {
+        for ( int by = yBegin >> VOXEL_BLOCK_SHIFT; by <= (yEnd - 1) >> VOXEL_BLOCK_SHIFT; ++by ) {
+            for ( int bx = xBegin >> VOXEL_BLOCK_SHIFT; bx <= (xEnd - 1) >> VOXEL_BLOCK_SHIFT; ++bx ) {
+                int index = findBlock( bx, by, bz );
+                if ( index < 0 ) {
+                    continue;
+                }
+                const VoxelBlock& block = blocks[index];
+                int xa = std::max( xBegin, bx * VOXEL_BLOCK_SIZE ), xb = std::min( xEnd, (bx + 1) * VOXEL_BLOCK_SIZE );
+                int ya = std::max( yBegin, by * VOXEL_BLOCK_SIZE ), yb = std::min( yEnd, (by + 1) * VOXEL_BLOCK_SIZE );
+                int za = std::max( zBegin, bz * VOXEL_BLOCK_SIZE ), zb = std::min( zEnd, (bz + 1) * VOXEL_BLOCK_SIZE );
+                for ( int z = za; z < zb; ++z ) {
+                    for ( int y = ya; y < yb; ++y ) {
+                        const TsdfVoxel* row = &block.voxel( xa & m, y & m, z & m );
+                        std::copy( row, row + (xb - xa), out + ((size_t)(z - z0) * size + (y - y0)) * size + (xa - x0) );
+                    }
+                }
+            }
+        }
+    }
+}
+
+const TsdfVoxel* HashedTsdfVolume::findVoxel( int x, int y, int z ) const
+{
+    if ( x < 0 || y < 0 || z < 0 ) {
+        return 0;
+    }
+    int block = findBlock( x >> VOXEL_BLOCK_SHIFT, y >> VOXEL_BLOCK_SHIFT, z >> VOXEL_BLOCK_SHIFT );
+    if ( block < 0 ) {
+        return 0;
+    }
+    const int m = VOXEL_BLOCK_SIZE - 1;
+    return &blocks[block].voxel( x & m, y & m, z & m );
+}
+
+UINT HashedTsdfVolume::sampleColor( const Float3& p ) const
+{
+    int x = (int)(p.x + 0.5f), y = (int)(p.y + 0.5f), z = (int)(p.z + 0.5f);
+    if ( !colored || x < 0 || y < 0 || z < 0 ) {
+        return 0;
+    }
+    int block = findBlock( x >> VOXEL_BLOCK_SHIFT, y >> VOXEL_BLOCK_SHIFT, z >> VOXEL_BLOCK_SHIFT );
+    if ( block < 0 ) {
+        return 0;
+    }
+    const int m = VOXEL_BLOCK_SIZE - 1;
+    return colorOfVoxel( colorBlocks[block].voxel( x & m, y & m, z & m ) );
+}
+
+bool HashedTsdfVolume::sampleTrilinear( const Float3& p, float& value ) const
+{
+    if ( p.x < 0 || p.y < 0 || p.z < 0 ) {
+        return false;
+    }
+    int x = (int)p.x, y = (int)p.y, z = (int)p.z;
+
+    const TsdfVoxel* c[8];
+    const int m = VOXEL_BLOCK_SIZE - 1;
+    if ( (x & m) != m && (y & m) != m && (z & m) != m ) {
+        // All corners in one block
+        const TsdfVoxel* v = findVoxel( x, y, z );
+        if ( v == 0 ) {
+            return false;
+        }
+        const int sy = VOXEL_BLOCK_SIZE, sz = VOXEL_BLOCK_SIZE * VOXEL_BLOCK_SIZE;
+        c[0] = v;      c[1] = v + 1;      c[2] = v + sy;      c[3] = v + sy + 1;
+        c[4] = v + sz; c[5] = v + sz + 1; c[6] = v + sz + sy; c[7] = v + sz + sy + 1;
+    }
+    else {
+        for ( int i = 0; i < 8; ++i ) {
+            c[i] = findVoxel( x + (i & 1), y + ((i >> 1) & 1), z + (i >> 2) );
+        }
+    }
+    return interpolateVoxels( c, p.x - x, p.y - y, p.z - z, value );
+}
+
+bool HashedTsdfVolume::gradient( const Float3& p, Float3& g ) const
+{
+    float x0, x1, y0, y1, z0, z1;
+    if ( !sampleTrilinear( p - Float3( 1, 0, 0 ), x0 ) || !sampleTrilinear( p + Float3( 1, 0, 0 ), x1 ) ||
+         !sampleTrilinear( p - Float3( 0, 1, 0 ), y0 ) || !sampleTrilinear( p + Float3( 0, 1, 0 ), y1 ) ||
+         !sampleTrilinear( p - Float3( 0, 0, 1 ), z0 ) || !sampleTrilinear( p + Float3( 0, 0, 1 ), z1 ) ) {
+        return false;
+    }
+
+    g = Float3( x1 - x0, y1 - y0, z1 - z0 );
+    return true;
+}
+
+void HashedTsdfVolume::raycast( const RigidTransform& worldToCamera, const CameraIntrinsics& k,
+                                PointCloudFrame& pointCloud ) const
+{
+    pointCloud.resize( k.width, k.height );
+
+    const float vpm = params.voxelsPerMeter;
+    const RigidTransform cameraToVolume = worldToVolume * worldToCamera.inverse();
+    const RigidTransform volumeToWorld = worldToVolume.inverse();
+    const Float3 origin = cameraToVolume.t * vpm;
+    const float dims[3] = { (float)(params.voxelCountX - 1), (float)(params.voxelCountY - 1), (float)(params.voxelCountZ - 1) };
+    const int m = VOXEL_BLOCK_SIZE - 1;
+    const int cellShift = VOXEL_BLOCK_SHIFT + CELL_BLOCK_SHIFT;
+
+    raycastTiles( pool, k, [&]( int u, int v ) {
+        Float3 dir = normalize( cameraToVolume.rotate( k.unproject( (float)u, (float)v, 1.0f ) ) );
+        Float3 step = dir * vpm;
+
+        // t in meters along the ray
+        float tNear = NUI_FUSION_DEFAULT_MINIMUM_DEPTH, tFar = NUI_FUSION_DEFAULT_MAXIMUM_DEPTH;
+        clipRayToBox( origin, step, dims, tNear, tFar );
+
+        float* out = pointCloud.pixel( u, v );
+        float previous = 0, previousT = 0;
+        bool hasPrevious = false;
+        int cachedKey[3] = { -1, -1, -1 };
+        int cachedBlock = -1;
+        int cachedCell[3] = { -1, -1, -1 };
+        bool cellHasBlocks = false;
+
+        for ( float t = tNear; t <= tFar; ) {
+            Float3 p = origin + step * t;
+            int x = (int)(p.x + 0.5f), y = (int)(p.y + 0.5f), z = (int)(p.z + 0.5f);
+            int cx = x >> cellShift, cy = y >> cellShift, cz = z >> cellShift;
+            if ( cx != cachedCell[0] || cy != cachedCell[1] || cz != cachedCell[2] ) {
+                cachedCell[0] = cx; cachedCell[1] = cy; cachedCell[2] = cz;
+                cellHasBlocks = cellOccupied( cx, cy, cz );
+            }
+            if ( !cellHasBlocks ) {
+                // Empty space: jump to where the ray leaves this cell
+                t = std::max( cellExit( origin, step, cx, cy, cz, (float)(1 << cellShift), tFar + 1 ), t ) + 1e-4f;
+                hasPrevious = false;
+                continue;
+            }
+
+            int bx = x >> VOXEL_BLOCK_SHIFT, by = y >> VOXEL_BLOCK_SHIFT, bz = z >> VOXEL_BLOCK_SHIFT;
+            if ( bx != cachedKey[0] || by != cachedKey[1] || bz != cachedKey[2] ) {
+                cachedKey[0] = bx; cachedKey[1] = by; cachedKey[2] = bz;
+                cachedBlock = findBlock( bx, by, bz );
+            }
+
+            if ( cachedBlock < 0 || blocks[cachedBlock].leastTsdf == (short)TSDF_SCALE ) {
+                if ( cachedBlock >= 0 && hasPrevious && previous < 0 ) {
+                    // Left the back of a surface
+                    break;
+                }
+
+                // Empty space or no surface in the block: jump to where the ray leaves it
+                t = std::max( cellExit( origin, step, bx, by, bz, (float)VOXEL_BLOCK_SIZE, tFar + 1 ), t ) + 1e-4f;
+                hasPrevious = false;
+                continue;
+            }
+
+            const TsdfVoxel& voxel = blocks[cachedBlock].voxel( x & m, y & m, z & m );
+            if ( voxel.weight == 0 ) {
+                hasPrevious = false;
+                t += voxelSize();
+                continue;
+            }
+            float f = voxel.tsdf * INV_TSDF_SCALE;
+
+            if ( hasPrevious && previous > 0 && f < 0 ) {
+                // Zero crossing, refine it with trilinear samples
+                float fa, fb, tHit = previousT;
+                if ( sampleTrilinear( origin + step * previousT, fa ) && sampleTrilinear( p, fb ) && fa > fb ) {
+                    tHit = previousT + (t - previousT) * fa / (fa - fb);
+                }
+
+                Float3 hit = origin + step * tHit;
+                Float3 g;
+                if ( gradient( hit, g ) && length( g ) > 0 ) {
+                    Float3 point = volumeToWorld * (hit * (1.0f / vpm));
+                    Float3 normal = normalize( volumeToWorld.rotate( g ) );
+                    out[0] = point.x;  out[1] = point.y;  out[2] = point.z;
+                    out[3] = normal.x; out[4] = normal.y; out[5] = normal.z;
+                }
+                break;
+            }
+            if ( hasPrevious && previous < 0 && f > 0 ) {
+                // Left the back of a surface
+                break;
+            }
+
+            previous = f;
+            previousT = t;
+            hasPrevious = true;
+            t += (f > 0) ? std::max( voxelSize(), f * truncation * 0.8f ) : voxelSize();
+        }
+    } );
+}
+
+}
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <deque>
+#include <vector>
+
+#include "TsdfVolume.h"
+
+namespace kinectbook {
+
+/// <summary>
+/// 8x8x8 voxels, x fastest
+/// </summary>
+struct VoxelBlock
+{
+    int x, y, z;        // block coordinates (voxel / 8)
+    unsigned int stamp; // modification stamp of the last integrate() that changed a voxel
+    unsigned int writeStamp;    // ... that wrote a voxel, if only its weight
+    short leastTsdf;    // leastObservedTsdf() of the voxels, TSDF_SCALE: nothing for a raycast to find
+    TsdfVoxel voxels[VOXELS_PER_BLOCK];
+
+    TsdfVoxel& voxel( int vx, int vy, int vz ) { return voxels[(vz * VOXEL_BLOCK_SIZE + vy) * VOXEL_BLOCK_SIZE + vx]; }
+    const TsdfVoxel& voxel( int vx, int vy, int vz ) const { return voxels[(vz * VOXEL_BLOCK_SIZE + vy) * VOXEL_BLOCK_SIZE + vx]; }
+};
+
+/// <summary>
+/// Colors of the voxels of a VoxelBlock, same order
+/// </summary>
+struct ColorVoxelBlock
+{
+    ColorVoxel voxels[VOXELS_PER_BLOCK];
+
+    ColorVoxel& voxel( int vx, int vy, int vz ) { return voxels[(vz * VOXEL_BLOCK_SIZE + vy) * VOXEL_BLOCK_SIZE + vx]; }
+    const ColorVoxel& voxel( int vx, int vy, int vz ) const { return voxels[(vz * VOXEL_BLOCK_SIZE + vy) * VOXEL_BLOCK_SIZE + vx]; }
+};
+
+/// <summary>
+/// Sparse truncated signed distance volume (voxel hashing)
+/// </summary>
+/// <remarks>
+/// Only blocks within the truncation band of an observed surface are
+/// allocated, so memory follows the scanned surface area instead of the
+/// bounding box. voxelCountX/Y/Z only bound where blocks may be created and
+/// can be far larger than a dense volume would fit in memory. A second,
+/// small table holds the cells of 8x8x8 blocks that have a block, so a
+/// raycast crosses empty space a cell at a time.
+/// </remarks>
+class HashedTsdfVolume : public ITsdfVolume
+{
+public:
+
+    HashedTsdfVolume( const NUI_FUSION_RECONSTRUCTION_PARAMETERS& params, ThreadPool& pool );
+
+    virtual void reset( const Matrix4* worldToVolume );
+
+    virtual void integrate( const DepthFloatFrame& depth, const ColorFrame* color, const CameraIntrinsics& intrinsics,
+                            const RigidTransform& worldToCamera, unsigned short maxWeight );
+
+    virtual void deintegrate( const DepthFloatFrame& depth, const CameraIntrinsics& intrinsics,
+                              const RigidTransform& worldToCamera, unsigned short maxWeight );
+
+    virtual void raycast( const RigidTransform& worldToCamera, const CameraIntrinsics& intrinsics,
+                          PointCloudFrame& pointCloud ) const;
+
+    virtual const NUI_FUSION_RECONSTRUCTION_PARAMETERS& parameters() const { return params; }
+
+    virtual float truncationDistance() const { return truncation; }
+
+    virtual RigidTransform worldToVolumeTransform() const { return worldToVolume; }
+
+    virtual size_t memoryUsage() const;
+
+    virtual unsigned int modificationStamp() const { return stamp; }
+
+    virtual bool changedBlocks( unsigned int since, std::vector<VoxelBlockIndex>& blocks ) const;
+
+    virtual void readVoxels( int x, int y, int z, int size, TsdfVoxel* voxels ) const;
+
+    virtual std::shared_ptr<VoxelBlockView> viewChangedBlocks( unsigned int since, bool& complete );
+
+    virtual void writeBlocks( const std::vector<VoxelBlockIndex>& blocks,
+                              const std::function<void ( size_t i, TsdfVoxel* voxels )>& fill );
+
+    virtual bool hasColor() const { return colored; }
+
+    virtual UINT sampleColor( const Float3& p ) const;
+
+    size_t blockCount() const { return blocks.size(); }
+
+private:
+
+    struct HashEntry
+    {
+        long long key;
+        int block;
+    };
+
+    static long long blockKey( int x, int y, int z )
+    {
+        return (long long)x | ((long long)y << 21) | ((long long)z << 42);
+    }
+
+    size_t hashSlot( int x, int y, int z ) const
+    {
+        return ((unsigned int)x * 73856093u ^ (unsigned int)y * 19349669u ^ (unsigned int)z * 83492791u) & tableMask;
+    }
+
+    int findBlock( int x, int y, int z ) const;
+    int allocateBlock( int x, int y, int z );
+    void resizeTable( size_t capacity );
+
+    bool cellOccupied( int cx, int cy, int cz ) const;
+    void occupyCell( int cx, int cy, int cz );
+    void resizeCellTable( size_t capacity );
+
+    void collectBandBlocks( const DepthFloatFrame& depth, const CameraIntrinsics& k,
+                            const RigidTransform& cameraToVolume, std::vector<long long>& keys ) const;
+
+    const TsdfVoxel* findVoxel( int x, int y, int z ) const;
+    bool sampleTrilinear( const Float3& p, float& value ) const;
+    bool gradient( const Float3& p, Float3& g ) const;
+
+    void releaseView();
+
+    NUI_FUSION_RECONSTRUCTION_PARAMETERS params;
+    float truncation;
+    RigidTransform worldToVolume;       // world to volume in meters, scale by voxelsPerMeter for voxels
+    int blockCountX, blockCountY, blockCountZ;
+
+    std::deque<VoxelBlock> blocks;      // deque: blocks never move when more are added
+    std::deque<ColorVoxelBlock> colorBlocks;    // colors of blocks[i], once colored
+    bool colored;
+    std::vector<HashEntry> table;       // open addressing, linear probing
+    size_t tableMask;
+    std::vector<long long> cellTable;   // blockKey() of the cells, same hashing
+    size_t cellTableMask;
+    size_t cellCount;
+
+    std::vector<int> visibleBlocks;
+    unsigned int stamp;
+    unsigned int resetStamp;
+
+    // Snapshot being read and the slot of every block in it by block
+    // number, -1 when not in it; blocks allocated later are never in it
+    std::shared_ptr<VoxelBlockView> view;
+    std::vector<int> viewSlots;
+
+    ThreadPool& pool;
+};
+
+}
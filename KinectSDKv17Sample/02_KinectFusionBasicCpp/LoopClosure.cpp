@@ -0,0 +1,109 @@
+#include "LoopClosure.h"
+
+#include <algorithm>
+
+namespace kinectbook {
+
+namespace {
+
+// A frame is moved once a point this far away (meters, about the end of
+// the useful depth) moves more than a quarter voxel
+const float REINTEGRATION_LEVER_ARM = 4.0f;
+const float REINTEGRATION_VOXEL_SHARE = 0.25f;
+
+}
+
+IntegratedFrames::IntegratedFrames( unsigned int maxFrames_ )
+    : maxFrames( maxFrames_ )
+{
+}
+
+void IntegratedFrames::reset()
+{
+    frames.clear();
+}
+
+void IntegratedFrames::setMaxFrames( unsigned int maxFrames_ )
+{
+    maxFrames = maxFrames_;
+    while ( frames.size() > maxFrames ) {
+        frames.pop_front();
+    }
+}
+
+void IntegratedFrames::store( size_t graphFrame, const RigidTransform& referenceToCamera, const DepthFloatFrame& depth,
+                              const CameraIntrinsics& intrinsics, const RigidTransform& worldToCamera,
+                              unsigned short maxWeight )
+{
+    if ( maxFrames == 0 ) {
+        return;
+    }
+
+    // The oldest frame's buffer is reused, so a full store allocates nothing
+    frames.push_back( Frame() );
+    if ( frames.size() > maxFrames ) {
+        frames.back().depth.swap( frames.front().depth );
+        frames.pop_front();
+    }
+    Frame& frame = frames.back();
+    frame.graphFrame = graphFrame;
+    frame.referenceToCamera = referenceToCamera;
+    frame.intrinsics = intrinsics;
+    frame.worldToCamera = worldToCamera;
+    frame.maxWeight = maxWeight;
+    frame.depth.resize( depth.pixels.size() );
+    for ( size_t i = 0; i < depth.pixels.size(); ++i ) {
+        frame.depth[i] = (unsigned short)std::min( depth.pixels[i] * 1000.0f + 0.5f, 65535.0f );
+    }
+}
+
+RigidTransform IntegratedFrames::poseOf( const Frame& frame, const PoseGraph& graph )
+{
+    return frame.referenceToCamera * graph.framePose( frame.graphFrame );
+}
+
+void IntegratedFrames::decode( const Frame& frame )
+{
+    depthFloat.resize( frame.intrinsics.width, frame.intrinsics.height );
+    for ( size_t i = 0; i < frame.depth.size(); ++i ) {
+        depthFloat.pixels[i] = frame.depth[i] * 0.001f;
+    }
+}
+
+unsigned int IntegratedFrames::reintegrate( ITsdfVolume& volume, const PoseGraph& graph )
+{
+    const float threshold = volume.voxelSize() * REINTEGRATION_VOXEL_SHARE;
+    std::vector<size_t> moved;
+    for ( size_t i = 0; i < frames.size(); ++i ) {
+        const RigidTransform delta = poseOf( frames[i], graph ) * frames[i].worldToCamera.inverse();
+        if ( length( delta.t ) + delta.angle() * REINTEGRATION_LEVER_ARM > threshold ) {
+            moved.push_back( i );
+        }
+    }
+
+    // All out first, then all in at the new poses, so no frame is averaged
+    // with the others at a mix of old and new poses
+    for ( size_t i = 0; i < moved.size(); ++i ) {
+        const Frame& frame = frames[moved[i]];
+        decode( frame );
+        volume.deintegrate( depthFloat, frame.intrinsics, frame.worldToCamera, frame.maxWeight );
+    }
+    for ( size_t i = 0; i < moved.size(); ++i ) {
+        Frame& frame = frames[moved[i]];
+        frame.worldToCamera = poseOf( frame, graph );
+        decode( frame );
+        volume.integrate( depthFloat, nullptr, frame.intrinsics, frame.worldToCamera, frame.maxWeight );
+    }
+    return (unsigned int)moved.size();
+}
+
+size_t IntegratedFrames::memoryUsage() const
+{
+    size_t size = depthFloat.pixels.capacity() * sizeof(float);
+    for ( std::deque<Frame>::const_iterator f = frames.begin(); f != frames.end(); ++f ) {
+        size += sizeof(Frame) + f->depth.capacity() * sizeof(unsigned short);
+    }
+    return size;
+}
+
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <deque>
+#include <vector>
+
+#include "FusionTypes.h"
+#include "PoseGraph.h"
+#include "TsdfVolume.h"
+
+namespace kinectbook {
+
+/// <summary>
+/// Settings of the loop closure of a CpuReconstruction
+/// </summary>
+struct LoopClosureOptions
+{
+    /// <summary>
+    /// Keyframes at least this far back count as a loop; nearer ones are
+    /// only the view tracking already agrees with
+    /// </summary>
+    unsigned int minKeyframeGap;
+
+    /// <summary>
+    /// Tracked frames between tries to find a loop (a raycast and an alignment each)
+    /// </summary>
+    unsigned int detectionInterval;
+
+    /// <summary>
+    /// Drift a loop has to correct to be closed (meters, rotation counted as
+    /// the motion of a point 1m away); smaller drift is left alone
+    /// </summary>
+    float minCorrection;
+
+    /// <summary>
+    /// Depth frames kept to be integrated again, newest first; 600 (20 seconds) take about 370MB at 640x480
+    /// </summary>
+    /// <remarks>
+    /// Frames older than that stay where they were integrated when a loop
+    /// moves them, so loops longer than this are only partly straightened.
+    /// Every sensor of a rig keeps its own frames, so a rig of three keeps
+    /// a third of the time.
+    /// </remarks>
+    unsigned int maxStoredFrames;
+
+    /// <summary>
+    /// Gauss-Newton steps of PoseGraph::optimize() per loop
+    /// </summary>
+    unsigned int optimizationIterations;
+
+    LoopClosureOptions()
+        : minKeyframeGap( 10 )
+        , detectionInterval( 10 )
+        , minCorrection( 0.005f )
+        , maxStoredFrames( 600 )
+        , optimizationIterations( 10 )
+    {
+    }
+};
+
+/// <summary>
+/// What the loop closure of a CpuReconstruction did since the last reset
+/// </summary>
+struct LoopClosureStatistics
+{
+    unsigned int attempts;              // keyframes aligned against
+    unsigned int closures;              // loops that moved the poses
+    unsigned int reintegratedFrames;    // frames moved in the volume
+    double reintegrationTime;           // milliseconds, all loops together
+
+    LoopClosureStatistics() : attempts( 0 ), closures( 0 ), reintegratedFrames( 0 ), reintegrationTime( 0 ) {}
+};
+
+/// <summary>
+/// Depth frames of a reconstruction kept with the pose they were integrated at,
+/// so they can be moved in the volume when a PoseGraph corrects their poses
+/// </summary>
+/// <remarks>
+/// A frame is moved by ITsdfVolume::deintegrate() at the old pose and
+/// integrate() at the new one; both only visit the blocks of the frame, so
+/// a loop touches the part of the volume the moved frames saw and nothing
+/// else. Frames that moved less than a quarter voxel are left alone.
+/// Depth is kept in millimeters as the sensor delivers it (2 bytes a
+/// pixel), which gives back the frame DepthToDepthFloatFrame() made bit for
+/// bit. Colors are not moved: they stay where they were fused. Frames of
+/// the other sensors of a rig are kept with the graph frame of the tracked
+/// sensor and their offset from it, so they move with it.
+/// </remarks>
+class IntegratedFrames
+{
+public:
+
+    explicit IntegratedFrames( unsigned int maxFrames = LoopClosureOptions().maxStoredFrames );
+
+    void reset();
+
+    void setMaxFrames( unsigned int maxFrames );
+
+    /// <summary>
+    /// Keep a frame just integrated, dropping the oldest one when full
+    /// </summary>
+    /// <param name="graphFrame">Index of the frame in the PoseGraph</param>
+    /// <param name="referenceToCamera">Offset of the sensor from the graph frame, identity for the tracked sensor</param>
+    void store( size_t graphFrame, const RigidTransform& referenceToCamera, const DepthFloatFrame& depth,
+                const CameraIntrinsics& intrinsics, const RigidTransform& worldToCamera, unsigned short maxWeight );
+
+    /// <summary>
+    /// Move the kept frames whose pose in graph changed to that pose
+    /// </summary>
+    /// <returns>Frames moved</returns>
+    unsigned int reintegrate( ITsdfVolume& volume, const PoseGraph& graph );
+
+    size_t frameCount() const { return frames.size(); }
+
+    size_t memoryUsage() const;
+
+private:
+
+    struct Frame
+    {
+        size_t graphFrame;
+        RigidTransform referenceToCamera;
+        CameraIntrinsics intrinsics;
+        RigidTransform worldToCamera;       // as integrated
+        unsigned short maxWeight;
+        std::vector<unsigned short> depth;  // millimeters
+    };
+
+    // World to camera of a frame as the graph has it now
+    static RigidTransform poseOf( const Frame& frame, const PoseGraph& graph );
+
+    void decode( const Frame& frame );
+
+    std::deque<Frame> frames;
+    unsigned int maxFrames;
+    DepthFloatFrame depthFloat;
+};
+
+}
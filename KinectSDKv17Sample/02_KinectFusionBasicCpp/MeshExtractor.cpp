@@ -0,0 +1,393 @@
+#include "MeshExtractor.h"
+
+#include <algorithm>
+
+#include "TsdfKernels.h"
+
+namespace kinectbook {
+
+namespace {
+
+// Voxels read per block: one before it for the normals, two after it for
+// the last cells and their normals
+const int BOX_SIZE = VOXEL_BLOCK_SIZE + 3;
+
+// Blocks per task of the parallel phases
+const int BLOCKS_PER_TASK = 4;
+
+/// <summary>
+/// Marching cubes triangles of the 256 corner configurations of a cell
+/// </summary>
+/// <remarks>
+/// Built at start-up instead of typing in the usual 256 x 16 table. Corner
+/// i is at (i & 1, (i >> 1) & 1, i >> 2), bit i of a configuration is set
+/// when corner i is inside (negative distance). Edge e runs along axis
+/// e / 4 from edgeCorner[e]. Every face of the cell is walked
+/// counter-clockwise seen from outside; each place where the walk enters
+/// the inside is joined to the next place where it leaves, so on an
+/// ambiguous face the inside corners stay apart. The neighbor cell walks
+/// the shared face the other way and joins the same points, so the mesh
+/// has no cracks. Joined segments form closed loops, one fan per loop.
+/// </remarks>
+struct CubeTriangulation
+{
+    int edgeCorner[12];
+    std::vector<unsigned char> triangles[256];
+
+    CubeTriangulation()
+    {
+        for ( int e = 0; e < 12; ++e ) {
+            int axis = e / 4, k = e % 4;
+            int u = (axis == 0) ? 1 : 0, v = (axis == 2) ? 1 : 2;
+            edgeCorner[e] = ((k & 1) << u) | ((k >> 1) << v);
+        }
+
+        for ( int config = 0; config < 256; ++config ) {
+            int next[12];
+            std::fill( next, next + 12, -1 );
+
+            for ( int axis = 0; axis < 3; ++axis ) {
+                int u = (axis + 1) % 3, v = (axis + 2) % 3;
+                for ( int side = 0; side < 2; ++side ) {
+                    // Counter-clockwise around +axis, reversed for the face looking down -axis
+                    int base = side << axis;
+                    int corners[4] = { base, base | (1 << u), base | (1 << u) | (1 << v), base | (1 << v) };
+                    if ( side == 0 ) {
+                        std::swap( corners[1], corners[3] );
+                    }
+
+                    int crossings[4];
+                    bool entering[4];
+                    int count = 0;
+                    for ( int i = 0; i < 4; ++i ) {
+                        int a = corners[i], b = corners[(i + 1) % 4];
+                        bool insideA = ((config >> a) & 1) != 0, insideB = ((config >> b) & 1) != 0;
+                        if ( insideA != insideB ) {
+                            crossings[count] = edgeBetween( a, b );
+                            entering[count] = insideB;
+                            ++count;
+                        }
+                    }
+                    for ( int i = 0; i < count; ++i ) {
+                        if ( entering[i] ) {
+                            next[crossings[i]] = crossings[(i + 1) % count];
+                        }
+                    }
+                }
+            }
+
+            bool visited[12] = {};
+            for ( int e = 0; e < 12; ++e ) {
+                if ( next[e] < 0 || visited[e] ) {
+                    continue;
+                }
+                std::vector<int> loop;
+                for ( int i = e; !visited[i]; i = next[i] ) {
+                    visited[i] = true;
+                    loop.push_back( i );
+                }
+                // Fan from a vertex whose diagonals do not run along a face, where
+                // the neighbor cell could have the same diagonal
+                size_t n = loop.size(), first = 0;
+                for ( size_t start = 0; start < n; ++start ) {
+                    bool inside = true;
+                    for ( size_t i = 2; i + 1 < n && inside; ++i ) {
+                        inside = !onCommonFace( loop[start], loop[(start + i) % n] );
+                    }
+                    if ( inside ) {
+                        first = start;
+                        break;
+                    }
+                }
+                for ( size_t i = 1; i + 1 < n; ++i ) {
+                    triangles[config].push_back( (unsigned char)loop[first] );
+                    triangles[config].push_back( (unsigned char)loop[(first + i) % n] );
+                    triangles[config].push_back( (unsigned char)loop[(first + i + 1) % n] );
+                }
+            }
+        }
+    }
+
+    int edgeBetween( int a, int b ) const
+    {
+        int start = a & b;
+        int axis = (a ^ b) == 1 ? 0 : ((a ^ b) == 2 ? 1 : 2);
+        int u = (axis == 0) ? 1 : 0, v = (axis == 2) ? 1 : 2;
+        return axis * 4 + ((start >> u) & 1) + ((start >> v) & 1) * 2;
+    }
+
+    bool onCommonFace( int e0, int e1 ) const
+    {
+        // The four corners of both edges agree in one coordinate
+        int a0 = edgeCorner[e0], b0 = a0 | (1 << (e0 / 4));
+        int a1 = edgeCorner[e1], b1 = a1 | (1 << (e1 / 4));
+        int all = a0 & b0 & a1 & b1, any = a0 | b0 | a1 | b1;
+        return ((all | ~any) & 7) != 0;
+    }
+};
+
+const CubeTriangulation cubeTriangulation;
+
+long long blockKey( int x, int y, int z )
+{
+    return (long long)x | ((long long)y << 21) | ((long long)z << 42);
+}
+
+VoxelBlockIndex blockFromKey( long long key )
+{
+    const long long mask = (1 << 21) - 1;
+    VoxelBlockIndex block = { (int)(key & mask), (int)((key >> 21) & mask), (int)(key >> 42), 0 };
+    return block;
+}
+
+/// <summary>
+/// Edge from voxel (x, y, z) to its neighbor along axis, ascending in z, y, x, axis order
+/// </summary>
+long long edgeKey( int x, int y, int z, int axis )
+{
+    return ((((long long)z << 20 | y) << 20 | x) << 2) | axis;
+}
+
+}
+
+MeshExtractor::MeshExtractor( const ITsdfVolume& volume_, ThreadPool& pool_ )
+    : volume( volume_ )
+    , pool( pool_ )
+    , lastStamp( 0 )
+    , meshed( false )
+{
+}
+
+void MeshExtractor::reset()
+{
+    lastStamp = 0;
+    meshed = false;
+    blockMeshes.clear();
+    edgeSlots.clear();
+    freeSlots.clear();
+    vertexBuffer.clear();
+    indexBuffer.clear();
+}
+
+size_t MeshExtractor::update()
+{
+    unsigned int stamp = volume.modificationStamp();
+    if ( meshed && stamp == lastStamp ) {
+        return 0;
+    }
+
+    // After a reset of the volume changed lists everything integrated since, so start over
+    if ( !volume.changedBlocks( lastStamp, changed ) ) {
+        reset();
+    }
+    lastStamp = stamp;
+    meshed = true;
+
+    // A changed voxel moves the cells and vertices of the neighbor blocks too
+    const NUI_FUSION_RECONSTRUCTION_PARAMETERS& params = volume.parameters();
+    const int blockCountX = (int)(params.voxelCountX + VOXEL_BLOCK_SIZE - 1) / VOXEL_BLOCK_SIZE;
+    const int blockCountY = (int)(params.voxelCountY + VOXEL_BLOCK_SIZE - 1) / VOXEL_BLOCK_SIZE;
+    const int blockCountZ = (int)(params.voxelCountZ + VOXEL_BLOCK_SIZE - 1) / VOXEL_BLOCK_SIZE;
+
+    std::vector<long long> keys;
+    keys.reserve( changed.size() * 27 );
+    for ( size_t i = 0; i < changed.size(); ++i ) {
+        const VoxelBlockIndex& b = changed[i];
+        for ( int z = std::max( b.z - 1, 0 ); z <= std::min( b.z + 1, blockCountZ - 1 ); ++z ) {
+            for ( int y = std::max( b.y - 1, 0 ); y <= std::min( b.y + 1, blockCountY - 1 ); ++y ) {
+                for ( int x = std::max( b.x - 1, 0 ); x <= std::min( b.x + 1, blockCountX - 1 ); ++x ) {
+                    keys.push_back( blockKey( x, y, z ) );
+                }
+            }
+        }
+    }
+    std::sort( keys.begin(), keys.end() );
+    keys.erase( std::unique( keys.begin(), keys.end() ), keys.end() );
+    if ( keys.empty() ) {
+        return 0;
+    }
+
+    // The map only grows here, so the pointers stay valid for the parallel phases
+    scratch.resize( keys.size() );
+    for ( size_t i = 0; i < keys.size(); ++i ) {
+        scratch[i].mesh = &blockMeshes[keys[i]];
+    }
+
+    // Vertices and triangles of every block, independent of each other
+    const RigidTransform volumeToWorld = volume.worldToVolumeTransform().inverse();
+    pool.parallelFor( 0, (int)keys.size(), [&]( int begin, int end ) {
+        std::vector<TsdfVoxel> box( BOX_SIZE * BOX_SIZE * BOX_SIZE );
+        for ( int i = begin; i < end; ++i ) {
+            meshBlock( blockFromKey( keys[i] ), volumeToWorld, box, scratch[i] );
+        }
+    }, BLOCKS_PER_TASK );
+
+    // Give the vertices their slots; an edge that stays on the surface keeps its slot
+    for ( size_t i = 0; i < keys.size(); ++i ) {
+        BlockScratch& block = scratch[i];
+        const std::vector<long long>& old = block.mesh->edges;
+        size_t a = 0, b = 0;
+        while ( a < old.size() || b < block.edges.size() ) {
+            if ( b == block.edges.size() || (a < old.size() && old[a] < block.edges[b]) ) {
+                freeSlot( old[a++] );
+            }
+            else if ( a == old.size() || block.edges[b] < old[a] ) {
+                allocateSlot( block.edges[b], block.vertices[b] );
+                ++b;
+            }
+            else {
+                vertexBuffer[edgeSlots[old[a]]] = block.vertices[b];
+                ++a;
+                ++b;
+            }
+        }
+        block.mesh->edges.swap( block.edges );
+    }
+
+    // Edges to vertex indices; edges of other blocks are read only now
+    pool.parallelFor( 0, (int)keys.size(), [&]( int begin, int end ) {
+        for ( int i = begin; i < end; ++i ) {
+            const std::vector<long long>& edges = scratch[i].triangleEdges;
+            std::vector<unsigned int>& triangles = scratch[i].mesh->triangles;
+            triangles.clear();
+            for ( size_t t = 0; t < edges.size(); t += 3 ) {
+                std::unordered_map<long long, unsigned int>::const_iterator v0 = edgeSlots.find( edges[t] );
+                std::unordered_map<long long, unsigned int>::const_iterator v1 = edgeSlots.find( edges[t + 1] );
+                std::unordered_map<long long, unsigned int>::const_iterator v2 = edgeSlots.find( edges[t + 2] );
+                if ( v0 != edgeSlots.end() && v1 != edgeSlots.end() && v2 != edgeSlots.end() ) {
+                    triangles.push_back( v0->second );
+                    triangles.push_back( v1->second );
+                    triangles.push_back( v2->second );
+                }
+            }
+        }
+    }, BLOCKS_PER_TASK );
+
+    for ( size_t i = 0; i < keys.size(); ++i ) {
+        if ( scratch[i].mesh->edges.empty() && scratch[i].mesh->triangles.empty() ) {
+            blockMeshes.erase( keys[i] );
+        }
+    }
+
+    indexBuffer.clear();
+    for ( std::unordered_map<long long, BlockMesh>::const_iterator b = blockMeshes.begin(); b != blockMeshes.end(); ++b ) {
+        indexBuffer.insert( indexBuffer.end(), b->second.triangles.begin(), b->second.triangles.end() );
+    }
+    return keys.size();
+}
+
+void MeshExtractor::meshBlock( const VoxelBlockIndex& block, const RigidTransform& volumeToWorld,
+                               std::vector<TsdfVoxel>& box, BlockScratch& result ) const
+{
+    result.edges.clear();
+    result.vertices.clear();
+    result.triangleEdges.clear();
+
+    const int x0 = block.x * VOXEL_BLOCK_SIZE, y0 = block.y * VOXEL_BLOCK_SIZE, z0 = block.z * VOXEL_BLOCK_SIZE;
+    volume.readVoxels( x0 - 1, y0 - 1, z0 - 1, BOX_SIZE, &box[0] );
+
+    // Box voxel of block voxel (x, y, z), -1 <= x, y, z <= VOXEL_BLOCK_SIZE + 1
+    const int step[3] = { 1, BOX_SIZE, BOX_SIZE * BOX_SIZE };
+    struct Box
+    {
+        static int index( int x, int y, int z ) { return ((z + 1) * BOX_SIZE + y + 1) * BOX_SIZE + x + 1; }
+    };
+    const TsdfVoxel* v = &box[0];
+    const float vs = volume.voxelSize();
+    const bool colored = volume.hasColor();
+
+    // Vertices on the edges starting at the voxels of the block
+    for ( int z = 0; z < VOXEL_BLOCK_SIZE; ++z ) {
+        for ( int y = 0; y < VOXEL_BLOCK_SIZE; ++y ) {
+            for ( int x = 0; x < VOXEL_BLOCK_SIZE; ++x ) {
+                int i0 = Box::index( x, y, z );
+                if ( v[i0].weight == 0 ) {
+                    continue;
+                }
+                for ( int axis = 0; axis < 3; ++axis ) {
+                    int i1 = i0 + step[axis];
+                    if ( v[i1].weight == 0 || (v[i0].tsdf < 0) == (v[i1].tsdf < 0) ) {
+                        continue;
+                    }
+
+                    float f0 = v[i0].tsdf * INV_TSDF_SCALE, f1 = v[i1].tsdf * INV_TSDF_SCALE;
+                    float t = f0 / (f0 - f1);
+                    float p[3] = { (float)(x0 + x), (float)(y0 + y), (float)(z0 + z) };
+                    p[axis] += t;
+
+                    // Central differences at both ends, interpolated like the position
+                    Float3 g0( (float)(v[i0 + 1].tsdf - v[i0 - 1].tsdf),
+                               (float)(v[i0 + step[1]].tsdf - v[i0 - step[1]].tsdf),
+                               (float)(v[i0 + step[2]].tsdf - v[i0 - step[2]].tsdf) );
+                    Float3 g1( (float)(v[i1 + 1].tsdf - v[i1 - 1].tsdf),
+                               (float)(v[i1 + step[1]].tsdf - v[i1 - step[1]].tsdf),
+                               (float)(v[i1 + step[2]].tsdf - v[i1 - step[2]].tsdf) );
+                    Float3 g = g0 * (1 - t) + g1 * t;
+
+                    MeshVertex vertex;
+                    vertex.position = volumeToWorld * (Float3( p[0], p[1], p[2] ) * vs);
+                    vertex.normal = (length( g ) > 0) ? normalize( volumeToWorld.rotate( g ) ) : Float3();
+                    vertex.color = colored ? volume.sampleColor( Float3( p[0], p[1], p[2] ) ) : 0;
+                    result.edges.push_back( edgeKey( x0 + x, y0 + y, z0 + z, axis ) );
+                    result.vertices.push_back( vertex );
+                }
+            }
+        }
+    }
+
+    // Triangles of the cells whose first corner is in the block
+    for ( int z = 0; z < VOXEL_BLOCK_SIZE; ++z ) {
+        for ( int y = 0; y < VOXEL_BLOCK_SIZE; ++y ) {
+            for ( int x = 0; x < VOXEL_BLOCK_SIZE; ++x ) {
+                int i0 = Box::index( x, y, z );
+                int config = 0;
+                bool observed = true;
+                for ( int c = 0; c < 8 && observed; ++c ) {
+                    const TsdfVoxel& corner = v[i0 + (c & 1) + ((c >> 1) & 1) * step[1] + (c >> 2) * step[2]];
+                    observed = corner.weight != 0;
+                    config |= (corner.tsdf < 0) ? 1 << c : 0;
+                }
+                if ( !observed ) {
+                    continue;
+                }
+
+                const std::vector<unsigned char>& triangles = cubeTriangulation.triangles[config];
+                for ( size_t t = 0; t < triangles.size(); ++t ) {
+                    int e = triangles[t];
+                    int c = cubeTriangulation.edgeCorner[e];
+                    result.triangleEdges.push_back( edgeKey( x0 + x + (c & 1), y0 + y + ((c >> 1) & 1),
+                                                             z0 + z + (c >> 2), e / 4 ) );
+                }
+            }
+        }
+    }
+}
+
+unsigned int MeshExtractor::allocateSlot( long long edge, const MeshVertex& vertex )
+{
+    unsigned int slot;
+    if ( freeSlots.empty() ) {
+        slot = (unsigned int)vertexBuffer.size();
+        vertexBuffer.push_back( vertex );
+    }
+    else {
+        slot = freeSlots.back();
+        freeSlots.pop_back();
+        vertexBuffer[slot] = vertex;
+    }
+    edgeSlots[edge] = slot;
+    return slot;
+}
+
+void MeshExtractor::freeSlot( long long edge )
+{
+    std::unordered_map<long long, unsigned int>::iterator i = edgeSlots.find( edge );
+    if ( i == edgeSlots.end() ) {
+        return;
+    }
+    vertexBuffer[i->second] = MeshVertex();
+    freeSlots.push_back( i->second );
+    edgeSlots.erase( i );
+}
+
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <unordered_map>
+#include <vector>
+
+#include "../common/ThreadPool.h"
+#include "FusionTypes.h"
+#include "TsdfVolume.h"
+
+namespace kinectbook {
+
+/// <summary>
+/// Vertex of an extracted mesh, world space
+/// </summary>
+struct MeshVertex
+{
+    Float3 position;
+    Float3 normal;
+    UINT color;         // fused BGRA color, alpha 0 when the volume has none there
+};
+
+/// <summary>
+/// Marching cubes mesh of an ITsdfVolume that is kept up to date block by block
+/// </summary>
+/// <remarks>
+/// update() asks the volume which 8x8x8 blocks changed since the last call
+/// and re-meshes only those and their neighbors, one block per task. A
+/// vertex belongs to the voxel edge it lies on and every edge to the block
+/// of its first voxel, so vertices are shared between cells and blocks and
+/// keep their index while their edge stays on the surface. Vertices of
+/// edges that left the surface become free slots (zero normal) that later
+/// vertices reuse; indices() never references them. Vertices take the
+/// color of their nearest voxel when the block is meshed, so a color that
+/// keeps changing on a settled surface shows after its next re-mesh.
+///
+/// Not thread safe: the volume must not be integrated during update(), and
+/// the buffers must not be read during update().
+/// </remarks>
+class MeshExtractor
+{
+public:
+
+    explicit MeshExtractor( const ITsdfVolume& volume, ThreadPool& pool = ThreadPool::shared() );
+
+    /// <summary>
+    /// Drop the mesh; the next update() meshes every block the volume changed since its reset
+    /// </summary>
+    void reset();
+
+    /// <summary>
+    /// Re-mesh the blocks the volume changed since the last update()
+    /// </summary>
+    /// <returns>Number of blocks meshed</returns>
+    size_t update();
+
+    /// <summary>
+    /// All vertex slots, including free ones
+    /// </summary>
+    const std::vector<MeshVertex>& vertices() const { return vertexBuffer; }
+
+    /// <summary>
+    /// Three vertex indices per triangle, counter-clockwise seen from the front
+    /// </summary>
+    const std::vector<unsigned int>& indices() const { return indexBuffer; }
+
+    /// <summary>
+    /// Vertices in use, without the free slots
+    /// </summary>
+    size_t vertexCount() const { return edgeSlots.size(); }
+
+    size_t triangleCount() const { return indexBuffer.size() / 3; }
+
+private:
+
+    MeshExtractor( const MeshExtractor& );
+    MeshExtractor& operator=( const MeshExtractor& );
+
+    /// <summary>
+    /// What one block contributes to the mesh
+    /// </summary>
+    struct BlockMesh
+    {
+        std::vector<long long> edges;           // owned edges with a vertex, ascending
+        std::vector<unsigned int> triangles;    // vertex indices of the triangles of owned cells
+    };
+
+    /// <summary>
+    /// Result of meshing one block, before the vertices got their slots
+    /// </summary>
+    struct BlockScratch
+    {
+        std::vector<long long> edges;
+        std::vector<MeshVertex> vertices;       // one per edge
+        std::vector<long long> triangleEdges;   // three edges per triangle
+        BlockMesh* mesh;
+    };
+
+    void meshBlock( const VoxelBlockIndex& block, const RigidTransform& volumeToWorld,
+                    std::vector<TsdfVoxel>& box, BlockScratch& scratch ) const;
+    unsigned int allocateSlot( long long edge, const MeshVertex& vertex );
+    void freeSlot( long long edge );
+
+    const ITsdfVolume& volume;
+    ThreadPool& pool;
+
+    unsigned int lastStamp;
+    bool meshed;
+
+    std::unordered_map<long long, BlockMesh> blockMeshes;
+    std::unordered_map<long long, unsigned int> edgeSlots;
+    std::vector<unsigned int> freeSlots;
+
+    std::vector<MeshVertex> vertexBuffer;
+    std::vector<unsigned int> indexBuffer;
+
+    std::vector<VoxelBlockIndex> changed;
+    std::vector<BlockScratch> scratch;
+};
+
+}
@@ -0,0 +1,431 @@
+#include "MeshWriter.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <stdexcept>
+
+namespace kinectbook {
+
+namespace {
+
+// Bytes formatted before they go to the file in one write
+const size_t WRITE_BUFFER_SIZE = 1024 * 1024;
+
+// Largest text line of an OBJ vertex or face
+const size_t MAX_RECORD_SIZE = 256;
+
+// Digits of the counts patched into a PLY header
+const int PLY_COUNT_DIGITS = 10;
+
+// Offset of the triangle count of a binary STL file
+const long STL_COUNT_OFFSET = 80;
+
+// Fixed point scale of OBJ positions (10 micrometers) and normals
+const unsigned int OBJ_POSITION_SCALE = 100000;
+const unsigned int OBJ_NORMAL_SCALE = 10000;
+
+// Vertices of a point cloud formatted at a time
+const size_t POINTS_PER_PIECE = 1024;
+
+// Written for vertices without a color
+const UINT DEFAULT_VERTEX_COLOR = 0xFF808080u;
+
+// Bytes of a PLY vertex: position and normal, then red, green and blue with colors
+const size_t PLY_VERTEX_SIZE = 24;
+const size_t PLY_COLOR_SIZE = 3;
+
+// Decimals of OBJ colors
+const unsigned int OBJ_COLOR_SCALE = 1000;
+
+char* formatUnsigned( char* out, unsigned long long value )
+{
+    char digits[20];
+    int count = 0;
+    do {
+        digits[count++] = (char)('0' + value % 10);
+        value /= 10;
+    } while ( value != 0 );
+
+    while ( count > 0 ) {
+        *out++ = digits[--count];
+    }
+    return out;
+}
+
+/// <summary>
+/// value with log10(scale) decimals; several times faster than printf("%f")
+/// </summary>
+char* formatFixed( char* out, float value, unsigned int scale )
+{
+    double scaled = std::min( std::max( (double)value, -1e9 ), 1e9 ) * scale;
+    bool negative = scaled < 0;
+    unsigned long long n = (unsigned long long)((negative ? -scaled : scaled) + 0.5);
+    if ( negative && n != 0 ) {
+        *out++ = '-';
+    }
+
+    out = formatUnsigned( out, n / scale );
+    *out++ = '.';
+    unsigned long long fraction = n % scale;
+    for ( unsigned int digit = scale / 10; digit != 0; digit /= 10 ) {
+        *out++ = (char)('0' + fraction / digit % 10);
+    }
+    return out;
+}
+
+char* formatFloat3( char* out, const char* tag, const Float3& v, unsigned int scale )
+{
+    size_t tagLength = std::strlen( tag );
+    std::memcpy( out, tag, tagLength );
+    out += tagLength;
+    out = formatFixed( out, v.x, scale );
+    *out++ = ' ';
+    out = formatFixed( out, v.y, scale );
+    *out++ = ' ';
+    out = formatFixed( out, v.z, scale );
+    *out++ = '\n';
+    return out;
+}
+
+UINT vertexColor( UINT bgra )
+{
+    return ColorFrame::isValid( bgra ) ? bgra : DEFAULT_VERTEX_COLOR;
+}
+
+// " r g b\n" in 0..1, the colors many OBJ readers take after the position
+char* formatColor( char* out, UINT bgra )
+{
+    const unsigned int channels[3] = { (bgra >> 16) & 0xFF, (bgra >> 8) & 0xFF, bgra & 0xFF };
+    for ( int c = 0; c < 3; ++c ) {
+        *out++ = ' ';
+        out = formatFixed( out, channels[c] / 255.0f, OBJ_COLOR_SCALE );
+    }
+    *out++ = '\n';
+    return out;
+}
+
+// Binary records are written in the byte order of the host; PLY says little endian,
+// which every platform the samples run on is
+char* putFloat3( char* out, const Float3& v )
+{
+    const float f[3] = { v.x, v.y, v.z };
+    std::memcpy( out, f, sizeof(f) );
+    return out + sizeof(f);
+}
+
+}
+
+char* MeshWriter::Output::reserve( size_t size )
+{
+    if ( used + size > buffer.size() ) {
+        flush();
+    }
+    return &buffer[used];
+}
+
+void MeshWriter::Output::append( const void* data, size_t size )
+{
+    std::memcpy( reserve( size ), data, size );
+    used += size;
+}
+
+void MeshWriter::Output::flush()
+{
+    if ( used != 0 && std::fwrite( &buffer[0], 1, used, file ) != used ) {
+        throw std::runtime_error( "MeshWriter: write failed" );
+    }
+    used = 0;
+}
+
+MeshWriter::MeshWriter( const std::string& path_, MeshFileFormat format_, bool vertexColors_ )
+    : path( path_ )
+    , format( format_ )
+    , vertexColors( vertexColors_ && format_ != MESH_FILE_STL )
+    , vertices( 0 )
+    , triangles( 0 )
+    , vertexCountOffset( 0 )
+    , faceCountOffset( 0 )
+{
+    output.file = std::fopen( path.c_str(), "wb" );
+    if ( output.file == 0 ) {
+        throw std::runtime_error( "MeshWriter: can't create " + path );
+    }
+    // Writes are already large, a stdio buffer would only add a copy
+    std::setvbuf( output.file, 0, _IONBF, 0 );
+    output.buffer.resize( WRITE_BUFFER_SIZE );
+
+    if ( format == MESH_FILE_PLY ) {
+        // Next to the result rather than tmpfile(), which needs a writable root on Windows
+        faces.file = std::fopen( (path + ".faces").c_str(), "w+b" );
+        if ( faces.file == 0 ) {
+            std::fclose( output.file );
+            output.file = 0;
+            throw std::runtime_error( "MeshWriter: can't create " + path + ".faces" );
+        }
+        std::setvbuf( faces.file, 0, _IONBF, 0 );
+        faces.buffer.resize( WRITE_BUFFER_SIZE );
+    }
+
+    writeHeader();
+}
+
+MeshWriter::~MeshWriter()
+{
+    try {
+        close();
+    }
+    catch ( std::exception& ) {
+    }
+
+    if ( output.file != 0 ) {
+        std::fclose( output.file );
+    }
+    if ( faces.file != 0 ) {
+        std::fclose( faces.file );
+        std::remove( (path + ".faces").c_str() );
+    }
+}
+
+void MeshWriter::writeHeader()
+{
+    if ( format == MESH_FILE_STL ) {
+        char header[STL_COUNT_OFFSET + 4] = { 0 };
+        std::strcpy( header, "binary STL, KinectSDKv17Sample" );
+        output.append( header, sizeof(header) );
+    }
+    else if ( format == MESH_FILE_PLY ) {
+        std::string header = "ply\n"
+                             "format binary_little_endian 1.0\n"
+                             "comment KinectSDKv17Sample\n"
+                             "element vertex ";
+        vertexCountOffset = (long)header.size();
+        header += std::string( PLY_COUNT_DIGITS, '0' ) + "\n"
+                  "property float x\n"
+                  "property float y\n"
+                  "property float z\n"
+                  "property float nx\n"
+                  "property float ny\n"
+                  "property float nz\n";
+        if ( vertexColors ) {
+            header += "property uchar red\n"
+                      "property uchar green\n"
+                      "property uchar blue\n";
+        }
+        header += "element face ";
+        faceCountOffset = (long)header.size();
+        header += std::string( PLY_COUNT_DIGITS, '0' ) + "\n"
+                  "property list uchar uint vertex_indices\n"
+                  "end_header\n";
+        output.append( header.data(), header.size() );
+    }
+    else {
+        const char header[] = "# KinectSDKv17Sample\n";
+        output.append( header, sizeof(header) - 1 );
+    }
+}
+
+void MeshWriter::write( const MeshVertex* pieceVertices, size_t vertexCount,
+                        const unsigned int* indices, size_t triangleCount )
+{
+    if ( output.file == 0 ) {
+        throw std::runtime_error( "MeshWriter: already closed" );
+    }
+    for ( size_t i = 0; i < triangleCount * 3; ++i ) {
+        if ( indices[i] >= vertexCount ) {
+            throw std::runtime_error( "MeshWriter: vertex index out of range" );
+        }
+    }
+
+    const size_t base = vertices;
+    if ( format == MESH_FILE_STL ) {
+        // Face normal, three corners and an unused attribute word per triangle
+        for ( size_t t = 0; t < triangleCount; ++t ) {
+            const Float3& a = pieceVertices[indices[t * 3]].position;
+            const Float3& b = pieceVertices[indices[t * 3 + 1]].position;
+            const Float3& c = pieceVertices[indices[t * 3 + 2]].position;
+            Float3 n = cross( b - a, c - a );
+            n = (length( n ) > 0) ? normalize( n ) : Float3();
+
+            char* p = output.reserve( 50 );
+            p = putFloat3( p, n );
+            p = putFloat3( p, a );
+            p = putFloat3( p, b );
+            p = putFloat3( p, c );
+            p[0] = p[1] = 0;
+            output.used += 50;
+        }
+    }
+    else if ( format == MESH_FILE_PLY ) {
+        const size_t vertexSize = PLY_VERTEX_SIZE + (vertexColors ? PLY_COLOR_SIZE : 0);
+        for ( size_t i = 0; i < vertexCount; ++i ) {
+            char* p = output.reserve( vertexSize );
+            p = putFloat3( p, pieceVertices[i].position );
+            p = putFloat3( p, pieceVertices[i].normal );
+            if ( vertexColors ) {
+                UINT color = vertexColor( pieceVertices[i].color );
+                p[0] = (char)(color >> 16);
+                p[1] = (char)(color >> 8);
+                p[2] = (char)color;
+            }
+            output.used += vertexSize;
+        }
+        for ( size_t t = 0; t < triangleCount; ++t ) {
+            char* p = faces.reserve( 13 );
+            const unsigned int face[3] = { (unsigned int)(base + indices[t * 3]),
+                                           (unsigned int)(base + indices[t * 3 + 1]),
+                                           (unsigned int)(base + indices[t * 3 + 2]) };
+            p[0] = 3;
+            std::memcpy( p + 1, face, sizeof(face) );
+            faces.used += 13;
+        }
+    }
+    else {
+        for ( size_t i = 0; i < vertexCount; ++i ) {
+            char* start = output.reserve( MAX_RECORD_SIZE );
+            char* p = formatFloat3( start, "v ", pieceVertices[i].position, OBJ_POSITION_SCALE );
+            if ( vertexColors ) {
+                p = formatColor( p - 1, vertexColor( pieceVertices[i].color ) );
+            }
+            p = formatFloat3( p, "vn ", pieceVertices[i].normal, OBJ_NORMAL_SCALE );
+            output.used += p - start;
+        }
+        for ( size_t t = 0; t < triangleCount; ++t ) {
+            // OBJ counts from 1; vertex and normal share the index
+            char* start = output.reserve( MAX_RECORD_SIZE );
+            char* p = start;
+            *p++ = 'f';
+            for ( int k = 0; k < 3; ++k ) {
+                unsigned long long index = base + indices[t * 3 + k] + 1;
+                *p++ = ' ';
+                p = formatUnsigned( p, index );
+                *p++ = '/';
+                *p++ = '/';
+                p = formatUnsigned( p, index );
+            }
+            *p++ = '\n';
+            output.used += p - start;
+        }
+    }
+
+    if ( format != MESH_FILE_STL ) {
+        vertices += vertexCount;
+    }
+    triangles += triangleCount;
+}
+
+void MeshWriter::writePointCloud( const PointCloudFrame& pointCloud, const ColorFrame* colors )
+{
+    if ( colors != nullptr && (colors->width != pointCloud.width || colors->height != pointCloud.height) ) {
+        throw std::runtime_error( "MeshWriter: point colors do not match the point cloud" );
+    }
+
+    MeshVertex piece[POINTS_PER_PIECE];
+    size_t count = 0;
+    for ( int y = 0; y < pointCloud.height; ++y ) {
+        for ( int x = 0; x < pointCloud.width; ++x ) {
+            const float* p = pointCloud.pixel( x, y );
+            if ( !PointCloudFrame::isValid( p ) ) {
+                continue;
+            }
+            piece[count].position = Float3( p[0], p[1], p[2] );
+            piece[count].normal = Float3( p[3], p[4], p[5] );
+            piece[count].color = (colors != nullptr) ? colors->row( y )[x] : 0;
+            if ( ++count == POINTS_PER_PIECE ) {
+                write( piece, count, 0, 0 );
+                count = 0;
+            }
+        }
+    }
+    write( piece, count, 0, 0 );
+}
+
+void MeshWriter::writeCount( long offset, size_t count, int digits )
+{
+    char text[32];
+    size_t size;
+    if ( digits == 0 ) {
+        unsigned int value = (unsigned int)count;
+        std::memcpy( text, &value, sizeof(value) );
+        size = sizeof(value);
+    }
+    else {
+        char* end = formatUnsigned( text + digits, count );
+        size_t length = end - (text + digits);
+        if ( length > (size_t)digits ) {
+            throw std::runtime_error( "MeshWriter: too many elements for " + path );
+        }
+        std::memset( text, '0', digits );
+        std::memmove( text + digits - length, text + digits, length );
+        size = digits;
+    }
+
+    if ( std::fseek( output.file, offset, SEEK_SET ) != 0 || std::fwrite( text, 1, size, output.file ) != size ) {
+        throw std::runtime_error( "MeshWriter: can't update the header of " + path );
+    }
+}
+
+void MeshWriter::close()
+{
+    if ( output.file == 0 ) {
+        return;
+    }
+
+    output.flush();
+    if ( format == MESH_FILE_STL ) {
+        writeCount( STL_COUNT_OFFSET, triangles, 0 );
+    }
+    else if ( format == MESH_FILE_PLY ) {
+        writeCount( vertexCountOffset, vertices, PLY_COUNT_DIGITS );
+        writeCount( faceCountOffset, triangles, PLY_COUNT_DIGITS );
+
+        // Append the faces, reusing the write buffer
+        faces.flush();
+        if ( std::fseek( output.file, 0, SEEK_END ) != 0 || std::fseek( faces.file, 0, SEEK_SET ) != 0 ) {
+            throw std::runtime_error( "MeshWriter: can't append the faces to " + path );
+        }
+        size_t size;
+        while ( (size = std::fread( &output.buffer[0], 1, output.buffer.size(), faces.file )) != 0 ) {
+            output.used = size;
+            output.flush();
+        }
+        std::fclose( faces.file );
+        faces.file = 0;
+        std::remove( (path + ".faces").c_str() );
+    }
+
+    int ret = std::fclose( output.file );
+    output.file = 0;
+    if ( ret != 0 ) {
+        throw std::runtime_error( "MeshWriter: close failed" );
+    }
+}
+
+bool MeshWriter::formatFromPath( const std::string& path, MeshFileFormat& format )
+{
+    size_t dot = path.find_last_of( '.' );
+    if ( dot == std::string::npos ) {
+        return false;
+    }
+
+    std::string extension = path.substr( dot + 1 );
+    for ( size_t i = 0; i < extension.size(); ++i ) {
+        extension[i] = (char)std::tolower( (unsigned char)extension[i] );
+    }
+
+    if ( extension == "stl" ) {
+        format = MESH_FILE_STL;
+    }
+    else if ( extension == "ply" ) {
+        format = MESH_FILE_PLY;
+    }
+    else if ( extension == "obj" ) {
+        format = MESH_FILE_OBJ;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "FusionTypes.h"
+#include "MeshExtractor.h"
+
+namespace kinectbook {
+
+/// <summary>
+/// File formats of MeshWriter
+/// </summary>
+enum MeshFileFormat
+{
+    MESH_FILE_STL,      // binary STL, triangles only
+    MESH_FILE_PLY,      // binary little endian PLY with normals (and colors)
+    MESH_FILE_OBJ,      // Wavefront OBJ with normals (and colors after the position, 0..1)
+};
+
+/// <summary>
+/// Writes a mesh or point cloud to a file piece by piece as it is produced
+/// </summary>
+/// <remarks>
+/// Every piece is formatted into a fixed size buffer that goes to the file
+/// in large writes whenever it fills up, so memory does not grow with the
+/// mesh. Counts the formats need in their header are patched in by close().
+/// PLY lists all vertices before the faces, so its faces go through a
+/// temporary file that close() appends. Errors are reported with
+/// std::runtime_error.
+/// </remarks>
+class MeshWriter
+{
+public:
+
+    /// <param name="vertexColors">Write MeshVertex::color too (not for STL); vertices without one are gray</param>
+    MeshWriter( const std::string& path, MeshFileFormat format, bool vertexColors = false );
+    ~MeshWriter();
+
+    /// <summary>
+    /// Append a piece of a mesh
+    /// </summary>
+    /// <param name="indices">Three per triangle, into the vertices of this piece</param>
+    /// <remarks>
+    /// The vertices of a piece are numbered on from the pieces before. A
+    /// whole MeshExtractor can be written as one piece; its free vertex
+    /// slots become unreferenced vertices. STL keeps no vertices of its own
+    /// and writes only the triangles.
+    /// </remarks>
+    void write( const MeshVertex* vertices, size_t vertexCount, const unsigned int* indices, size_t triangleCount );
+
+    /// <summary>
+    /// Append the valid points of a point cloud as vertices (not for STL)
+    /// </summary>
+    /// <param name="colors">Color of every point (CalculatePointCloud), nullptr for none</param>
+    void writePointCloud( const PointCloudFrame& pointCloud, const ColorFrame* colors = nullptr );
+
+    /// <summary>
+    /// Complete the file; called by the destructor too, which swallows errors
+    /// </summary>
+    void close();
+
+    size_t vertexCount() const { return vertices; }
+
+    size_t triangleCount() const { return triangles; }
+
+    /// <summary>
+    /// Format of a file name extension (.stl, .ply or .obj, any case)
+    /// </summary>
+    /// <returns>false for other extensions</returns>
+    static bool formatFromPath( const std::string& path, MeshFileFormat& format );
+
+private:
+
+    MeshWriter( const MeshWriter& );
+    MeshWriter& operator=( const MeshWriter& );
+
+    /// <summary>
+    /// File with its write buffer
+    /// </summary>
+    struct Output
+    {
+        FILE* file;
+        std::vector<char> buffer;
+        size_t used;
+
+        Output() : file( 0 ), used( 0 ) {}
+
+        // Room for at least size bytes at the end of the buffer
+        char* reserve( size_t size );
+        void append( const void* data, size_t size );
+        void flush();
+    };
+
+    void writeHeader();
+    void writeCount( long offset, size_t count, int digits );
+
+    std::string path;
+    MeshFileFormat format;
+    bool vertexColors;
+    Output output;
+    Output faces;               // PLY faces until close()
+
+    size_t vertices;
+    size_t triangles;
+    long vertexCountOffset;     // where the counts go into the header
+    long faceCountOffset;
+};
+
+}
@@ -0,0 +1,886 @@
+#include "MultiScaleTsdfVolume.h"
+
+#include <algorithm>
+#include <mutex>
+
+#include "../common/ThreadPool.h"
+#include "TsdfKernels.h"
+
+namespace kinectbook {
+
+namespace {
+
+const long long EMPTY_KEY = -1;
+const size_t INITIAL_TABLE_SIZE = 1 << 16;
+const long long KEY_COORDINATE_MASK = (1 << 19) - 1;
+
+// Pixels sampled in each direction when looking for blocks to allocate
+const int ALLOCATION_PIXEL_STEP = 2;
+
+// Depth up to which measurements go to the finest level; the coarsest
+// level starts at half of NUI_FUSION_DEFAULT_MAXIMUM_DEPTH
+const float FINEST_LEVEL_RANGE = NUI_FUSION_DEFAULT_MAXIMUM_DEPTH / (1 << MAX_VOXEL_LEVEL);
+
+// A pixel shows detail when the inverse depth of the pixels this far
+// away on either side deviates from a plane by more than DETAIL_CURVATURE,
+// relative to its own. Planes are linear in inverse depth; the threshold
+// stays above the depth noise of the sensor at 8 pixels.
+const int DETAIL_PIXEL_STEP = 8;
+const float DETAIL_CURVATURE = 0.02f;
+
+// Weight of voxels inherited from a coarser block: a few frames, so the
+// finer measurements take over quickly
+const unsigned short INHERITED_WEIGHT = 4;
+
+}
+
+MultiScaleTsdfVolume::BlockLookup::BlockLookup( size_t blockLimit_ )
+    : blockLimit( blockLimit_ )
+{
+    for ( int level = 0; level <= MAX_VOXEL_LEVEL; ++level ) {
+        key[level][0] = key[level][1] = key[level][2] = -1;
+        block[level] = -1;
+    }
+}
+
+MultiScaleTsdfVolume::MultiScaleTsdfVolume( const NUI_FUSION_RECONSTRUCTION_PARAMETERS& params_, ThreadPool& pool_ )
+    : params( params_ )
+    , colored( false )
+    , tableMask( 0 )
+    , tableEntries( 0 )
+    , stamp( 0 )
+    , resetStamp( 0 )
+    , pool( pool_ )
+{
+    const UINT voxelCounts[3] = { params_.voxelCountX, params_.voxelCountY, params_.voxelCountZ };
+    for ( int level = 0; level <= MAX_VOXEL_LEVEL; ++level ) {
+        truncations[level] = defaultTruncationDistance( params_.voxelsPerMeter / (1 << level) );
+        const UINT blockSize = VOXEL_BLOCK_SIZE << level;
+        for ( int a = 0; a < 3; ++a ) {
+            blockCounts[level][a] = (int)((voxelCounts[a] + blockSize - 1) / blockSize);
+        }
+    }
+
+    reset( nullptr );
+}
+
+void MultiScaleTsdfVolume::reset( const Matrix4* worldToVolumeTransform )
+{
+    if ( view ) {
+        view->preserveAll();
+        releaseView();
+    }
+
+    worldToVolume = worldToVolumeInMeters( params, worldToVolumeTransform );
+
+    std::deque<ScaledVoxelBlock>().swap( blocks );
+    std::deque<ColorVoxelBlock>().swap( colorBlocks );
+    colored = false;
+    std::vector<HashEntry>().swap( table );
+    tableEntries = 0;
+    resizeTable( INITIAL_TABLE_SIZE );
+    std::fill( levelBlockCounts, levelBlockCounts + MAX_VOXEL_LEVEL + 1, 0 );
+    resetStamp = ++stamp;
+}
+
+size_t MultiScaleTsdfVolume::memoryUsage() const
+{
+    return blocks.size() * sizeof(ScaledVoxelBlock) + colorBlocks.size() * sizeof(ColorVoxelBlock) +
+           table.size() * sizeof(HashEntry);
+}
+
+void MultiScaleTsdfVolume::resizeTable( size_t capacity )
+{
+    std::vector<HashEntry> old;
+    old.swap( table );
+
+    HashEntry empty = { EMPTY_KEY, -1 };
+    table.assign( capacity, empty );
+    tableMask = capacity - 1;
+
+    for ( size_t i = 0; i < old.size(); ++i ) {
+        const long long key = old[i].key;
+        if ( key == EMPTY_KEY ) {
+            continue;
+        }
+        size_t slot = hashSlot( (int)(key >> 57), (int)(key & KEY_COORDINATE_MASK),
+                                (int)((key >> 19) & KEY_COORDINATE_MASK), (int)((key >> 38) & KEY_COORDINATE_MASK) );
+        while ( table[slot].key != EMPTY_KEY ) {
+            slot = (slot + 1) & tableMask;
+        }
+        table[slot] = old[i];
+    }
+}
+
+const MultiScaleTsdfVolume::HashEntry* MultiScaleTsdfVolume::findEntry( int level, int x, int y, int z ) const
+{
+    long long key = blockKey( level, x, y, z );
+    for ( size_t slot = hashSlot( level, x, y, z ); ; slot = (slot + 1) & tableMask ) {
+        const HashEntry& e = table[slot];
+        if ( e.key == key ) {
+            return &e;
+        }
+        if ( e.key == EMPTY_KEY ) {
+            return 0;
+        }
+    }
+}
+
+int MultiScaleTsdfVolume::findBlock( int level, int x, int y, int z ) const
+{
+    const HashEntry* e = findEntry( level, x, y, z );
+    return (e != 0) ? e->block : -1;
+}
+
+MultiScaleTsdfVolume::HashEntry& MultiScaleTsdfVolume::insertEntry( int level, int x, int y, int z )
+{
+    // Keep the load factor at or below one half
+    if ( (tableEntries + 1) * 2 > table.size() ) {
+        resizeTable( table.size() * 2 );
+    }
+
+    long long key = blockKey( level, x, y, z );
+    size_t slot = hashSlot( level, x, y, z );
+    for ( ; table[slot].key != EMPTY_KEY; slot = (slot + 1) & tableMask ) {
+        if ( table[slot].key == key ) {
+            return table[slot];
+        }
+    }
+
+    table[slot].key = key;
+    table[slot].block = -1;
+    ++tableEntries;
+    return table[slot];
+}
+
+int MultiScaleTsdfVolume::allocateBlock( int level, int x, int y, int z )
+{
+    // Every block is announced in the coarsest cell around it, so the
+    // raycast can skip coarse cells without any block in one lookup
+    const int shift = MAX_VOXEL_LEVEL - level;
+    insertEntry( MAX_VOXEL_LEVEL, x >> shift, y >> shift, z >> shift );
+
+    HashEntry& entry = insertEntry( level, x, y, z );
+    if ( entry.block >= 0 ) {
+        return entry.block;
+    }
+
+    blocks.push_back( ScaledVoxelBlock() );
+    ScaledVoxelBlock& b = blocks.back();
+    b.x = x;
+    b.y = y;
+    b.z = z;
+    b.level = level;
+    b.stamp = 0;
+    b.writeStamp = 0;
+    b.leastTsdf = (short)TSDF_SCALE;
+    TsdfVoxel empty = { (short)TSDF_SCALE, 0 };
+    std::fill( b.voxels, b.voxels + VOXELS_PER_BLOCK, empty );
+    if ( colored ) {
+        colorBlocks.push_back( ColorVoxelBlock() );
+    }
+
+    ++levelBlockCounts[level];
+    entry.block = (int)blocks.size() - 1;
+    return entry.block;
+}
+
+int MultiScaleTsdfVolume::levelOfPixel( const DepthFloatFrame& depth, int u, int v ) const
+{
+    const float d = depth.row( v )[u];
+    int level = 0;
+    while ( level < MAX_VOXEL_LEVEL && d > FINEST_LEVEL_RANGE * (1 << level) ) {
+        ++level;
+    }
+    if ( level == 0 ) {
+        return 0;
+    }
+
+    // Neighbors on both sides along x, then along y; missing ones tell nothing
+    const int s = DETAIL_PIXEL_STEP;
+    if ( u >= s && u + s < depth.width ) {
+        float a = depth.row( v )[u - s], b = depth.row( v )[u + s];
+        if ( a > 0 && b > 0 && std::fabs( d / a + d / b - 2 ) > DETAIL_CURVATURE ) {
+            return level - 1;
+        }
+    }
+    if ( v >= s && v + s < depth.height ) {
+        float a = depth.row( v - s )[u], b = depth.row( v + s )[u];
+        if ( a > 0 && b > 0 && std::fabs( d / a + d / b - 2 ) > DETAIL_CURVATURE ) {
+            return level - 1;
+        }
+    }
+    return level;
+}
+
+void MultiScaleTsdfVolume::collectBandBlocks( const DepthFloatFrame& depth, const CameraIntrinsics& k,
+                                              const RigidTransform& cameraToVolume, std::vector<long long>& keys ) const
+{
+    const float vpm = params.voxelsPerMeter;
+    std::mutex keysMutex;
+
+    pool.parallelFor( 0, (depth.height + ALLOCATION_PIXEL_STEP - 1) / ALLOCATION_PIXEL_STEP, [&]( int begin, int end ) {
+        std::vector<long long> local;
+        long long lastKey = EMPTY_KEY;
+
+        for ( int row = begin; row < end; ++row ) {
+            int v = row * ALLOCATION_PIXEL_STEP;
+            const float* depthRow = depth.row( v );
+            for ( int u = 0; u < depth.width; u += ALLOCATION_PIXEL_STEP ) {
+                float d = depthRow[u];
+                if ( d <= 0 ) {
+                    continue;
+                }
+
+                // Walk the truncation band of the level in half block steps of the level
+                const int level = levelOfPixel( depth, u, v );
+                const int shift = VOXEL_BLOCK_SHIFT + level;
+                const float truncation = truncations[level];
+                Float3 a = cameraToVolume * k.unproject( (float)u, (float)v, d - truncation ) * vpm;
+                Float3 b = cameraToVolume * k.unproject( (float)u, (float)v, d + truncation ) * vpm;
+                int steps = (int)std::ceil( length( b - a ) / (float)(VOXEL_BLOCK_SIZE << level) * 2 );
+                Float3 delta = (b - a) * (1.0f / std::max( steps, 1 ));
+                for ( int i = 0; i <= steps; ++i ) {
+                    Float3 p = a + delta * (float)i;
+                    if ( p.x < 0 || p.y < 0 || p.z < 0 ) {
+                        continue;
+                    }
+                    int bx = (int)p.x >> shift, by = (int)p.y >> shift, bz = (int)p.z >> shift;
+                    if ( !inside( level, bx, by, bz ) ) {
+                        continue;
+                    }
+                    long long key = blockKey( level, bx, by, bz );
+                    if ( key != lastKey ) {
+                        local.push_back( key );
+                        lastKey = key;
+                    }
+                }
+            }
+        }
+
+        std::sort( local.begin(), local.end() );
+        local.erase( std::unique( local.begin(), local.end() ), local.end() );
+
+        std::lock_guard<std::mutex> lock( keysMutex );
+        keys.insert( keys.end(), local.begin(), local.end() );
+    }, 4 );
+
+    std::sort( keys.begin(), keys.end() );
+    keys.erase( std::unique( keys.begin(), keys.end() ), keys.end() );
+}
+
+void MultiScaleTsdfVolume::inheritVoxels( VoxelBlock& block, int level, BlockLookup& lookup ) const
+{
+    const float invTruncation = 1.0f / truncations[level];
+    const float scale = (float)(1 << level);
+    for ( int z = 0; z < VOXEL_BLOCK_SIZE; ++z ) {
+        for ( int y = 0; y < VOXEL_BLOCK_SIZE; ++y ) {
+            for ( int x = 0; x < VOXEL_BLOCK_SIZE; ++x ) {
+                // Fine voxel coordinates of the voxel, then the finest coarser level that saw it
+                Float3 p = Float3( (float)(block.x * VOXEL_BLOCK_SIZE + x), (float)(block.y * VOXEL_BLOCK_SIZE + y),
+                                   (float)(block.z * VOXEL_BLOCK_SIZE + z) ) * scale;
+                for ( int source = level + 1; source <= MAX_VOXEL_LEVEL; ++source ) {
+                    float distance;
+                    unsigned short weight;
+                    if ( !sampleLevel( source, p * (1.0f / (1 << source)), distance, weight, lookup ) ) {
+                        continue;
+                    }
+
+                    // Behind the band of this level nothing is integrated, leave it unobserved
+                    if ( distance >= -truncations[level] ) {
+                        TsdfVoxel& v = block.voxel( x, y, z );
+                        float tsdf = std::min( distance * invTruncation, 1.0f );
+                        v.tsdf = (short)(tsdf * TSDF_SCALE + ((tsdf >= 0) ? 0.5f : -0.5f));
+                        v.weight = std::min( weight, INHERITED_WEIGHT );
+                    }
+                    break;
+                }
+            }
+        }
+    }
+}
+
+void MultiScaleTsdfVolume::integrate( const DepthFloatFrame& depth, const ColorFrame* color, const CameraIntrinsics& intrinsics,
+                                      const RigidTransform& worldToCamera, unsigned short maxWeight )
+{
+    const RigidTransform volumeToCamera = worldToCamera * worldToVolume.inverse();
+
+    // Blocks allocated from now on get their colors with them
+    if ( color != nullptr && !colored ) {
+        colorBlocks.resize( blocks.size() );
+        colored = true;
+    }
+
+    // Allocation is serial but only touches the blocks of the band, a bounded number per level
+    std::vector<long long> keys;
+    collectBandBlocks( depth, intrinsics, volumeToCamera.inverse(), keys );
+
+    const size_t oldBlockCount = blocks.size();
+    visibleBlocks.resize( keys.size() );
+    for ( size_t i = 0; i < keys.size(); ++i ) {
+        visibleBlocks[i] = allocateBlock( (int)(keys[i] >> 57), (int)(keys[i] & KEY_COORDINATE_MASK),
+                                          (int)((keys[i] >> 19) & KEY_COORDINATE_MASK),
+                                          (int)((keys[i] >> 38) & KEY_COORDINATE_MASK) );
+    }
+
+    // New blocks start from the coarser blocks that existed before this frame,
+    // which nothing writes until the integration below
+    std::vector<int> newBlocks;
+    for ( size_t i = 0; i < visibleBlocks.size(); ++i ) {
+        if ( (size_t)visibleBlocks[i] >= oldBlockCount && blocks[visibleBlocks[i]].level < MAX_VOXEL_LEVEL ) {
+            newBlocks.push_back( visibleBlocks[i] );
+        }
+    }
+    pool.parallelFor( 0, (int)newBlocks.size(), [&]( int begin, int end ) {
+        BlockLookup lookup( oldBlockCount );
+        for ( int i = begin; i < end; ++i ) {
+            ScaledVoxelBlock& block = blocks[newBlocks[i]];
+            inheritVoxels( block, block.level, lookup );
+        }
+    }, 4 );
+
+    if ( view && (view->settled() || view.unique()) ) {
+        releaseView();
+    }
+    VoxelBlockView* const snapshot = view.get();
+    const int viewBlockCount = (int)viewSlots.size();
+
+    // Every block belongs to exactly one task, so the update needs no locking
+    const unsigned int integrateStamp = ++stamp;
+    pool.parallelFor( 0, (int)visibleBlocks.size(), [&]( int begin, int end ) {
+        for ( int i = begin; i < end; ++i ) {
+            if ( snapshot != nullptr && visibleBlocks[i] < viewBlockCount && viewSlots[visibleBlocks[i]] >= 0 ) {
+                snapshot->beforeWrite( viewSlots[visibleBlocks[i]] );
+            }
+            ScaledVoxelBlock& block = blocks[visibleBlocks[i]];
+            ColorVoxelBlock* colorBlock = (color != nullptr) ? &colorBlocks[visibleBlocks[i]] : nullptr;
+            block.writeStamp = integrateStamp;
+            const float vs = voxelSize() * (1 << block.level);
+            const Float3 dx = volumeToCamera.column( 0 ) * vs;
+            const float truncation = truncations[block.level];
+            int x0 = block.x * VOXEL_BLOCK_SIZE, y0 = block.y * VOXEL_BLOCK_SIZE, z0 = block.z * VOXEL_BLOCK_SIZE;
+            for ( int z = 0; z < VOXEL_BLOCK_SIZE; ++z ) {
+                for ( int y = 0; y < VOXEL_BLOCK_SIZE; ++y ) {
+                    Float3 p0 = volumeToCamera * (Float3( (float)x0, (float)(y0 + y), (float)(z0 + z) ) * vs);
+                    int first, last;
+                    if ( clipVoxelRow( p0, dx, VOXEL_BLOCK_SIZE, intrinsics, first, last ) &&
+                         integrateVoxelRow( &block.voxel( 0, y, z ), colorBlock ? &colorBlock->voxel( 0, y, z ) : nullptr,
+                                            first, last, p0, dx, depth, color, intrinsics, truncation, (float)maxWeight ) ) {
+                        block.stamp = integrateStamp;
+                    }
+                }
+            }
+            // New blocks may have inherited a surface this frame did not move
+            if ( block.stamp == integrateStamp || (size_t)visibleBlocks[i] >= oldBlockCount ) {
+                block.leastTsdf = leastObservedTsdf( block.voxels, VOXELS_PER_BLOCK, (short)TSDF_SCALE );
+            }
+        }
+    }, 16 );
+}
+
+void MultiScaleTsdfVolume::deintegrate( const DepthFloatFrame& depth, const CameraIntrinsics& intrinsics,
+                                        const RigidTransform& worldToCamera, unsigned short maxWeight )
+{
+    const RigidTransform volumeToCamera = worldToCamera * worldToVolume.inverse();
+
+    // The band of every level integrate() used for the frame. A fine block
+    // allocated after the frame inherited it from a coarser block, which
+    // keeps it, so only the blocks that saw the frame themselves are exact.
+    std::vector<long long> keys;
+    collectBandBlocks( depth, intrinsics, volumeToCamera.inverse(), keys );
+
+    visibleBlocks.clear();
+    for ( size_t i = 0; i < keys.size(); ++i ) {
+        int block = findBlock( (int)(keys[i] >> 57), (int)(keys[i] & KEY_COORDINATE_MASK),
+                               (int)((keys[i] >> 19) & KEY_COORDINATE_MASK), (int)((keys[i] >> 38) & KEY_COORDINATE_MASK) );
+        if ( block >= 0 ) {
+            visibleBlocks.push_back( block );
+        }
+    }
+
+    if ( view && (view->settled() || view.unique()) ) {
+        releaseView();
+    }
+    VoxelBlockView* const snapshot = view.get();
+    const int viewBlockCount = (int)viewSlots.size();
+
+    const unsigned int deintegrateStamp = ++stamp;
+    pool.parallelFor( 0, (int)visibleBlocks.size(), [&]( int begin, int end ) {
+        for ( int i = begin; i < end; ++i ) {
+            if ( snapshot != nullptr && visibleBlocks[i] < viewBlockCount && viewSlots[visibleBlocks[i]] >= 0 ) {
+                snapshot->beforeWrite( viewSlots[visibleBlocks[i]] );
+            }
+            ScaledVoxelBlock& block = blocks[visibleBlocks[i]];
+            block.writeStamp = deintegrateStamp;
+            const float vs = voxelSize() * (1 << block.level);
+            const Float3 dx = volumeToCamera.column( 0 ) * vs;
+            const float truncation = truncations[block.level];
+            int x0 = block.x * VOXEL_BLOCK_SIZE, y0 = block.y * VOXEL_BLOCK_SIZE, z0 = block.z * VOXEL_BLOCK_SIZE;
+            for ( int z = 0; z < VOXEL_BLOCK_SIZE; ++z ) {
+                for ( int y = 0; y < VOXEL_BLOCK_SIZE; ++y ) {
+                    Float3 p0 = volumeToCamera * (Float3( (float)x0, (float)(y0 + y), (float)(z0 + z) ) * vs);
+                    int first, last;
+                    if ( clipVoxelRow( p0, dx, VOXEL_BLOCK_SIZE, intrinsics, first, last ) &&
+                         deintegrateVoxelRow( &block.voxel( 0, y, z ), first, last, p0, dx, depth, intrinsics,
+                                              truncation, (float)maxWeight ) ) {
+                        block.stamp = deintegrateStamp;
+                    }
+                }
+            }
+            if ( block.stamp == deintegrateStamp ) {
+                block.leastTsdf = leastObservedTsdf( block.voxels, VOXELS_PER_BLOCK, (short)TSDF_SCALE );
+            }
+        }
+    }, 16 );
+}
+
+bool MultiScaleTsdfVolume::changedBlocks( unsigned int since, std::vector<VoxelBlockIndex>& changed ) const
+{
+    changed.clear();
+
+    for ( std::deque<ScaledVoxelBlock>::const_iterator b = blocks.begin(); b != blocks.end(); ++b ) {
+        if ( b->stamp <= since ) {
+            continue;
+        }
+        if ( b->level == 0 ) {
+            VoxelBlockIndex block = { b->x, b->y, b->z, 0 };
+            changed.push_back( block );
+            continue;
+        }
+
+        // Fine blocks of a coarse block, but only those near its surface:
+        // the others would mesh to nothing at many times the cost
+        const int n = 1 << b->level;
+        const int span = VOXEL_BLOCK_SIZE / n;
+        for ( int sz = 0; sz < n; ++sz ) {
+            for ( int sy = 0; sy < n; ++sy ) {
+                for ( int sx = 0; sx < n; ++sx ) {
+                    VoxelBlockIndex block = { b->x * n + sx, b->y * n + sy, b->z * n + sz, 0 };
+                    if ( !inside( 0, block.x, block.y, block.z ) ) {
+                        continue;
+                    }
+
+                    // Voxels of the coarse block the fine block interpolates, one more on each side
+                    bool nearSurface = false;
+                    for ( int z = std::max( sz * span - 1, 0 ); !nearSurface && z <= std::min( (sz + 1) * span, VOXEL_BLOCK_SIZE - 1 ); ++z ) {
+                        for ( int y = std::max( sy * span - 1, 0 ); !nearSurface && y <= std::min( (sy + 1) * span, VOXEL_BLOCK_SIZE - 1 ); ++y ) {
+                            for ( int x = std::max( sx * span - 1, 0 ); x <= std::min( (sx + 1) * span, VOXEL_BLOCK_SIZE - 1 ); ++x ) {
+                                const TsdfVoxel& v = b->voxel( x, y, z );
+                                if ( v.weight != 0 && v.tsdf != (short)TSDF_SCALE ) {
+                                    nearSurface = true;
+                                    break;
+                                }
+                            }
+                        }
+                    }
+                    if ( nearSurface ) {
+                        changed.push_back( block );
+                    }
+                }
+            }
+        }
+    }
+
+    // Blocks of several levels cover the same fine blocks
+    struct Order
+    {
+        bool operator()( const VoxelBlockIndex& a, const VoxelBlockIndex& b ) const
+        {
+            return (a.z != b.z) ? a.z < b.z : (a.y != b.y) ? a.y < b.y : a.x < b.x;
+        }
+        static bool same( const VoxelBlockIndex& a, const VoxelBlockIndex& b )
+        {
+            return a.x == b.x && a.y == b.y && a.z == b.z;
+        }
+    };
+    std::sort( changed.begin(), changed.end(), Order() );
+    changed.erase( std::unique( changed.begin(), changed.end(), &Order::same ), changed.end() );
+    return resetStamp <= since;
+}
+
+std::shared_ptr<VoxelBlockView> MultiScaleTsdfVolume::viewChangedBlocks( unsigned int since, bool& complete )
+{
+    if ( view ) {
+        view->preserveAll();
+        releaseView();
+    }
+
+    // The view keeps pointers, the table may be resized while it is read
+    std::vector<VoxelBlockIndex> changed;
+    std::vector<const VoxelBlock*> changedBlocks;
+    viewSlots.assign( blocks.size(), -1 );
+    for ( size_t i = 0; i < blocks.size(); ++i ) {
+        const ScaledVoxelBlock& b = blocks[i];
+        if ( b.writeStamp > since ) {
+            VoxelBlockIndex block = { b.x, b.y, b.z, b.level };
+            viewSlots[i] = (int)changed.size();
+            changed.push_back( block );
+            changedBlocks.push_back( &b );
+        }
+    }
+    complete = resetStamp <= since;
+
+    view = std::make_shared<VoxelBlockView>( changed, [changedBlocks]( size_t slot, const VoxelBlockIndex&, TsdfVoxel* out ) {
+        std::copy( changedBlocks[slot]->voxels, changedBlocks[slot]->voxels + VOXELS_PER_BLOCK, out );
+    } );
+    return view;
+}
+
+void MultiScaleTsdfVolume::releaseView()
+{
+    view.reset();
+    std::vector<int>().swap( viewSlots );
+}
+
+void MultiScaleTsdfVolume::writeBlocks( const std::vector<VoxelBlockIndex>& written,
+                                        const std::function<void ( size_t i, TsdfVoxel* voxels )>& fill )
+{
+    if ( view ) {
+        view->preserveAll();
+        releaseView();
+    }
+
+    std::vector<int> indices( written.size(), -1 );
+    for ( size_t i = 0; i < written.size(); ++i ) {
+        const VoxelBlockIndex& b = written[i];
+        if ( b.level >= 0 && b.level <= MAX_VOXEL_LEVEL && inside( b.level, b.x, b.y, b.z ) ) {
+            indices[i] = allocateBlock( b.level, b.x, b.y, b.z );
+        }
+    }
+
+    const unsigned int writeStamp = ++stamp;
+    pool.parallelFor( 0, (int)written.size(), [&]( int begin, int end ) {
+        for ( int i = begin; i < end; ++i ) {
+            if ( indices[i] >= 0 ) {
+                ScaledVoxelBlock& block = blocks[indices[i]];
+                fill( i, block.voxels );
+                if ( colored ) {
+                    colorBlocks[indices[i]] = ColorVoxelBlock();
+                }
+                block.leastTsdf = leastObservedTsdf( block.voxels, VOXELS_PER_BLOCK, (short)TSDF_SCALE );
+                block.stamp = writeStamp;
+                block.writeStamp = writeStamp;
+            }
+        }
+    }, 16 );
+}
+
+UINT MultiScaleTsdfVolume::sampleColor( const Float3& p ) const
+{
+    if ( !colored ) {
+        return 0;
+    }
+    for ( int level = 0; level <= MAX_VOXEL_LEVEL; ++level ) {
+        const Float3 q = p * (1.0f / (1 << level));
+        int x = (int)(q.x + 0.5f), y = (int)(q.y + 0.5f), z = (int)(q.z + 0.5f);
+        if ( x < 0 || y < 0 || z < 0 ) {
+            return 0;
+        }
+        int block = findBlock( level, x >> VOXEL_BLOCK_SHIFT, y >> VOXEL_BLOCK_SHIFT, z >> VOXEL_BLOCK_SHIFT );
+        if ( block < 0 ) {
+            continue;
+        }
+        const int m = VOXEL_BLOCK_SIZE - 1;
+        UINT c = colorOfVoxel( colorBlocks[block].voxel( x & m, y & m, z & m ) );
+        if ( c != 0 ) {
+            return c;
+        }
+    }
+    return 0;
+}
+
+int MultiScaleTsdfVolume::lookupBlock( int level, int x, int y, int z, BlockLookup& lookup ) const
+{
+    int* key = lookup.key[level];
+    if ( x != key[0] || y != key[1] || z != key[2] ) {
+        key[0] = x; key[1] = y; key[2] = z;
+        int block = findBlock( level, x, y, z );
+        lookup.block[level] = ((size_t)block < lookup.blockLimit) ? block : -1;
+    }
+    return lookup.block[level];
+}
+
+const TsdfVoxel* MultiScaleTsdfVolume::findVoxel( int level, int x, int y, int z, BlockLookup& lookup ) const
+{
+    if ( x < 0 || y < 0 || z < 0 ) {
+        return 0;
+    }
+    int block = lookupBlock( level, x >> VOXEL_BLOCK_SHIFT, y >> VOXEL_BLOCK_SHIFT, z >> VOXEL_BLOCK_SHIFT, lookup );
+    if ( block < 0 ) {
+        return 0;
+    }
+    const int m = VOXEL_BLOCK_SIZE - 1;
+    return &blocks[block].voxel( x & m, y & m, z & m );
+}
+
+bool MultiScaleTsdfVolume::sampleLevel( int level, const Float3& p, float& distance, unsigned short& weight,
+                                        BlockLookup& lookup ) const
+{
+    if ( p.x < 0 || p.y < 0 || p.z < 0 ) {
+        return false;
+    }
+    int x = (int)p.x, y = (int)p.y, z = (int)p.z;
+
+    const TsdfVoxel* c[8];
+    const int m = VOXEL_BLOCK_SIZE - 1;
+    if ( (x & m) != m && (y & m) != m && (z & m) != m ) {
+        // All corners in one block
+        const TsdfVoxel* v = findVoxel( level, x, y, z, lookup );
+        if ( v == 0 ) {
+            return false;
+        }
+        const int sy = VOXEL_BLOCK_SIZE, sz = VOXEL_BLOCK_SIZE * VOXEL_BLOCK_SIZE;
+        c[0] = v;      c[1] = v + 1;      c[2] = v + sy;      c[3] = v + sy + 1;
+        c[4] = v + sz; c[5] = v + sz + 1; c[6] = v + sz + sy; c[7] = v + sz + sy + 1;
+    }
+    else {
+        for ( int i = 0; i < 8; ++i ) {
+            c[i] = findVoxel( level, x + (i & 1), y + ((i >> 1) & 1), z + (i >> 2), lookup );
+        }
+    }
+
+    float value;
+    if ( !interpolateVoxels( c, p.x - x, p.y - y, p.z - z, value ) ) {
+        return false;
+    }
+    distance = value * truncations[level];
+    weight = c[0]->weight;
+    for ( int i = 1; i < 8; ++i ) {
+        weight = std::min( weight, c[i]->weight );
+    }
+    return true;
+}
+
+bool MultiScaleTsdfVolume::sample( const Float3& p, float& distance, int& level, BlockLookup& lookup ) const
+{
+    unsigned short weight;
+    for ( level = 0; level <= MAX_VOXEL_LEVEL; ++level ) {
+        if ( sampleLevel( level, p * (1.0f / (1 << level)), distance, weight, lookup ) ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool MultiScaleTsdfVolume::gradient( int level, const Float3& p, Float3& g, BlockLookup& lookup ) const
+{
+    const Float3 q = p * (1.0f / (1 << level));
+    float x0, x1, y0, y1, z0, z1;
+    unsigned short w;
+    if ( !sampleLevel( level, q - Float3( 1, 0, 0 ), x0, w, lookup ) || !sampleLevel( level, q + Float3( 1, 0, 0 ), x1, w, lookup ) ||
+         !sampleLevel( level, q - Float3( 0, 1, 0 ), y0, w, lookup ) || !sampleLevel( level, q + Float3( 0, 1, 0 ), y1, w, lookup ) ||
+         !sampleLevel( level, q - Float3( 0, 0, 1 ), z0, w, lookup ) || !sampleLevel( level, q + Float3( 0, 0, 1 ), z1, w, lookup ) ) {
+        return false;
+    }
+
+    g = Float3( x1 - x0, y1 - y0, z1 - z0 );
+    return true;
+}
+
+void MultiScaleTsdfVolume::raycast( const RigidTransform& worldToCamera, const CameraIntrinsics& k,
+                                    PointCloudFrame& pointCloud ) const
+{
+    pointCloud.resize( k.width, k.height );
+
+    const float vpm = params.voxelsPerMeter;
+    const RigidTransform cameraToVolume = worldToVolume * worldToCamera.inverse();
+    const RigidTransform volumeToWorld = worldToVolume.inverse();
+    const Float3 origin = cameraToVolume.t * vpm;
+    const float dims[3] = { (float)(params.voxelCountX - 1), (float)(params.voxelCountY - 1), (float)(params.voxelCountZ - 1) };
+    const int m = VOXEL_BLOCK_SIZE - 1;
+    const int coarseShift = VOXEL_BLOCK_SHIFT + MAX_VOXEL_LEVEL;
+
+    raycastTiles( pool, k, [&]( int u, int v ) {
+        Float3 dir = normalize( cameraToVolume.rotate( k.unproject( (float)u, (float)v, 1.0f ) ) );
+        Float3 step = dir * vpm;
+
+        // t in meters along the ray, positions in fine voxels
+        float tNear = NUI_FUSION_DEFAULT_MINIMUM_DEPTH, tFar = NUI_FUSION_DEFAULT_MAXIMUM_DEPTH;
+        clipRayToBox( origin, step, dims, tNear, tFar );
+
+        float* out = pointCloud.pixel( u, v );
+        float previous = 0, previousT = 0;
+        bool hasPrevious = false;
+
+        // Whether the coarsest cell of the last step holds any block
+        BlockLookup lookup( blocks.size() );
+        int cachedCell[3] = { -1, -1, -1 };
+        bool cellOccupied = false;
+
+        for ( float t = tNear; t <= tFar; ) {
+            Float3 p = origin + step * t;
+            int x = (int)(p.x + 0.5f), y = (int)(p.y + 0.5f), z = (int)(p.z + 0.5f);
+
+            int cx = x >> coarseShift, cy = y >> coarseShift, cz = z >> coarseShift;
+            if ( cx != cachedCell[0] || cy != cachedCell[1] || cz != cachedCell[2] ) {
+                cachedCell[0] = cx; cachedCell[1] = cy; cachedCell[2] = cz;
+                cellOccupied = findEntry( MAX_VOXEL_LEVEL, cx, cy, cz ) != 0;
+            }
+            if ( !cellOccupied ) {
+                // Nothing at any level: jump to where the ray leaves the coarsest cell
+                t = std::max( cellExit( origin, step, cx, cy, cz, (float)(VOXEL_BLOCK_SIZE << MAX_VOXEL_LEVEL), tFar + 1 ), t ) + 1e-4f;
+                hasPrevious = false;
+                continue;
+            }
+
+            // Finest level with an observed voxel here, and whether a block of any level holds a surface
+            int level = -1, blockLevel = -1;
+            float f = 0;
+            bool surface = false;
+            for ( int l = 0; l <= MAX_VOXEL_LEVEL && (level < 0 || !surface); ++l ) {
+                const float inv = 1.0f / (1 << l);
+                int lx = (int)(p.x * inv + 0.5f), ly = (int)(p.y * inv + 0.5f), lz = (int)(p.z * inv + 0.5f);
+                int bx = lx >> VOXEL_BLOCK_SHIFT, by = ly >> VOXEL_BLOCK_SHIFT, bz = lz >> VOXEL_BLOCK_SHIFT;
+                int block = lookupBlock( l, bx, by, bz, lookup );
+                if ( block < 0 ) {
+                    continue;
+                }
+                if ( blockLevel < 0 ) {
+                    blockLevel = l;
+                }
+                surface = surface || blocks[block].leastTsdf != (short)TSDF_SCALE;
+                const TsdfVoxel& voxel = blocks[block].voxel( lx & m, ly & m, lz & m );
+                if ( level < 0 && voxel.weight != 0 ) {
+                    level = l;
+                    f = voxel.tsdf * INV_TSDF_SCALE * truncations[l];
+                }
+            }
+
+            if ( blockLevel < 0 || !surface ) {
+                if ( blockLevel >= 0 && hasPrevious && previous < 0 ) {
+                    // Left the back of a surface
+                    break;
+                }
+
+                // No block at any level, or none with a surface: jump to where the ray leaves this fine block
+                t = std::max( cellExit( origin, step, x >> VOXEL_BLOCK_SHIFT, y >> VOXEL_BLOCK_SHIFT,
+                                        z >> VOXEL_BLOCK_SHIFT, (float)VOXEL_BLOCK_SIZE, tFar + 1 ), t ) + 1e-4f;
+                hasPrevious = false;
+                continue;
+            }
+            if ( level < 0 ) {
+                hasPrevious = false;
+                t += voxelSize() * (1 << blockLevel);
+                continue;
+            }
+
+            if ( hasPrevious && previous > 0 && f < 0 ) {
+                // Zero crossing, refine it with trilinear samples in meters, whatever their level
+                float fa, fb, tHit = previousT;
+                int la, lb;
+                if ( sample( origin + step * previousT, fa, la, lookup ) && sample( p, fb, lb, lookup ) && fa > fb ) {
+                    tHit = previousT + (t - previousT) * fa / (fa - fb);
+                }
+
+                Float3 hit = origin + step * tHit;
+                Float3 g;
+                float fHit;
+                int hitLevel;
+                if ( sample( hit, fHit, hitLevel, lookup ) && gradient( hitLevel, hit, g, lookup ) && length( g ) > 0 ) {
+                    Float3 point = volumeToWorld * (hit * (1.0f / vpm));
+                    Float3 normal = normalize( volumeToWorld.rotate( g ) );
+                    out[0] = point.x;  out[1] = point.y;  out[2] = point.z;
+                    out[3] = normal.x; out[4] = normal.y; out[5] = normal.z;
+                }
+                break;
+            }
+            if ( hasPrevious && previous < 0 && f > 0 ) {
+                // Left the back of a surface
+                break;
+            }
+
+            previous = f;
+            previousT = t;
+            hasPrevious = true;
+            const float vs = voxelSize() * (1 << level);
+            t += (f > 0) ? std::max( vs, f * 0.8f ) : vs;
+        }
+    } );
+}
+
+void MultiScaleTsdfVolume::readVoxels( int x0, int y0, int z0, int size, TsdfVoxel* out ) const
+{
+    const TsdfVoxel empty = { (short)TSDF_SCALE, 0 };
+    std::fill( out, out + (size_t)size * size * size, empty );
+
+    int xBegin = std::max( x0, 0 ), xEnd = std::min( x0 + size, (int)params.voxelCountX );
+    int yBegin = std::max( y0, 0 ), yEnd = std::min( y0 + size, (int)params.voxelCountY );
+    int zBegin = std::max( z0, 0 ), zEnd = std::min( z0 + size, (int)params.voxelCountZ );
+    if ( xBegin >= xEnd || yBegin >= yEnd || zBegin >= zEnd ) {
+        return;
+    }
+
+    // Fine blocks are copied row by row like in HashedTsdfVolume
+    const int m = VOXEL_BLOCK_SIZE - 1;
+    for ( int bz = zBegin >> VOXEL_BLOCK_SHIFT; bz <= (zEnd - 1) >> VOXEL_BLOCK_SHIFT; ++bz ) {
+        for ( int by = yBegin >> VOXEL_BLOCK_SHIFT; by <= (yEnd - 1) >> VOXEL_BLOCK_SHIFT; ++by ) {
+            for ( int bx = xBegin >> VOXEL_BLOCK_SHIFT; bx <= (xEnd - 1) >> VOXEL_BLOCK_SHIFT; ++bx ) {
+                int index = findBlock( 0, bx, by, bz );
+                if ( index < 0 ) {
+                    continue;
+                }
+                const VoxelBlock& block = blocks[index];
+                int xa = std::max( xBegin, bx * VOXEL_BLOCK_SIZE ), xb = std::min( xEnd, (bx + 1) * VOXEL_BLOCK_SIZE );
+                int ya = std::max( yBegin, by * VOXEL_BLOCK_SIZE ), yb = std::min( yEnd, (by + 1) * VOXEL_BLOCK_SIZE );
+                int za = std::max( zBegin, bz * VOXEL_BLOCK_SIZE ), zb = std::min( zEnd, (bz + 1) * VOXEL_BLOCK_SIZE );
+                for ( int z = za; z < zb; ++z ) {
+                    for ( int y = ya; y < yb; ++y ) {
+                        const TsdfVoxel* row = &block.voxel( xa & m, y & m, z & m );
+                        std::copy( row, row + (xb - xa), out + ((size_t)(z - z0) * size + (y - y0)) * size + (xa - x0) );
+                    }
+                }
+            }
+        }
+    }
+
+    // What they left unobserved is resampled from the coarser levels that
+    // have blocks here, rescaled to the truncation of the finest level
+    int levels[MAX_VOXEL_LEVEL];
+    int levelCount = 0;
+    for ( int level = 1; level <= MAX_VOXEL_LEVEL; ++level ) {
+        // Interpolation reaches one coarse voxel beyond the cube
+        const int shift = VOXEL_BLOCK_SHIFT + level;
+        bool present = false;
+        for ( int bz = zBegin >> shift; !present && bz <= (zEnd + (1 << level)) >> shift; ++bz ) {
+            for ( int by = yBegin >> shift; !present && by <= (yEnd + (1 << level)) >> shift; ++by ) {
+                for ( int bx = xBegin >> shift; !present && bx <= (xEnd + (1 << level)) >> shift; ++bx ) {
+                    present = findBlock( level, bx, by, bz ) >= 0;
+                }
+            }
+        }
+        if ( present ) {
+            levels[levelCount++] = level;
+        }
+    }
+    if ( levelCount == 0 ) {
+        return;
+    }
+
+    const float invTruncation = 1.0f / truncations[0];
+    BlockLookup lookup( blocks.size() );
+    for ( int z = zBegin; z < zEnd; ++z ) {
+        for ( int y = yBegin; y < yEnd; ++y ) {
+            for ( int x = xBegin; x < xEnd; ++x ) {
+                TsdfVoxel& v = out[((size_t)(z - z0) * size + (y - y0)) * size + (x - x0)];
+                if ( v.weight != 0 ) {
+                    continue;
+                }
+
+                for ( int i = 0; i < levelCount; ++i ) {
+                    const int level = levels[i];
+                    float distance;
+                    unsigned short weight;
+                    if ( sampleLevel( level, Float3( (float)x, (float)y, (float)z ) * (1.0f / (1 << level)),
+                                      distance, weight, lookup ) ) {
+                        float tsdf = std::max( std::min( distance * invTruncation, 1.0f ), -1.0f );
+                        v.tsdf = (short)(tsdf * TSDF_SCALE + ((tsdf >= 0) ? 0.5f : -0.5f));
+                        v.weight = weight;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+}
+
+}
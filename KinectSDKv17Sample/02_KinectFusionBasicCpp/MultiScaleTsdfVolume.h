@@ -0,0 +1,179 @@
+#pragma once
+
+#include <deque>
+#include <vector>
+
+#include "HashedTsdfVolume.h"
+
+namespace kinectbook {
+
+/// <summary>
+/// Coarsest level of a MultiScaleTsdfVolume; its voxels are 2^MAX_VOXEL_LEVEL fine voxels wide
+/// </summary>
+const int MAX_VOXEL_LEVEL = 3;
+
+/// <summary>
+/// Voxel block of one level of a MultiScaleTsdfVolume
+/// </summary>
+struct ScaledVoxelBlock : VoxelBlock
+{
+    int level;          // voxels are 2^level fine voxels wide, x, y, z count blocks of that level
+};
+
+/// <summary>
+/// Sparse truncated signed distance volume whose voxel size follows the distance
+/// </summary>
+/// <remarks>
+/// Blocks are hashed like in HashedTsdfVolume, but every block has a level
+/// and its voxels are 2^level voxels of parameters() wide. A measurement
+/// is integrated at the level of its depth: the finest up to 1m, twice as
+/// coarse with every doubling of the distance, the coarsest at the 8m
+/// NUI_FUSION_DEFAULT_MAXIMUM_DEPTH. Corners, edges and small objects,
+/// where the depth is not locally planar, go one level finer. Since a
+/// block of a level covers about the same number of pixels wherever it
+/// is seen, a frame touches a bounded number of blocks and a room costs
+/// a fraction of the memory of a fine hashed volume.
+///
+/// Where blocks of several levels overlap the finest observed one wins.
+/// A new block inherits the voxels of a coarser block covering it, so
+/// stepping closer refines the surface instead of punching a hole in it.
+///
+/// changedBlocks() and readVoxels() speak fine blocks and voxels, coarse
+/// blocks are resampled, so MeshExtractor meshes every level at the fine
+/// resolution without cracks between levels. viewChangedBlocks() and
+/// writeBlocks() move blocks of every level as they are (VoxelBlockIndex::level).
+/// sampleColor() returns the color of the finest level that has one.
+/// </remarks>
+class MultiScaleTsdfVolume : public ITsdfVolume
+{
+public:
+
+    MultiScaleTsdfVolume( const NUI_FUSION_RECONSTRUCTION_PARAMETERS& params, ThreadPool& pool );
+
+    virtual void reset( const Matrix4* worldToVolume );
+
+    virtual void integrate( const DepthFloatFrame& depth, const ColorFrame* color, const CameraIntrinsics& intrinsics,
+                            const RigidTransform& worldToCamera, unsigned short maxWeight );
+
+    virtual void deintegrate( const DepthFloatFrame& depth, const CameraIntrinsics& intrinsics,
+                              const RigidTransform& worldToCamera, unsigned short maxWeight );
+
+    virtual void raycast( const RigidTransform& worldToCamera, const CameraIntrinsics& intrinsics,
+                          PointCloudFrame& pointCloud ) const;
+
+    virtual const NUI_FUSION_RECONSTRUCTION_PARAMETERS& parameters() const { return params; }
+
+    /// <summary>
+    /// Truncation distance of the finest level; every level truncates at about 4 of its voxels
+    /// </summary>
+    virtual float truncationDistance() const { return truncations[0]; }
+
+    virtual RigidTransform worldToVolumeTransform() const { return worldToVolume; }
+
+    virtual size_t memoryUsage() const;
+
+    virtual unsigned int modificationStamp() const { return stamp; }
+
+    virtual bool changedBlocks( unsigned int since, std::vector<VoxelBlockIndex>& blocks ) const;
+
+    virtual void readVoxels( int x, int y, int z, int size, TsdfVoxel* voxels ) const;
+
+    virtual std::shared_ptr<VoxelBlockView> viewChangedBlocks( unsigned int since, bool& complete );
+
+    virtual void writeBlocks( const std::vector<VoxelBlockIndex>& blocks,
+                              const std::function<void ( size_t i, TsdfVoxel* voxels )>& fill );
+
+    virtual bool hasColor() const { return colored; }
+
+    virtual UINT sampleColor( const Float3& p ) const;
+
+    size_t blockCount() const { return blocks.size(); }
+
+    /// <summary>
+    /// Blocks of one level
+    /// </summary>
+    size_t blockCount( int level ) const { return levelBlockCounts[level]; }
+
+private:
+
+    struct HashEntry
+    {
+        long long key;
+        int block;          // -1: no block, the coarsest cell only holds finer ones
+    };
+
+    // 19 bits per coordinate leave room for the level
+    static long long blockKey( int level, int x, int y, int z )
+    {
+        return (long long)x | ((long long)y << 19) | ((long long)z << 38) | ((long long)level << 57);
+    }
+
+    size_t hashSlot( int level, int x, int y, int z ) const
+    {
+        return ((unsigned int)x * 73856093u ^ (unsigned int)y * 19349669u ^ (unsigned int)z * 83492791u ^
+                (unsigned int)level * 2654435761u) & tableMask;
+    }
+
+    bool inside( int level, int x, int y, int z ) const
+    {
+        return x >= 0 && y >= 0 && z >= 0 &&
+               x < blockCounts[level][0] && y < blockCounts[level][1] && z < blockCounts[level][2];
+    }
+
+    /// <summary>
+    /// Last block looked up on each level, and how many blocks may be read
+    /// </summary>
+    struct BlockLookup
+    {
+        explicit BlockLookup( size_t blockLimit );
+
+        size_t blockLimit;
+        int key[MAX_VOXEL_LEVEL + 1][3];
+        int block[MAX_VOXEL_LEVEL + 1];
+    };
+
+    const HashEntry* findEntry( int level, int x, int y, int z ) const;
+    int findBlock( int level, int x, int y, int z ) const;
+    int allocateBlock( int level, int x, int y, int z );
+    HashEntry& insertEntry( int level, int x, int y, int z );
+    void resizeTable( size_t capacity );
+
+    int levelOfPixel( const DepthFloatFrame& depth, int u, int v ) const;
+    void collectBandBlocks( const DepthFloatFrame& depth, const CameraIntrinsics& k,
+                            const RigidTransform& cameraToVolume, std::vector<long long>& keys ) const;
+    void inheritVoxels( VoxelBlock& block, int level, BlockLookup& lookup ) const;
+
+    int lookupBlock( int level, int x, int y, int z, BlockLookup& lookup ) const;
+    const TsdfVoxel* findVoxel( int level, int x, int y, int z, BlockLookup& lookup ) const;
+    bool sampleLevel( int level, const Float3& p, float& distance, unsigned short& weight, BlockLookup& lookup ) const;
+    bool sample( const Float3& p, float& distance, int& level, BlockLookup& lookup ) const;
+    bool gradient( int level, const Float3& p, Float3& g, BlockLookup& lookup ) const;
+
+    void releaseView();
+
+    NUI_FUSION_RECONSTRUCTION_PARAMETERS params;
+    float truncations[MAX_VOXEL_LEVEL + 1];     // meters, per level
+    RigidTransform worldToVolume;               // world to volume in meters, scale by voxelsPerMeter for fine voxels
+    int blockCounts[MAX_VOXEL_LEVEL + 1][3];
+
+    std::deque<ScaledVoxelBlock> blocks;        // deque: blocks never move when more are added
+    std::deque<ColorVoxelBlock> colorBlocks;    // colors of blocks[i], once colored
+    bool colored;
+    std::vector<HashEntry> table;               // open addressing, linear probing
+    size_t tableMask;
+    size_t tableEntries;
+    size_t levelBlockCounts[MAX_VOXEL_LEVEL + 1];
+
+    std::vector<int> visibleBlocks;
+    unsigned int stamp;
+    unsigned int resetStamp;
+
+    // Snapshot being read and the slot of every block in it by block
+    // number, -1 when not in it; blocks allocated later are never in it
+    std::shared_ptr<VoxelBlockView> view;
+    std::vector<int> viewSlots;
+
+    ThreadPool& pool;
+};
+
+}
@@ -0,0 +1,421 @@
+#include "MultiSensorFusion.h"
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include "DepthProcessor.h"
+
+namespace kinectbook {
+
+namespace {
+
+const unsigned int WAIT_FOREVER = FrameQueue<SensorFrame*>::WAIT_FOREVER;
+
+// How long a set waits for the frames of the other sensors when nothing is
+// dropped (replay); only the end of a stream ever takes that long
+const double REPLAY_MATCH_WAIT = 1000.0;
+
+// Milliseconds the clock offset of a sensor grows per frame, so a sensor
+// clock slower than the host's is followed (300 ppm at 30 fps)
+const double CLOCK_OFFSET_CREEP = 0.01;
+
+// Every queue can hold all of its frames, but the ready frames of a sensor
+// have two consumers (the fuse stage and a live submit() taking the oldest),
+// so a push can find its cell still claimed by a pop that has not finished
+template <class T>
+void pushFrame( FrameQueue<T>& queue, T frame )
+{
+    while ( !queue.push( frame ) ) {
+        std::this_thread::yield();
+    }
+}
+
+}
+
+MultiSensorFusion::MultiSensorFusion( CpuReconstruction& reconstruction_, const MultiSensorFusionOptions& options_,
+                                      const ShadeFunction& shade_ )
+    : reconstruction( reconstruction_ )
+    , options( options_ )
+    , shade( shade_ )
+    , startTime( SensorFrame::Clock::now() )
+    , freeFrames( options_.pipeline.frameCount )
+    , shadeQueue( options_.pipeline.frameCount )
+    , presentQueue( options_.pipeline.frameCount )
+    , stopping( false )
+    , droppedFrames( 0 )
+    , framesInFlight( 0 )
+    , fusedSets( 0 )
+    , profiler( options_.pipeline.profiler != 0 ? *options_.pipeline.profiler : Profiler::shared() )
+    , upkeep( reconstruction_, options_.pipeline, options_.trackReference, profiler )
+{
+    if ( options.referenceToCamera.empty() ) {
+        throw std::runtime_error( "MultiSensorFusion: no sensors" );
+    }
+    if ( options.pipeline.frameCount < 2 ) {
+        options.pipeline.frameCount = 2;
+    }
+
+    ids.depthFloat = profiler.stage( "fusion.depth_float" );
+    ids.processFrame = profiler.stage( "fusion.process_frame" );
+    ids.integrate = profiler.stage( "fusion.integrate" );
+    ids.pointCloud = profiler.stage( "fusion.point_cloud" );
+    ids.shade = profiler.stage( "fusion.shade" );
+    ids.latency = profiler.stage( "fusion.latency" );
+    ids.droppedFrames = profiler.counter( "fusion.dropped_frames" );
+    ids.unmatchedFrames = profiler.counter( "fusion.unmatched_frames" );
+    ids.staleFrames = profiler.counter( "fusion.stale_frames" );
+
+    for ( size_t i = 0; i < options.referenceToCamera.size(); ++i ) {
+        std::unique_ptr<Sensor> sensor( new Sensor( options.pipeline.frameCount ) );
+        sensor->referenceToCamera = RigidTransform::fromMatrix4( options.referenceToCamera[i] );
+        for ( unsigned int j = 0; j < options.pipeline.frameCount; ++j ) {
+            sensor->frames.push_back( std::unique_ptr<SensorFrame>( new SensorFrame() ) );
+            sensor->freeFrames.push( sensor->frames.back().get() );
+        }
+        sensors.push_back( std::move( sensor ) );
+    }
+
+    for ( unsigned int i = 0; i < options.pipeline.frameCount; ++i ) {
+        frames.push_back( std::unique_ptr<FusionPipelineFrame>( new FusionPipelineFrame() ) );
+        freeFrames.push( frames.back().get() );
+    }
+
+    threads.push_back( std::thread( &MultiSensorFusion::fuseStage, this ) );
+    threads.push_back( std::thread( &MultiSensorFusion::shadeStage, this ) );
+}
+
+MultiSensorFusion::~MultiSensorFusion()
+{
+    stopping = true;
+
+    for ( size_t i = 0; i < sensors.size(); ++i ) {
+        sensors[i]->freeFrames.close();
+        sensors[i]->readyFrames.close();
+    }
+    freeFrames.close();
+    shadeQueue.close();
+    presentQueue.close();
+
+    for ( size_t i = 0; i < threads.size(); ++i ) {
+        threads[i].join();
+    }
+}
+
+bool MultiSensorFusion::submit( UINT index, const NUI_DEPTH_IMAGE_PIXEL* pixels, UINT width, UINT height,
+                                LONGLONG timestamp )
+{
+    return submit( index, pixels, width, height, timestamp, nullptr, 0, 0, nullptr );
+}
+
+bool MultiSensorFusion::submit( UINT index, const NUI_DEPTH_IMAGE_PIXEL* pixels, UINT width, UINT height,
+                                LONGLONG timestamp, const BYTE* colorPixels, UINT colorWidth, UINT colorHeight,
+                                const NUI_COLOR_IMAGE_POINT* colorCoordinates )
+{
+    if ( index >= sensors.size() ) {
+        return false;
+    }
+    Sensor& sensor = *sensors[index];
+    const SensorFrame::Clock::time_point now = SensorFrame::Clock::now();
+
+    SensorFrame* frame = 0;
+    if ( stopping || !sensor.freeFrames.pop( frame, options.pipeline.dropStaleFrames ? 0 : WAIT_FOREVER ) ) {
+        // A live sensor that is ahead of the others gives up its oldest frame
+        if ( stopping || !options.pipeline.dropStaleFrames || !sensor.readyFrames.tryPop( frame ) ) {
+            dropFrame();
+            return false;
+        }
+        dropFrame();
+        if ( index == 0 ) {
+            --framesInFlight;
+        }
+    }
+
+    frame->timestamp = timestamp;
+    frame->alignedTimestamp = alignTimestamp( sensor, timestamp, now );
+    frame->submitTime = now;
+    frame->hasColor = index == 0 && colorPixels != nullptr && colorCoordinates != nullptr;
+    {
+        ScopedTimer timer( ids.depthFloat, profiler );
+        DepthToDepthFloatFrame( pixels, width, height, &frame->depthFloat, options.pipeline.minimumDepth,
+                                options.pipeline.maximumDepth, options.pipeline.mirrorDepth );
+        if ( frame->hasColor ) {
+            RegisterColorFrame( colorPixels, colorWidth, colorHeight, colorCoordinates, width, height,
+                                &frame->color, options.pipeline.mirrorDepth );
+        }
+    }
+
+    if ( index == 0 ) {
+        ++framesInFlight;
+    }
+    pushFrame( sensor.readyFrames, frame );
+    return true;
+}
+
+double MultiSensorFusion::alignTimestamp( Sensor& sensor, LONGLONG timestamp, SensorFrame::Clock::time_point now )
+{
+    if ( options.sharedClock ) {
+        return (double)timestamp;
+    }
+
+    // The frame that waited the least in the driver gives the best offset
+    double host = std::chrono::duration<double, std::milli>( now - startTime ).count();
+    double offset = host - (double)timestamp;
+    if ( !sensor.clockValid || offset < sensor.clockOffset ) {
+        sensor.clockOffset = offset;
+        sensor.clockValid = true;
+    }
+    else {
+        sensor.clockOffset += CLOCK_OFFSET_CREEP;
+    }
+    return (double)timestamp + sensor.clockOffset;
+}
+
+FusionPipelineFrame* MultiSensorFusion::receive( unsigned int timeoutMilliseconds )
+{
+    FusionPipelineFrame* frame = 0;
+    if ( stopping || !presentQueue.pop( frame, timeoutMilliseconds ) ) {
+        return 0;
+    }
+
+    // Older results are stale once a newer one is waiting
+    FusionPipelineFrame* newer = 0;
+    while ( options.pipeline.dropStaleFrames && presentQueue.tryPop( newer ) ) {
+        pushFrame( freeFrames, frame );
+        dropFrame();
+        frame = newer;
+    }
+    return frame;
+}
+
+void MultiSensorFusion::release( FusionPipelineFrame* frame )
+{
+    if ( frame != 0 ) {
+        pushFrame( freeFrames, frame );
+    }
+}
+
+void MultiSensorFusion::flush()
+{
+    while ( framesInFlight.load() != 0 && !stopping ) {
+        std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+    }
+}
+
+void MultiSensorFusion::recycle( Sensor& sensor, SensorFrame* frame )
+{
+    pushFrame( sensor.freeFrames, frame );
+}
+
+void MultiSensorFusion::dropFrame()
+{
+    ++droppedFrames;
+    profiler.add( ids.droppedFrames );
+}
+
+SensorFrame* MultiSensorFusion::popReference()
+{
+    Sensor& reference = *sensors[0];
+    SensorFrame* frame = 0;
+    if ( stopping || !reference.readyFrames.pop( frame, WAIT_FOREVER ) ) {
+        return 0;
+    }
+
+    // Skip to the newest frame when live; the other sensors follow it
+    SensorFrame* newer = 0;
+    while ( options.pipeline.dropStaleFrames && reference.readyFrames.tryPop( newer ) ) {
+        recycle( reference, frame );
+        dropFrame();
+        --framesInFlight;
+        frame = newer;
+    }
+    return frame;
+}
+
+SensorFrame* MultiSensorFusion::matchFrame( Sensor& sensor, const SensorFrame& reference )
+{
+    // A frame taken at the same time arrives about as late as the reference did
+    const double wait = options.pipeline.dropStaleFrames ? options.syncTolerance : REPLAY_MATCH_WAIT;
+    const SensorFrame::Clock::time_point deadline =
+        reference.submitTime + std::chrono::microseconds( (long long)(wait * 1000.0) );
+
+    for ( ;; ) {
+        if ( sensor.held == 0 ) {
+            SensorFrame::Clock::time_point now = SensorFrame::Clock::now();
+            unsigned int timeout = (now < deadline) ?
+                (unsigned int)std::chrono::duration_cast<std::chrono::milliseconds>( deadline - now ).count() : 0;
+            if ( !sensor.readyFrames.pop( sensor.held, timeout ) ) {
+                sensor.held = 0;
+                return 0;
+            }
+        }
+
+        double difference = sensor.held->alignedTimestamp - reference.alignedTimestamp;
+        if ( difference < -options.syncTolerance ) {
+            // Too old for this set and every later one
+            recycle( sensor, sensor.held );
+            sensor.held = 0;
+            profiler.add( ids.staleFrames );
+            continue;
+        }
+        if ( difference > options.syncTolerance ) {
+            // Belongs to a later set
+            return 0;
+        }
+
+        SensorFrame* match = sensor.held;
+        sensor.held = 0;
+        return match;
+    }
+}
+
+void MultiSensorFusion::fuseStage()
+{
+    std::vector<SensorFrame*> set( sensors.size(), 0 );
+    while ( SensorFrame* reference = popReference() ) {
+        set[0] = reference;
+        for ( size_t i = 1; i < sensors.size(); ++i ) {
+            set[i] = matchFrame( *sensors[i], *reference );
+            if ( set[i] == 0 ) {
+                profiler.add( ids.unmatchedFrames );
+            }
+        }
+
+        // Sensor 0 is tracked (or stands still), the others follow it
+        Matrix4 worldToCamera;
+        reconstruction.GetCurrentWorldToCameraTransform( &worldToCamera );
+        upkeep.frameStarted( reference->timestamp );
+        const ColorFrame* color = reference->hasColor ? &reference->color : nullptr;
+        FusionPipelineFrame::Clock::time_point start = FusionPipelineFrame::Clock::now();
+        HRESULT hr = options.trackReference ?
+            reconstruction.ProcessFrame( &reference->depthFloat, color, options.pipeline.alignIterationCount,
+                                         options.pipeline.integrationWeight, &worldToCamera ) :
+            reconstruction.IntegrateFrame( &reference->depthFloat, color, options.pipeline.integrationWeight,
+                                           &worldToCamera );
+        FusionPipelineFrame::Clock::time_point end = FusionPipelineFrame::Clock::now();
+        profiler.record( ids.processFrame, start, end );
+        upkeep.frameTracked( hr );
+
+        if ( SUCCEEDED( hr ) ) {
+            reconstruction.GetCurrentWorldToCameraTransform( &worldToCamera );
+
+            // At their offset from sensor 0, kept with its frame so loop closures move them along
+            ScopedTimer timer( ids.integrate, profiler );
+            for ( size_t i = 1; i < sensors.size(); ++i ) {
+                if ( set[i] != 0 ) {
+                    Matrix4 referenceToSensor = sensors[i]->referenceToCamera.toMatrix4();
+                    reconstruction.IntegrateRigFrame( &set[i]->depthFloat, options.pipeline.integrationWeight,
+                                                      &referenceToSensor );
+                }
+            }
+        }
+
+        for ( size_t i = 1; i < sensors.size(); ++i ) {
+            if ( set[i] != 0 ) {
+                recycle( *sensors[i], set[i] );
+            }
+        }
+
+        // The view of sensor 0 is the result of the set
+        FusionPipelineFrame* frame = 0;
+        if ( FAILED( hr ) ) {
+            // Nothing new to show
+        }
+        else if ( !freeFrames.pop( frame, options.pipeline.dropStaleFrames ? 0 : WAIT_FOREVER ) ) {
+            frame = 0;
+            dropFrame();
+        }
+        else {
+            frame->sequence = fusedSets;
+            frame->timestamp = reference->timestamp;
+            frame->submitTime = reference->submitTime;
+            frame->width = reference->depthFloat.width;
+            frame->height = reference->depthFloat.height;
+            frame->depthPixels.clear();
+            frame->hasColor = reference->hasColor;
+            frame->trackingResult = hr;
+            frame->tracking = reconstruction.trackingStatistics();
+            frame->trackingTime = std::chrono::duration<double, std::milli>( end - start ).count();
+            frame->worldToCamera = worldToCamera;
+            {
+                ScopedTimer timer( ids.pointCloud, profiler );
+                frame->sizePointCloud( options.pipeline.pointCloudLevel );
+                if ( frame->hasColor ) {
+                    reconstruction.CalculatePointCloud( &frame->pointCloud, &frame->pointCloudColors,
+                                                        &frame->worldToCamera );
+                }
+                else {
+                    reconstruction.CalculatePointCloud( &frame->pointCloud, &frame->worldToCamera );
+                }
+            }
+        }
+        ++fusedSets;
+        recycle( *sensors[0], reference );
+
+        if ( frame != 0 ) {
+            pushFrame( shadeQueue, frame );
+        }
+        else {
+            --framesInFlight;
+        }
+
+        if ( SUCCEEDED( hr ) ) {
+            upkeep.frameIntegrated();
+        }
+    }
+
+    upkeep.finish();
+}
+
+void MultiSensorFusion::shadeStage()
+{
+    FusionPipelineFrame* frame = 0;
+    while ( !stopping && shadeQueue.pop( frame, WAIT_FOREVER ) ) {
+        if ( shade ) {
+            ScopedTimer timer( ids.shade, profiler );
+            shade( *frame );
+        }
+
+        FusionPipelineFrame::Clock::time_point end = FusionPipelineFrame::Clock::now();
+        frame->latency = std::chrono::duration<double, std::milli>( end - frame->submitTime ).count();
+        profiler.record( ids.latency, frame->submitTime, end );
+        --framesInFlight;
+        pushFrame( presentQueue, frame );
+    }
+}
+
+std::vector<Matrix4> MultiSensorFusion::loadExtrinsics( const std::string& path, UINT sensorCount )
+{
+    std::vector<Matrix4> referenceToCamera( sensorCount, RigidTransform().toMatrix4() );
+
+    std::ifstream file( path.c_str() );
+    if ( !file ) {
+        throw std::runtime_error( "MultiSensorFusion: cannot open " + path );
+    }
+
+    std::string line;
+    for ( int lineNumber = 1; std::getline( file, line ); ++lineNumber ) {
+        std::istringstream fields( line );
+        UINT index = 0;
+        if ( line.empty() || line[0] == '#' || !(fields >> index) ) {
+            continue;
+        }
+
+        RigidTransform cameraToReference;
+        for ( int i = 0; i < 9; ++i ) {
+            fields >> cameraToReference.r[i / 3][i % 3];
+        }
+        fields >> cameraToReference.t.x >> cameraToReference.t.y >> cameraToReference.t.z;
+        if ( !fields || index == 0 ) {
+            std::ostringstream message;
+            message << "MultiSensorFusion: bad extrinsics in " << path << " line " << lineNumber;
+            throw std::runtime_error( message.str() );
+        }
+        if ( index < sensorCount ) {
+            referenceToCamera[index] = cameraToReference.inverse().toMatrix4();
+        }
+    }
+    return referenceToCamera;
+}
+
+}
@@ -0,0 +1,250 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../common/FrameQueue.h"
+#include "../common/Profiler.h"
+#include "CpuReconstruction.h"
+#include "FusionPipeline.h"
+#include "MeshExtractor.h"
+#include "ReconstructionUpkeep.h"
+
+namespace kinectbook {
+
+/// <summary>
+/// Converted depth frame of one sensor waiting to be fused
+/// </summary>
+struct SensorFrame
+{
+    typedef std::chrono::steady_clock Clock;
+
+    LONGLONG timestamp;                 // liTimeStamp, on the clock of the sensor
+    double alignedTimestamp;            // milliseconds on the clock shared by all sensors
+    Clock::time_point submitTime;
+
+    DepthFloatFrame depthFloat;
+
+    bool hasColor;                      // submitted with color, sensor 0 only
+    ColorFrame color;                   // registered to depthFloat
+};
+
+/// <summary>
+/// Settings of a MultiSensorFusion
+/// </summary>
+struct MultiSensorFusionOptions
+{
+    /// <summary>
+    /// Where the sensors are: the world to camera transform of every sensor
+    /// while sensor 0 is at the origin, identity for sensor 0
+    /// </summary>
+    /// <remarks>One per sensor; see MultiSensorFusion::loadExtrinsics()</remarks>
+    std::vector<Matrix4> referenceToCamera;
+
+    /// <summary>
+    /// Frames of the other sensors at most this many milliseconds away from
+    /// a frame of sensor 0 are fused with it
+    /// </summary>
+    /// <remarks>Half a frame at 30 fps, so a sensor adds at most one frame to a set</remarks>
+    double syncTolerance;
+
+    /// <summary>
+    /// true: the timestamps of all sensors are on one clock already (recordings
+    /// made together, synthetic data). false: every sensor counts from its own
+    /// start and is mapped to the clock of the host.
+    /// </summary>
+    bool sharedClock;
+
+    /// <summary>
+    /// true: sensor 0 is tracked and the rig moves with it.
+    /// false: the rig stands still at the initial pose of the reconstruction.
+    /// </summary>
+    bool trackReference;
+
+    /// <summary>
+    /// Everything else as for a FusionPipeline; frameCount is per sensor
+    /// </summary>
+    FusionPipelineOptions pipeline;
+
+    MultiSensorFusionOptions()
+        : syncTolerance( 16.0 )
+        , sharedClock( false )
+        , trackReference( true )
+    {
+    }
+};
+
+/// <summary>
+/// Several Kinects of a rig integrated into one volume
+/// </summary>
+/// <remarks>
+///   capture thread per sensor (caller, submit, depth float conversion) ->
+///   matching by time, tracking of sensor 0 and integration of every sensor
+///   -> shading (callback) -> presentation (caller, receive)
+///
+/// Every sensor converts its frames on its own capture thread, so the
+/// conversion scales with the sensors. The volume is only touched by the
+/// fusion stage; its integration and raycasts run on the thread pool.
+///
+/// A frame of sensor 0 forms a set with the frame of every other sensor
+/// that is within the tolerance of it; a sensor without one is left out of
+/// the set and counted as "fusion.unmatched_frames". Sensors that do not
+/// share a clock are mapped to the clock of the host by the smallest delay
+/// between their timestamp and submit() seen so far, which is the frame
+/// that waited the least in the driver. The result of a set is the view of
+/// sensor 0, handed out like the frames of a FusionPipeline. With loop
+/// closure the frames of the other sensors go into the reconstruction by
+/// IntegrateRigFrame(), so a closed loop moves the whole set. Only the
+/// color of sensor 0 is fused; the other sensors add their depth alone.
+/// </remarks>
+class MultiSensorFusion
+{
+public:
+
+    typedef FusionPipeline::ShadeFunction ShadeFunction;
+
+    /// <param name="shade">Called on the shade stage for every set; may be empty</param>
+    MultiSensorFusion( CpuReconstruction& reconstruction, const MultiSensorFusionOptions& options,
+                       const ShadeFunction& shade );
+    ~MultiSensorFusion();
+
+    UINT sensorCount() const { return (UINT)sensors.size(); }
+
+    /// <summary>
+    /// Convert a depth frame of one sensor and queue it for fusion
+    /// </summary>
+    /// <remarks>Called by the capture thread of the sensor; one thread per sensor</remarks>
+    /// <returns>false when the frame was dropped</returns>
+    bool submit( UINT sensor, const NUI_DEPTH_IMAGE_PIXEL* pixels, UINT width, UINT height, LONGLONG timestamp );
+
+    /// <summary>
+    /// submit() with the color image the depth frame maps to, registered on the calling thread
+    /// </summary>
+    /// <remarks>The color is fused for sensor 0 and ignored for the others</remarks>
+    /// <param name="colorPixels">BGRX, 4 bytes per pixel</param>
+    /// <param name="colorCoordinates">Color pixel of every depth pixel (MapDepthFrameToColorFrame)</param>
+    bool submit( UINT sensor, const NUI_DEPTH_IMAGE_PIXEL* pixels, UINT width, UINT height, LONGLONG timestamp,
+                 const BYTE* colorPixels, UINT colorWidth, UINT colorHeight,
+                 const NUI_COLOR_IMAGE_POINT* colorCoordinates );
+
+    /// <summary>
+    /// Newest finished set; hand it back with release() when done with it
+    /// </summary>
+    /// <param name="timeoutMilliseconds">0 to poll</param>
+    /// <returns>nullptr when nothing finished in time</returns>
+    FusionPipelineFrame* receive( unsigned int timeoutMilliseconds );
+
+    void release( FusionPipelineFrame* frame );
+
+    /// <summary>
+    /// Block until every frame of sensor 0 submitted so far has been fused
+    /// </summary>
+    void flush();
+
+    /// <summary>
+    /// Frames dropped by submit() or skipped by a stage
+    /// </summary>
+    unsigned int droppedFrameCount() const { return droppedFrames.load(); }
+
+    /// <summary>
+    /// Call read with the mesh while the fusion stage does not update it
+    /// </summary>
+    /// <returns>false when meshUpdateInterval is 0</returns>
+    bool readMesh( const std::function<void ( const MeshExtractor& mesh )>& read ) { return upkeep.readMesh( read ); }
+
+    /// <summary>
+    /// Take a snapshot after the next fused set (needs pipeline.snapshotPath)
+    /// </summary>
+    void requestSnapshot() { upkeep.requestSnapshot(); }
+
+    /// <summary>
+    /// referenceToCamera of a rig from a calibration file
+    /// </summary>
+    /// <remarks>
+    /// One line per sensor other than sensor 0: its index, then its pose in
+    /// the camera space of sensor 0 as a rotation matrix row by row and a
+    /// translation in meters, 13 numbers. Lines starting with # are comments;
+    /// sensors without a line stay at the pose of sensor 0.
+    /// </remarks>
+    static std::vector<Matrix4> loadExtrinsics( const std::string& path, UINT sensorCount );
+
+private:
+
+    MultiSensorFusion( const MultiSensorFusion& );
+    MultiSensorFusion& operator=( const MultiSensorFusion& );
+
+    typedef FrameQueue<SensorFrame*> SensorQueue;
+    typedef FrameQueue<FusionPipelineFrame*> Queue;
+
+    struct Sensor
+    {
+        std::vector<std::unique_ptr<SensorFrame> > frames;
+        SensorQueue freeFrames;
+        SensorQueue readyFrames;
+        RigidTransform referenceToCamera;
+
+        // Host minus sensor milliseconds, used by the capture thread only
+        double clockOffset;
+        bool clockValid;
+
+        // Fusion stage only: next frame, too new for the last set
+        SensorFrame* held;
+
+        explicit Sensor( size_t capacity )
+            : freeFrames( capacity ), readyFrames( capacity ), clockOffset( 0 ), clockValid( false ), held( 0 ) {}
+    };
+
+    double alignTimestamp( Sensor& sensor, LONGLONG timestamp, SensorFrame::Clock::time_point now );
+    SensorFrame* popReference();
+    SensorFrame* matchFrame( Sensor& sensor, const SensorFrame& reference );
+    void recycle( Sensor& sensor, SensorFrame* frame );
+    void fuseStage();
+    void shadeStage();
+    void dropFrame();
+
+    CpuReconstruction& reconstruction;
+    MultiSensorFusionOptions options;
+    ShadeFunction shade;
+    const SensorFrame::Clock::time_point startTime;
+
+    std::vector<std::unique_ptr<Sensor> > sensors;
+
+    // Results, as in FusionPipeline
+    std::vector<std::unique_ptr<FusionPipelineFrame> > frames;
+    Queue freeFrames;
+    Queue shadeQueue;
+    Queue presentQueue;
+
+    std::atomic<bool> stopping;
+    std::atomic<unsigned int> droppedFrames;
+    std::atomic<unsigned int> framesInFlight;   // of sensor 0
+    unsigned int fusedSets;
+
+    // Ids in the profiler
+    Profiler& profiler;
+    struct ProfilerIds
+    {
+        unsigned int depthFloat;
+        unsigned int processFrame;
+        unsigned int integrate;
+        unsigned int pointCloud;
+        unsigned int shade;
+        unsigned int latency;
+        unsigned int droppedFrames;
+        unsigned int unmatchedFrames;
+        unsigned int staleFrames;
+    } ids;
+
+    // Used by the fusion stage, the only thread touching the volume; the poses are those of sensor 0
+    ReconstructionUpkeep upkeep;
+
+    std::vector<std::thread> threads;
+};
+
+}
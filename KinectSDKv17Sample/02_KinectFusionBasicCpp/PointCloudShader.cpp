@@ -0,0 +1,299 @@
+#include "PointCloudShader.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "../common/SimdConfig.h"
+
+namespace kinectbook {
+
+namespace {
+
+// Pixels of a tile; 64x16 pixels are 24kB of point cloud, which stays in the cache
+const int SHADE_TILE_WIDTH = 64;
+const int SHADE_TILE_HEIGHT = 16;
+
+// Pixels without a point, opaque black
+const UINT BACKGROUND_PIXEL = 0xFF000000;
+
+// Scale of an 8 bit color channel to 0..1
+const float INV_CHANNEL_MAX = 1.0f / 255.0f;
+
+// Everything a pixel needs, worked out once per frame
+struct Shader
+{
+    RigidTransform worldToCamera;
+    PointCloudShading shading;
+    float ambient, diffuse, specular;
+    unsigned int specularPower;
+    float minimumDepth, inverseDepthRange;
+
+    Shader( const Matrix4& worldToCameraTransform, const PointCloudShadingParameters& p )
+        : worldToCamera( RigidTransform::fromMatrix4( worldToCameraTransform ) )
+        , shading( p.shading )
+        , ambient( p.ambient )
+        , diffuse( p.diffuse )
+        , specular( p.specular )
+        , specularPower( p.specularPower )
+        , minimumDepth( p.minimumDepth )
+        , inverseDepthRange( 1.0f / (p.maximumDepth - p.minimumDepth) )
+    {
+    }
+};
+
+HRESULT checkShadeArguments( const PointCloudFrame* pointCloudFrame, const ColorFrame* colorFrame,
+                             const Matrix4* worldToCameraTransform, const PointCloudShadingParameters& parameters,
+                             const BYTE* bgraPixels, UINT pitch )
+{
+    if ( pointCloudFrame == 0 || worldToCameraTransform == 0 || bgraPixels == 0 ) {
+        return E_POINTER;
+    }
+    if ( pointCloudFrame->width <= 0 || pointCloudFrame->height <= 0 || pitch < (UINT)pointCloudFrame->width * 4 ||
+         parameters.maximumDepth <= parameters.minimumDepth ) {
+        return E_INVALIDARG;
+    }
+    if ( colorFrame != 0 && (colorFrame->width != pointCloudFrame->width || colorFrame->height != pointCloudFrame->height) ) {
+        return E_INVALIDARG;
+    }
+    return S_OK;
+}
+
+inline float saturate( float x )
+{
+    return std::min( std::max( x, 0.0f ), 1.0f );
+}
+
+// x^n by squaring, the same steps as the SIMD kernel
+inline float power( float x, unsigned int n )
+{
+    float result = 1.0f;
+    for ( ; n != 0; n >>= 1 ) {
+        if ( n & 1 ) {
+            result *= x;
+        }
+        x *= x;
+    }
+    return result;
+}
+
+inline UINT packPixel( float r, float g, float b )
+{
+    return BACKGROUND_PIXEL | ((UINT)(r * 255.0f + 0.5f) << 16) | ((UINT)(g * 255.0f + 0.5f) << 8) | (UINT)(b * 255.0f + 0.5f);
+}
+
+// color: fused color of the point, alpha 0 for none
+UINT shadePixel( const float* p, UINT color, const Shader& s )
+{
+    if ( !PointCloudFrame::isValid( p ) ) {
+        return BACKGROUND_PIXEL;
+    }
+
+    const Float3 point = s.worldToCamera * Float3( p[0], p[1], p[2] );
+    const Float3 normal = s.worldToCamera.rotate( Float3( p[3], p[4], p[5] ) );
+    if ( s.shading == POINT_CLOUD_SHADING_NORMALS ) {
+        return packPixel( saturate( (1.0f + normal.x) * 0.5f ), saturate( (1.0f + normal.y) * 0.5f ),
+                          saturate( (1.0f - normal.z) * 0.5f ) );
+    }
+    if ( s.shading == POINT_CLOUD_SHADING_DEPTH ) {
+        // Three overlapping ramps: blue, green and red peak at 1/4, 1/2 and 3/4 of the range
+        float t = saturate( (point.z - s.minimumDepth) * s.inverseDepthRange ) * 4.0f;
+        return packPixel( saturate( 1.5f - std::fabs( t - 3.0f ) ), saturate( 1.5f - std::fabs( t - 2.0f ) ),
+                          saturate( 1.5f - std::fabs( t - 1.0f ) ) );
+    }
+
+    // The light and the viewer are both at the camera, so the reflected
+    // ray makes twice the angle of the normal with the view direction
+    float cosine = std::max( -dot( normal, point ) * (1.0f / std::sqrt( dot( point, point ) )), 0.0f );
+    float reflection = std::max( 2.0f * cosine * cosine - 1.0f, 0.0f );
+    float intensity = std::min( s.ambient + s.diffuse * cosine + s.specular * power( reflection, s.specularPower ), 1.0f );
+    if ( s.shading == POINT_CLOUD_SHADING_COLOR && ColorFrame::isValid( color ) ) {
+        return packPixel( intensity * (float)((color >> 16) & 0xFF) * INV_CHANNEL_MAX,
+                          intensity * (float)((color >> 8) & 0xFF) * INV_CHANNEL_MAX,
+                          intensity * (float)(color & 0xFF) * INV_CHANNEL_MAX );
+    }
+    return packPixel( intensity, intensity, intensity );
+}
+
+// colors: one per point, nullptr for none
+void shadeRowReference( const float* points, const UINT* colors, UINT* pixels, int width, const Shader& s )
+{
+    for ( int x = 0; x < width; ++x ) {
+        pixels[x] = shadePixel( points + (size_t)x * PointCloudFrame::FLOATS_PER_PIXEL, (colors != 0) ? colors[x] : 0, s );
+    }
+}
+
+#ifdef KB_SSE2
+KB_FORCEINLINE __m128 saturate4( __m128 x )
+{
+    return _mm_min_ps( _mm_max_ps( x, _mm_setzero_ps() ), _mm_set1_ps( 1.0f ) );
+}
+
+KB_FORCEINLINE __m128 abs4( __m128 x )
+{
+    return _mm_andnot_ps( _mm_set1_ps( -0.0f ), x );
+}
+
+KB_FORCEINLINE __m128i pack4( __m128 r, __m128 g, __m128 b )
+{
+    const __m128 scale = _mm_set1_ps( 255.0f );
+    const __m128 half = _mm_set1_ps( 0.5f );
+    __m128i ri = _mm_cvttps_epi32( _mm_add_ps( _mm_mul_ps( r, scale ), half ) );
+    __m128i gi = _mm_cvttps_epi32( _mm_add_ps( _mm_mul_ps( g, scale ), half ) );
+    __m128i bi = _mm_cvttps_epi32( _mm_add_ps( _mm_mul_ps( b, scale ), half ) );
+    return _mm_or_si128( _mm_or_si128( _mm_set1_epi32( (int)BACKGROUND_PIXEL ), _mm_slli_epi32( ri, 16 ) ),
+                         _mm_or_si128( _mm_slli_epi32( gi, 8 ), bi ) );
+}
+#endif
+
+// Same results as shadeRowReference, 4 pixels at a time
+void shadeRow( const float* points, const UINT* colors, UINT* pixels, int width, const Shader& s )
+{
+    int x = 0;
+
+#ifdef KB_SSE2
+    const RigidTransform& m = s.worldToCamera;
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps( 1.0f );
+    const __m128 half = _mm_set1_ps( 0.5f );
+    const __m128i background = _mm_set1_epi32( (int)BACKGROUND_PIXEL );
+
+    for ( ; x + 4 <= width; x += 4 ) {
+        // 4 pixels of 6 floats, x y z nx ny nz each, to one register per component
+        const float* p = points + (size_t)x * PointCloudFrame::FLOATS_PER_PIXEL;
+        __m128 a = _mm_loadu_ps( p ), b = _mm_loadu_ps( p + 4 ), c = _mm_loadu_ps( p + 8 );
+        __m128 d = _mm_loadu_ps( p + 12 ), e = _mm_loadu_ps( p + 16 ), f = _mm_loadu_ps( p + 20 );
+        __m128 xy01 = _mm_shuffle_ps( a, b, _MM_SHUFFLE( 3, 2, 1, 0 ) ), xy23 = _mm_shuffle_ps( d, e, _MM_SHUFFLE( 3, 2, 1, 0 ) );
+        __m128 zn01 = _mm_shuffle_ps( a, c, _MM_SHUFFLE( 1, 0, 3, 2 ) ), zn23 = _mm_shuffle_ps( d, f, _MM_SHUFFLE( 1, 0, 3, 2 ) );
+        __m128 nn01 = _mm_shuffle_ps( b, c, _MM_SHUFFLE( 3, 2, 1, 0 ) ), nn23 = _mm_shuffle_ps( e, f, _MM_SHUFFLE( 3, 2, 1, 0 ) );
+        __m128 px = _mm_shuffle_ps( xy01, xy23, _MM_SHUFFLE( 2, 0, 2, 0 ) ), py = _mm_shuffle_ps( xy01, xy23, _MM_SHUFFLE( 3, 1, 3, 1 ) );
+        __m128 pz = _mm_shuffle_ps( zn01, zn23, _MM_SHUFFLE( 2, 0, 2, 0 ) ), nx = _mm_shuffle_ps( zn01, zn23, _MM_SHUFFLE( 3, 1, 3, 1 ) );
+        __m128 ny = _mm_shuffle_ps( nn01, nn23, _MM_SHUFFLE( 2, 0, 2, 0 ) ), nz = _mm_shuffle_ps( nn01, nn23, _MM_SHUFFLE( 3, 1, 3, 1 ) );
+
+        __m128 valid = _mm_or_ps( _mm_or_ps( _mm_cmpneq_ps( px, zero ), _mm_cmpneq_ps( py, zero ) ), _mm_cmpneq_ps( pz, zero ) );
+        if ( _mm_movemask_ps( valid ) == 0 ) {
+            _mm_storeu_si128( (__m128i*)(pixels + x), background );
+            continue;
+        }
+
+        // Camera space, in the order of RigidTransform::operator * and rotate()
+        __m128 cz = _mm_add_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( _mm_set1_ps( m.r[2][0] ), px ), _mm_mul_ps( _mm_set1_ps( m.r[2][1] ), py ) ),
+                                            _mm_mul_ps( _mm_set1_ps( m.r[2][2] ), pz ) ), _mm_set1_ps( m.t.z ) );
+        __m128 mz = _mm_add_ps( _mm_add_ps( _mm_mul_ps( _mm_set1_ps( m.r[2][0] ), nx ), _mm_mul_ps( _mm_set1_ps( m.r[2][1] ), ny ) ),
+                                _mm_mul_ps( _mm_set1_ps( m.r[2][2] ), nz ) );
+        __m128i color;
+        if ( s.shading == POINT_CLOUD_SHADING_DEPTH ) {
+            __m128 t = _mm_mul_ps( saturate4( _mm_mul_ps( _mm_sub_ps( cz, _mm_set1_ps( s.minimumDepth ) ), _mm_set1_ps( s.inverseDepthRange ) ) ),
+                                   _mm_set1_ps( 4.0f ) );
+            const __m128 top = _mm_set1_ps( 1.5f );
+            color = pack4( saturate4( _mm_sub_ps( top, abs4( _mm_sub_ps( t, _mm_set1_ps( 3.0f ) ) ) ) ),
+                           saturate4( _mm_sub_ps( top, abs4( _mm_sub_ps( t, _mm_set1_ps( 2.0f ) ) ) ) ),
+                           saturate4( _mm_sub_ps( top, abs4( _mm_sub_ps( t, one ) ) ) ) );
+        }
+        else {
+            __m128 mx = _mm_add_ps( _mm_add_ps( _mm_mul_ps( _mm_set1_ps( m.r[0][0] ), nx ), _mm_mul_ps( _mm_set1_ps( m.r[0][1] ), ny ) ),
+                                    _mm_mul_ps( _mm_set1_ps( m.r[0][2] ), nz ) );
+            __m128 my = _mm_add_ps( _mm_add_ps( _mm_mul_ps( _mm_set1_ps( m.r[1][0] ), nx ), _mm_mul_ps( _mm_set1_ps( m.r[1][1] ), ny ) ),
+                                    _mm_mul_ps( _mm_set1_ps( m.r[1][2] ), nz ) );
+            if ( s.shading == POINT_CLOUD_SHADING_NORMALS ) {
+                color = pack4( saturate4( _mm_mul_ps( _mm_add_ps( one, mx ), half ) ), saturate4( _mm_mul_ps( _mm_add_ps( one, my ), half ) ),
+                               saturate4( _mm_mul_ps( _mm_sub_ps( one, mz ), half ) ) );
+            }
+            else {
+                __m128 cx = _mm_add_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( _mm_set1_ps( m.r[0][0] ), px ), _mm_mul_ps( _mm_set1_ps( m.r[0][1] ), py ) ),
+                                                    _mm_mul_ps( _mm_set1_ps( m.r[0][2] ), pz ) ), _mm_set1_ps( m.t.x ) );
+                __m128 cy = _mm_add_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( _mm_set1_ps( m.r[1][0] ), px ), _mm_mul_ps( _mm_set1_ps( m.r[1][1] ), py ) ),
+                                                    _mm_mul_ps( _mm_set1_ps( m.r[1][2] ), pz ) ), _mm_set1_ps( m.t.y ) );
+                __m128 normalDotPoint = _mm_add_ps( _mm_add_ps( _mm_mul_ps( mx, cx ), _mm_mul_ps( my, cy ) ), _mm_mul_ps( mz, cz ) );
+                __m128 pointDotPoint = _mm_add_ps( _mm_add_ps( _mm_mul_ps( cx, cx ), _mm_mul_ps( cy, cy ) ), _mm_mul_ps( cz, cz ) );
+                __m128 cosine = _mm_max_ps( _mm_mul_ps( _mm_sub_ps( zero, normalDotPoint ), _mm_div_ps( one, _mm_sqrt_ps( pointDotPoint ) ) ), zero );
+                __m128 reflection = _mm_max_ps( _mm_sub_ps( _mm_mul_ps( _mm_mul_ps( _mm_set1_ps( 2.0f ), cosine ), cosine ), one ), zero );
+
+                __m128 highlight = one;
+                for ( unsigned int n = s.specularPower; n != 0; n >>= 1 ) {
+                    if ( n & 1 ) {
+                        highlight = _mm_mul_ps( highlight, reflection );
+                    }
+                    reflection = _mm_mul_ps( reflection, reflection );
+                }
+                __m128 intensity = _mm_min_ps( _mm_add_ps( _mm_add_ps( _mm_set1_ps( s.ambient ), _mm_mul_ps( _mm_set1_ps( s.diffuse ), cosine ) ),
+                                                           _mm_mul_ps( _mm_set1_ps( s.specular ), highlight ) ), one );
+                if ( s.shading == POINT_CLOUD_SHADING_COLOR && colors != 0 ) {
+                    // Points without a color keep the gray intensity
+                    __m128i fused = _mm_loadu_si128( (const __m128i*)(colors + x) );
+                    __m128i hasColor = _mm_cmpeq_epi32( _mm_cmpeq_epi32( _mm_srli_epi32( fused, 24 ), _mm_setzero_si128() ),
+                                                        _mm_setzero_si128() );
+                    const __m128i channelMask = _mm_set1_epi32( 0xFF );
+                    __m128 red = _mm_mul_ps( _mm_mul_ps( intensity, _mm_cvtepi32_ps( _mm_and_si128( _mm_srli_epi32( fused, 16 ), channelMask ) ) ),
+                                             _mm_set1_ps( INV_CHANNEL_MAX ) );
+                    __m128 green = _mm_mul_ps( _mm_mul_ps( intensity, _mm_cvtepi32_ps( _mm_and_si128( _mm_srli_epi32( fused, 8 ), channelMask ) ) ),
+                                               _mm_set1_ps( INV_CHANNEL_MAX ) );
+                    __m128 blue = _mm_mul_ps( _mm_mul_ps( intensity, _mm_cvtepi32_ps( _mm_and_si128( fused, channelMask ) ) ),
+                                              _mm_set1_ps( INV_CHANNEL_MAX ) );
+                    __m128 take = _mm_castsi128_ps( hasColor );
+                    color = pack4( _mm_or_ps( _mm_and_ps( take, red ), _mm_andnot_ps( take, intensity ) ),
+                                   _mm_or_ps( _mm_and_ps( take, green ), _mm_andnot_ps( take, intensity ) ),
+                                   _mm_or_ps( _mm_and_ps( take, blue ), _mm_andnot_ps( take, intensity ) ) );
+                }
+                else {
+                    color = pack4( intensity, intensity, intensity );
+                }
+            }
+        }
+
+        __m128i keep = _mm_castps_si128( valid );
+        _mm_storeu_si128( (__m128i*)(pixels + x), _mm_or_si128( _mm_and_si128( keep, color ), _mm_andnot_si128( keep, background ) ) );
+    }
+#endif
+
+    shadeRowReference( points + (size_t)x * PointCloudFrame::FLOATS_PER_PIXEL, (colors != 0) ? colors + x : 0,
+                       pixels + x, width - x, s );
+}
+
+typedef void (*ShadeRowFunction)( const float* points, const UINT* colors, UINT* pixels, int width, const Shader& s );
+
+HRESULT shadeTiles( const PointCloudFrame* pointCloudFrame, const ColorFrame* colorFrame,
+                    const Matrix4* worldToCameraTransform, const PointCloudShadingParameters& parameters,
+                    BYTE* bgraPixels, UINT pitch, ThreadPool& pool, ShadeRowFunction shadeRowFunction )
+{
+    HRESULT hr = checkShadeArguments( pointCloudFrame, colorFrame, worldToCameraTransform, parameters, bgraPixels, pitch );
+    if ( FAILED( hr ) ) {
+        return hr;
+    }
+
+    const Shader shader( *worldToCameraTransform, parameters );
+    const int width = pointCloudFrame->width, height = pointCloudFrame->height;
+    const int tilesX = (width + SHADE_TILE_WIDTH - 1) / SHADE_TILE_WIDTH;
+    const int tilesY = (height + SHADE_TILE_HEIGHT - 1) / SHADE_TILE_HEIGHT;
+    pool.parallelFor( 0, tilesX * tilesY, [&]( int begin, int end ) {
+        for ( int tile = begin; tile < end; ++tile ) {
+            int x0 = (tile % tilesX) * SHADE_TILE_WIDTH, y0 = (tile / tilesX) * SHADE_TILE_HEIGHT;
+            int tileWidth = std::min( SHADE_TILE_WIDTH, width - x0 ), y1 = std::min( y0 + SHADE_TILE_HEIGHT, height );
+            for ( int y = y0; y < y1; ++y ) {
+                const UINT* colors = (colorFrame != 0) ? colorFrame->row( y ) + x0 : 0;
+                shadeRowFunction( pointCloudFrame->pixel( x0, y ), colors, (UINT*)(bgraPixels + (size_t)y * pitch) + x0,
+                                  tileWidth, shader );
+            }
+        }
+    }, 4 );
+
+    return S_OK;
+}
+
+}
+
+HRESULT ShadePointCloud( const PointCloudFrame* pointCloudFrame, const ColorFrame* colorFrame,
+                         const Matrix4* worldToCameraTransform, const PointCloudShadingParameters& parameters,
+                         BYTE* bgraPixels, UINT pitch, ThreadPool& pool )
+{
+    return shadeTiles( pointCloudFrame, colorFrame, worldToCameraTransform, parameters, bgraPixels, pitch, pool, shadeRow );
+}
+
+HRESULT ShadePointCloudReference( const PointCloudFrame* pointCloudFrame, const ColorFrame* colorFrame,
+                                  const Matrix4* worldToCameraTransform, const PointCloudShadingParameters& parameters,
+                                  BYTE* bgraPixels, UINT pitch, ThreadPool& pool )
+{
+    return shadeTiles( pointCloudFrame, colorFrame, worldToCameraTransform, parameters, bgraPixels, pitch, pool,
+                       shadeRowReference );
+}
+
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "../common/ThreadPool.h"
+#include "FusionTypes.h"
+
+namespace kinectbook {
+
+/// <summary>
+/// What ShadePointCloud() draws of a point
+/// </summary>
+enum PointCloudShading
+{
+    POINT_CLOUD_SHADING_SURFACE,    // Phong shading with the light at the camera, gray
+    POINT_CLOUD_SHADING_NORMALS,    // normal in camera space: x red, y green, towards the camera blue
+    POINT_CLOUD_SHADING_DEPTH,      // distance along the view axis: near blue, green, far red
+    POINT_CLOUD_SHADING_COLOR,      // surface shading of the fused color, gray where there is none
+};
+
+/// <summary>
+/// Settings of ShadePointCloud()
+/// </summary>
+struct PointCloudShadingParameters
+{
+    PointCloudShading shading;
+
+    // Surface and color: ambient + diffuse * cos(a) + specular * cos(2a)^specularPower,
+    // a the angle between the normal and the direction to the camera
+    FLOAT ambient;
+    FLOAT diffuse;
+    FLOAT specular;
+    UINT specularPower;
+
+    // Depth: the range the colors are spread over (meters)
+    FLOAT minimumDepth;
+    FLOAT maximumDepth;
+
+    PointCloudShadingParameters()
+        : shading( POINT_CLOUD_SHADING_SURFACE )
+        , ambient( 0.15f )
+        , diffuse( 0.7f )
+        , specular( 0.25f )
+        , specularPower( 16 )
+        , minimumDepth( NUI_FUSION_DEFAULT_MINIMUM_DEPTH )
+        , maximumDepth( 4.0f )
+    {
+    }
+};
+
+/// <summary>
+/// Draw a point cloud (world space points and normals) as BGRA pixels
+/// </summary>
+/// <remarks>
+/// Takes the place of NuiFusionShadePointCloud for display and writes
+/// straight into the caller's image, e.g. the back buffer of the
+/// presentation. Tiles of the image are shaded in parallel, 4 pixels at
+/// a time with SSE2; groups without a valid point only store the
+/// background, opaque black.
+/// </remarks>
+/// <param name="colorFrame">
+/// Color of every point (CalculatePointCloud) for POINT_CLOUD_SHADING_COLOR, the size of
+/// pointCloudFrame; nullptr shades every point gray
+/// </param>
+/// <param name="bgraPixels">pointCloudFrame->width x height pixels, 4 bytes each</param>
+/// <param name="pitch">Bytes from one row of bgraPixels to the next</param>
+HRESULT ShadePointCloud( const PointCloudFrame* pointCloudFrame, const ColorFrame* colorFrame,
+                         const Matrix4* worldToCameraTransform, const PointCloudShadingParameters& parameters,
+                         BYTE* bgraPixels, UINT pitch, ThreadPool& pool = ThreadPool::shared() );
+
+/// <summary>
+/// Scalar ShadePointCloud, the reference the SIMD kernel is checked against
+/// </summary>
+HRESULT ShadePointCloudReference( const PointCloudFrame* pointCloudFrame, const ColorFrame* colorFrame,
+                                  const Matrix4* worldToCameraTransform, const PointCloudShadingParameters& parameters,
+                                  BYTE* bgraPixels, UINT pitch, ThreadPool& pool = ThreadPool::shared() );
+
+}
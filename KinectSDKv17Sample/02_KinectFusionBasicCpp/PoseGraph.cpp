@@ -0,0 +1,394 @@
+#include "PoseGraph.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace kinectbook {
+
+namespace {
+
+// Unknowns per keyframe: rotation and translation of its twist
+const int POSE_DOF = 6;
+
+// Levenberg damping added to the diagonal, relative to it, so keyframes
+// the edges barely constrain still get a solvable system
+const double DIAGONAL_DAMPING = 1e-6;
+
+// Updates below this (radians, meters) end the iterations
+const double MIN_UPDATE = 1e-7;
+
+// Rotation vector (axis * angle) of a rotation matrix
+void rotationVector( const RigidTransform& m, double w[3] )
+{
+    const double angle = m.angle();
+    const double a[3] = { m.r[2][1] - m.r[1][2], m.r[0][2] - m.r[2][0], m.r[1][0] - m.r[0][1] };
+    const double s = std::sin( angle );
+    const double scale = (s > 1e-6) ? angle / (2 * s) : 0.5;
+    for ( int i = 0; i < 3; ++i ) {
+        w[i] = a[i] * scale;
+    }
+}
+
+// Error of an edge: rotation vector and translation of relative^-1 * to * from^-1, identity when they agree
+RigidTransform edgeError( const PoseGraph::Edge& e, const std::vector<RigidTransform>& keyframes )
+{
+    return e.relative.inverse() * keyframes[e.to] * keyframes[e.from].inverse();
+}
+
+void residual( const RigidTransform& error, double r[6] )
+{
+    rotationVector( error, r );
+    r[3] = error.t.x;
+    r[4] = error.t.y;
+    r[5] = error.t.z;
+}
+
+// Adjoint of m: carries a twist (w, v) applied before m to the one applied after it
+void adjoint( const RigidTransform& m, double a[6][6] )
+{
+    const double t[3] = { m.t.x, m.t.y, m.t.z };
+    for ( int i = 0; i < 6; ++i ) {
+        std::fill( a[i], a[i] + 6, 0.0 );
+    }
+    for ( int i = 0; i < 3; ++i ) {
+        for ( int j = 0; j < 3; ++j ) {
+            a[i][j] = m.r[i][j];
+            a[i + 3][j + 3] = m.r[i][j];
+        }
+    }
+    // [t]x R
+    for ( int j = 0; j < 3; ++j ) {
+        a[3][j] = t[1] * m.r[2][j] - t[2] * m.r[1][j];
+        a[4][j] = t[2] * m.r[0][j] - t[0] * m.r[2][j];
+        a[5][j] = t[0] * m.r[1][j] - t[1] * m.r[0][j];
+    }
+}
+
+// Unit quaternion (x, y, z, w) of a rotation matrix
+void toQuaternion( const float r[3][3], double q[4] )
+{
+    double trace = r[0][0] + r[1][1] + r[2][2];
+    if ( trace > 0 ) {
+        double s = 0.5 / std::sqrt( trace + 1.0 );
+        q[3] = 0.25 / s;
+        q[0] = (r[2][1] - r[1][2]) * s;
+        q[1] = (r[0][2] - r[2][0]) * s;
+        q[2] = (r[1][0] - r[0][1]) * s;
+    }
+    else if ( r[0][0] > r[1][1] && r[0][0] > r[2][2] ) {
+        double s = 2.0 * std::sqrt( 1.0 + r[0][0] - r[1][1] - r[2][2] );
+        q[3] = (r[2][1] - r[1][2]) / s;
+        q[0] = 0.25 * s;
+        q[1] = (r[0][1] + r[1][0]) / s;
+        q[2] = (r[0][2] + r[2][0]) / s;
+    }
+    else if ( r[1][1] > r[2][2] ) {
+        double s = 2.0 * std::sqrt( 1.0 + r[1][1] - r[0][0] - r[2][2] );
+        q[3] = (r[0][2] - r[2][0]) / s;
+        q[0] = (r[0][1] + r[1][0]) / s;
+        q[1] = 0.25 * s;
+        q[2] = (r[1][2] + r[2][1]) / s;
+    }
+    else {
+        double s = 2.0 * std::sqrt( 1.0 + r[2][2] - r[0][0] - r[1][1] );
+        q[3] = (r[1][0] - r[0][1]) / s;
+        q[0] = (r[0][2] + r[2][0]) / s;
+        q[1] = (r[1][2] + r[2][1]) / s;
+        q[2] = 0.25 * s;
+    }
+}
+
+// Symmetric positive definite matrix stored by rows from the first nonzero column to the diagonal
+struct EnvelopeMatrix
+{
+    std::vector<int> first;
+    std::vector<size_t> rowStart;
+    std::vector<double> values;
+
+    explicit EnvelopeMatrix( const std::vector<int>& first_ ) : first( first_ ), rowStart( first_.size() + 1, 0 )
+    {
+        for ( size_t i = 0; i < first.size(); ++i ) {
+            rowStart[i + 1] = rowStart[i] + (i - first[i] + 1);
+        }
+        values.assign( rowStart.back(), 0.0 );
+    }
+
+    // Lower triangle only, j <= i and j >= first[i]
+    double& at( int i, int j ) { return values[rowStart[i] + (j - first[i])]; }
+
+    // In place L L^T; fill-in stays within the envelope of every row
+    bool decompose()
+    {
+        const int n = (int)first.size();
+        for ( int i = 0; i < n; ++i ) {
+            for ( int j = first[i]; j <= i; ++j ) {
+                double sum = at( i, j );
+                for ( int k = std::max( first[i], first[j] ); k < j; ++k ) {
+                    sum -= at( i, k ) * at( j, k );
+                }
+                if ( i == j ) {
+                    if ( sum <= 1e-15 ) {
+                        return false;
+                    }
+                    at( i, i ) = std::sqrt( sum );
+                }
+                else {
+                    at( i, j ) = sum / at( j, j );
+                }
+            }
+        }
+        return true;
+    }
+
+    // Solve L L^T x = b after decompose()
+    void solve( std::vector<double>& x )
+    {
+        const int n = (int)first.size();
+        for ( int i = 0; i < n; ++i ) {
+            double sum = x[i];
+            for ( int k = first[i]; k < i; ++k ) {
+                sum -= at( i, k ) * x[k];
+            }
+            x[i] = sum / at( i, i );
+        }
+        for ( int i = n - 1; i >= 0; --i ) {
+            x[i] /= at( i, i );
+            for ( int k = first[i]; k < i; ++k ) {
+                x[k] -= at( i, k ) * x[i];
+            }
+        }
+    }
+};
+
+}
+
+PoseGraph::PoseGraph() : loopClosureCount( 0 )
+{
+}
+
+void PoseGraph::reset()
+{
+    keyframes.clear();
+    frames.clear();
+    edgeList.clear();
+    loopClosureCount = 0;
+}
+
+int PoseGraph::addKeyframe( const RigidTransform& worldToCamera )
+{
+    keyframes.push_back( worldToCamera );
+    const int id = lastKeyframe();
+    if ( id > 0 ) {
+        Edge edge = { id - 1, id, worldToCamera * keyframes[id - 1].inverse(), false };
+        edgeList.push_back( edge );
+    }
+    return id;
+}
+
+void PoseGraph::addFrame( unsigned int sequence, const RigidTransform& worldToCamera )
+{
+    Frame frame;
+    frame.sequence = sequence;
+    frame.keyframe = lastKeyframe();
+    frame.keyframeToCamera = worldToCamera * keyframes.back().inverse();
+    frames.push_back( frame );
+}
+
+void PoseGraph::addLoopClosure( int from, int to, const RigidTransform& relative )
+{
+    Edge edge = { from, to, relative, true };
+    edgeList.push_back( edge );
+    ++loopClosureCount;
+}
+
+double PoseGraph::totalError() const
+{
+    double error = 0;
+    for ( size_t i = 0; i < edgeList.size(); ++i ) {
+        double r[6];
+        residual( edgeError( edgeList[i], keyframes ), r );
+        for ( int k = 0; k < 6; ++k ) {
+            error += r[k] * r[k];
+        }
+    }
+    return error;
+}
+
+bool PoseGraph::optimize( unsigned int maxIterations )
+{
+    // Keyframe 0 is fixed, keyframe k > 0 has the unknowns from row (k - 1) * POSE_DOF
+    const int unknowns = (int)(keyframes.size() - 1) * POSE_DOF;
+    if ( loopClosureCount == 0 || unknowns <= 0 ) {
+        return false;
+    }
+
+    // Every block row reaches back to the oldest keyframe it shares an edge with
+    std::vector<int> first( unknowns );
+    for ( int i = 0; i < unknowns; ++i ) {
+        first[i] = i - i % POSE_DOF;
+    }
+    for ( size_t i = 0; i < edgeList.size(); ++i ) {
+        const int lo = std::min( edgeList[i].from, edgeList[i].to ), hi = std::max( edgeList[i].from, edgeList[i].to );
+        if ( lo == 0 ) {
+            continue;
+        }
+        for ( int row = (hi - 1) * POSE_DOF; row < hi * POSE_DOF; ++row ) {
+            first[row] = std::min( first[row], (lo - 1) * POSE_DOF );
+        }
+    }
+
+    double error = totalError();
+    bool moved = false;
+    for ( unsigned int iteration = 0; iteration < maxIterations; ++iteration ) {
+        EnvelopeMatrix h( first );
+        std::vector<double> g( unknowns, 0.0 );
+
+        // Error after moving to by a twist: Ad(relative^-1) of it; after moving from: -Ad(error) of it
+        for ( size_t i = 0; i < edgeList.size(); ++i ) {
+            const Edge& e = edgeList[i];
+            const RigidTransform error = edgeError( e, keyframes );
+            double r[6];
+            residual( error, r );
+
+            double jacobians[2][6][6];
+            adjoint( e.relative.inverse(), jacobians[0] );
+            adjoint( error, jacobians[1] );
+            for ( int row = 0; row < 6; ++row ) {
+                for ( int col = 0; col < 6; ++col ) {
+                    jacobians[1][row][col] = -jacobians[1][row][col];
+                }
+            }
+            const int nodes[2] = { e.to, e.from };
+
+            for ( int a = 0; a < 2; ++a ) {
+                if ( nodes[a] == 0 ) {
+                    continue;
+                }
+                const int rowBase = (nodes[a] - 1) * POSE_DOF;
+                for ( int p = 0; p < 6; ++p ) {
+                    for ( int k = 0; k < 6; ++k ) {
+                        g[rowBase + p] += jacobians[a][k][p] * r[k];
+                    }
+                }
+                for ( int b = 0; b < 2; ++b ) {
+                    if ( nodes[b] == 0 || nodes[b] > nodes[a] ) {
+                        continue;
+                    }
+                    const int colBase = (nodes[b] - 1) * POSE_DOF;
+                    for ( int p = 0; p < 6; ++p ) {
+                        for ( int q = 0; q < 6; ++q ) {
+                            if ( colBase + q > rowBase + p ) {
+                                continue;
+                            }
+                            double sum = 0;
+                            for ( int k = 0; k < 6; ++k ) {
+                                sum += jacobians[a][k][p] * jacobians[b][k][q];
+                            }
+                            h.at( rowBase + p, colBase + q ) += sum;
+                        }
+                    }
+                }
+            }
+        }
+        for ( int i = 0; i < unknowns; ++i ) {
+            h.at( i, i ) *= 1 + DIAGONAL_DAMPING;
+            h.at( i, i ) += 1e-12;
+        }
+
+        if ( !h.decompose() ) {
+            return moved;
+        }
+        std::vector<double> x( unknowns );
+        for ( int i = 0; i < unknowns; ++i ) {
+            x[i] = -g[i];
+        }
+        h.solve( x );
+
+        const std::vector<RigidTransform> before = keyframes;
+        double largest = 0;
+        for ( size_t k = 1; k < keyframes.size(); ++k ) {
+            float twist[6];
+            for ( int i = 0; i < 6; ++i ) {
+                twist[i] = (float)x[(k - 1) * POSE_DOF + i];
+                largest = std::max( largest, std::fabs( x[(k - 1) * POSE_DOF + i] ) );
+            }
+            keyframes[k] = RigidTransform::fromTwist( twist ) * keyframes[k];
+        }
+
+        // The linearization holds near the solution; a step that makes it worse is taken back
+        const double newError = totalError();
+        if ( newError > error ) {
+            keyframes = before;
+            break;
+        }
+        error = newError;
+        moved = true;
+        if ( largest < MIN_UPDATE ) {
+            break;
+        }
+    }
+    return moved;
+}
+
+size_t PoseGraph::memoryUsage() const
+{
+    return keyframes.capacity() * sizeof(RigidTransform) + frames.capacity() * sizeof(Frame) +
+           edgeList.capacity() * sizeof(Edge);
+}
+
+void PoseGraph::writeTrajectory( std::FILE* file, const std::vector<LONGLONG>& timestamps ) const
+{
+    for ( size_t i = 0; i < frames.size(); ++i ) {
+        if ( frames[i].sequence >= timestamps.size() ) {
+            continue;
+        }
+        RigidTransform cameraToWorld = framePose( i ).inverse();
+        double q[4];
+        toQuaternion( cameraToWorld.r, q );
+        std::fprintf( file, "%.3f %.6f %.6f %.6f %.7f %.7f %.7f %.7f\n", timestamps[frames[i].sequence] / 1000.0,
+                      cameraToWorld.t.x, cameraToWorld.t.y, cameraToWorld.t.z, q[0], q[1], q[2], q[3] );
+    }
+}
+
+TrajectoryWriter::TrajectoryWriter( const std::string& path, const std::string& comment )
+    : filePath( path )
+    , failed( false )
+{
+    if ( filePath.empty() ) {
+        return;
+    }
+
+    std::FILE* file = std::fopen( filePath.c_str(), "w" );
+    if ( file == 0 ) {
+        failed = true;
+        return;
+    }
+    std::fprintf( file, "# %scamera to world, timestamp tx ty tz qx qy qz qw\n",
+                  comment.empty() ? "" : (comment + ": ").c_str() );
+    failed = std::ferror( file ) != 0;
+    failed = (std::fclose( file ) != 0) || failed;
+}
+
+bool TrajectoryWriter::write( const PoseGraph& graph, const std::string& note )
+{
+    if ( filePath.empty() || failed ) {
+        timestamps.clear();
+        return !failed;
+    }
+
+    std::FILE* file = std::fopen( filePath.c_str(), "a" );
+    if ( file == 0 ) {
+        failed = true;
+        return false;
+    }
+    graph.writeTrajectory( file, timestamps );
+    if ( !note.empty() ) {
+        std::fprintf( file, "# %s\n", note.c_str() );
+    }
+    failed = std::ferror( file ) != 0;
+    failed = (std::fclose( file ) != 0) || failed;
+    timestamps.clear();
+    return !failed;
+}
+
+}
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "FusionTypes.h"
+
+namespace kinectbook {
+
+/// <summary>
+/// Camera poses of a reconstruction as a graph of keyframes
+/// </summary>
+/// <remarks>
+/// Nodes are keyframes (world to camera), in the order they were added,
+/// tied by an odometry edge to the keyframe before and by loop closure
+/// edges to keyframes seen again much later. Every tracked frame is kept
+/// relative to the keyframe before it, so when optimize() moves the
+/// keyframes to agree with the loop closures the frames move along and the
+/// trajectory stays smooth. Costs a pose per keyframe and per frame, no
+/// image data.
+/// </remarks>
+class PoseGraph
+{
+public:
+
+    /// <summary>
+    /// Measured motion between two keyframes: pose of to ~= relative * pose of from
+    /// </summary>
+    struct Edge
+    {
+        int from;
+        int to;
+        RigidTransform relative;
+        bool loopClosure;
+    };
+
+    PoseGraph();
+
+    void reset();
+
+    /// <summary>
+    /// Add a keyframe, tied by an odometry edge to the last one
+    /// </summary>
+    /// <returns>Its id, keyframeCount() - 1</returns>
+    int addKeyframe( const RigidTransform& worldToCamera );
+
+    /// <summary>
+    /// Log a tracked frame, relative to the last keyframe (there has to be one)
+    /// </summary>
+    /// <param name="sequence">Caller's number of the frame, e.g. its index in a list of timestamps</param>
+    void addFrame( unsigned int sequence, const RigidTransform& worldToCamera );
+
+    /// <summary>
+    /// Tie two keyframes by where the camera found itself again
+    /// </summary>
+    void addLoopClosure( int from, int to, const RigidTransform& relative );
+
+    /// <summary>
+    /// Move the keyframes to agree best with all edges; the first keyframe stays where it is
+    /// </summary>
+    /// <remarks>
+    /// Gauss-Newton over the twists of the keyframes. The normal equations
+    /// are banded by the odometry chain apart from the rows of loop
+    /// closures, so they are solved by an envelope Cholesky decomposition
+    /// whose cost grows with the keyframes a loop spans, not with their square.
+    /// </remarks>
+    /// <returns>false when there was no loop closure to agree with or the system could not be solved</returns>
+    bool optimize( unsigned int maxIterations );
+
+    size_t keyframeCount() const { return keyframes.size(); }
+
+    const RigidTransform& keyframePose( int keyframe ) const { return keyframes[keyframe]; }
+
+    int lastKeyframe() const { return (int)keyframes.size() - 1; }
+
+    size_t frameCount() const { return frames.size(); }
+
+    unsigned int frameSequence( size_t frame ) const { return frames[frame].sequence; }
+
+    /// <summary>
+    /// World to camera of a logged frame, following its keyframe
+    /// </summary>
+    RigidTransform framePose( size_t frame ) const
+    {
+        return frames[frame].keyframeToCamera * keyframes[frames[frame].keyframe];
+    }
+
+    const std::vector<Edge>& edges() const { return edgeList; }
+
+    size_t memoryUsage() const;
+
+    /// <summary>
+    /// Write the frames as camera to world in the TUM RGB-D format "timestamp tx ty tz qx qy qz qw"
+    /// </summary>
+    /// <param name="timestamps">Milliseconds, indexed by the sequence of a frame</param>
+    /// <remarks>Frames without a timestamp are left out; check the file with ferror()</remarks>
+    void writeTrajectory( std::FILE* file, const std::vector<LONGLONG>& timestamps ) const;
+
+private:
+
+    struct Frame
+    {
+        unsigned int sequence;
+        int keyframe;
+        RigidTransform keyframeToCamera;
+    };
+
+    double totalError() const;
+
+    std::vector<RigidTransform> keyframes;
+    std::vector<Frame> frames;
+    std::vector<Edge> edgeList;
+    size_t loopClosureCount;
+};
+
+/// <summary>
+/// Trajectory of a reconstruction in a file, a PoseGraph per reset
+/// </summary>
+/// <remarks>
+/// Poses of earlier frames change as long as loops may close, so the
+/// frames of a graph are written at once when it is done: before the
+/// reconstruction is reset and at the end. Keeps the timestamp of every
+/// ProcessFrame() call since, which the frames are matched to by their sequence.
+/// </remarks>
+class TrajectoryWriter
+{
+public:
+
+    /// <summary>
+    /// Create the file with a header line; an empty path writes nothing
+    /// </summary>
+    /// <param name="comment">Added to the header line</param>
+    explicit TrajectoryWriter( const std::string& path, const std::string& comment = std::string() );
+
+    /// <summary>
+    /// Timestamp (ms) of the next ProcessFrame() call, successful or not
+    /// </summary>
+    void addFrame( LONGLONG timestamp )
+    {
+        if ( !filePath.empty() ) {
+            timestamps.push_back( timestamp );
+        }
+    }
+
+    /// <summary>
+    /// Append the frames of graph and start over for the next one
+    /// </summary>
+    /// <param name="note">Written as a comment line after the frames (e.g. why the graph ends), may be empty</param>
+    /// <returns>false when the file could not be written, now or before</returns>
+    bool write( const PoseGraph& graph, const std::string& note = std::string() );
+
+    const std::string& path() const { return filePath; }
+
+private:
+
+    std::string filePath;
+    std::vector<LONGLONG> timestamps;
+    bool failed;
+};
+
+}
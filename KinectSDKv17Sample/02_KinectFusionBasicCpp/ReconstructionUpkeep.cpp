@@ -0,0 +1,103 @@
+#include "ReconstructionUpkeep.h"
+
+#include "FusionPipeline.h"
+
+namespace kinectbook {
+
+ReconstructionUpkeep::ReconstructionUpkeep( CpuReconstruction& reconstruction_, const FusionPipelineOptions& options,
+                                            bool tracked_, Profiler& profiler_ )
+    : reconstruction( reconstruction_ )
+    , resetAfterTrackingErrors( options.resetAfterTrackingErrors )
+    , meshUpdateInterval( options.meshUpdateInterval )
+    , snapshotPath( options.snapshotPath )
+    , snapshotInterval( options.snapshotInterval )
+    , tracked( tracked_ )
+    , trackingErrorCount( 0 )
+    , framesSinceMeshUpdate( 0 )
+    , snapshotRequested( false )
+    , framesSinceSnapshot( 0 )
+    , trajectory( tracked_ ? options.trajectoryPath : std::string() )
+    , profiler( profiler_ )
+{
+    ids.meshUpdate = profiler.stage( "fusion.mesh_update" );
+    ids.snapshot = profiler.stage( "fusion.snapshot" );
+    ids.trackingErrors = profiler.counter( "fusion.tracking_errors" );
+    ids.trackingResets = profiler.counter( "fusion.tracking_resets" );
+    ids.loopClosures = profiler.counter( "fusion.loop_closures" );
+
+    if ( meshUpdateInterval != 0 ) {
+        mesh.reset( new MeshExtractor( reconstruction.volume() ) );
+    }
+}
+
+void ReconstructionUpkeep::frameTracked( HRESULT result )
+{
+    if ( SUCCEEDED( result ) ) {
+        trackingErrorCount = 0;
+        if ( tracked && reconstruction.trackingStatistics().loopClosed ) {
+            profiler.add( ids.loopClosures );
+        }
+        return;
+    }
+
+    // Kinect or the object moved too fast, or the view is blocked;
+    // start over when the camera could not be found for too long
+    ++trackingErrorCount;
+    profiler.add( ids.trackingErrors );
+    if ( resetAfterTrackingErrors != 0 && trackingErrorCount >= resetAfterTrackingErrors ) {
+        trackingErrorCount = 0;
+        profiler.add( ids.trackingResets );
+        takeSnapshot();
+        trajectory.write( reconstruction.poseGraph(), "reset" );
+        Matrix4 identity = RigidTransform().toMatrix4();
+        reconstruction.ResetReconstruction( &identity, nullptr );
+    }
+}
+
+void ReconstructionUpkeep::frameIntegrated()
+{
+    // A reset of the volume is noticed by the mesh itself
+    if ( mesh && ++framesSinceMeshUpdate >= meshUpdateInterval ) {
+        framesSinceMeshUpdate = 0;
+        std::lock_guard<std::mutex> lock( meshMutex );
+        ScopedTimer timer( ids.meshUpdate, profiler );
+        mesh->update();
+    }
+
+    if ( snapshotRequested || (snapshotInterval != 0 && ++framesSinceSnapshot >= snapshotInterval) ) {
+        takeSnapshot();
+    }
+}
+
+void ReconstructionUpkeep::finish()
+{
+    trajectory.write( reconstruction.poseGraph() );
+}
+
+bool ReconstructionUpkeep::readMesh( const std::function<void ( const MeshExtractor& mesh )>& read )
+{
+    if ( !mesh ) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock( meshMutex );
+    read( *mesh );
+    return true;
+}
+
+void ReconstructionUpkeep::takeSnapshot()
+{
+    if ( snapshotPath.empty() ) {
+        snapshotRequested = false;
+        return;
+    }
+
+    // Only a view of the volume is taken here, the pipeline goes on at once
+    ScopedTimer timer( ids.snapshot, profiler );
+    if ( reconstruction.SaveSnapshotAsync( snapshotPath ) == S_OK ) {
+        snapshotRequested = false;
+        framesSinceSnapshot = 0;
+    }
+}
+
+}
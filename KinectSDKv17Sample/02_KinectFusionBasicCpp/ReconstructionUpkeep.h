@@ -0,0 +1,116 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "../common/Profiler.h"
+#include "CpuReconstruction.h"
+#include "MeshExtractor.h"
+
+namespace kinectbook {
+
+struct FusionPipelineOptions;
+
+/// <summary>
+/// What a pipeline does around every frame it fuses: the reset after
+/// tracking errors, the mesh, the snapshots and the trajectory
+/// </summary>
+/// <remarks>
+/// Used by the one stage of FusionPipeline or MultiSensorFusion that touches
+/// the volume, per frame:
+///
+///   frameStarted() -> ProcessFrame() -> frameTracked() -> (frame handed on)
+///   -> frameIntegrated() when it was tracked
+///
+/// and finish() when the stage stops. readMesh() and requestSnapshot() may
+/// be called from any thread. Records "fusion.mesh_update", "fusion.snapshot",
+/// "fusion.tracking_errors", "fusion.tracking_resets" and "fusion.loop_closures".
+/// </remarks>
+class ReconstructionUpkeep
+{
+public:
+
+    /// <param name="tracked">
+    /// false when the camera is placed rather than tracked (IntegrateFrame):
+    /// no trajectory is written and no loop closures are counted
+    /// </param>
+    ReconstructionUpkeep( CpuReconstruction& reconstruction, const FusionPipelineOptions& options, bool tracked,
+                          Profiler& profiler );
+
+    /// <summary>
+    /// Timestamp of the frame that is about to be processed, successful or not
+    /// </summary>
+    void frameStarted( LONGLONG timestamp ) { trajectory.addFrame( timestamp ); }
+
+    /// <summary>
+    /// Count the result of processing the frame
+    /// </summary>
+    /// <remarks>
+    /// Resets the reconstruction after resetAfterTrackingErrors errors in
+    /// a row, with a snapshot and the trajectory so far written first.
+    /// </remarks>
+    void frameTracked( HRESULT result );
+
+    /// <summary>
+    /// Bring the mesh up to date and take the snapshot when they are due
+    /// </summary>
+    /// <remarks>Call once everything of a tracked frame is in the volume, after the frame was handed on</remarks>
+    void frameIntegrated();
+
+    /// <summary>
+    /// Append the rest of the trajectory
+    /// </summary>
+    void finish();
+
+    /// <summary>
+    /// Call read with the mesh while it is not updated
+    /// </summary>
+    /// <returns>false when meshUpdateInterval is 0</returns>
+    bool readMesh( const std::function<void ( const MeshExtractor& mesh )>& read );
+
+    /// <summary>
+    /// Take a snapshot after the next tracked frame (needs snapshotPath)
+    /// </summary>
+    void requestSnapshot() { snapshotRequested = true; }
+
+private:
+
+    ReconstructionUpkeep( const ReconstructionUpkeep& );
+    ReconstructionUpkeep& operator=( const ReconstructionUpkeep& );
+
+    void takeSnapshot();
+
+    CpuReconstruction& reconstruction;
+    const unsigned int resetAfterTrackingErrors;
+    const unsigned int meshUpdateInterval;
+    const std::string snapshotPath;
+    const unsigned int snapshotInterval;
+    const bool tracked;
+
+    unsigned int trackingErrorCount;
+
+    std::unique_ptr<MeshExtractor> mesh;
+    std::mutex meshMutex;
+    unsigned int framesSinceMeshUpdate;
+
+    std::atomic<bool> snapshotRequested;
+    unsigned int framesSinceSnapshot;
+
+    TrajectoryWriter trajectory;
+
+    // Ids in the profiler
+    Profiler& profiler;
+    struct ProfilerIds
+    {
+        unsigned int meshUpdate;
+        unsigned int snapshot;
+        unsigned int trackingErrors;
+        unsigned int trackingResets;
+        unsigned int loopClosures;
+    } ids;
+};
+
+}
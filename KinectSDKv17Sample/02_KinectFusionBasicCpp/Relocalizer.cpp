@@ -0,0 +1,134 @@
+#include "Relocalizer.h"
+
+#include <algorithm>
+#include <random>
+
+namespace kinectbook {
+
+namespace {
+
+// Depth thresholds of the ferns, the useful range of the sensor (meters)
+const float MIN_FERN_DEPTH = 0.8f;
+const float MAX_FERN_DEPTH = 4.0f;
+
+// A frame becomes a keyframe when every stored keyframe differs in more than this share of ferns
+const float NEW_KEYFRAME_DISSIMILARITY = 0.2f;
+
+// Keyframes differing in more ferns than this are not worth a try
+const float MAX_CANDIDATE_DISSIMILARITY = 0.5f;
+
+}
+
+Relocalizer::Relocalizer( unsigned int fernCount )
+    : ferns( std::max( fernCount, 1u ) )
+    , keyframesByCode( ferns.size() * FERN_CODES )
+    , codes( ferns.size() )
+{
+    // Fixed seed: the same ferns every run, so results are reproducible
+    std::mt19937 random( 5489u );
+    std::uniform_real_distribution<float> position( 0.0f, 1.0f );
+    std::uniform_real_distribution<float> depth( MIN_FERN_DEPTH, MAX_FERN_DEPTH );
+    for ( size_t i = 0; i < ferns.size(); ++i ) {
+        for ( int bit = 0; bit < FERN_BITS; ++bit ) {
+            ferns[i].u[bit] = position( random );
+            ferns[i].v[bit] = position( random );
+            ferns[i].threshold[bit] = depth( random );
+        }
+    }
+}
+
+void Relocalizer::reset()
+{
+    for ( size_t i = 0; i < keyframesByCode.size(); ++i ) {
+        keyframesByCode[i].clear();
+    }
+    poses.clear();
+}
+
+bool Relocalizer::addKeyframe( const DepthFloatFrame& depth, const RigidTransform& worldToCamera )
+{
+    encode( depth );
+    countMatches();
+
+    int best = 0;
+    for ( size_t i = 0; i < matches.size(); ++i ) {
+        best = std::max( best, matches[i] );
+    }
+    if ( !poses.empty() && 1.0f - (float)best / ferns.size() <= NEW_KEYFRAME_DISSIMILARITY ) {
+        return false;
+    }
+
+    int id = (int)poses.size();
+    poses.push_back( worldToCamera );
+    for ( size_t i = 0; i < ferns.size(); ++i ) {
+        keyframesByCode[i * FERN_CODES + codes[i]].push_back( id );
+    }
+    return true;
+}
+
+void Relocalizer::findCandidates( const DepthFloatFrame& depth, unsigned int maxCount,
+                                  std::vector<Candidate>& candidates )
+{
+    candidates.clear();
+    if ( poses.empty() || maxCount == 0 ) {
+        return;
+    }
+
+    encode( depth );
+    countMatches();
+
+    for ( size_t i = 0; i < poses.size(); ++i ) {
+        Candidate candidate;
+        candidate.keyframe = (int)i;
+        candidate.worldToCamera = poses[i];
+        candidate.dissimilarity = 1.0f - (float)matches[i] / ferns.size();
+        if ( candidate.dissimilarity <= MAX_CANDIDATE_DISSIMILARITY ) {
+            candidates.push_back( candidate );
+        }
+    }
+
+    size_t count = std::min( (size_t)maxCount, candidates.size() );
+    std::partial_sort( candidates.begin(), candidates.begin() + count, candidates.end(),
+                       []( const Candidate& a, const Candidate& b ) { return a.dissimilarity < b.dissimilarity; } );
+    candidates.resize( count );
+}
+
+size_t Relocalizer::memoryUsage() const
+{
+    size_t size = ferns.size() * sizeof(Fern) + poses.capacity() * sizeof(RigidTransform);
+    for ( size_t i = 0; i < keyframesByCode.size(); ++i ) {
+        size += keyframesByCode[i].capacity() * sizeof(int);
+    }
+    return size;
+}
+
+void Relocalizer::encode( const DepthFloatFrame& depth )
+{
+    for ( size_t i = 0; i < ferns.size(); ++i ) {
+        const Fern& fern = ferns[i];
+        unsigned char code = 0;
+        for ( int bit = 0; bit < FERN_BITS; ++bit ) {
+            int x = std::min( (int)(fern.u[bit] * depth.width), depth.width - 1 );
+            int y = std::min( (int)(fern.v[bit] * depth.height), depth.height - 1 );
+
+            // Invalid depth (0) reads as "nearer than the threshold"
+            if ( depth.row( y )[x] > fern.threshold[bit] ) {
+                code |= 1 << bit;
+            }
+        }
+        codes[i] = code;
+    }
+}
+
+void Relocalizer::countMatches()
+{
+    matches.assign( poses.size(), 0 );
+    for ( size_t i = 0; i < ferns.size(); ++i ) {
+        const std::vector<int>& keyframes = keyframesByCode[i * FERN_CODES + codes[i]];
+        for ( size_t k = 0; k < keyframes.size(); ++k ) {
+            ++matches[keyframes[k]];
+        }
+    }
+}
+
+}
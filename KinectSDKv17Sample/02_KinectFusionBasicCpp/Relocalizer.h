@@ -0,0 +1,91 @@
+#pragma once
+
+#include <vector>
+
+#include "FusionTypes.h"
+
+namespace kinectbook {
+
+/// <summary>
+/// Keyframe database to find the camera pose again after tracking was lost
+/// </summary>
+/// <remarks>
+/// Randomized ferns (Glocker et al., "Real-time RGB-D camera relocalization
+/// via randomized ferns for keyframe encoding"): every fern compares the
+/// depth at a few fixed spots of a small depth image against random
+/// thresholds, and the results form a 4 bit code. Frames that share many
+/// codes were taken from a similar pose. A keyframe costs one index entry
+/// per fern plus its pose; no depth is kept and nothing is re-integrated.
+/// </remarks>
+class Relocalizer
+{
+public:
+
+    struct Candidate
+    {
+        int keyframe;               // id, the keyframeCount() - 1 when it was added
+        RigidTransform worldToCamera;
+
+        /// <summary>
+        /// Share of ferns with a different code, 0 = identical
+        /// </summary>
+        float dissimilarity;
+    };
+
+    /// <param name="fernCount">More ferns tell poses apart better and cost more per frame</param>
+    explicit Relocalizer( unsigned int fernCount = 500 );
+
+    void reset();
+
+    /// <summary>
+    /// Store the frame as a keyframe unless a stored keyframe already looks alike
+    /// </summary>
+    /// <param name="depth">Best a low resolution level of the depth pyramid</param>
+    /// <returns>true when the frame was added</returns>
+    bool addKeyframe( const DepthFloatFrame& depth, const RigidTransform& worldToCamera );
+
+    /// <summary>
+    /// Keyframes most similar to the frame, best first
+    /// </summary>
+    void findCandidates( const DepthFloatFrame& depth, unsigned int maxCount,
+                         std::vector<Candidate>& candidates );
+
+    size_t keyframeCount() const { return poses.size(); }
+
+    const RigidTransform& keyframePose( int keyframe ) const { return poses[keyframe]; }
+
+    /// <summary>
+    /// Move a keyframe, when a PoseGraph corrected its pose
+    /// </summary>
+    void setKeyframePose( int keyframe, const RigidTransform& worldToCamera ) { poses[keyframe] = worldToCamera; }
+
+    size_t memoryUsage() const;
+
+private:
+
+    static const int FERN_BITS = 4;
+    static const int FERN_CODES = 1 << FERN_BITS;
+
+    struct Fern
+    {
+        // Sample spots in [0, 1) of the image and the depth threshold of every bit
+        float u[FERN_BITS];
+        float v[FERN_BITS];
+        float threshold[FERN_BITS];
+    };
+
+    void encode( const DepthFloatFrame& depth );
+    void countMatches();
+
+    std::vector<Fern> ferns;
+
+    // Keyframe ids per fern and code, index fern * FERN_CODES + code
+    std::vector<std::vector<int> > keyframesByCode;
+    std::vector<RigidTransform> poses;
+
+    // Codes of the last encoded frame and the number of codes every keyframe shares with it
+    std::vector<unsigned char> codes;
+    std::vector<int> matches;
+};
+
+}
@@ -0,0 +1,401 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+
+#include "../common/SimdConfig.h"
+#include "../common/ThreadPool.h"
+#include "FusionTypes.h"
+#include "TsdfVolume.h"
+
+namespace kinectbook {
+
+// Per voxel routines shared by the dense and the hashed volume
+
+const float TSDF_SCALE = 32767.0f;
+const float INV_TSDF_SCALE = 1.0f / 32767.0f;
+
+// Nearest distance from the camera that is still integrated
+const float INTEGRATION_NEAR_PLANE = 0.1f;
+
+// Cells of 2^CELL_BLOCK_SHIFT blocks (64 voxels) a raycast steps over
+// at once when no block in them holds a surface
+const int CELL_BLOCK_SHIFT = 3;
+
+// Square tiles of pixels a raycast hands to the threads; neighbouring
+// rays cross the same blocks, so a tile keeps them in the cache
+const int RAYCAST_TILE_SIZE = 16;
+
+/// <summary>
+/// Part [first, last) of a voxel row p0 + dx * i (camera space) that projects into the image
+/// </summary>
+/// <remarks>
+/// The voxels of a row are on a line, so the visible part is found by
+/// clipping the line against the five planes of the view frustum.
+/// </remarks>
+inline bool clipVoxelRow( const Float3& p0, const Float3& dx, int count, const CameraIntrinsics& k,
+                          int& first, int& last )
+{
+    struct Clip
+    {
+        // Narrow [lo, hi] to the x where a + b * x >= 0
+        static void linear( float a, float b, float& lo, float& hi )
+        {
+            if ( b > 1e-12f ) {
+                lo = std::max( lo, -a / b );
+            }
+            else if ( b < -1e-12f ) {
+                hi = std::min( hi, -a / b );
+            }
+            else if ( a < 0 ) {
+                hi = lo - 1;
+            }
+        }
+    };
+
+    float lo = 0, hi = (float)(count - 1);
+    Clip::linear( p0.z - INTEGRATION_NEAR_PLANE, dx.z, lo, hi );
+    Clip::linear( k.fx * p0.x + (k.cx + 0.5f) * p0.z, k.fx * dx.x + (k.cx + 0.5f) * dx.z, lo, hi );
+    Clip::linear( (k.width - 0.5f - k.cx) * p0.z - k.fx * p0.x, (k.width - 0.5f - k.cx) * dx.z - k.fx * dx.x, lo, hi );
+    Clip::linear( k.fy * p0.y + (k.cy + 0.5f) * p0.z, k.fy * dx.y + (k.cy + 0.5f) * dx.z, lo, hi );
+    Clip::linear( (k.height - 0.5f - k.cy) * p0.z - k.fy * p0.y, (k.height - 0.5f - k.cy) * dx.z - k.fy * dx.y, lo, hi );
+    if ( hi < lo ) {
+        return false;
+    }
+
+    first = std::max( 0, (int)std::ceil( lo ) );
+    last = std::min( count, (int)std::floor( hi ) + 1 );
+    return first < last;
+}
+
+/// <summary>
+/// Running weighted average of one voxel
+/// </summary>
+inline void updateVoxel( TsdfVoxel& v, float tsdf, float maxWeight )
+{
+    float w = v.weight;
+    float value = (v.tsdf * INV_TSDF_SCALE * w + tsdf) / (w + 1);
+    v.tsdf = (short)(value * TSDF_SCALE + ((value >= 0) ? 0.5f : -0.5f));
+    v.weight = (unsigned short)std::min( w + 1, maxWeight );
+}
+
+/// <summary>
+/// Take one observation out of the running average of a voxel, the inverse of updateVoxel()
+/// </summary>
+/// <remarks>
+/// A voxel at maxWeight may have been at maxWeight before the observation
+/// too; it is assumed it was, so the weight stays and the removal is only
+/// approximate for voxels seen more than maxWeight times.
+/// </remarks>
+inline void removeVoxel( TsdfVoxel& v, float tsdf, float maxWeight )
+{
+    float w = v.weight;
+    if ( w <= 1 ) {
+        v.tsdf = (short)TSDF_SCALE;
+        v.weight = 0;
+        return;
+    }
+    float value = (w >= maxWeight) ? (v.tsdf * INV_TSDF_SCALE * (w + 1) - tsdf) / w :
+                                     (v.tsdf * INV_TSDF_SCALE * w - tsdf) / (w - 1);
+    value = std::min( std::max( value, -1.0f ), 1.0f );
+    v.tsdf = (short)(value * TSDF_SCALE + ((value >= 0) ? 0.5f : -0.5f));
+    v.weight = (unsigned short)((w >= maxWeight) ? w : w - 1);
+}
+
+/// <summary>
+/// Running average of the color of one voxel, rounded to 8 bits
+/// </summary>
+/// <param name="bgra">Registered color; alpha 0 (no color) leaves the voxel alone</param>
+inline void updateColorVoxel( ColorVoxel& c, UINT bgra, float maxWeight )
+{
+    if ( !ColorFrame::isValid( bgra ) ) {
+        return;
+    }
+    const unsigned int w = c.weight, w1 = w + 1;
+    c.b = (unsigned char)((c.b * w + (bgra & 0xFF) + w1 / 2) / w1);
+    c.g = (unsigned char)((c.g * w + ((bgra >> 8) & 0xFF) + w1 / 2) / w1);
+    c.r = (unsigned char)((c.r * w + ((bgra >> 16) & 0xFF) + w1 / 2) / w1);
+    c.weight = (unsigned char)std::min( std::min( (float)w1, maxWeight ), 255.0f );
+}
+
+/// <summary>
+/// Color of a voxel as BGRA, 0 (alpha 0) when it has none
+/// </summary>
+inline UINT colorOfVoxel( const ColorVoxel& c )
+{
+    return (c.weight != 0) ? (0xFF000000u | ((UINT)c.r << 16) | ((UINT)c.g << 8) | c.b) : 0u;
+}
+
+/// <summary>
+/// Integrate voxels [first, last) of a row whose voxel i is at p0 + dx * i in camera space
+/// </summary>
+/// <remarks>
+/// With colorRow and color, voxels within the truncation distance of the
+/// surface also average the color of their pixel. Only those voxels touch
+/// colorRow, the distance update streams through row alone.
+/// </remarks>
+/// <returns>
+/// true when a voxel was observed for the first time or its distance changed;
+/// a weight that only grows does not move the surface and does not count
+/// </returns>
+inline bool integrateVoxelRow( TsdfVoxel* row, ColorVoxel* colorRow, int first, int last,
+                               const Float3& p0, const Float3& dx,
+                               const DepthFloatFrame& depth, const ColorFrame* color, const CameraIntrinsics& k,
+                               float truncation, float maxWeight )
+{
+    const int width = depth.width;
+    const float* depthPixels = &depth.pixels[0];
+    const UINT* colorPixels = (colorRow != 0 && color != 0) ? &color->pixels[0] : 0;
+    const float invTruncation = 1.0f / truncation;
+    bool changed = false;
+    int x = first;
+
+#ifdef KB_SSE2
+    const __m128 lane = _mm_setr_ps( 0, 1, 2, 3 );
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps( 1.0f );
+    const __m128 uMax = _mm_set1_ps( (float)(k.width - 1) );
+    const __m128 vMax = _mm_set1_ps( (float)(k.height - 1) );
+    const __m128 negTruncation = _mm_set1_ps( -truncation );
+    const __m128 posTruncation = _mm_set1_ps( truncation );
+    const __m128i lowMask = _mm_set1_epi32( 0xFFFF );
+
+    for ( ; x + 4 <= last; x += 4 ) {
+        __m128 xs = _mm_add_ps( _mm_set1_ps( (float)x ), lane );
+        __m128 px = _mm_add_ps( _mm_set1_ps( p0.x ), _mm_mul_ps( _mm_set1_ps( dx.x ), xs ) );
+        __m128 py = _mm_add_ps( _mm_set1_ps( p0.y ), _mm_mul_ps( _mm_set1_ps( dx.y ), xs ) );
+        __m128 pz = _mm_add_ps( _mm_set1_ps( p0.z ), _mm_mul_ps( _mm_set1_ps( dx.z ), xs ) );
+        __m128 invZ = _mm_div_ps( one, pz );
+
+        __m128 u = _mm_add_ps( _mm_mul_ps( _mm_mul_ps( px, _mm_set1_ps( k.fx ) ), invZ ), _mm_set1_ps( k.cx ) );
+        __m128 v = _mm_add_ps( _mm_mul_ps( _mm_mul_ps( py, _mm_set1_ps( k.fy ) ), invZ ), _mm_set1_ps( k.cy ) );
+        u = _mm_min_ps( _mm_max_ps( u, zero ), uMax );
+        v = _mm_min_ps( _mm_max_ps( v, zero ), vMax );
+
+        KB_ALIGN(16) int ui[4];
+        KB_ALIGN(16) int vi[4];
+        _mm_store_si128( (__m128i*)ui, _mm_cvtps_epi32( u ) );
+        _mm_store_si128( (__m128i*)vi, _mm_cvtps_epi32( v ) );
+        __m128 d = _mm_setr_ps( depthPixels[vi[0] * width + ui[0]], depthPixels[vi[1] * width + ui[1]],
+                                depthPixels[vi[2] * width + ui[2]], depthPixels[vi[3] * width + ui[3]] );
+
+        __m128 sdf = _mm_sub_ps( d, pz );
+        __m128 mask = _mm_and_ps( _mm_cmpgt_ps( d, zero ), _mm_cmpge_ps( sdf, negTruncation ) );
+        if ( _mm_movemask_ps( mask ) == 0 ) {
+            continue;
+        }
+        __m128 tsdf = _mm_min_ps( _mm_mul_ps( sdf, _mm_set1_ps( invTruncation ) ), one );
+
+        // Each voxel is one 32 bit lane: tsdf in the low, weight in the high half
+        __m128i old = _mm_loadu_si128( (const __m128i*)(row + x) );
+        __m128 oldTsdf = _mm_mul_ps( _mm_cvtepi32_ps( _mm_srai_epi32( _mm_slli_epi32( old, 16 ), 16 ) ),
+                                     _mm_set1_ps( INV_TSDF_SCALE ) );
+        __m128 oldWeight = _mm_cvtepi32_ps( _mm_srli_epi32( old, 16 ) );
+        __m128 weightPlusOne = _mm_add_ps( oldWeight, one );
+
+        __m128 newTsdf = _mm_div_ps( _mm_add_ps( _mm_mul_ps( oldTsdf, oldWeight ), tsdf ), weightPlusOne );
+        __m128 newWeight = _mm_min_ps( weightPlusOne, _mm_set1_ps( maxWeight ) );
+
+        __m128i packed = _mm_or_si128(
+            _mm_and_si128( _mm_cvtps_epi32( _mm_mul_ps( newTsdf, _mm_set1_ps( TSDF_SCALE ) ) ), lowMask ),
+            _mm_slli_epi32( _mm_cvtps_epi32( newWeight ), 16 ) );
+        __m128i m = _mm_castps_si128( mask );
+        _mm_storeu_si128( (__m128i*)(row + x), _mm_or_si128( _mm_and_si128( m, packed ), _mm_andnot_si128( m, old ) ) );
+
+        __m128i sameTsdf = _mm_cmpeq_epi32( _mm_and_si128( _mm_xor_si128( packed, old ), lowMask ), _mm_setzero_si128() );
+        __m128i unobserved = _mm_cmpeq_epi32( _mm_srli_epi32( old, 16 ), _mm_setzero_si128() );
+        __m128i moved = _mm_and_si128( m, _mm_or_si128( _mm_andnot_si128( sameTsdf, m ), unobserved ) );
+        changed = changed || _mm_movemask_epi8( moved ) != 0;
+
+        if ( colorPixels != 0 ) {
+            int band = _mm_movemask_ps( _mm_and_ps( mask, _mm_cmplt_ps( sdf, posTruncation ) ) );
+            for ( int i = 0; band != 0; ++i, band >>= 1 ) {
+                if ( band & 1 ) {
+                    updateColorVoxel( colorRow[x + i], colorPixels[vi[i] * width + ui[i]], maxWeight );
+                }
+            }
+        }
+    }
+#endif
+
+    for ( ; x < last; ++x ) {
+        Float3 p = p0 + dx * (float)x;
+        float invZ = 1.0f / p.z;
+        int u = (int)(k.fx * p.x * invZ + k.cx + 0.5f);
+        int v = (int)(k.fy * p.y * invZ + k.cy + 0.5f);
+        u = std::min( std::max( u, 0 ), k.width - 1 );
+        v = std::min( std::max( v, 0 ), k.height - 1 );
+
+        float d = depthPixels[v * width + u];
+        float sdf = d - p.z;
+        if ( d <= 0 || sdf < -truncation ) {
+            continue;
+        }
+        TsdfVoxel old = row[x];
+        updateVoxel( row[x], std::min( sdf * invTruncation, 1.0f ), maxWeight );
+        changed = changed || old.weight == 0 || old.tsdf != row[x].tsdf;
+        if ( colorPixels != 0 && sdf < truncation ) {
+            updateColorVoxel( colorRow[x], colorPixels[v * width + u], maxWeight );
+        }
+    }
+
+    return changed;
+}
+
+/// <summary>
+/// Take a frame integrated by integrateVoxelRow() with the same arguments out of voxels [first, last) of a row again
+/// </summary>
+/// <remarks>
+/// Projects every voxel exactly like the part of integrateVoxelRow() that
+/// integrated it, so it sees the pixels the frame was averaged in with:
+/// the vector part clamps before rounding to the nearest even pixel, the
+/// scalar part rounds half up and clamps after. Colors are left alone.
+/// Rare enough (loop closures) to need no vector path of its own.
+/// </remarks>
+/// <returns>true when a voxel changed</returns>
+inline bool deintegrateVoxelRow( TsdfVoxel* row, int first, int last, const Float3& p0, const Float3& dx,
+                                 const DepthFloatFrame& depth, const CameraIntrinsics& k,
+                                 float truncation, float maxWeight )
+{
+    const int width = depth.width;
+    const float* depthPixels = &depth.pixels[0];
+    const float invTruncation = 1.0f / truncation;
+    bool changed = false;
+#ifdef KB_SSE2
+    // integrateVoxelRow() took the voxels up to here four at a time
+    const int vectorLast = first + (last - first) / 4 * 4;
+#endif
+
+    for ( int x = first; x < last; ++x ) {
+        Float3 p = p0 + dx * (float)x;
+        float invZ = 1.0f / p.z;
+        int u, v;
+#ifdef KB_SSE2
+        if ( x < vectorLast ) {
+            float uf = std::min( std::max( p.x * k.fx * invZ + k.cx, 0.0f ), (float)(k.width - 1) );
+            float vf = std::min( std::max( p.y * k.fy * invZ + k.cy, 0.0f ), (float)(k.height - 1) );
+            u = _mm_cvtss_si32( _mm_set_ss( uf ) );
+            v = _mm_cvtss_si32( _mm_set_ss( vf ) );
+        }
+        else
+#endif
+        {
+            u = (int)(k.fx * p.x * invZ + k.cx + 0.5f);
+            v = (int)(k.fy * p.y * invZ + k.cy + 0.5f);
+            u = std::min( std::max( u, 0 ), k.width - 1 );
+            v = std::min( std::max( v, 0 ), k.height - 1 );
+        }
+
+        float d = depthPixels[v * width + u];
+        float sdf = d - p.z;
+        if ( d <= 0 || sdf < -truncation || row[x].weight == 0 ) {
+            continue;
+        }
+        removeVoxel( row[x], std::min( sdf * invTruncation, 1.0f ), maxWeight );
+        changed = true;
+    }
+    return changed;
+}
+
+/// <summary>
+/// Trilinear interpolation of the eight voxels around a point
+/// </summary>
+/// <param name="c">Corners in x, then y, then z order</param>
+/// <returns>false when a corner has never been observed</returns>
+inline bool interpolateVoxels( const TsdfVoxel* const c[8], float fx, float fy, float fz, float& value )
+{
+    for ( int i = 0; i < 8; ++i ) {
+        if ( c[i] == 0 || c[i]->weight == 0 ) {
+            return false;
+        }
+    }
+
+    float c00 = c[0]->tsdf + (c[1]->tsdf - c[0]->tsdf) * fx;
+    float c10 = c[2]->tsdf + (c[3]->tsdf - c[2]->tsdf) * fx;
+    float c01 = c[4]->tsdf + (c[5]->tsdf - c[4]->tsdf) * fx;
+    float c11 = c[6]->tsdf + (c[7]->tsdf - c[6]->tsdf) * fx;
+    float c0 = c00 + (c10 - c00) * fy;
+    float c1 = c01 + (c11 - c01) * fy;
+    value = (c0 + (c1 - c0) * fz) * INV_TSDF_SCALE;
+    return true;
+}
+
+/// <summary>
+/// Smallest distance of the observed voxels, least if none is smaller
+/// </summary>
+/// <remarks>
+/// A raycast only stops where the distance falls below TSDF_SCALE, so
+/// voxels whose least distance is TSDF_SCALE can be stepped over at once.
+/// Unobserved voxels hold TSDF_SCALE too and need no test of the weight.
+/// </remarks>
+inline short leastObservedTsdf( const TsdfVoxel* voxels, int count, short least )
+{
+    for ( int i = 0; i < count; ++i ) {
+        least = std::min( least, voxels[i].tsdf );
+    }
+    return least;
+}
+
+/// <summary>
+/// Ray parameter where o + d * t leaves the cell (cx, cy, cz) of size cellSize
+/// </summary>
+/// <remarks>Cells are centered like the voxels they contain, offset by half a voxel</remarks>
+inline float cellExit( const Float3& o, const Float3& d, int cx, int cy, int cz, float cellSize, float tLimit )
+{
+    const int c[3] = { cx, cy, cz };
+    const float origin[3] = { o.x, o.y, o.z };
+    const float dir[3] = { d.x, d.y, d.z };
+    float tExit = tLimit;
+    for ( int a = 0; a < 3; ++a ) {
+        if ( dir[a] > 1e-9f ) {
+            tExit = std::min( tExit, ((c[a] + 1) * cellSize - 0.5f - origin[a]) / dir[a] );
+        }
+        else if ( dir[a] < -1e-9f ) {
+            tExit = std::min( tExit, (c[a] * cellSize - 0.5f - origin[a]) / dir[a] );
+        }
+    }
+    return tExit;
+}
+
+/// <summary>
+/// Call castRay( u, v ) for every pixel of the image, RAYCAST_TILE_SIZE square tiles in parallel
+/// </summary>
+template <class CastRay>
+void raycastTiles( ThreadPool& pool, const CameraIntrinsics& k, const CastRay& castRay )
+{
+    const int tilesX = (k.width + RAYCAST_TILE_SIZE - 1) / RAYCAST_TILE_SIZE;
+    const int tilesY = (k.height + RAYCAST_TILE_SIZE - 1) / RAYCAST_TILE_SIZE;
+    pool.parallelFor( 0, tilesX * tilesY, [&]( int begin, int end ) {
+        for ( int tile = begin; tile < end; ++tile ) {
+            int u0 = (tile % tilesX) * RAYCAST_TILE_SIZE, v0 = (tile / tilesX) * RAYCAST_TILE_SIZE;
+            int u1 = std::min( u0 + RAYCAST_TILE_SIZE, k.width ), v1 = std::min( v0 + RAYCAST_TILE_SIZE, k.height );
+            for ( int v = v0; v < v1; ++v ) {
+                for ( int u = u0; u < u1; ++u ) {
+                    castRay( u, v );
+                }
+            }
+        }
+    } );
+}
+
+/// <summary>
+/// Clip a ray o + d * t against the box [0, dims] (all in voxels)
+/// </summary>
+inline void clipRayToBox( const Float3& o, const Float3& d, const float dims[3], float& tNear, float& tFar )
+{
+    const float origin[3] = { o.x, o.y, o.z };
+    const float dir[3] = { d.x, d.y, d.z };
+    for ( int a = 0; a < 3; ++a ) {
+        if ( std::fabs( dir[a] ) < 1e-9f ) {
+            if ( origin[a] < 0 || origin[a] > dims[a] ) {
+                tFar = -1;
+            }
+            continue;
+        }
+        float t0 = (0 - origin[a]) / dir[a], t1 = (dims[a] - origin[a]) / dir[a];
+        tNear = std::max( tNear, std::min( t0, t1 ) );
+        tFar = std::min( tFar, std::max( t0, t1 ) );
+    }
+}
+
+}
@@ -0,0 +1,540 @@
+#include "TsdfVolume.h"
+
+#include <algorithm>
+#include <thread>
+
+#include "../common/ThreadPool.h"
+#include "HashedTsdfVolume.h"
+#include "MultiScaleTsdfVolume.h"
+#include "TsdfKernels.h"
+
+namespace kinectbook {
+
+ITsdfVolume* ITsdfVolume::create( TsdfVolumeType type, const NUI_FUSION_RECONSTRUCTION_PARAMETERS& params, ThreadPool& pool )
+{
+    if ( type == TSDF_VOLUME_HASHED ) {
+        return new HashedTsdfVolume( params, pool );
+    }
+    if ( type == TSDF_VOLUME_MULTISCALE ) {
+        return new MultiScaleTsdfVolume( params, pool );
+    }
+    return new TsdfVolume( params, pool );
+}
+
+RigidTransform worldToVolumeInMeters( const NUI_FUSION_RECONSTRUCTION_PARAMETERS& params, const Matrix4* worldToVolume )
+{
+    float voxelSize = 1.0f / params.voxelsPerMeter;
+    if ( worldToVolume == nullptr ) {
+        RigidTransform m;
+        m.t = Float3( params.voxelCountX * 0.5f, params.voxelCountY * 0.5f, 0 ) * voxelSize;
+        return m;
+    }
+
+    // Remove the voxel scale; what remains has to be rigid
+    Matrix4 m = *worldToVolume;
+    m.M11 *= voxelSize; m.M12 *= voxelSize; m.M13 *= voxelSize;
+    m.M21 *= voxelSize; m.M22 *= voxelSize; m.M23 *= voxelSize;
+    m.M31 *= voxelSize; m.M32 *= voxelSize; m.M33 *= voxelSize;
+    m.M41 *= voxelSize; m.M42 *= voxelSize; m.M43 *= voxelSize;
+    return RigidTransform::fromMatrix4( m );
+}
+
+VoxelBlockView::VoxelBlockView( std::vector<VoxelBlockIndex>& blocks_, const ReadFunction& readLive_ )
+    : readLive( readLive_ )
+    , settledCount( 0 )
+{
+    blocks.swap( blocks_ );
+    states.reset( new std::atomic<unsigned char>[blocks.size()] );
+    for ( size_t i = 0; i < blocks.size(); ++i ) {
+        states[i].store( BLOCK_LIVE, std::memory_order_relaxed );
+    }
+    copies.resize( blocks.size() );
+}
+
+void VoxelBlockView::read( size_t slot, TsdfVoxel* out )
+{
+    unsigned char state = BLOCK_LIVE;
+    if ( states[slot].compare_exchange_strong( state, BLOCK_READING, std::memory_order_acquire ) ) {
+        readLive( slot, blocks[slot], out );
+        states[slot].store( BLOCK_DONE, std::memory_order_release );
+        settledCount.fetch_add( 1 );
+        return;
+    }
+
+    // The volume got there first; it finishes its copy before writing
+    while ( states[slot].load( std::memory_order_acquire ) == BLOCK_COPYING ) {
+        std::this_thread::yield();
+    }
+    std::copy( copies[slot].get(), copies[slot].get() + VOXELS_PER_BLOCK, out );
+    copies[slot].reset();
+    states[slot].store( BLOCK_DONE, std::memory_order_relaxed );
+}
+
+void VoxelBlockView::beforeWrite( size_t slot )
+{
+    unsigned char state = BLOCK_LIVE;
+    if ( states[slot].compare_exchange_strong( state, BLOCK_COPYING, std::memory_order_acquire ) ) {
+        copies[slot].reset( new TsdfVoxel[VOXELS_PER_BLOCK] );
+        readLive( slot, blocks[slot], copies[slot].get() );
+        states[slot].store( BLOCK_COPIED, std::memory_order_release );
+        settledCount.fetch_add( 1 );
+        return;
+    }
+
+    // The reader is copying the block out; that is one block, not worth a lock
+    while ( state == BLOCK_READING ) {
+        std::this_thread::yield();
+        state = states[slot].load( std::memory_order_acquire );
+    }
+}
+
+void VoxelBlockView::preserveAll()
+{
+    for ( size_t i = 0; i < blocks.size(); ++i ) {
+        beforeWrite( i );
+    }
+}
+
+TsdfVolume::TsdfVolume( const NUI_FUSION_RECONSTRUCTION_PARAMETERS& params_, ThreadPool& pool_ )
+    : params( params_ )
+    , truncation( defaultTruncationDistance( params_.voxelsPerMeter ) )
+    , blockCountX( (params_.voxelCountX + VOXEL_BLOCK_SIZE - 1) / VOXEL_BLOCK_SIZE )
+    , blockCountY( (params_.voxelCountY + VOXEL_BLOCK_SIZE - 1) / VOXEL_BLOCK_SIZE )
+    , blockCountZ( (params_.voxelCountZ + VOXEL_BLOCK_SIZE - 1) / VOXEL_BLOCK_SIZE )
+    , stamp( 0 )
+    , resetStamp( 0 )
+    , cellCountX( (blockCountX + (1 << CELL_BLOCK_SHIFT) - 1) >> CELL_BLOCK_SHIFT )
+    , cellCountY( (blockCountY + (1 << CELL_BLOCK_SHIFT) - 1) >> CELL_BLOCK_SHIFT )
+    , cellCountZ( (blockCountZ + (1 << CELL_BLOCK_SHIFT) - 1) >> CELL_BLOCK_SHIFT )
+    , pool( pool_ )
+{
+    voxels.resize( (size_t)params.voxelCountX * params.voxelCountY * params.voxelCountZ );
+    blockStamps.resize( (size_t)blockCountX * blockCountY * blockCountZ );
+    writeStamps.resize( blockStamps.size() );
+    blockLeastTsdf.resize( blockStamps.size() );
+    cellLeastTsdf.resize( (size_t)cellCountX * cellCountY * cellCountZ );
+    reset( nullptr );
+}
+
+void TsdfVolume::reset( const Matrix4* worldToVolumeTransform )
+{
+    if ( view ) {
+        view->preserveAll();
+        releaseView();
+    }
+
+    worldToVolume = worldToVolumeInMeters( params, worldToVolumeTransform );
+
+    pool.parallelFor( 0, (int)params.voxelCountZ, [&]( int begin, int end ) {
+        size_t slice = (size_t)params.voxelCountX * params.voxelCountY;
+        TsdfVoxel empty = { (short)TSDF_SCALE, 0 };
+        std::fill( voxels.begin() + begin * slice, voxels.begin() + end * slice, empty );
+    } );
+
+    // Color comes back with the next colored frame
+    std::vector<ColorVoxel>().swap( colors );
+
+    resetStamp = ++stamp;
+    std::fill( blockStamps.begin(), blockStamps.end(), 0u );
+    std::fill( writeStamps.begin(), writeStamps.end(), 0u );
+    std::fill( blockLeastTsdf.begin(), blockLeastTsdf.end(), (short)TSDF_SCALE );
+    std::fill( cellLeastTsdf.begin(), cellLeastTsdf.end(), (short)TSDF_SCALE );
+}
+
+void TsdfVolume::integrate( const DepthFloatFrame& depth, const ColorFrame* color, const CameraIntrinsics& intrinsics,
+                            const RigidTransform& worldToCamera, unsigned short maxWeight )
+{
+    if ( color != nullptr && colors.empty() ) {
+        const ColorVoxel none = { 0, 0, 0, 0 };
+        colors.assign( voxels.size(), none );
+    }
+    ColorVoxel* const colorVoxels = (color != nullptr) ? &colors[0] : nullptr;
+
+    const RigidTransform volumeToCamera = worldToCamera * worldToVolume.inverse();
+    const float vs = voxelSize();
+    const Float3 dx = volumeToCamera.column( 0 ) * vs;
+    const unsigned int integrateStamp = ++stamp;
+
+    if ( view && (view->settled() || view.unique()) ) {
+        releaseView();
+    }
+    VoxelBlockView* const snapshot = view.get();
+
+    // Tasks take whole block slabs in z, so every block stamp has a single writer
+    pool.parallelFor( 0, blockCountZ, [&]( int begin, int end ) {
+        int zEnd = std::min( end * VOXEL_BLOCK_SIZE, (int)params.voxelCountZ );
+        for ( int z = begin * VOXEL_BLOCK_SIZE; z < zEnd; ++z ) {
+            for ( int y = 0; y < (int)params.voxelCountY; ++y ) {
+                Float3 p0 = volumeToCamera * Float3( 0, y * vs, z * vs );
+                int first, last;
+                if ( !clipVoxelRow( p0, dx, params.voxelCountX, intrinsics, first, last ) ) {
+                    continue;
+                }
+                const size_t rowBlocks = blockOffset( 0, y >> VOXEL_BLOCK_SHIFT, z >> VOXEL_BLOCK_SHIFT );
+                for ( int bx = first >> VOXEL_BLOCK_SHIFT; bx <= (last - 1) >> VOXEL_BLOCK_SHIFT; ++bx ) {
+                    if ( snapshot != nullptr && viewSlots[rowBlocks + bx] >= 0 ) {
+                        snapshot->beforeWrite( viewSlots[rowBlocks + bx] );
+                    }
+                    writeStamps[rowBlocks + bx] = integrateStamp;
+                }
+                ColorVoxel* colorRow = (colorVoxels != nullptr) ? colorVoxels + voxelOffset( 0, y, z ) : nullptr;
+                if ( integrateVoxelRow( &voxel( 0, y, z ), colorRow, first, last, p0, dx, depth, color, intrinsics,
+                                        truncation, (float)maxWeight ) ) {
+                    unsigned int* stamps = &blockStamps[rowBlocks];
+                    for ( int bx = first >> VOXEL_BLOCK_SHIFT; bx <= (last - 1) >> VOXEL_BLOCK_SHIFT; ++bx ) {
+                        stamps[bx] = integrateStamp;
+                    }
+                }
+            }
+        }
+    } );
+
+    updateLeastTsdf( integrateStamp - 1 );
+}
+
+void TsdfVolume::deintegrate( const DepthFloatFrame& depth, const CameraIntrinsics& intrinsics,
+                              const RigidTransform& worldToCamera, unsigned short maxWeight )
+{
+    const RigidTransform volumeToCamera = worldToCamera * worldToVolume.inverse();
+    const float vs = voxelSize();
+    const Float3 dx = volumeToCamera.column( 0 ) * vs;
+    const unsigned int deintegrateStamp = ++stamp;
+
+    if ( view && (view->settled() || view.unique()) ) {
+        releaseView();
+    }
+    VoxelBlockView* const snapshot = view.get();
+
+    // The rows of integrate(), with the same single writer per block stamp
+    pool.parallelFor( 0, blockCountZ, [&]( int begin, int end ) {
+        int zEnd = std::min( end * VOXEL_BLOCK_SIZE, (int)params.voxelCountZ );
+        for ( int z = begin * VOXEL_BLOCK_SIZE; z < zEnd; ++z ) {
+            for ( int y = 0; y < (int)params.voxelCountY; ++y ) {
+                Float3 p0 = volumeToCamera * Float3( 0, y * vs, z * vs );
+                int first, last;
+                if ( !clipVoxelRow( p0, dx, params.voxelCountX, intrinsics, first, last ) ) {
+                    continue;
+                }
+                const size_t rowBlocks = blockOffset( 0, y >> VOXEL_BLOCK_SHIFT, z >> VOXEL_BLOCK_SHIFT );
+                for ( int bx = first >> VOXEL_BLOCK_SHIFT; bx <= (last - 1) >> VOXEL_BLOCK_SHIFT; ++bx ) {
+                    if ( snapshot != nullptr && viewSlots[rowBlocks + bx] >= 0 ) {
+                        snapshot->beforeWrite( viewSlots[rowBlocks + bx] );
+                    }
+                    writeStamps[rowBlocks + bx] = deintegrateStamp;
+                }
+                if ( deintegrateVoxelRow( &voxel( 0, y, z ), first, last, p0, dx, depth, intrinsics,
+                                          truncation, (float)maxWeight ) ) {
+                    unsigned int* stamps = &blockStamps[rowBlocks];
+                    for ( int bx = first >> VOXEL_BLOCK_SHIFT; bx <= (last - 1) >> VOXEL_BLOCK_SHIFT; ++bx ) {
+                        stamps[bx] = deintegrateStamp;
+                    }
+                }
+            }
+        }
+    } );
+
+    updateLeastTsdf( deintegrateStamp - 1 );
+}
+
+void TsdfVolume::updateLeastTsdf( unsigned int since )
+{
+    const int cellSize = 1 << CELL_BLOCK_SHIFT;
+
+    // Tasks take whole cell slabs in z, so every block and cell has a single writer
+    pool.parallelFor( 0, cellCountZ, [&]( int begin, int end ) {
+        for ( int cz = begin; cz < end; ++cz ) {
+            for ( int cy = 0; cy < cellCountY; ++cy ) {
+                for ( int cx = 0; cx < cellCountX; ++cx ) {
+                    short cellLeast = (short)TSDF_SCALE;
+                    bool changed = false;
+                    int bzEnd = std::min( (cz + 1) * cellSize, blockCountZ );
+                    int byEnd = std::min( (cy + 1) * cellSize, blockCountY );
+                    int bxEnd = std::min( (cx + 1) * cellSize, blockCountX );
+                    for ( int bz = cz * cellSize; bz < bzEnd; ++bz ) {
+                        for ( int by = cy * cellSize; by < byEnd; ++by ) {
+                            for ( int bx = cx * cellSize; bx < bxEnd; ++bx ) {
+                                const size_t b = blockOffset( bx, by, bz );
+                                if ( blockStamps[b] > since ) {
+                                    // Blocks on the far faces of the volume are cut off
+                                    int x0 = bx * VOXEL_BLOCK_SIZE, y0 = by * VOXEL_BLOCK_SIZE, z0 = bz * VOXEL_BLOCK_SIZE;
+                                    int width = std::min( VOXEL_BLOCK_SIZE, (int)params.voxelCountX - x0 );
+                                    int yEnd = std::min( VOXEL_BLOCK_SIZE, (int)params.voxelCountY - y0 );
+                                    int zEnd = std::min( VOXEL_BLOCK_SIZE, (int)params.voxelCountZ - z0 );
+                                    short least = (short)TSDF_SCALE;
+                                    for ( int z = 0; z < zEnd; ++z ) {
+                                        for ( int y = 0; y < yEnd; ++y ) {
+                                            least = leastObservedTsdf( &voxel( x0, y0 + y, z0 + z ), width, least );
+                                        }
+                                    }
+                                    blockLeastTsdf[b] = least;
+                                    changed = true;
+                                }
+                                cellLeast = std::min( cellLeast, blockLeastTsdf[b] );
+                            }
+                        }
+                    }
+                    if ( changed ) {
+                        cellLeastTsdf[cellOffset( cx, cy, cz )] = cellLeast;
+                    }
+                }
+            }
+        }
+    } );
+}
+
+bool TsdfVolume::changedBlocks( unsigned int since, std::vector<VoxelBlockIndex>& blocks ) const
+{
+    blocks.clear();
+
+    size_t i = 0;
+    for ( int z = 0; z < blockCountZ; ++z ) {
+        for ( int y = 0; y < blockCountY; ++y ) {
+            for ( int x = 0; x < blockCountX; ++x, ++i ) {
+                if ( blockStamps[i] > since ) {
+                    VoxelBlockIndex block = { x, y, z, 0 };
+                    blocks.push_back( block );
+                }
+            }
+        }
+    }
+    return resetStamp <= since;
+}
+
+std::shared_ptr<VoxelBlockView> TsdfVolume::viewChangedBlocks( unsigned int since, bool& complete )
+{
+    if ( view ) {
+        view->preserveAll();
+        releaseView();
+    }
+
+    std::vector<VoxelBlockIndex> blocks;
+    viewSlots.assign( writeStamps.size(), -1 );
+    size_t i = 0;
+    for ( int z = 0; z < blockCountZ; ++z ) {
+        for ( int y = 0; y < blockCountY; ++y ) {
+            for ( int x = 0; x < blockCountX; ++x, ++i ) {
+                if ( writeStamps[i] > since ) {
+                    VoxelBlockIndex block = { x, y, z, 0 };
+                    viewSlots[i] = (int)blocks.size();
+                    blocks.push_back( block );
+                }
+            }
+        }
+    }
+    complete = resetStamp <= since;
+
+    view = std::make_shared<VoxelBlockView>( blocks, [this]( size_t, const VoxelBlockIndex& b, TsdfVoxel* out ) {
+        readVoxels( b.x * VOXEL_BLOCK_SIZE, b.y * VOXEL_BLOCK_SIZE, b.z * VOXEL_BLOCK_SIZE, VOXEL_BLOCK_SIZE, out );
+    } );
+    return view;
+}
+
+void TsdfVolume::releaseView()
+{
+    view.reset();
+    std::vector<int>().swap( viewSlots );
+}
+
+void TsdfVolume::writeBlocks( const std::vector<VoxelBlockIndex>& blocks,
+                              const std::function<void ( size_t i, TsdfVoxel* voxels )>& fill )
+{
+    if ( view ) {
+        view->preserveAll();
+        releaseView();
+    }
+
+    const unsigned int writeStamp = ++stamp;
+    pool.parallelFor( 0, (int)blocks.size(), [&]( int begin, int end ) {
+        TsdfVoxel block[VOXELS_PER_BLOCK];
+        for ( int i = begin; i < end; ++i ) {
+            const VoxelBlockIndex& b = blocks[i];
+            if ( b.level != 0 || b.x < 0 || b.y < 0 || b.z < 0 || b.x >= blockCountX || b.y >= blockCountY || b.z >= blockCountZ ) {
+                continue;
+            }
+            fill( i, block );
+
+            // Blocks on the far faces of the volume are cut off
+            int x0 = b.x * VOXEL_BLOCK_SIZE, y0 = b.y * VOXEL_BLOCK_SIZE, z0 = b.z * VOXEL_BLOCK_SIZE;
+            int width = std::min( VOXEL_BLOCK_SIZE, (int)params.voxelCountX - x0 );
+            int yEnd = std::min( VOXEL_BLOCK_SIZE, (int)params.voxelCountY - y0 );
+            int zEnd = std::min( VOXEL_BLOCK_SIZE, (int)params.voxelCountZ - z0 );
+            for ( int z = 0; z < zEnd; ++z ) {
+                for ( int y = 0; y < yEnd; ++y ) {
+                    const TsdfVoxel* row = block + (z * VOXEL_BLOCK_SIZE + y) * VOXEL_BLOCK_SIZE;
+                    std::copy( row, row + width, &voxel( x0, y0 + y, z0 + z ) );
+                    if ( !colors.empty() ) {
+                        const ColorVoxel none = { 0, 0, 0, 0 };
+                        std::fill_n( colors.begin() + voxelOffset( x0, y0 + y, z0 + z ), width, none );
+                    }
+                }
+            }
+            blockStamps[blockOffset( b.x, b.y, b.z )] = writeStamp;
+            writeStamps[blockOffset( b.x, b.y, b.z )] = writeStamp;
+        }
+    } );
+
+    updateLeastTsdf( writeStamp - 1 );
+}
+
+void TsdfVolume::readVoxels( int x0, int y0, int z0, int size, TsdfVoxel* out ) const
+{
+    const TsdfVoxel empty = { (short)TSDF_SCALE, 0 };
+    std::fill( out, out + (size_t)size * size * size, empty );
+
+    int xBegin = std::max( x0, 0 ), xEnd = std::min( x0 + size, (int)params.voxelCountX );
+    int yBegin = std::max( y0, 0 ), yEnd = std::min( y0 + size, (int)params.voxelCountY );
+    int zBegin = std::max( z0, 0 ), zEnd = std::min( z0 + size, (int)params.voxelCountZ );
+    if ( xBegin >= xEnd ) {
+        return;
+    }
+
+    for ( int z = zBegin; z < zEnd; ++z ) {
+        for ( int y = yBegin; y < yEnd; ++y ) {
+            const TsdfVoxel* row = &voxel( xBegin, y, z );
+            std::copy( row, row + (xEnd - xBegin), out + ((size_t)(z - z0) * size + (y - y0)) * size + (xBegin - x0) );
+        }
+    }
+}
+
+UINT TsdfVolume::sampleColor( const Float3& p ) const
+{
+    int x = (int)(p.x + 0.5f), y = (int)(p.y + 0.5f), z = (int)(p.z + 0.5f);
+    if ( colors.empty() || x < 0 || y < 0 || z < 0 ||
+         x >= (int)params.voxelCountX || y >= (int)params.voxelCountY || z >= (int)params.voxelCountZ ) {
+        return 0;
+    }
+
+    return colorOfVoxel( colors[voxelOffset( x, y, z )] );
+}
+
+bool TsdfVolume::sampleNearest( const Float3& p, float& value ) const
+{
+    int x = (int)(p.x + 0.5f), y = (int)(p.y + 0.5f), z = (int)(p.z + 0.5f);
+    if ( x < 0 || y < 0 || z < 0 ||
+         x >= (int)params.voxelCountX || y >= (int)params.voxelCountY || z >= (int)params.voxelCountZ ) {
+        return false;
+    }
+
+    const TsdfVoxel& v = voxel( x, y, z );
+    value = v.tsdf * INV_TSDF_SCALE;
+    return v.weight != 0;
+}
+
+bool TsdfVolume::sampleTrilinear( const Float3& p, float& value ) const
+{
+    if ( p.x < 0 || p.y < 0 || p.z < 0 ) {
+        return false;
+    }
+    int x = (int)p.x, y = (int)p.y, z = (int)p.z;
+    if ( x + 1 >= (int)params.voxelCountX || y + 1 >= (int)params.voxelCountY || z + 1 >= (int)params.voxelCountZ ) {
+        return false;
+    }
+
+    size_t stepY = params.voxelCountX;
+    size_t stepZ = (size_t)params.voxelCountX * params.voxelCountY;
+    const TsdfVoxel* v = &voxel( x, y, z );
+    const TsdfVoxel* c[8] = { v, v + 1, v + stepY, v + stepY + 1,
+                              v + stepZ, v + stepZ + 1, v + stepZ + stepY, v + stepZ + stepY + 1 };
+    return interpolateVoxels( c, p.x - x, p.y - y, p.z - z, value );
+}
+
+bool TsdfVolume::gradient( const Float3& p, Float3& g ) const
+{
+    float x0, x1, y0, y1, z0, z1;
+    if ( !sampleTrilinear( p - Float3( 1, 0, 0 ), x0 ) || !sampleTrilinear( p + Float3( 1, 0, 0 ), x1 ) ||
+         !sampleTrilinear( p - Float3( 0, 1, 0 ), y0 ) || !sampleTrilinear( p + Float3( 0, 1, 0 ), y1 ) ||
+         !sampleTrilinear( p - Float3( 0, 0, 1 ), z0 ) || !sampleTrilinear( p + Float3( 0, 0, 1 ), z1 ) ) {
+        return false;
+    }
+
+    g = Float3( x1 - x0, y1 - y0, z1 - z0 );
+    return true;
+}
+
+void TsdfVolume::raycast( const RigidTransform& worldToCamera, const CameraIntrinsics& k,
+                          PointCloudFrame& pointCloud ) const
+{
+    pointCloud.resize( k.width, k.height );
+
+    const float vpm = params.voxelsPerMeter;
+    const RigidTransform cameraToVolume = worldToVolume * worldToCamera.inverse();
+    const RigidTransform volumeToWorld = worldToVolume.inverse();
+    const Float3 origin = cameraToVolume.t * vpm;
+    const float dims[3] = { (float)(params.voxelCountX - 1), (float)(params.voxelCountY - 1), (float)(params.voxelCountZ - 1) };
+    const int cellShift = VOXEL_BLOCK_SHIFT + CELL_BLOCK_SHIFT;
+
+    raycastTiles( pool, k, [&]( int u, int v ) {
+        Float3 dir = normalize( cameraToVolume.rotate( k.unproject( (float)u, (float)v, 1.0f ) ) );
+        Float3 step = dir * vpm;
+
+        // t in meters along the ray
+        float tNear = NUI_FUSION_DEFAULT_MINIMUM_DEPTH, tFar = NUI_FUSION_DEFAULT_MAXIMUM_DEPTH;
+        clipRayToBox( origin, step, dims, tNear, tFar );
+
+        float* out = pointCloud.pixel( u, v );
+        float previous = 0, previousT = 0;
+        bool hasPrevious = false;
+        for ( float t = tNear; t <= tFar; ) {
+            Float3 p = origin + step * t;
+            int x = (int)(p.x + 0.5f), y = (int)(p.y + 0.5f), z = (int)(p.z + 0.5f);
+            if ( x >= 0 && y >= 0 && z >= 0 &&
+                 x < (int)params.voxelCountX && y < (int)params.voxelCountY && z < (int)params.voxelCountZ ) {
+                // No surface in the cell or block: jump to where the ray leaves it
+                int shift = -1;
+                if ( cellLeastTsdf[cellOffset( x >> cellShift, y >> cellShift, z >> cellShift )] == (short)TSDF_SCALE ) {
+                    shift = cellShift;
+                }
+                else if ( blockLeastTsdf[blockOffset( x >> VOXEL_BLOCK_SHIFT, y >> VOXEL_BLOCK_SHIFT, z >> VOXEL_BLOCK_SHIFT )] == (short)TSDF_SCALE ) {
+                    shift = VOXEL_BLOCK_SHIFT;
+                }
+                if ( shift >= 0 ) {
+                    if ( hasPrevious && previous < 0 ) {
+                        // Left the back of a surface
+                        break;
+                    }
+                    t = std::max( cellExit( origin, step, x >> shift, y >> shift, z >> shift, (float)(1 << shift), tFar + 1 ), t ) + 1e-4f;
+                    hasPrevious = false;
+                    continue;
+                }
+            }
+
+            float f;
+            if ( !sampleNearest( p, f ) ) {
+                hasPrevious = false;
+                t += truncation;
+                continue;
+            }
+
+            if ( hasPrevious && previous > 0 && f < 0 ) {
+                // Zero crossing, refine it with trilinear samples
+                float fa, fb, tHit = previousT;
+                if ( sampleTrilinear( origin + step * previousT, fa ) && sampleTrilinear( p, fb ) && fa > fb ) {
+                    tHit = previousT + (t - previousT) * fa / (fa - fb);
+                }
+
+                Float3 hit = origin + step * tHit;
+                Float3 g;
+                if ( gradient( hit, g ) && length( g ) > 0 ) {
+                    Float3 point = volumeToWorld * (hit * (1.0f / vpm));
+                    Float3 normal = normalize( volumeToWorld.rotate( g ) );
+                    out[0] = point.x;  out[1] = point.y;  out[2] = point.z;
+                    out[3] = normal.x; out[4] = normal.y; out[5] = normal.z;
+                }
+                break;
+            }
+            if ( hasPrevious && previous < 0 && f > 0 ) {
+                // Left the back of a surface
+                break;
+            }
+
+            previous = f;
+            previousT = t;
+            hasPrevious = true;
+
+            // Far from a surface the distance tells how far it is safe to jump
+            t += (f > 0) ? std::max( voxelSize(), f * truncation * 0.8f ) : voxelSize();
+        }
+    } );
+}
+
+}
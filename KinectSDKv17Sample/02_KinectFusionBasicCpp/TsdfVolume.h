@@ -0,0 +1,368 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "FusionTypes.h"
+
+namespace kinectbook {
+
+class ThreadPool;
+
+/// <summary>
+/// One voxel: truncated signed distance scaled to a short and its weight (4 bytes per voxel)
+/// </summary>
+struct TsdfVoxel
+{
+    short tsdf;
+    unsigned short weight;
+};
+
+/// <summary>
+/// Fused color of one voxel and its weight, 8 bits each (4 bytes per voxel)
+/// </summary>
+/// <remarks>
+/// Kept in an array of its own next to the TsdfVoxel array: integration
+/// only touches the colors of the few voxels near the surface, and
+/// tracking and raycasting never read them, so a volume without color
+/// costs no bandwidth at all.
+/// </remarks>
+struct ColorVoxel
+{
+    unsigned char b, g, r;
+    unsigned char weight;
+};
+
+/// <summary>
+/// Edge length of a voxel block in voxels; both volumes track changes per block
+/// </summary>
+const int VOXEL_BLOCK_SIZE = 8;
+const int VOXEL_BLOCK_SHIFT = 3;
+const int VOXELS_PER_BLOCK = VOXEL_BLOCK_SIZE * VOXEL_BLOCK_SIZE * VOXEL_BLOCK_SIZE;
+
+/// <summary>
+/// Block coordinates (voxel / VOXEL_BLOCK_SIZE)
+/// </summary>
+struct VoxelBlockIndex
+{
+    int x, y, z;
+    int level;          // voxels 2^level voxels wide, 0 but in the blocks of a MultiScaleTsdfVolume
+};
+
+/// <summary>
+/// Copy-on-write view of some blocks of a volume, read on another thread
+/// while the volume goes on integrating
+/// </summary>
+/// <remarks>
+/// Taking the view copies nothing. A block the volume is about to change
+/// is copied first unless the reader has read it already; whichever side
+/// comes first claims the block, so neither waits longer than it takes to
+/// copy one block. Blocks the volume never touches again are never copied.
+/// The view reads from the volume, which has to outlive the reads.
+/// </remarks>
+class VoxelBlockView
+{
+public:
+
+    /// <summary>
+    /// Copies the current voxels of a block of the view, x fastest
+    /// </summary>
+    typedef std::function<void ( size_t slot, const VoxelBlockIndex& block, TsdfVoxel* voxels )> ReadFunction;
+
+    /// <param name="blocks">Blocks of the view; taken over</param>
+    /// <param name="readLive">Reads a block from the volume</param>
+    VoxelBlockView( std::vector<VoxelBlockIndex>& blocks, const ReadFunction& readLive );
+
+    size_t blockCount() const { return blocks.size(); }
+
+    const VoxelBlockIndex& block( size_t slot ) const { return blocks[slot]; }
+
+    /// <summary>
+    /// Voxels of a block as they were when the view was taken; once per block
+    /// </summary>
+    void read( size_t slot, TsdfVoxel* voxels );
+
+    /// <summary>
+    /// Called by the volume before the voxels of a block of the view change
+    /// </summary>
+    void beforeWrite( size_t slot );
+
+    /// <summary>
+    /// Copy every block not read yet; before the volume drops or clears its voxels
+    /// </summary>
+    void preserveAll();
+
+    /// <summary>
+    /// Every block was read or copied, the volume no longer has to call beforeWrite()
+    /// </summary>
+    bool settled() const { return settledCount.load() == blocks.size(); }
+
+private:
+
+    VoxelBlockView( const VoxelBlockView& );
+    VoxelBlockView& operator=( const VoxelBlockView& );
+
+    enum BlockState
+    {
+        BLOCK_LIVE,         // nobody touched it, the volume holds the voxels of the view
+        BLOCK_READING,      // the reader copies it out of the volume
+        BLOCK_COPYING,      // the volume copies it before changing it
+        BLOCK_COPIED,       // copies[slot] holds the voxels of the view
+        BLOCK_DONE,         // read
+    };
+
+    std::vector<VoxelBlockIndex> blocks;
+    ReadFunction readLive;
+    std::unique_ptr<std::atomic<unsigned char>[]> states;
+    std::vector<std::unique_ptr<TsdfVoxel[]> > copies;
+    std::atomic<size_t> settledCount;
+};
+
+/// <summary>
+/// How the voxels of a reconstruction are stored
+/// </summary>
+enum TsdfVolumeType
+{
+    TSDF_VOLUME_DENSE,      // every voxel of the box
+    TSDF_VOLUME_HASHED,     // only 8x8x8 blocks near observed surfaces
+    TSDF_VOLUME_MULTISCALE, // hashed blocks whose voxels grow with the distance from the camera
+};
+
+/// <summary>
+/// Truncated signed distance volume used by CpuReconstruction
+/// </summary>
+/// <remarks>
+/// Volume coordinates are in voxels: voxel (x, y, z) sits at the integer
+/// position (x, y, z). The default world to volume transform puts the world
+/// origin (the camera after a reset) at the center of the front face,
+/// looking into +Z, like the SDK does.
+/// </remarks>
+class ITsdfVolume
+{
+public:
+
+    virtual ~ITsdfVolume() {}
+
+    /// <summary>
+    /// Clear all voxels
+    /// </summary>
+    /// <param name="worldToVolume">SDK style world to volume transform (with the voxel scale), nullptr for the default</param>
+    virtual void reset( const Matrix4* worldToVolume ) = 0;
+
+    /// <summary>
+    /// Fuse a depth frame seen from worldToCamera into the volume
+    /// </summary>
+    /// <param name="color">Color registered to depth, nullptr to integrate the distance only</param>
+    virtual void integrate( const DepthFloatFrame& depth, const ColorFrame* color, const CameraIntrinsics& intrinsics,
+                            const RigidTransform& worldToCamera, unsigned short maxWeight ) = 0;
+
+    /// <summary>
+    /// Take a depth frame integrated with the same arguments out of the volume again
+    /// </summary>
+    /// <remarks>
+    /// Visits only the blocks the frame was integrated into and allocates
+    /// nothing; the changed blocks count as changed like after integrate().
+    /// Exact while the voxels are below maxWeight, approximate above (see
+    /// removeVoxel). Colors stay as they are.
+    /// </remarks>
+    virtual void deintegrate( const DepthFloatFrame& depth, const CameraIntrinsics& intrinsics,
+                              const RigidTransform& worldToCamera, unsigned short maxWeight ) = 0;
+
+    /// <summary>
+    /// Raycast the zero crossing for every pixel of the camera
+    /// </summary>
+    /// <param name="pointCloud">Points and normals in world space, resized to the camera</param>
+    virtual void raycast( const RigidTransform& worldToCamera, const CameraIntrinsics& intrinsics,
+                          PointCloudFrame& pointCloud ) const = 0;
+
+    virtual const NUI_FUSION_RECONSTRUCTION_PARAMETERS& parameters() const = 0;
+
+    virtual float truncationDistance() const = 0;
+
+    /// <summary>
+    /// World to volume transform in meters
+    /// </summary>
+    virtual RigidTransform worldToVolumeTransform() const = 0;
+
+    /// <summary>
+    /// Bytes held by the voxels and their index
+    /// </summary>
+    virtual size_t memoryUsage() const = 0;
+
+    /// <summary>
+    /// Counter that advances with every integrate(), deintegrate() and reset()
+    /// </summary>
+    virtual unsigned int modificationStamp() const = 0;
+
+    /// <summary>
+    /// Blocks whose voxels integrate() changed after modificationStamp() returned since
+    /// </summary>
+    /// <returns>
+    /// false when the volume was reset after since: anything derived from the
+    /// voxels before is stale, and blocks lists what was integrated after the reset
+    /// </returns>
+    virtual bool changedBlocks( unsigned int since, std::vector<VoxelBlockIndex>& blocks ) const = 0;
+
+    /// <summary>
+    /// Copy the voxels of the cube [x, x + size) * [y, y + size) * [z, z + size), x fastest
+    /// </summary>
+    /// <remarks>Voxels outside the volume or not allocated read as empty (weight 0)</remarks>
+    virtual void readVoxels( int x, int y, int z, int size, TsdfVoxel* voxels ) const = 0;
+
+    /// <summary>
+    /// Copy-on-write view of the blocks integrate() wrote after since
+    /// </summary>
+    /// <remarks>
+    /// Unlike changedBlocks() this includes blocks where only the weights
+    /// grew, so the view can bring a copy of the voxels up to date.
+    /// Call on the thread that integrates. The volume keeps the view intact
+    /// until every block of it was read or copied; a new view replaces the
+    /// last one, which is copied out first.
+    /// </remarks>
+    /// <param name="complete">false when the volume was reset after since, as for changedBlocks()</param>
+    virtual std::shared_ptr<VoxelBlockView> viewChangedBlocks( unsigned int since, bool& complete ) = 0;
+
+    /// <summary>
+    /// Overwrite whole blocks, allocating them where needed (restoring a snapshot)
+    /// </summary>
+    /// <remarks>Blocks outside the volume or of a level it does not have are skipped; the blocks count as changed</remarks>
+    /// <param name="fill">Called on the thread pool with an index into blocks and its voxels, x fastest</param>
+    virtual void writeBlocks( const std::vector<VoxelBlockIndex>& blocks,
+                              const std::function<void ( size_t i, TsdfVoxel* voxels )>& fill ) = 0;
+
+    /// <summary>
+    /// A color frame was integrated since the last reset()
+    /// </summary>
+    virtual bool hasColor() const = 0;
+
+    /// <summary>
+    /// Fused color of the voxel nearest to p (volume coordinates, fine voxels) as BGRA
+    /// </summary>
+    /// <returns>0 (alpha 0) where no color was integrated</returns>
+    virtual UINT sampleColor( const Float3& p ) const = 0;
+
+    float voxelSize() const { return 1.0f / parameters().voxelsPerMeter; }
+
+    /// <summary>
+    /// Create a volume of the given type
+    /// </summary>
+    static ITsdfVolume* create( TsdfVolumeType type, const NUI_FUSION_RECONSTRUCTION_PARAMETERS& params, ThreadPool& pool );
+};
+
+/// <summary>
+/// Distance beyond which the signed distance is truncated
+/// </summary>
+/// <remarks>About 4 voxels (1.5cm at 256 voxels per meter), never below 1cm</remarks>
+inline float defaultTruncationDistance( float voxelsPerMeter )
+{
+    float d = 4.0f / voxelsPerMeter;
+    return (d > 0.01f) ? d : 0.01f;
+}
+
+/// <summary>
+/// World to volume transform in meters: SDK style transform without the voxel scale,
+/// or the default placement when worldToVolume is nullptr
+/// </summary>
+RigidTransform worldToVolumeInMeters( const NUI_FUSION_RECONSTRUCTION_PARAMETERS& params, const Matrix4* worldToVolume );
+
+/// <summary>
+/// Dense truncated signed distance volume on the CPU
+/// </summary>
+/// <remarks>
+/// Every block and every cell of 8x8x8 blocks keeps the least distance of
+/// its observed voxels. A raycast steps over cells and blocks that hold no
+/// surface at once, which is most of the volume in a room.
+/// </remarks>
+class TsdfVolume : public ITsdfVolume
+{
+public:
+
+    TsdfVolume( const NUI_FUSION_RECONSTRUCTION_PARAMETERS& params, ThreadPool& pool );
+
+    virtual void reset( const Matrix4* worldToVolume );
+
+    virtual void integrate( const DepthFloatFrame& depth, const ColorFrame* color, const CameraIntrinsics& intrinsics,
+                            const RigidTransform& worldToCamera, unsigned short maxWeight );
+
+    virtual void deintegrate( const DepthFloatFrame& depth, const CameraIntrinsics& intrinsics,
+                              const RigidTransform& worldToCamera, unsigned short maxWeight );
+
+    virtual void raycast( const RigidTransform& worldToCamera, const CameraIntrinsics& intrinsics,
+                          PointCloudFrame& pointCloud ) const;
+
+    virtual const NUI_FUSION_RECONSTRUCTION_PARAMETERS& parameters() const { return params; }
+
+    virtual float truncationDistance() const { return truncation; }
+
+    virtual RigidTransform worldToVolumeTransform() const { return worldToVolume; }
+
+    virtual size_t memoryUsage() const
+    {
+        return voxels.size() * sizeof(TsdfVoxel) + colors.size() * sizeof(ColorVoxel) +
+               (blockStamps.size() + writeStamps.size()) * sizeof(unsigned int) +
+               (blockLeastTsdf.size() + cellLeastTsdf.size()) * sizeof(short);
+    }
+
+    virtual unsigned int modificationStamp() const { return stamp; }
+
+    virtual bool changedBlocks( unsigned int since, std::vector<VoxelBlockIndex>& blocks ) const;
+
+    virtual void readVoxels( int x, int y, int z, int size, TsdfVoxel* voxels ) const;
+
+    virtual std::shared_ptr<VoxelBlockView> viewChangedBlocks( unsigned int since, bool& complete );
+
+    virtual void writeBlocks( const std::vector<VoxelBlockIndex>& blocks,
+                              const std::function<void ( size_t i, TsdfVoxel* voxels )>& fill );
+
+    virtual bool hasColor() const { return !colors.empty(); }
+
+    virtual UINT sampleColor( const Float3& p ) const;
+
+private:
+
+    size_t voxelOffset( int x, int y, int z ) const
+    {
+        return ((size_t)z * params.voxelCountY + y) * params.voxelCountX + x;
+    }
+
+    TsdfVoxel& voxel( int x, int y, int z ) { return voxels[voxelOffset( x, y, z )]; }
+
+    const TsdfVoxel& voxel( int x, int y, int z ) const { return voxels[voxelOffset( x, y, z )]; }
+
+    bool sampleTrilinear( const Float3& p, float& value ) const;
+    bool sampleNearest( const Float3& p, float& value ) const;
+    bool gradient( const Float3& p, Float3& g ) const;
+
+    size_t blockOffset( int bx, int by, int bz ) const { return ((size_t)bz * blockCountY + by) * blockCountX + bx; }
+    size_t cellOffset( int cx, int cy, int cz ) const { return ((size_t)cz * cellCountY + cy) * cellCountX + cx; }
+    void updateLeastTsdf( unsigned int since );
+    void releaseView();
+
+    NUI_FUSION_RECONSTRUCTION_PARAMETERS params;
+    float truncation;
+    RigidTransform worldToVolume;       // world to volume in meters, scale by voxelsPerMeter for voxels
+    std::vector<TsdfVoxel> voxels;
+    std::vector<ColorVoxel> colors;     // same layout as voxels, empty until color is integrated
+
+    // Stamp of the last integrate() that changed each block, and of the last reset()
+    int blockCountX, blockCountY, blockCountZ;
+    std::vector<unsigned int> blockStamps;
+    std::vector<unsigned int> writeStamps;  // of the last integrate() that wrote a voxel of the block
+    unsigned int stamp;
+    unsigned int resetStamp;
+
+    // leastObservedTsdf() of every block and of every cell of blocks
+    int cellCountX, cellCountY, cellCountZ;
+    std::vector<short> blockLeastTsdf;
+    std::vector<short> cellLeastTsdf;
+
+    // Snapshot being read and the slot of every block in it, -1 when not in it
+    std::shared_ptr<VoxelBlockView> view;
+    std::vector<int> viewSlots;
+
+    ThreadPool& pool;
+};
+
+}
@@ -0,0 +1,353 @@
+#include "VolumeSnapshot.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#include "TsdfKernels.h"
+
+namespace kinectbook {
+
+namespace {
+
+// Snapshots are written in large blocks; a 512^3 room packs to a few MB
+const size_t WRITE_BUFFER_SIZE = 4 * 1024 * 1024;
+
+// PackBits limits: literal runs up to 128 voxels, repeats up to 129
+const size_t MAX_LITERAL_VOXELS = 128;
+const size_t MAX_REPEATED_VOXELS = 129;
+const size_t REPEAT_BIAS = 126;
+
+// Block coordinates packed into one key, 20 bits each, and the level above them
+const long long BLOCK_KEY_MASK = (1 << 20) - 1;
+
+long long blockKey( const VoxelBlockIndex& b )
+{
+    return (long long)b.x | ((long long)b.y << 20) | ((long long)b.z << 40) | ((long long)b.level << 60);
+}
+
+VoxelBlockIndex blockFromKey( long long key )
+{
+    VoxelBlockIndex b = { (int)(key & BLOCK_KEY_MASK), (int)((key >> 20) & BLOCK_KEY_MASK),
+                          (int)((key >> 40) & BLOCK_KEY_MASK), (int)(key >> 60) };
+    return b;
+}
+
+bool sameVoxel( const TsdfVoxel& a, const TsdfVoxel& b )
+{
+    return a.tsdf == b.tsdf && a.weight == b.weight;
+}
+
+bool emptyBlock( const TsdfVoxel* voxels )
+{
+    for ( int i = 0; i < VOXELS_PER_BLOCK; ++i ) {
+        if ( voxels[i].weight != 0 ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void appendVoxels( std::vector<BYTE>& out, const TsdfVoxel* voxels, size_t count )
+{
+    const BYTE* bytes = (const BYTE*)voxels;
+    out.insert( out.end(), bytes, bytes + count * sizeof(TsdfVoxel) );
+}
+
+void packVoxels( const TsdfVoxel* voxels, std::vector<BYTE>& out )
+{
+    out.clear();
+
+    const size_t n = VOXELS_PER_BLOCK;
+    size_t i = 0;
+    while ( i < n ) {
+        size_t run = 1;
+        while ( i + run < n && run < MAX_REPEATED_VOXELS && sameVoxel( voxels[i + run], voxels[i] ) ) {
+            ++run;
+        }
+        if ( run >= 2 ) {
+            out.push_back( (BYTE)(run + REPEAT_BIAS) );
+            appendVoxels( out, voxels + i, 1 );
+            i += run;
+            continue;
+        }
+
+        // Literals up to where the next repeat starts
+        size_t literal = 1;
+        while ( i + literal < n && literal < MAX_LITERAL_VOXELS &&
+                !(i + literal + 1 < n && sameVoxel( voxels[i + literal], voxels[i + literal + 1] )) ) {
+            ++literal;
+        }
+        out.push_back( (BYTE)(literal - 1) );
+        appendVoxels( out, voxels + i, literal );
+        i += literal;
+    }
+}
+
+bool unpackVoxels( const BYTE* p, size_t size, TsdfVoxel* voxels )
+{
+    const BYTE* end = p + size;
+    size_t i = 0;
+    while ( p < end ) {
+        BYTE control = *p++;
+        if ( control < 128 ) {
+            size_t count = (size_t)control + 1;
+            if ( i + count > (size_t)VOXELS_PER_BLOCK || (size_t)(end - p) < count * sizeof(TsdfVoxel) ) {
+                return false;
+            }
+            std::memcpy( voxels + i, p, count * sizeof(TsdfVoxel) );
+            p += count * sizeof(TsdfVoxel);
+            i += count;
+        }
+        else {
+            size_t count = control - REPEAT_BIAS;
+            if ( i + count > (size_t)VOXELS_PER_BLOCK || (size_t)(end - p) < sizeof(TsdfVoxel) ) {
+                return false;
+            }
+            TsdfVoxel v;
+            std::memcpy( &v, p, sizeof(v) );
+            p += sizeof(TsdfVoxel);
+            std::fill( voxels + i, voxels + i + count, v );
+            i += count;
+        }
+    }
+    return i == (size_t)VOXELS_PER_BLOCK;
+}
+
+// SDK style world to volume transform, the inverse of worldToVolumeInMeters()
+Matrix4 worldToVolumeMatrix( const ITsdfVolume& volume )
+{
+    float vpm = volume.parameters().voxelsPerMeter;
+    Matrix4 m = volume.worldToVolumeTransform().toMatrix4();
+    m.M11 *= vpm; m.M12 *= vpm; m.M13 *= vpm;
+    m.M21 *= vpm; m.M22 *= vpm; m.M23 *= vpm;
+    m.M31 *= vpm; m.M32 *= vpm; m.M33 *= vpm;
+    m.M41 *= vpm; m.M42 *= vpm; m.M43 *= vpm;
+    return m;
+}
+
+UINT alignVolumeChunk( UINT size )
+{
+    return (size + VOLUME_CHUNK_ALIGNMENT - 1) & ~(VOLUME_CHUNK_ALIGNMENT - 1);
+}
+
+}
+
+VolumeSnapshotWriter::VolumeSnapshotWriter()
+    : writing( false )
+    , volume( 0 )
+    , lastStamp( 0 )
+    , packedBlocksValid( true )
+{
+}
+
+VolumeSnapshotWriter::~VolumeSnapshotWriter()
+{
+    wait();
+}
+
+bool VolumeSnapshotWriter::start( ITsdfVolume& target, const Matrix4& worldToCamera, const std::string& path )
+{
+    if ( writing.load() ) {
+        return false;
+    }
+    wait();
+
+    if ( volume != &target || !packedBlocksValid ) {
+        packedBlocks.clear();
+        volume = &target;
+        lastStamp = 0;
+        packedBlocksValid = true;
+    }
+
+    // Only what changed since the last snapshot has to be read again
+    unsigned int stamp = target.modificationStamp();
+    bool complete = false;
+    std::shared_ptr<VoxelBlockView> view = target.viewChangedBlocks( lastStamp, complete );
+    if ( !complete ) {
+        packedBlocks.clear();
+    }
+    lastStamp = stamp;
+
+    const NUI_FUSION_RECONSTRUCTION_PARAMETERS& params = target.parameters();
+    VolumeFileHeader header;
+    std::memset( &header, 0, sizeof(header) );
+    std::memcpy( header.magic, VOLUME_FILE_MAGIC, sizeof(header.magic) );
+    header.version = VOLUME_FILE_VERSION;
+    header.headerSize = sizeof(VolumeFileHeader);
+    header.voxelsPerMeter = params.voxelsPerMeter;
+    header.voxelCountX = params.voxelCountX;
+    header.voxelCountY = params.voxelCountY;
+    header.voxelCountZ = params.voxelCountZ;
+    header.worldToVolume = worldToVolumeMatrix( target );
+    header.worldToCamera = worldToCamera;
+
+    writing.store( true );
+    thread = std::thread( &VolumeSnapshotWriter::write, this, view, header, path, std::chrono::steady_clock::now() );
+    return true;
+}
+
+void VolumeSnapshotWriter::wait()
+{
+    if ( thread.joinable() ) {
+        thread.join();
+    }
+}
+
+VolumeSnapshotResult VolumeSnapshotWriter::result() const
+{
+    std::lock_guard<std::mutex> lock( resultMutex );
+    return lastResult;
+}
+
+void VolumeSnapshotWriter::write( std::shared_ptr<VoxelBlockView> view, VolumeFileHeader header, std::string path,
+                                  std::chrono::steady_clock::time_point started )
+{
+    VolumeSnapshotResult result;
+    const std::string temporary = path + ".tmp";
+    FILE* file = 0;
+
+    try {
+        packedBlocksValid = false;
+        TsdfVoxel voxels[VOXELS_PER_BLOCK];
+        for ( size_t slot = 0; slot < view->blockCount(); ++slot ) {
+            view->read( slot, voxels );
+            long long key = blockKey( view->block( slot ) );
+            if ( emptyBlock( voxels ) ) {
+                packedBlocks.erase( key );
+            }
+            else {
+                packVoxels( voxels, packedBlocks[key] );
+            }
+        }
+        result.packedBlockCount = view->blockCount();
+        packedBlocksValid = true;
+
+        // Blocks the volume copies from now on are of no use to anyone
+        view.reset();
+
+        file = std::fopen( temporary.c_str(), "wb" );
+        if ( file == 0 ) {
+            throw std::runtime_error( "VolumeSnapshotWriter: can't create " + temporary );
+        }
+        std::setvbuf( file, 0, _IOFBF, WRITE_BUFFER_SIZE );
+
+        header.blockCount = (UINT)packedBlocks.size();
+        bool written = std::fwrite( &header, sizeof(header), 1, file ) == 1;
+        size_t fileSize = sizeof(header);
+
+        const BYTE padding[VOLUME_CHUNK_ALIGNMENT] = { 0 };
+        for ( std::unordered_map<long long, std::vector<BYTE> >::const_iterator it = packedBlocks.begin();
+              written && it != packedBlocks.end(); ++it ) {
+            VoxelBlockIndex b = blockFromKey( it->first );
+            VolumeChunkHeader chunk = { b.x, b.y, b.z, b.level, (UINT)it->second.size(), 0 };
+            UINT paddingSize = alignVolumeChunk( chunk.size ) - chunk.size;
+            written = std::fwrite( &chunk, sizeof(chunk), 1, file ) == 1 &&
+                      std::fwrite( it->second.data(), 1, chunk.size, file ) == chunk.size &&
+                      std::fwrite( padding, 1, paddingSize, file ) == paddingSize;
+            fileSize += sizeof(chunk) + chunk.size + paddingSize;
+        }
+
+        int closed = std::fclose( file );
+        file = 0;
+        if ( !written || closed != 0 ) {
+            throw std::runtime_error( "VolumeSnapshotWriter: can't write " + temporary );
+        }
+
+#ifdef _WIN32
+        bool moved = ::MoveFileExA( temporary.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING ) != 0;
+#else
+        bool moved = std::rename( temporary.c_str(), path.c_str() ) == 0;
+#endif
+        if ( !moved ) {
+            throw std::runtime_error( "VolumeSnapshotWriter: can't replace " + path );
+        }
+
+        result.succeeded = true;
+        result.blockCount = header.blockCount;
+        result.fileSize = fileSize;
+    }
+    catch ( const std::exception& e ) {
+        if ( file != 0 ) {
+            std::fclose( file );
+        }
+        std::remove( temporary.c_str() );
+        result.error = e.what();
+    }
+
+    result.milliseconds = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - started ).count();
+    {
+        std::lock_guard<std::mutex> lock( resultMutex );
+        lastResult = result;
+    }
+    writing.store( false );
+}
+
+VolumeSnapshotReader::VolumeSnapshotReader( const std::string& path )
+    : file( path, MappedFile::ACCESS_RANDOM )
+    , fileHeader( 0 )
+{
+    const BYTE* data = file.data();
+    const size_t size = file.size();
+
+    fileHeader = (const VolumeFileHeader*)data;
+    if ( size < sizeof(VolumeFileHeader) ||
+         std::memcmp( fileHeader->magic, VOLUME_FILE_MAGIC, sizeof(fileHeader->magic) ) != 0 ) {
+        throw std::runtime_error( "VolumeSnapshotReader: not a snapshot " + path );
+    }
+    if ( fileHeader->version != VOLUME_FILE_VERSION || fileHeader->headerSize < sizeof(VolumeFileHeader) ) {
+        throw std::runtime_error( "VolumeSnapshotReader: unsupported version " + path );
+    }
+
+    // Snapshots are renamed into place when complete, so anything missing is damage
+    blocks.reserve( fileHeader->blockCount );
+    chunks.reserve( fileHeader->blockCount );
+    size_t offset = fileHeader->headerSize;
+    for ( UINT i = 0; i < fileHeader->blockCount; ++i ) {
+        if ( offset > size || size - offset < sizeof(VolumeChunkHeader) ) {
+            throw std::runtime_error( "VolumeSnapshotReader: truncated " + path );
+        }
+        const VolumeChunkHeader* chunk = (const VolumeChunkHeader*)(data + offset);
+        size_t payloadOffset = offset + sizeof(VolumeChunkHeader);
+        if ( chunk->size > size - payloadOffset ) {
+            throw std::runtime_error( "VolumeSnapshotReader: truncated " + path );
+        }
+
+        VoxelBlockIndex block = { chunk->x, chunk->y, chunk->z, chunk->level };
+        blocks.push_back( block );
+        chunks.push_back( chunk );
+        offset = payloadOffset + alignVolumeChunk( chunk->size );
+    }
+}
+
+bool VolumeSnapshotReader::matches( const NUI_FUSION_RECONSTRUCTION_PARAMETERS& params ) const
+{
+    return fileHeader->voxelsPerMeter == params.voxelsPerMeter && fileHeader->voxelCountX == params.voxelCountX &&
+           fileHeader->voxelCountY == params.voxelCountY && fileHeader->voxelCountZ == params.voxelCountZ;
+}
+
+void VolumeSnapshotReader::restore( ITsdfVolume& volume ) const
+{
+    if ( !matches( volume.parameters() ) ) {
+        throw std::runtime_error( "VolumeSnapshotReader: the snapshot is of a volume of another size" );
+    }
+
+    volume.reset( &fileHeader->worldToVolume );
+
+    std::atomic<bool> damaged( false );
+    const TsdfVoxel empty = { (short)TSDF_SCALE, 0 };
+    volume.writeBlocks( blocks, [&]( size_t i, TsdfVoxel* voxels ) {
+        if ( !unpackVoxels( (const BYTE*)(chunks[i] + 1), chunks[i]->size, voxels ) ) {
+            std::fill( voxels, voxels + VOXELS_PER_BLOCK, empty );
+            damaged.store( true );
+        }
+    } );
+
+    if ( damaged.load() ) {
+        volume.reset( &fileHeader->worldToVolume );
+        throw std::runtime_error( "VolumeSnapshotReader: damaged block data" );
+    }
+}
+
+}
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "../common/MappedFile.h"
+#include "TsdfVolume.h"
+
+namespace kinectbook {
+
+// Snapshot of a reconstruction (.kbvol)
+//
+//   file  : VolumeFileHeader, then blockCount chunks
+//   chunk : VolumeChunkHeader, packed voxels, zero padding to a multiple of 8 bytes
+//
+// A chunk holds the voxels of one block, x fastest, packed with PackBits
+// over whole voxels: a control byte n < 128 is followed by n + 1 literal
+// voxels, a control byte n >= 128 by one voxel repeated n - 126 times.
+// Blocks without an observed voxel are not stored and read as empty.
+
+const char VOLUME_FILE_MAGIC[4] = { 'K', 'B', 'V', 'L' };
+const UINT VOLUME_FILE_VERSION = 2;
+const UINT VOLUME_CHUNK_ALIGNMENT = 8;
+
+struct VolumeFileHeader
+{
+    char magic[4];
+    UINT version;
+    UINT headerSize;        // sizeof(VolumeFileHeader), chunks start here
+    UINT blockCount;
+    FLOAT voxelsPerMeter;
+    UINT voxelCountX;
+    UINT voxelCountY;
+    UINT voxelCountZ;
+    Matrix4 worldToVolume;  // SDK style, with the voxel scale
+    Matrix4 worldToCamera;  // pose of the camera when the snapshot was taken
+};
+
+struct VolumeChunkHeader
+{
+    int x, y, z;            // block
+    int level;              // VoxelBlockIndex::level, 0 but for multi-scale volumes
+    UINT size;              // packed bytes without the padding
+    UINT reserved;          // 0, keeps the header a multiple of 8 bytes
+};
+
+/// <summary>
+/// What the last snapshot of a VolumeSnapshotWriter did
+/// </summary>
+struct VolumeSnapshotResult
+{
+    bool succeeded;
+    std::string error;
+    size_t blockCount;          // blocks in the file
+    size_t packedBlockCount;    // blocks read and packed, the others were unchanged since the last snapshot
+    size_t fileSize;
+    double milliseconds;        // from start() until the file was in place
+
+    VolumeSnapshotResult() : succeeded( false ), blockCount( 0 ), packedBlockCount( 0 ), fileSize( 0 ), milliseconds( 0 ) {}
+};
+
+/// <summary>
+/// Writes snapshots of a volume on a background thread
+/// </summary>
+/// <remarks>
+/// start() only takes a copy-on-write view of the blocks integrated since
+/// the last snapshot and returns; the thread packs those blocks while the
+/// volume goes on integrating. Packed blocks are kept, so a block that did
+/// not change is neither read nor packed again. The file is written next
+/// to its final name and renamed when complete, a crash never leaves half
+/// a snapshot behind. The volume has to outlive the writer.
+/// </remarks>
+class VolumeSnapshotWriter
+{
+public:
+
+    VolumeSnapshotWriter();
+    ~VolumeSnapshotWriter();
+
+    /// <summary>
+    /// Start a snapshot; on the thread that integrates the volume
+    /// </summary>
+    /// <returns>false when the last snapshot is still being written; nothing is started</returns>
+    bool start( ITsdfVolume& volume, const Matrix4& worldToCamera, const std::string& path );
+
+    bool busy() const { return writing.load(); }
+
+    /// <summary>
+    /// Wait until the snapshot being written is complete
+    /// </summary>
+    void wait();
+
+    /// <summary>
+    /// The last complete snapshot; call after busy() became false or wait()
+    /// </summary>
+    VolumeSnapshotResult result() const;
+
+private:
+
+    VolumeSnapshotWriter( const VolumeSnapshotWriter& );
+    VolumeSnapshotWriter& operator=( const VolumeSnapshotWriter& );
+
+    void write( std::shared_ptr<VoxelBlockView> view, VolumeFileHeader header, std::string path,
+                std::chrono::steady_clock::time_point started );
+
+    std::thread thread;
+    std::atomic<bool> writing;
+
+    // Packed voxels of every non-empty block, by block key; only the
+    // writer thread touches them while a snapshot is written
+    std::unordered_map<long long, std::vector<BYTE> > packedBlocks;
+    const ITsdfVolume* volume;      // the packed blocks belong to
+    unsigned int lastStamp;         // modificationStamp() of the volume at the last snapshot
+    bool packedBlocksValid;         // false after a snapshot failed while packing
+
+    mutable std::mutex resultMutex;
+    VolumeSnapshotResult lastResult;
+};
+
+/// <summary>
+/// Reads a snapshot back, through a memory map of the file
+/// </summary>
+/// <remarks>
+/// The chunks are indexed when the file is opened; restore() unpacks them
+/// in parallel straight from the mapping, so only the blocks stored are
+/// touched. Errors, including a damaged file, are reported with
+/// std::runtime_error.
+/// </remarks>
+class VolumeSnapshotReader
+{
+public:
+
+    explicit VolumeSnapshotReader( const std::string& path );
+
+    const VolumeFileHeader& header() const { return *fileHeader; }
+
+    /// <summary>
+    /// true when the snapshot was taken of a volume with these parameters
+    /// </summary>
+    bool matches( const NUI_FUSION_RECONSTRUCTION_PARAMETERS& params ) const;
+
+    /// <summary>
+    /// Reset the volume to the placement of the snapshot and write its blocks
+    /// </summary>
+    void restore( ITsdfVolume& volume ) const;
+
+    size_t blockCount() const { return blocks.size(); }
+
+private:
+
+    VolumeSnapshotReader( const VolumeSnapshotReader& );
+    VolumeSnapshotReader& operator=( const VolumeSnapshotReader& );
+
+    MappedFile file;
+    const VolumeFileHeader* fileHeader;
+    std::vector<VoxelBlockIndex> blocks;
+    std::vector<const VolumeChunkHeader*> chunks;
+};
+
+}
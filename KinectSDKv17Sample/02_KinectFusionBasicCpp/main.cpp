@@ -1,300 +1,727 @@
-#include <iostream>
-
-#include <Windows.h>
-#include <NuiApi.h>
-#include <NuiKinectFusionApi.h>
-
-#include <opencv2/opencv.hpp>
-
-
-
-#define ERROR_CHECK( ret )  \
-    if ( ret != S_OK ) {    \
-    std::stringstream ss;	\
-    ss << "failed " #ret " " << std::hex << ret << std::endl;			\
-    throw std::runtime_error( ss.str().c_str() );			\
-    }
-
-const NUI_IMAGE_RESOLUTION CAMERA_RESOLUTION = NUI_IMAGE_RESOLUTION_640x480;
-
-class KinectSample
-{
-private:
-
-    INuiSensor* kinect;
-
-    INuiFusionReconstruction*   m_pVolume;
-
-    NUI_FUSION_IMAGE_FRAME*     m_pDepthFloatImage;
-    NUI_FUSION_IMAGE_FRAME*     m_pPointCloud;
-    NUI_FUSION_IMAGE_FRAME*     m_pShadedSurface;
-
-    HANDLE imageStreamHandle;
-    HANDLE depthStreamHandle;
-    HANDLE streamEvent;
-
-    DWORD width;
-    DWORD height;
-
-public:
-
-    KinectSample()
-        : kinect( 0 )
-        , m_pVolume( 0 )
-        , m_pDepthFloatImage( 0 )
-        , m_pPointCloud( 0 )
-        , m_pShadedSurface( 0 )
-        , trackingErrorCount( 0 )
-    {
-    }
-
-    ~KinectSample()
-    {
-        // I
-        if ( kinect != 0 ) {
-            kinect->NuiShutdown();
-            kinect->Release();
-        }
-    }
-
-    void initialize()
-    {
-        createInstance();
-
-        // Kinect̐ݒ
-        ERROR_CHECK( kinect->NuiInitialize( NUI_INITIALIZE_FLAG_USES_COLOR | NUI_INITIALIZE_FLAG_USES_DEPTH_AND_PLAYER_INDEX | NUI_INITIALIZE_FLAG_USES_SKELETON ) );
-
-        // RGBJ
-        ERROR_CHECK( kinect->NuiImageStreamOpen( NUI_IMAGE_TYPE_COLOR, CAMERA_RESOLUTION,
-            0, 2, 0, &imageStreamHandle ) );
-
-        // J
-        ERROR_CHECK( kinect->NuiImageStreamOpen( NUI_IMAGE_TYPE_DEPTH_AND_PLAYER_INDEX, CAMERA_RESOLUTION,
-            0, 2, 0, &depthStreamHandle ) );
-
-        // Near[h
-        ERROR_CHECK( kinect->NuiImageStreamSetImageFrameFlags(
-          depthStreamHandle, NUI_IMAGE_STREAM_FLAG_ENABLE_NEAR_MODE ) );
-
-        // XPg
-        ERROR_CHECK( kinect->NuiSkeletonTrackingEnable( 0, NUI_SKELETON_TRACKING_FLAG_ENABLE_SEATED_SUPPORT ) );
-
-        // t[XVCxg̃nh쐬
-        streamEvent = ::CreateEvent( 0, TRUE, FALSE, 0 );
-        ERROR_CHECK( kinect->NuiSetFrameEndEvent( streamEvent, 0 ) );
-
-        // w肵𑜓x́AʃTCY擾
-        ::NuiImageResolutionToSize(CAMERA_RESOLUTION, width, height );
-
-        // KinectFusion̏
-        initializeKinectFusion();
-    }
-
-    void initializeKinectFusion()
-    {
-        HRESULT hr = S_OK;
-
-        NUI_FUSION_RECONSTRUCTION_PARAMETERS reconstructionParams;
-        reconstructionParams.voxelsPerMeter = 256;// 1000mm / 256vpm = ~3.9mm/voxel    
-        reconstructionParams.voxelCountX = 512;   // 512 / 256vpm = 2m wide reconstruction
-        reconstructionParams.voxelCountY = 384;   // Memory = 512*384*512 * 4bytes per voxel
-        reconstructionParams.voxelCountZ = 512;   // This will require a GPU with at least 512MB
-
-        // Reconstruction Volume ̃CX^X𐶐
-        hr = ::NuiFusionCreateReconstruction(
-            &reconstructionParams,
-            NUI_FUSION_RECONSTRUCTION_PROCESSOR_TYPE_AMP, // NUI_FUSION_RECONSTRUCTION_PROCESSOR_TYPE_CPU
-            -1, &IdentityMatrix(), &m_pVolume);
-        if (FAILED(hr)){
-            throw std::runtime_error( "::NuiFusionCreateReconstruction failed." );
-        }
-
-        // DepthFloatImage ̃CX^X𐶐
-        hr = ::NuiFusionCreateImageFrame(NUI_FUSION_IMAGE_TYPE_FLOAT, width, height, nullptr, &m_pDepthFloatImage);
-        if (FAILED(hr)) {
-            throw std::runtime_error( "::NuiFusionCreateImageFrame failed(Float)." );
-        }
-
-        // PointCloud ̃CX^X𐶐
-        hr = ::NuiFusionCreateImageFrame(NUI_FUSION_IMAGE_TYPE_POINT_CLOUD, width, height, nullptr, &m_pPointCloud);
-        if (FAILED(hr)) {
-            throw std::runtime_error( "::NuiFusionCreateImageFrame failed(PointCloud)." );
-        }
-
-        // VF[_[T[tF[X̃CX^X𐶐
-        hr = ::NuiFusionCreateImageFrame(NUI_FUSION_IMAGE_TYPE_COLOR, width, height, nullptr, &m_pShadedSurface);
-        if (FAILED(hr)) {
-            throw std::runtime_error( "::NuiFusionCreateImageFrame failed(Color)." );
-        }
-
-        // Zbg
-        m_pVolume->ResetReconstruction( &IdentityMatrix(), nullptr );
-    }
-
-    /// <summary>
-    /// Set Identity in a Matrix4
-    /// </summary>
-    /// <param name="mat">The matrix to set to identity</param>
-    const Matrix4& IdentityMatrix()
-    {
-        static Matrix4 mat;
-        mat.M11 = 1; mat.M12 = 0; mat.M13 = 0; mat.M14 = 0;
-        mat.M21 = 0; mat.M22 = 1; mat.M23 = 0; mat.M24 = 0;
-        mat.M31 = 0; mat.M32 = 0; mat.M33 = 1; mat.M34 = 0;
-        mat.M41 = 0; mat.M42 = 0; mat.M43 = 0; mat.M44 = 1;
-        return mat;
-    }
-
-    void run()
-    {
-        cv::Mat image;
-
-        // C[v
-        while ( 1 ) {
-            // f[^̍XV҂
-            DWORD ret = ::WaitForSingleObject( streamEvent, INFINITE );
-            ::ResetEvent( streamEvent );
-
-            processDepth( image );
-
-            // 摜\
-            cv::imshow( "KinectSample", image );
-
-            // Î߂̃L[̓`FbNA\̂߂̃EFCg
-            int key = cv::waitKey( 10 );
-            if ( key == 'q' ) {
-                break;
-            }
-        }
-    }
-
-private:
-
-    void createInstance()
-    {
-        // ڑĂKinect̐擾
-        int count = 0;
-        ERROR_CHECK( ::NuiGetSensorCount( &count ) );
-        if ( count == 0 ) {
-            throw std::runtime_error( "Kinect ڑĂ" );
-        }
-
-        // ŏKinect̃CX^X쐬
-        ERROR_CHECK( ::NuiCreateSensorByIndex( 0, &kinect ) );
-
-        // Kinect̏Ԃ擾
-        HRESULT status = kinect->NuiStatus();
-        if ( status != S_OK ) {
-            throw std::runtime_error( "Kinect p\ł͂܂" );
-        }
-    }
-
-    void drawRgbImage( cv::Mat& image )
-    {
-        // RGBJ̃t[f[^擾
-        NUI_IMAGE_FRAME imageFrame = { 0 };
-        ERROR_CHECK( kinect->NuiImageStreamGetNextFrame( imageStreamHandle, INFINITE, &imageFrame ) );
-
-        // 摜f[^擾
-        NUI_LOCKED_RECT colorData;
-        imageFrame.pFrameTexture->LockRect( 0, &colorData, 0, 0 );
-
-        // 摜f[^Rs[
-        image = cv::Mat( height, width, CV_8UC4, colorData.pBits );
-
-        // t[f[^
-        ERROR_CHECK( kinect->NuiImageStreamReleaseFrame( imageStreamHandle, &imageFrame ) );
-    }
-
-    void processDepth( cv::Mat& mat )
-    {
-        // J̃t[f[^擾
-        NUI_IMAGE_FRAME depthFrame = { 0 };
-        ERROR_CHECK( kinect->NuiImageStreamGetNextFrame( depthStreamHandle, 0, &depthFrame ) );
-
-        // t[f[^ɁAgf[^擾
-		BOOL nearMode = FALSE;
-		INuiFrameTexture *frameTexture = 0;
-		kinect->NuiImageFrameGetDepthImagePixelFrameTexture( depthStreamHandle, &depthFrame, &nearMode, &frameTexture );
-
-        // f[^擾
-        NUI_LOCKED_RECT depthData = { 0 };
-        frameTexture->LockRect( 0, &depthData, 0, 0 );
-        if ( depthData.Pitch == 0 ) {
-            std::cout << "zero" << std::endl;
-        }
-
-        // KinectFusion̏s
-        processKinectFusion( (NUI_DEPTH_IMAGE_PIXEL*)depthData.pBits, depthData.size, mat );
-
-        // t[f[^
-        ERROR_CHECK( kinect->NuiImageStreamReleaseFrame( depthStreamHandle, &depthFrame ) );
-    }
-
-    int trackingErrorCount;
-    void processKinectFusion( const NUI_DEPTH_IMAGE_PIXEL* depthPixel, int depthPixelSize, cv::Mat& mat ) 
-    {
-        // DepthImagePixel  DepthFloaatFrame ɕϊ
-        HRESULT hr = ::NuiFusionDepthToDepthFloatFrame( depthPixel, width, height, m_pDepthFloatImage,
-                            NUI_FUSION_DEFAULT_MINIMUM_DEPTH, NUI_FUSION_DEFAULT_MAXIMUM_DEPTH, TRUE );
-        if (FAILED(hr)) {
-            throw std::runtime_error( "::NuiFusionDepthToDepthFloatFrame failed." );
-        }
-
-        // t[
-        Matrix4 worldToCameraTransform;
-        m_pVolume->GetCurrentWorldToCameraTransform( &worldToCameraTransform );
-        hr = m_pVolume->ProcessFrame( m_pDepthFloatImage, NUI_FUSION_DEFAULT_ALIGN_ITERATION_COUNT,
-                                        NUI_FUSION_DEFAULT_INTEGRATION_WEIGHT, &worldToCameraTransform );
-        if (FAILED(hr)) {
-            // 萔G[ɂȂ烊Zbg
-            // Kinect܂͑Ώۂf Ȃǂ̏ꍇ
-            ++trackingErrorCount;
-            if ( trackingErrorCount >= 100 ) {
-                trackingErrorCount = 0;
-                m_pVolume->ResetReconstruction( &IdentityMatrix(), nullptr );
-            }
-
-            return;
-        }
-
-        // PointCloud擾
-        hr = m_pVolume->CalculatePointCloud( m_pPointCloud, &worldToCameraTransform );
-        if (FAILED(hr)) {
-            throw std::runtime_error( "CalculatePointCloud failed." );
-        }
-
-        // PointCloud2̃f[^ɕ`悷
-        hr = ::NuiFusionShadePointCloud( m_pPointCloud, &worldToCameraTransform,
-                                    nullptr, m_pShadedSurface, nullptr );
-        if (FAILED(hr)) {
-            throw std::runtime_error( "::NuiFusionShadePointCloud failed." );
-        }
-
-        // 2̃f[^Bitmapɏ
-        INuiFrameTexture * pShadedImageTexture = m_pShadedSurface->pFrameTexture;
-        NUI_LOCKED_RECT ShadedLockedRect;
-        hr = pShadedImageTexture->LockRect(0, &ShadedLockedRect, nullptr, 0);
-        if (FAILED(hr)) {
-            throw std::runtime_error( "LockRect failed." );
-        }
-
-        mat = cv::Mat( height, width, CV_8UC4, ShadedLockedRect.pBits );
-
-        // We're done with the texture so unlock it
-        pShadedImageTexture->UnlockRect(0);
-    }
-};
-
-void main()
-{
-
-    try {
-        KinectSample kinect;
-        kinect.initialize();
-        kinect.run();
-    }
-    catch ( std::exception& ex ) {
-        std::cout << ex.what() << std::endl;
-    }
-}
+#include <atomic>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <Windows.h>
+#include <NuiApi.h>
+#include <NuiKinectFusionApi.h>
+
+#include <opencv2/opencv.hpp>
+
+#include "../common/FrameRecorder.h"
+#include "../common/KinectFrameSource.h"
+#include "../common/Profiler.h"
+#include "../common/RecordedFrameSource.h"
+#include "../common/TripleBuffer.h"
+#include "CpuReconstruction.h"
+#include "DepthProcessor.h"
+#include "FusionPipeline.h"
+#include "MeshWriter.h"
+#include "MultiSensorFusion.h"
+#include "PointCloudShader.h"
+
+
+#define ERROR_CHECK( ret )  \
+    if ( ret != S_OK ) {    \
+    std::stringstream ss;	\
+    ss << "failed " #ret " " << std::hex << ret << std::endl;			\
+    throw std::runtime_error( ss.str().c_str() );			\
+    }
+
+const NUI_IMAGE_RESOLUTION CAMERA_RESOLUTION = NUI_IMAGE_RESOLUTION_640x480;
+
+// ボリュームとカメラの位置のスナップショット
+const char* const SNAPSHOT_FILE = "KinectFusion.kbvol";
+
+// カメラの軌跡(TUM RGB-D 形式、ループを閉じて直した後の位置)
+const char* const TRAJECTORY_FILE = "KinectFusion.poses.txt";
+
+// シェーディングの種類(kinectbook::PointCloudShading の後に、比較のためのSDKのシェーディング)
+const int SHADING_MODE_SDK = kinectbook::POINT_CLOUD_SHADING_COLOR + 1;
+const char* const SHADING_MODE_NAMES[] = { "surface", "normals", "depth", "color", "sdk" };
+
+class KinectSample
+{
+private:
+
+    // Kinectの距離とスケルトンのフレーム(データのない距離フレームは渡されない)
+    // RGBカメラと座標の変換は kinect を直接使う
+    kinectbook::KinectFrameSource*  kinectSource;
+    INuiSensor* kinect;
+
+    // CPUで動くKinectFusion(INuiFusionReconstruction と同じ使い方ができる)
+    kinectbook::CpuReconstruction*  m_pVolume;
+
+    NUI_FUSION_IMAGE_FRAME*     m_pPointCloud;
+    NUI_FUSION_IMAGE_FRAME*     m_pShadedSurface;
+
+    // シェーディングした画像(シェーディングのスレッドが書き、メインループが表示する)
+    // 3枚を使い回すので、描画と表示はお互いを待たず、表示中の画像が書き換えられることもない
+    kinectbook::TripleBuffer<cv::Mat> presentation;
+
+    // シェーディングの種類(メインループが切り替え、シェーディングのスレッドが読む)
+    std::atomic<int> shadingMode;
+
+    // 距離データの記録と再生
+    kinectbook::FrameRecorder*  recorder;
+    std::mutex                  recorderMutex;
+    kinectbook::RecordedFrameSource*    player;
+
+    // 複数のKinectを使う場合は、すべてのKinectの距離データを1つのボリュームに統合する
+    // Kinectごとの距離フレーム(データのない距離フレームは渡されない)
+    std::vector<kinectbook::KinectFrameSource*> sensors;
+    std::vector<Matrix4>        referenceToCamera;
+
+    // 距離フレームが取れなかった回数(kinectSource の数えた分は reportedEmptyDepthFrames まで、
+    // sensors[i] の数えた分は reportedSensorEmptyFrames[i] まで加えてある)
+    unsigned int emptyDepthFrames;
+    unsigned int reportedEmptyDepthFrames;
+    std::vector<unsigned int>   reportedSensorEmptyFrames;
+
+    // RGBカメラの最新の画像と、距離データの各ピクセルに対応するRGBカメラのピクセル
+    // (色をボリュームに統合するため。再生時は使わず、複数のKinectでは1台目のものを使う)
+    INuiCoordinateMapper*               coordinateMapper;
+    std::vector<BYTE>                   colorImage;
+    std::vector<NUI_COLOR_IMAGE_POINT>  colorCoordinates;
+
+    HANDLE imageStreamHandle;
+
+    DWORD width;
+    DWORD height;
+
+public:
+
+    KinectSample()
+        : kinectSource( 0 )
+        , kinect( 0 )
+        , m_pVolume( 0 )
+        , m_pPointCloud( 0 )
+        , m_pShadedSurface( 0 )
+        , recorder( 0 )
+        , player( 0 )
+        , emptyDepthFrames( kinectbook::Profiler::shared().counter( "kinect.empty_depth_frames" ) )
+        , reportedEmptyDepthFrames( 0 )
+        , coordinateMapper( 0 )
+    {
+        shadingMode = kinectbook::POINT_CLOUD_SHADING_SURFACE;
+    }
+
+    ~KinectSample()
+    {
+        // 終了処理
+        delete m_pVolume;
+        delete recorder;
+        delete player;
+
+        if ( coordinateMapper != 0 ) {
+            coordinateMapper->Release();
+        }
+        delete kinectSource;
+
+        for ( size_t i = 0; i < sensors.size(); ++i ) {
+            delete sensors[i];
+        }
+    }
+
+    void initialize()
+    {
+        // Kinectの設定を初期化する(距離カメラはNearモード、スケルトンは着席モード、RGBカメラも使う)
+        // フレームの終わりのイベントではなく、各ストリームのイベントで距離フレームが来たかを調べる
+        kinectbook::KinectFrameSourceOptions options;
+        options.resolution = CAMERA_RESOLUTION;
+        options.nearMode = true;
+        options.skeletonTrackingFlags = NUI_SKELETON_TRACKING_FLAG_ENABLE_SEATED_SUPPORT;
+        options.color = true;
+        kinectSource = new kinectbook::KinectFrameSource( options );
+        kinect = kinectSource->sensor();
+        imageStreamHandle = kinectSource->colorStream();
+
+        // 指定した解像度の、画面サイズを取得する
+        ::NuiImageResolutionToSize(CAMERA_RESOLUTION, width, height );
+
+        // 距離データとRGBカメラの画像の位置を合わせる
+        ERROR_CHECK( kinect->NuiGetCoordinateMapper( &coordinateMapper ) );
+        colorCoordinates.resize( width * height );
+
+        // KinectFusionの初期化
+        initializeKinectFusion();
+    }
+
+    // Kinectの代わりに、記録したファイルから距離データを読み込む
+    void initializePlayer( const std::string& path )
+    {
+        player = new kinectbook::RecordedFrameSource( path );
+        std::cout << path << " : " << player->recording().depthFrameCount() << " frames" << std::endl;
+
+        // 指定した解像度の、画面サイズを取得する
+        ::NuiImageResolutionToSize(CAMERA_RESOLUTION, width, height );
+
+        // KinectFusionの初期化
+        initializeKinectFusion();
+    }
+
+    // 接続されているKinectをすべて使う
+    // extrinsics : 2台目以降のKinectの、1台目から見た位置のファイル(MultiSensorFusion::loadExtrinsics)
+    void initializeMultiSensor( const std::string& extrinsics )
+    {
+        int count = 0;
+        ERROR_CHECK( ::NuiGetSensorCount( &count ) );
+        for ( int i = 0; i < count; ++i ) {
+            // 距離カメラと、1台目だけはRGBカメラを使う(プレイヤーの検出とスケルトンは1台でしかできない)
+            kinectbook::KinectFrameSourceOptions options;
+            options.sensorIndex = i;
+            options.resolution = CAMERA_RESOLUTION;
+            options.playerIndex = false;
+            options.skeleton = false;
+            options.color = sensors.empty();
+
+            // 利用できないKinectは使わない
+            try {
+                std::unique_ptr<kinectbook::KinectFrameSource> sensor( new kinectbook::KinectFrameSource( options ) );
+                sensors.push_back( sensor.get() );
+                sensor.release();
+            }
+            catch ( std::exception& ex ) {
+                std::cout << i << " : " << ex.what() << std::endl;
+            }
+        }
+        reportedSensorEmptyFrames.assign( sensors.size(), 0 );
+        if ( sensors.empty() ) {
+            throw std::runtime_error( "Kinect を接続してください" );
+        }
+        std::cout << sensors.size() << " Kinect" << std::endl;
+
+        // 位置のファイルがなければ、すべて1台目と同じ位置とする
+        referenceToCamera = extrinsics.empty() ?
+            std::vector<Matrix4>( sensors.size(), IdentityMatrix() ) :
+            kinectbook::MultiSensorFusion::loadExtrinsics( extrinsics, (UINT)sensors.size() );
+
+        // 指定した解像度の、画面サイズを取得する
+        ::NuiImageResolutionToSize(CAMERA_RESOLUTION, width, height );
+
+        // 1台目の距離データとRGBカメラの画像の位置を合わせる
+        kinect = sensors[0]->sensor();
+        imageStreamHandle = sensors[0]->colorStream();
+        ERROR_CHECK( kinect->NuiGetCoordinateMapper( &coordinateMapper ) );
+        colorCoordinates.resize( width * height );
+
+        // KinectFusionの初期化
+        initializeKinectFusion();
+    }
+
+    void initializeKinectFusion()
+    {
+        HRESULT hr = S_OK;
+
+        NUI_FUSION_RECONSTRUCTION_PARAMETERS reconstructionParams;
+        reconstructionParams.voxelsPerMeter = 256;// 1000mm / 256vpm = ~3.9mm/voxel    
+        reconstructionParams.voxelCountX = 2048;  // 2048 / 256vpm = 8m wide reconstruction
+        reconstructionParams.voxelCountY = 1024;  // 1024 / 256vpm = 4m high
+        reconstructionParams.voxelCountZ = 2048;  // 2048 / 256vpm = 8m deep
+
+        // Reconstruction Volume のインスタンスを生成(CPU、全コアを使う)
+        // 表面付近の 8x8x8 ボクセルブロックだけを確保するので、メモリは範囲の大きさではなく
+        // スキャンした表面の面積に比例する(密なボリュームでは 8m x 4m x 8m = 32GB になる)
+        // ボクセルの大きさはカメラからの距離に合わせて 1m までは 3.9mm、遠くでは最大 3.1cm まで粗くなる
+        m_pVolume = new kinectbook::CpuReconstruction( reconstructionParams, IdentityMatrix(),
+                                                       kinectbook::TSDF_VOLUME_MULTISCALE );
+
+        // 以前に見た場所に戻ってきたらカメラのずれを直し、直近の約20秒のフレームを正しい位置で統合し直す
+        // 複数のKinectでは、ほかのKinectのフレームも1台目のフレームと一緒に動かす(その分、保持する時間は短くなる)
+        m_pVolume->enableLoopClosure();
+
+        // PointCloud のインスタンスを生成(シェーディング用)
+        hr = ::NuiFusionCreateImageFrame(NUI_FUSION_IMAGE_TYPE_POINT_CLOUD, width, height, nullptr, &m_pPointCloud);
+        if (FAILED(hr)) {
+            throw std::runtime_error( "::NuiFusionCreateImageFrame failed(PointCloud)." );
+        }
+
+        // シェーダーサーフェースのインスタンスを生成
+        hr = ::NuiFusionCreateImageFrame(NUI_FUSION_IMAGE_TYPE_COLOR, width, height, nullptr, &m_pShadedSurface);
+        if (FAILED(hr)) {
+            throw std::runtime_error( "::NuiFusionCreateImageFrame failed(Color)." );
+        }
+
+        // リセット
+        m_pVolume->ResetReconstruction( &IdentityMatrix(), nullptr );
+    }
+
+    /// <summary>
+    /// Set Identity in a Matrix4
+    /// </summary>
+    /// <param name="mat">The matrix to set to identity</param>
+    const Matrix4& IdentityMatrix()
+    {
+        static Matrix4 mat;
+        mat.M11 = 1; mat.M12 = 0; mat.M13 = 0; mat.M14 = 0;
+        mat.M21 = 0; mat.M22 = 1; mat.M23 = 0; mat.M24 = 0;
+        mat.M31 = 0; mat.M32 = 0; mat.M33 = 1; mat.M34 = 0;
+        mat.M41 = 0; mat.M42 = 0; mat.M43 = 0; mat.M44 = 1;
+        return mat;
+    }
+
+    // 前回のスナップショットを読み込み、その続きから統合する
+    void resume()
+    {
+        HRESULT hr = m_pVolume->LoadSnapshot( SNAPSHOT_FILE );
+        if ( hr == E_INVALIDARG ) {
+            throw std::runtime_error( "スナップショットのボリュームの大きさが違います" );
+        }
+        ERROR_CHECK( hr );
+        std::cout << "loaded " << SNAPSHOT_FILE << std::endl;
+    }
+
+    void run()
+    {
+        // 各ステージの処理時間と、捨てたフレームの数を1秒ごとにファイルに追記する
+        kinectbook::Profiler& profiler = kinectbook::Profiler::shared();
+        profiler.startExport( "KinectFusion.stats.jsonl", 1000 );
+
+        // 取得、変換、位置合わせと統合、シェーディング、表示を別々のスレッドで並行して行う
+        // センサーの場合は古いフレームを捨てて遅延を抑え、再生時はすべてのフレームを処理する
+        kinectbook::FusionPipelineOptions options;
+        options.dropStaleFrames = (player == 0);
+
+        // メッシュは変化したブロックだけを約0.5秒ごとに作り直す
+        options.meshUpdateInterval = 15;
+
+        // スナップショットは約10秒ごとに、統合を止めずに別のスレッドで書き出す
+        options.snapshotPath = SNAPSHOT_FILE;
+        options.snapshotInterval = 300;
+
+        // カメラの軌跡は終了時とリセットの前に書き出す
+        options.trajectoryPath = TRAJECTORY_FILE;
+
+        if ( !sensors.empty() ) {
+            runMultiSensor( options );
+        }
+        else {
+            kinectbook::FusionPipeline pipeline( *m_pVolume, options,
+                [this]( kinectbook::FusionPipelineFrame& frame ) { shadePointCloud( frame ); } );
+
+            // データの取得は専用のスレッドで行う
+            std::atomic<bool> stop( false );
+            std::atomic<bool> finished( false );
+            std::thread acquisition( [&]() {
+                try {
+                    while ( !stop ) {
+                        if ( player != 0 ) {
+                            // 再生時は待たずに次のフレームを処理する
+                            if ( !playDepth( pipeline ) ) {
+                                pipeline.flush();
+                                break;
+                            }
+                        }
+                        else {
+                            processDepth( pipeline );
+                        }
+                    }
+                }
+                catch ( std::exception& ex ) {
+                    std::cout << ex.what() << std::endl;
+                }
+                finished = true;
+            } );
+
+            present( pipeline, finished );
+
+            stop = true;
+            acquisition.join();
+        }
+
+        profiler.stopTrace();
+        profiler.stopExport();
+        kinectbook::ProfilerSnapshot snapshot = profiler.snapshot();
+        for ( size_t i = 0; i < snapshot.stages.size(); ++i ) {
+            const kinectbook::StageStatistics& stage = snapshot.stages[i];
+            std::cout << stage.name << " : " << stage.count << " frames, p50 " << stage.p50
+                      << " ms, p99 " << stage.p99 << " ms, max " << stage.max << " ms" << std::endl;
+        }
+        for ( size_t i = 0; i < snapshot.counters.size(); ++i ) {
+            std::cout << snapshot.counters[i].first << " : " << snapshot.counters[i].second << std::endl;
+        }
+    }
+
+private:
+
+    // メインループ(表示)
+    // Fusion : FusionPipeline か MultiSensorFusion
+    template <class Fusion>
+    void present( Fusion& fusion, std::atomic<bool>& finished )
+    {
+        kinectbook::Profiler& profiler = kinectbook::Profiler::shared();
+        unsigned int shownCount = 0;
+        double trackingTime = 0;
+        unsigned int trackingIterations = 0;
+        while ( 1 ) {
+            // トラッキングの処理時間と反復回数を集計する(画像はシェーディングで描かれているので、すぐに返す)
+            kinectbook::FusionPipelineFrame* frame = fusion.receive( 10 );
+            if ( frame != 0 ) {
+                ++shownCount;
+                trackingTime += frame->trackingTime;
+                trackingIterations += frame->tracking.totalIterations();
+                fusion.release( frame );
+            }
+            else if ( finished ) {
+                break;
+            }
+
+            // 新しい画像ができていれば表示する
+            if ( presentation.update() && !presentation.front().empty() ) {
+                cv::imshow( "KinectSample", presentation.front() );
+            }
+
+            // 終了のためのキー入力チェック兼、表示のためのウェイト
+            int key = cv::waitKey( 1 );
+            if ( key == 'q' ) {
+                break;
+            }
+            else if ( key == 'r' ) {
+                toggleRecording();
+            }
+            else if ( key == 't' ) {
+                // chrome://tracing で見られるトレースを記録する
+                if ( !profiler.tracing() ) {
+                    profiler.startTrace( "KinectFusion.trace.json" );
+                    std::cout << "trace start" << std::endl;
+                }
+                else {
+                    profiler.stopTrace();
+                    std::cout << "trace stop : KinectFusion.trace.json" << std::endl;
+                }
+            }
+            else if ( key == 'm' ) {
+                fusion.readMesh( []( const kinectbook::MeshExtractor& mesh ) {
+                    std::cout << "mesh : " << mesh.vertexCount() << " vertices, "
+                              << mesh.triangleCount() << " triangles" << std::endl;
+                } );
+            }
+            else if ( key == 's' ) {
+                // メッシュをバイナリPLYで保存する(書き出し中はメッシュの更新を待たせる)
+                // 色を統合していれば、頂点の色も書き出す
+                bool colored = m_pVolume->volume().hasColor();
+                fusion.readMesh( [colored]( const kinectbook::MeshExtractor& mesh ) {
+                    kinectbook::MeshWriter writer( "KinectFusion.ply", kinectbook::MESH_FILE_PLY, colored );
+                    if ( !mesh.indices().empty() ) {
+                        writer.write( &mesh.vertices()[0], mesh.vertices().size(),
+                                      &mesh.indices()[0], mesh.triangleCount() );
+                    }
+                    writer.close();
+                    std::cout << "saved KinectFusion.ply : " << writer.triangleCount() << " triangles" << std::endl;
+                } );
+            }
+            else if ( key == 'v' ) {
+                // 次のフレームの後でスナップショットを書き出す
+                fusion.requestSnapshot();
+                std::cout << "snapshot : " << SNAPSHOT_FILE << std::endl;
+            }
+            else if ( key == 'c' ) {
+                // シェーディングを 表面 -> 法線 -> 距離 -> 色 -> SDK の順に切り替える
+                int mode = (shadingMode + 1) % (SHADING_MODE_SDK + 1);
+                shadingMode = mode;
+                std::cout << "shading : " << SHADING_MODE_NAMES[mode] << std::endl;
+            }
+        }
+
+        std::cout << "dropped frames : " << fusion.droppedFrameCount() << std::endl;
+        if ( shownCount != 0 ) {
+            std::cout << "tracking : " << trackingTime / shownCount << " ms, "
+                      << (double)trackingIterations / shownCount << " iterations per frame" << std::endl;
+        }
+    }
+
+    // すべてのKinectの距離データを1つのボリュームに統合する
+    // 1台目をトラッキングし、ほかのKinectは1台目からの位置で統合する
+    void runMultiSensor( const kinectbook::FusionPipelineOptions& pipelineOptions )
+    {
+        kinectbook::MultiSensorFusionOptions options;
+        options.pipeline = pipelineOptions;
+        options.referenceToCamera = referenceToCamera;
+        kinectbook::MultiSensorFusion fusion( *m_pVolume, options,
+            [this]( kinectbook::FusionPipelineFrame& frame ) { shadePointCloud( frame ); } );
+
+        // Kinectごとに、データの取得と変換を専用のスレッドで行う
+        std::atomic<bool> stop( false );
+        std::atomic<bool> finished( false );
+        std::vector<std::thread> acquisition;
+        for ( size_t i = 0; i < sensors.size(); ++i ) {
+            acquisition.push_back( std::thread( [&, i]() {
+                try {
+                    while ( !stop ) {
+                        processSensorDepth( fusion, (UINT)i );
+                    }
+                }
+                catch ( std::exception& ex ) {
+                    std::cout << ex.what() << std::endl;
+                }
+                finished = true;
+            } ) );
+        }
+
+        present( fusion, finished );
+
+        stop = true;
+        for ( size_t i = 0; i < acquisition.size(); ++i ) {
+            acquisition[i].join();
+        }
+    }
+
+    // RGBカメラの新しい画像があれば colorImage にコピーする
+    // 待たずに戻り、新しい画像がなければ前の画像を使い続ける
+    void updateColorImage()
+    {
+        // RGBカメラのフレームデータを取得する
+        NUI_IMAGE_FRAME imageFrame = { 0 };
+        if ( kinect->NuiImageStreamGetNextFrame( imageStreamHandle, 0, &imageFrame ) != S_OK ) {
+            return;
+        }
+
+        // 画像データを取得する
+        NUI_LOCKED_RECT colorData;
+        imageFrame.pFrameTexture->LockRect( 0, &colorData, 0, 0 );
+
+        // 画像データをコピーする(フレームを解放するとSDKのバッファは使えなくなる)
+        if ( colorData.Pitch != 0 ) {
+            colorImage.assign( colorData.pBits, colorData.pBits + colorData.size );
+        }
+
+        // フレームデータを解放する
+        imageFrame.pFrameTexture->UnlockRect( 0 );
+        ERROR_CHECK( kinect->NuiImageStreamReleaseFrame( imageStreamHandle, &imageFrame ) );
+    }
+
+    void processDepth( kinectbook::FusionPipeline& pipeline )
+    {
+        // 次のフレームを取得する(なければフレームが来るまで待つ)
+        kinectbook::FrameRef frame;
+        if ( !kinectSource->tryGetNextFrame( frame ) ) {
+            kinectSource->wait( 100 );
+            return;
+        }
+
+        // データがなかった距離フレームは数えるだけにする
+        unsigned int empty = kinectSource->emptyDepthFrames();
+        kinectbook::Profiler::shared().add( emptyDepthFrames, empty - reportedEmptyDepthFrames );
+        reportedEmptyDepthFrames = empty;
+
+        // 距離データ以外は使わない
+        NUI_DEPTH_IMAGE_PIXEL* depthPixels = (NUI_DEPTH_IMAGE_PIXEL*)frame->depthPixels();
+        if ( depthPixels == 0 ) {
+            return;
+        }
+
+        // 記録中であれば、距離データをファイルに書き出す
+        {
+            std::lock_guard<std::mutex> lock( recorderMutex );
+            if ( recorder != 0 ) {
+                recorder->writeDepth( depthPixels, width, height, frame->timestamp );
+            }
+        }
+
+        // KinectFusionのパイプラインに渡す(処理が追いついていなければ捨てられる)
+        // 色が取れていれば、距離と一緒にボリュームに統合する
+        // 距離フレームはSDKのバッファのままなので、frame がなくなるとSDKに返る
+        if ( mapColor( depthPixels ) ) {
+            pipeline.submit( depthPixels, width, height, frame->timestamp,
+                             &colorImage[0], width, height, &colorCoordinates[0] );
+        }
+        else {
+            pipeline.submit( depthPixels, width, height, frame->timestamp );
+        }
+    }
+
+    // 距離データの各ピクセルが、RGBカメラのどのピクセルに写っているかを colorCoordinates に求める
+    // RGBカメラの画像がまだないか、求められなければ false
+    bool mapColor( const NUI_DEPTH_IMAGE_PIXEL* depthPixels )
+    {
+        updateColorImage();
+        if ( colorImage.empty() ) {
+            return false;
+        }
+
+        HRESULT hr = coordinateMapper->MapDepthFrameToColorFrame( CAMERA_RESOLUTION, width * height,
+            const_cast<NUI_DEPTH_IMAGE_PIXEL*>( depthPixels ), NUI_IMAGE_TYPE_COLOR, CAMERA_RESOLUTION,
+            width * height, &colorCoordinates[0] );
+        return hr == S_OK;
+    }
+
+    // index のKinectの距離データを統合する(processDepth と同じく、取れなければフレームが来るまで待つ)
+    void processSensorDepth( kinectbook::MultiSensorFusion& fusion, UINT index )
+    {
+        kinectbook::KinectFrameSource* sensor = sensors[index];
+
+        // 次のフレームを取得する(取得に失敗したフレームは飛ばされる)
+        kinectbook::FrameRef frame;
+        if ( !sensor->tryGetNextFrame( frame ) ) {
+            sensor->wait( 100 );
+            return;
+        }
+
+        // データがなかった距離フレームは数えるだけにする
+        unsigned int empty = sensor->emptyDepthFrames();
+        kinectbook::Profiler::shared().add( emptyDepthFrames, empty - reportedSensorEmptyFrames[index] );
+        reportedSensorEmptyFrames[index] = empty;
+
+        const NUI_DEPTH_IMAGE_PIXEL* depthPixels = frame->depthPixels();
+        if ( depthPixels == 0 ) {
+            return;
+        }
+
+        // このスレッドで変換して統合を待つ(処理が追いついていなければ古いフレームから捨てられる)
+        // 1台目は、色が取れていれば距離と一緒にボリュームに統合する
+        // 距離フレームはSDKのバッファのままなので、frame がなくなるとSDKに返る
+        if ( index == 0 && mapColor( depthPixels ) ) {
+            fusion.submit( index, depthPixels, width, height, frame->timestamp,
+                           &colorImage[0], width, height, &colorCoordinates[0] );
+        }
+        else {
+            fusion.submit( index, depthPixels, width, height, frame->timestamp );
+        }
+    }
+
+    bool playDepth( kinectbook::FusionPipeline& pipeline )
+    {
+        // 次のフレームを取得する(ファイルをマップしたメモリをそのまま使う)
+        kinectbook::FrameRef frame;
+        while ( !player->tryGetNextFrame( frame ) ) {
+            if ( player->finished() ) {
+                return false;
+            }
+            player->wait( 100 );
+        }
+
+        // 距離データ以外は使わない
+        if ( frame->depthPixels() == 0 ) {
+            return true;
+        }
+        if ( frame->width != width || frame->height != height ) {
+            throw std::runtime_error( "記録された距離データの解像度が違います" );
+        }
+
+        // KinectFusionのパイプラインに渡す(空きができるまで待つ)
+        pipeline.submit( frame->depthPixels(), width, height, frame->timestamp );
+        return true;
+    }
+
+    void toggleRecording()
+    {
+        // 記録できるのは1台のKinectだけ
+        if ( player != 0 || !sensors.empty() ) {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock( recorderMutex );
+        if ( recorder == 0 ) {
+            recorder = new kinectbook::FrameRecorder( "KinectFusion.kbrec" );
+            std::cout << "recording start" << std::endl;
+        }
+        else {
+            std::cout << "recording stop : " << recorder->chunkCount() << " frames" << std::endl;
+            delete recorder;
+            recorder = 0;
+        }
+    }
+
+    // パイプラインのシェーディングのスレッドから呼ばれる
+    // ワーカースレッドなので、失敗しても例外は投げずにそのフレームを表示しない
+    void shadePointCloud( kinectbook::FusionPipelineFrame& frame )
+    {
+        int mode = shadingMode;
+        if ( mode == SHADING_MODE_SDK ) {
+            shadePointCloudWithSdk( frame );
+            return;
+        }
+
+        // 表示されていない画像に直接描画する
+        cv::Mat& image = presentation.back();
+        image.create( frame.height, frame.width, CV_8UC4 );
+
+        kinectbook::PointCloudShadingParameters parameters;
+        parameters.shading = (kinectbook::PointCloudShading)mode;
+        HRESULT hr = kinectbook::ShadePointCloud( &frame.pointCloud, frame.hasColor ? &frame.pointCloudColors : nullptr,
+                                                  &frame.worldToCamera, parameters, image.data, (UINT)image.step );
+        if (FAILED(hr)) {
+            std::cout << "kinectbook::ShadePointCloud failed." << std::endl;
+            return;
+        }
+
+        // メインループに渡す
+        presentation.publish();
+    }
+
+    // SDKでシェーディングする(速度と見た目の比較用)
+    void shadePointCloudWithSdk( kinectbook::FusionPipelineFrame& frame )
+    {
+        // PointCloudをSDKのフレームにコピーする
+        NUI_LOCKED_RECT pointCloudLockedRect;
+        HRESULT hr = m_pPointCloud->pFrameTexture->LockRect( 0, &pointCloudLockedRect, nullptr, 0 );
+        if (FAILED(hr)) {
+            std::cout << "LockRect failed." << std::endl;
+            return;
+        }
+
+        memcpy( pointCloudLockedRect.pBits, &frame.pointCloud.data[0], frame.pointCloud.data.size() * sizeof(float) );
+        m_pPointCloud->pFrameTexture->UnlockRect( 0 );
+
+        // PointCloudを2次元のデータに描画する
+        hr = ::NuiFusionShadePointCloud( m_pPointCloud, &frame.worldToCamera,
+                                    nullptr, m_pShadedSurface, nullptr );
+        if (FAILED(hr)) {
+            std::cout << "::NuiFusionShadePointCloud failed." << std::endl;
+            return;
+        }
+
+        // 2次元のデータを、表示されていない画像にコピーする
+        INuiFrameTexture * pShadedImageTexture = m_pShadedSurface->pFrameTexture;
+        NUI_LOCKED_RECT ShadedLockedRect;
+        hr = pShadedImageTexture->LockRect(0, &ShadedLockedRect, nullptr, 0);
+        if (FAILED(hr)) {
+            std::cout << "LockRect failed." << std::endl;
+            return;
+        }
+
+        cv::Mat& image = presentation.back();
+        cv::Mat( frame.height, frame.width, CV_8UC4, ShadedLockedRect.pBits ).copyTo( image );
+
+        // We're done with the texture so unlock it
+        pShadedImageTexture->UnlockRect(0);
+
+        // メインループに渡す
+        presentation.publish();
+    }
+};
+
+// 引数に記録したファイル(.kbrec)を指定すると、Kinectの代わりにそのデータを使う
+// --multi を指定すると、接続されているすべてのKinectを使う(続けて各Kinectの位置のファイルを指定できる)
+// 最後に --resume を指定すると、前回のスナップショット(KinectFusion.kbvol)から続ける
+void main( int argc, char* argv[] )
+{
+
+    try {
+        bool resume = (argc > 1 && std::string( argv[argc - 1] ) == "--resume");
+        if ( resume ) {
+            --argc;
+        }
+
+        KinectSample kinect;
+        if ( argc > 1 && std::string( argv[1] ) == "--multi" ) {
+            kinect.initializeMultiSensor( argc > 2 ? argv[2] : "" );
+        }
+        else if ( argc > 1 ) {
+            kinect.initializePlayer( argv[1] );
+        }
+        else {
+            kinect.initialize();
+        }
+        if ( resume ) {
+            kinect.resume();
+        }
+        kinect.run();
+    }
+    catch ( std::exception& ex ) {
+        std::cout << ex.what() << std::endl;
+    }
+}
@@ -0,0 +1,114 @@
+#include "SyntheticFrameSource.h"
+
+#include <thread>
+
+namespace kinectbook {
+
+namespace {
+
+// Depth frames that can be out at once
+const UINT DEPTH_POOL_SIZE = 4;
+
+// Sleep of wait() while the consumers hold every depth frame (ms)
+const unsigned int POOL_POLL_INTERVAL = 1;
+
+}
+
+SyntheticFrameSource::SyntheticFrameSource( UINT width, UINT height, int frameCount, bool realTime,
+                                            const RigidTransform& referenceToCamera, LONGLONG timestampOffset )
+    : width( width )
+    , height( height )
+    , frameCount( frameCount )
+    , realTime( realTime )
+    , referenceToCamera( referenceToCamera )
+    , timestampOffset( timestampOffset )
+    , depthPool( DEPTH_POOL_SIZE, width * height * sizeof(NUI_DEPTH_IMAGE_PIXEL) )
+    , accelerometerPool( DEPTH_POOL_SIZE, sizeof(Vector4) )
+    , frameNumber( 0 )
+    , started( false )
+    , dropped( 0 )
+{
+}
+
+bool SyntheticFrameSource::tryGetNextFrame( FrameRef& frame )
+{
+    if ( !pendingAccelerometer.empty() ) {
+        frame.swap( pendingAccelerometer );
+        pendingAccelerometer.reset();
+        return true;
+    }
+    if ( frameCount != 0 && frameNumber == frameCount ) {
+        return false;
+    }
+
+    if ( realTime ) {
+        if ( !started ) {
+            start = Clock::now();
+            started = true;
+        }
+        else if ( Clock::now() < dueTime() ) {
+            return false;
+        }
+    }
+
+    FrameRef depth = depthPool.allocateDepth( width, height, timestamp( frameNumber ) );
+    if ( depth.empty() ) {
+        if ( realTime ) {
+            ++dropped;
+            ++frameNumber;
+        }
+        return false;
+    }
+
+    const RigidTransform pose = worldToCamera( frameNumber );
+    scene.render( pose, frameNumber, width, height, true, (NUI_DEPTH_IMAGE_PIXEL*)depth.storage() );
+
+    // Fusion space has y down, the accelerometer y up
+    FrameRef reading = accelerometerPool.allocate( FRAME_CHUNK_ACCELEROMETER, sizeof(Vector4), timestamp( frameNumber ) );
+    if ( !reading.empty() ) {
+        const Float3 down = pose.rotate( Float3( 0, 1, 0 ) );
+        Vector4& v = *(Vector4*)reading.storage();
+        v.x = down.x;
+        v.y = -down.y;
+        v.z = down.z;
+        v.w = 0;
+        pendingAccelerometer.swap( reading );
+    }
+    ++frameNumber;
+
+    frame.swap( depth );
+    return true;
+}
+
+bool SyntheticFrameSource::wait( unsigned int timeoutMilliseconds )
+{
+    if ( finished() ) {
+        return false;
+    }
+    if ( !pendingAccelerometer.empty() ) {
+        return true;
+    }
+
+    const Clock::time_point deadline = Clock::now() + std::chrono::milliseconds( timeoutMilliseconds );
+    if ( realTime ) {
+        if ( started ) {
+            const Clock::time_point due = dueTime();
+            if ( due > deadline ) {
+                std::this_thread::sleep_until( deadline );
+                return false;
+            }
+            std::this_thread::sleep_until( due );
+        }
+        return true;
+    }
+
+    while ( depthPool.freeCount() == 0 ) {
+        if ( Clock::now() >= deadline ) {
+            return false;
+        }
+        std::this_thread::sleep_for( std::chrono::milliseconds( POOL_POLL_INTERVAL ) );
+    }
+    return true;
+}
+
+}
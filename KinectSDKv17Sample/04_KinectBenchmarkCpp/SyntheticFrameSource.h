@@ -0,0 +1,82 @@
+#pragma once
+
+#include <chrono>
+
+#include "../common/FrameSource.h"
+#include "SyntheticScene.h"
+
+namespace kinectbook {
+
+/// <summary>
+/// Depth and accelerometer frames of a SyntheticScene seen along SyntheticScene::trajectory()
+/// </summary>
+/// <remarks>
+/// Frame i is rendered into the storage of the pool when it is taken, with
+/// timestamp i * 33ms, and is followed by the accelerometer reading of the
+/// same pose, gravity in the SDK's convention: (0, -1, 0) for a level
+/// sensor. Frames only depend on their number, so every run sees the
+/// same sequence. Like a recording it runs as fast as it is read, waiting
+/// for the consumers when they hold the whole pool, or in real time at
+/// 30Hz, dropping frames the pool has no room for.
+/// </remarks>
+class SyntheticFrameSource : public IFrameSource
+{
+public:
+
+    /// <param name="frameCount">Depth frames until finished(); 0 never finishes</param>
+    /// <param name="realTime">30 frames a second instead of as fast as they are asked for</param>
+    /// <param name="referenceToCamera">Pose of the camera on a rig following the trajectory</param>
+    /// <param name="timestampOffset">Added to every timestamp, e.g. for free running sensors of a rig (ms)</param>
+    SyntheticFrameSource( UINT width, UINT height, int frameCount, bool realTime = false,
+                          const RigidTransform& referenceToCamera = RigidTransform(), LONGLONG timestampOffset = 0 );
+
+    virtual bool tryGetNextFrame( FrameRef& frame );
+
+    virtual bool wait( unsigned int timeoutMilliseconds );
+
+    virtual bool finished() const { return frameCount != 0 && frameNumber == frameCount && pendingAccelerometer.empty(); }
+
+    virtual UINT depthWidth() const { return width; }
+
+    virtual UINT depthHeight() const { return height; }
+
+    virtual unsigned int droppedFrames() const { return dropped; }
+
+    /// <summary>
+    /// Camera of depth frame i
+    /// </summary>
+    RigidTransform worldToCamera( int i ) const { return referenceToCamera * SyntheticScene::trajectory( i ); }
+
+private:
+
+    typedef std::chrono::steady_clock Clock;
+
+    SyntheticFrameSource( const SyntheticFrameSource& );
+    SyntheticFrameSource& operator=( const SyntheticFrameSource& );
+
+    LONGLONG timestamp( int i ) const { return i * FRAME_INTERVAL + timestampOffset; }
+
+    Clock::time_point dueTime() const { return start + std::chrono::milliseconds( timestamp( frameNumber ) - timestampOffset ); }
+
+    // Between two depth frames (ms)
+    static const int FRAME_INTERVAL = 33;
+
+    SyntheticScene scene;
+    UINT width;
+    UINT height;
+    int frameCount;
+    bool realTime;
+    RigidTransform referenceToCamera;
+    LONGLONG timestampOffset;
+
+    FramePool depthPool;
+    FramePool accelerometerPool;
+    FrameRef pendingAccelerometer;      // reading of the depth frame handed out last
+
+    int frameNumber;
+    Clock::time_point start;
+    bool started;
+    unsigned int dropped;
+};
+
+}
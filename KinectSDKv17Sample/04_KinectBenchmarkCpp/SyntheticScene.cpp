@@ -0,0 +1,259 @@
+#include "SyntheticScene.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace kinectbook {
+
+namespace {
+
+// Depth range of the sensor (m)
+const float MIN_DEPTH = 0.4f;
+const float MAX_DEPTH = 4.0f;
+
+// Axial noise of the sensor: sigma = a + b * (z - c)^2 (Nguyen et al. 2012)
+const float NOISE_A = 0.0012f;
+const float NOISE_B = 0.0019f;
+const float NOISE_C = 0.4f;
+
+// Pixels between independent noise samples
+const UINT NOISE_GRID = 4;
+
+const float NO_HIT = 1e30f;
+
+// Roughly normal distributed noise with unit variance from a pixel and a frame
+float gaussianNoise( unsigned int frame, unsigned int pixel )
+{
+    unsigned int h = pixel * 0x9E3779B1u ^ (frame + 1) * 0x85EBCA77u;
+    float sum = 0;
+    for ( int i = 0; i < 4; ++i ) {
+        h ^= h >> 15;
+        h *= 0x2C1B3C6Du;
+        h ^= h >> 12;
+        h *= 0x297A2D39u;
+        h ^= h >> 15;
+        sum += (h & 0xFFFF) / 65535.0f;
+    }
+    // Sum of four uniforms has mean 2 and variance 1/3
+    return (sum - 2.0f) * 1.7320508f;
+}
+
+// The sensor matches blocks of its pattern, so neighbouring pixels share
+// their error: noise of a coarse grid, interpolated bilinearly
+float correlatedNoise( unsigned int frame, UINT x, UINT y )
+{
+    const UINT gx = x / NOISE_GRID, gy = y / NOISE_GRID;
+    const float fx = (float)(x % NOISE_GRID) / NOISE_GRID, fy = (float)(y % NOISE_GRID) / NOISE_GRID;
+    const unsigned int stride = 4096;
+    float top = gaussianNoise( frame, gy * stride + gx ) * (1 - fx) + gaussianNoise( frame, gy * stride + gx + 1 ) * fx;
+    float bottom = gaussianNoise( frame, (gy + 1) * stride + gx ) * (1 - fx) +
+                   gaussianNoise( frame, (gy + 1) * stride + gx + 1 ) * fx;
+    return top * (1 - fy) + bottom * fy;
+}
+
+Vector4 joint( float x, float y, float z )
+{
+    Vector4 p = { x, y, z, 1.0f };
+    return p;
+}
+
+// Skeleton space to depth image, as NuiTransformSkeletonToDepthImage
+void project( const Vector4& p, UINT width, UINT height, float& u, float& v )
+{
+    const float focal = NUI_CAMERA_DEPTH_NOMINAL_FOCAL_LENGTH_IN_PIXELS * width / 320.0f;
+    u = width * 0.5f + p.x * focal / p.z;
+    v = height * 0.5f - p.y * focal / p.z;
+}
+
+}
+
+SyntheticScene::SyntheticScene()
+{
+    addPlane( Float3( 0, 0, -1 ), -1.9f );          // back wall
+    addPlane( Float3( 0, -1, 0 ), -0.6f );          // floor
+    addPlane( Float3( 1, 0, 0 ), -0.8f );           // left wall
+    addSphere( Float3( 0.15f, 0.1f, 1.2f ), 0.25f );
+    addSphere( Float3( -0.4f, 0.3f, 1.5f ), 0.2f );
+    addSphere( Float3( 0.45f, -0.25f, 1.6f ), 0.15f );
+}
+
+void SyntheticScene::addPlane( const Float3& normal, float distance )
+{
+    Plane plane = { normalize( normal ), distance };
+    planes.push_back( plane );
+}
+
+void SyntheticScene::addSphere( const Float3& center, float radius )
+{
+    Sphere sphere = { center, radius };
+    spheres.push_back( sphere );
+}
+
+RigidTransform SyntheticScene::trajectory( int frame )
+{
+    // Camera to world as a twist (rotation, then translation); identity at frame 0
+    float f = (float)frame;
+    float twist[6] = {
+        0.03f * std::sin( f * 0.037f ),
+        0.08f * std::sin( f * 0.05f ),
+        0,
+        0.15f * std::sin( f * 0.05f ),
+        0.03f * std::sin( f * 0.031f ),
+        0.05f * (1.0f - std::cos( f * 0.02f )),
+    };
+    return RigidTransform::fromTwist( twist ).inverse();
+}
+
+float SyntheticScene::intersect( const Float3& origin, const Float3& direction ) const
+{
+    float nearest = NO_HIT;
+    for ( size_t i = 0; i < planes.size(); ++i ) {
+        float facing = dot( planes[i].normal, direction );
+        if ( facing < -1e-6f ) {
+            float t = (planes[i].distance - dot( planes[i].normal, origin )) / facing;
+            if ( t > 0 ) {
+                nearest = std::min( nearest, t );
+            }
+        }
+    }
+    for ( size_t i = 0; i < spheres.size(); ++i ) {
+        Float3 oc = origin - spheres[i].center;
+        float b = dot( oc, direction );
+        float c = dot( oc, oc ) - spheres[i].radius * spheres[i].radius;
+        float discriminant = b * b - c;
+        if ( discriminant > 0 ) {
+            float t = -b - std::sqrt( discriminant );
+            if ( t > 0 ) {
+                nearest = std::min( nearest, t );
+            }
+        }
+    }
+    return nearest;
+}
+
+void SyntheticScene::render( const RigidTransform& worldToCamera, int frame, UINT width, UINT height, bool mirror,
+                             std::vector<NUI_DEPTH_IMAGE_PIXEL>& pixels ) const
+{
+    pixels.resize( (size_t)width * height );
+    render( worldToCamera, frame, width, height, mirror, &pixels[0] );
+}
+
+void SyntheticScene::render( const RigidTransform& worldToCamera, int frame, UINT width, UINT height, bool mirror,
+                             NUI_DEPTH_IMAGE_PIXEL* pixels ) const
+{
+    const CameraIntrinsics camera = CameraIntrinsics::depthCamera( width, height );
+    const RigidTransform cameraToWorld = worldToCamera.inverse();
+
+    for ( UINT y = 0; y < height; ++y ) {
+        for ( UINT x = 0; x < width; ++x ) {
+            Float3 ray = normalize( camera.unproject( (float)x, (float)y, 1.0f ) );
+            float t = intersect( cameraToWorld.t, cameraToWorld.rotate( ray ) );
+            float depth = t * ray.z;
+
+            if ( t != NO_HIT ) {
+                float d = depth - NOISE_C;
+                depth += (NOISE_A + NOISE_B * d * d) * correlatedNoise( frame, x, y );
+            }
+
+            NUI_DEPTH_IMAGE_PIXEL& pixel = pixels[y * width + (mirror ? width - 1 - x : x)];
+            pixel.playerIndex = 0;
+            pixel.depth = (t != NO_HIT && depth >= MIN_DEPTH && depth <= MAX_DEPTH) ? (USHORT)(depth * 1000.0f + 0.5f) : 0;
+        }
+    }
+}
+
+void SyntheticScene::renderColor( const RigidTransform& worldToCamera, UINT width, UINT height, bool mirror,
+                                  std::vector<BYTE>& bgrx ) const
+{
+    const CameraIntrinsics camera = CameraIntrinsics::depthCamera( width, height );
+    const RigidTransform cameraToWorld = worldToCamera.inverse();
+
+    bgrx.assign( (size_t)width * height * 4, 0 );
+    for ( UINT y = 0; y < height; ++y ) {
+        for ( UINT x = 0; x < width; ++x ) {
+            Float3 ray = cameraToWorld.rotate( normalize( camera.unproject( (float)x, (float)y, 1.0f ) ) );
+            float t = intersect( cameraToWorld.t, ray );
+            if ( t == NO_HIT ) {
+                continue;
+            }
+
+            // The sensor leaves the fourth byte 0
+            UINT color = colorAt( cameraToWorld.t + ray * t ) & 0x00FFFFFFu;
+            std::memcpy( &bgrx[((size_t)y * width + (mirror ? width - 1 - x : x)) * 4], &color, 4 );
+        }
+    }
+}
+
+UINT SyntheticScene::colorAt( const Float3& p )
+{
+    UINT r = (UINT)(128.0f + 100.0f * std::sin( p.x * 8.0f ));
+    UINT g = (UINT)(128.0f + 100.0f * std::sin( p.y * 8.0f ));
+    UINT b = (UINT)(128.0f + 100.0f * std::sin( p.z * 8.0f ));
+    return 0xFF000000u | (r << 16) | (g << 8) | b;
+}
+
+void renderHandFrame( bool fist, UINT width, UINT height, std::vector<NUI_DEPTH_IMAGE_PIXEL>& pixels,
+                      NUI_SKELETON_DATA& skeleton )
+{
+    const float focal = NUI_CAMERA_DEPTH_NOMINAL_FOCAL_LENGTH_IN_PIXELS * width / 320.0f;
+
+    std::memset( &skeleton, 0, sizeof(skeleton) );
+    skeleton.eTrackingState = NUI_SKELETON_TRACKED;
+    skeleton.dwTrackingID = 1;
+    skeleton.Position = joint( 0, 0, 2.0f );
+    for ( int j = 0; j < NUI_SKELETON_POSITION_COUNT; ++j ) {
+        skeleton.SkeletonPositions[j] = joint( 0, 0, 2.0f );
+        skeleton.eSkeletonPositionTrackingState[j] = NUI_SKELETON_POSITION_TRACKED;
+    }
+    skeleton.SkeletonPositions[NUI_SKELETON_POSITION_SHOULDER_RIGHT] = joint( 0.18f, 0.4f, 2.0f );
+    skeleton.SkeletonPositions[NUI_SKELETON_POSITION_ELBOW_RIGHT] = joint( 0.3f, 0.3f, 1.8f );
+    skeleton.SkeletonPositions[NUI_SKELETON_POSITION_WRIST_RIGHT] = joint( 0.32f, 0.4f, 1.65f );
+    skeleton.SkeletonPositions[NUI_SKELETON_POSITION_HAND_RIGHT] = joint( 0.33f, 0.48f, 1.62f );
+
+    float bodyLeft, bodyTop, bodyRight, bodyBottom;
+    project( joint( -0.2f, 0.5f, 2.0f ), width, height, bodyLeft, bodyTop );
+    project( joint( 0.2f, -0.8f, 2.0f ), width, height, bodyRight, bodyBottom );
+    float elbowU, elbowV, wristU, wristV, handU, handV;
+    project( skeleton.SkeletonPositions[NUI_SKELETON_POSITION_ELBOW_RIGHT], width, height, elbowU, elbowV );
+    project( skeleton.SkeletonPositions[NUI_SKELETON_POSITION_WRIST_RIGHT], width, height, wristU, wristV );
+    project( skeleton.SkeletonPositions[NUI_SKELETON_POSITION_HAND_RIGHT], width, height, handU, handV );
+
+    // Palm with fingers above it, or a ball
+    float palm = (fist ? 0.045f : 0.05f) * focal / 1.62f;
+    float fingers = fist ? 0 : 0.09f * focal / 1.62f;
+    float arm = 0.035f * focal / 1.7f;
+
+    pixels.resize( (size_t)width * height );
+    for ( UINT y = 0; y < height; ++y ) {
+        for ( UINT x = 0; x < width; ++x ) {
+            NUI_DEPTH_IMAGE_PIXEL& pixel = pixels[y * width + x];
+            pixel.depth = 3000;
+            pixel.playerIndex = 0;
+
+            float u = (float)x, v = (float)y;
+            if ( u >= bodyLeft && u <= bodyRight && v >= bodyTop && v <= bodyBottom ) {
+                pixel.depth = 2000;
+                pixel.playerIndex = 1;
+            }
+
+            // Forearm from the elbow to the wrist
+            float ax = wristU - elbowU, ay = wristV - elbowV;
+            float t = std::min( std::max( ((u - elbowU) * ax + (v - elbowV) * ay) / (ax * ax + ay * ay), 0.0f ), 1.0f );
+            float dx = u - elbowU - t * ax, dy = v - elbowV - t * ay;
+            if ( dx * dx + dy * dy < arm * arm ) {
+                pixel.depth = (USHORT)(1800 - t * 150);
+                pixel.playerIndex = 1;
+            }
+
+            float hx = u - handU, hy = v - handV;
+            if ( hx * hx + hy * hy < palm * palm || (hy < 0 && hy > -palm - fingers && std::fabs( hx ) < palm * 0.8f &&
+                 std::fmod( hx + palm, palm * 0.4f ) < palm * 0.25f) ) {
+                pixel.depth = 1620;
+                pixel.playerIndex = 1;
+            }
+        }
+    }
+}
+
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <vector>
+
+#include "../02_KinectFusionBasicCpp/FusionTypes.h"
+
+namespace kinectbook {
+
+/// <summary>
+/// Depth frames of planes and spheres seen by a moving camera
+/// </summary>
+/// <remarks>
+/// Frames are raycast exactly and then quantized to millimeters with
+/// noise that grows with the square of the distance like the Kinect's and
+/// is correlated over a few pixels like its block matching.
+/// The noise only depends on the frame number, so every run and every
+/// machine sees the same frames. The default room fits into a volume of
+/// 2m x 2m x 2m placed the default way in front of the camera.
+/// </remarks>
+class SyntheticScene
+{
+public:
+
+    /// <summary>
+    /// Back wall, floor, side wall and three spheres
+    /// </summary>
+    SyntheticScene();
+
+    /// <summary>
+    /// Points p with dot( normal, p ) == distance, seen from the side the normal points to
+    /// </summary>
+    void addPlane( const Float3& normal, float distance );
+
+    void addSphere( const Float3& center, float radius );
+
+    /// <summary>
+    /// Camera of the given frame: a slow sideways sway with a little pan and tilt
+    /// </summary>
+    static RigidTransform trajectory( int frame );
+
+    /// <summary>
+    /// Depth frame with player index 0
+    /// </summary>
+    /// <param name="mirror">Mirror horizontally like the sensor does</param>
+    void render( const RigidTransform& worldToCamera, int frame, UINT width, UINT height, bool mirror,
+                 std::vector<NUI_DEPTH_IMAGE_PIXEL>& pixels ) const;
+
+    /// <summary>
+    /// Depth frame into width x height pixels of the caller, e.g. the storage of a pooled frame
+    /// </summary>
+    void render( const RigidTransform& worldToCamera, int frame, UINT width, UINT height, bool mirror,
+                 NUI_DEPTH_IMAGE_PIXEL* pixels ) const;
+
+    /// <summary>
+    /// Color image seen by a color camera at the depth camera, BGRX like the sensor's
+    /// </summary>
+    /// <remarks>Pixel (x, y) is the color of depth pixel (x, y) of render(), without its noise</remarks>
+    void renderColor( const RigidTransform& worldToCamera, UINT width, UINT height, bool mirror,
+                      std::vector<BYTE>& bgrx ) const;
+
+    /// <summary>
+    /// Color of the surfaces at a world point as BGRA: smooth waves along the three axes
+    /// </summary>
+    static UINT colorAt( const Float3& p );
+
+private:
+
+    struct Plane
+    {
+        Float3 normal;
+        float distance;
+    };
+
+    struct Sphere
+    {
+        Float3 center;
+        float radius;
+    };
+
+    float intersect( const Float3& origin, const Float3& direction ) const;
+
+    std::vector<Plane> planes;
+    std::vector<Sphere> spheres;
+};
+
+/// <summary>
+/// One user in front of a wall reaching out with the right hand, open or as a fist
+/// </summary>
+/// <param name="skeleton">Tracked skeleton of the user, player index 1</param>
+void renderHandFrame( bool fist, UINT width, UINT height, std::vector<NUI_DEPTH_IMAGE_PIXEL>& pixels,
+                      NUI_SKELETON_DATA& skeleton );
+
+}
@@ -0,0 +1,1440 @@
+// Headless benchmark of the per frame processing
+//
+//   04_KinectBenchmarkCpp [--frames N] [--freenect] [iterations] [recording.kbrec]
+//
+// Runs without a Kinect. Seven suites:
+//
+//   kernels  the depth kernels on a synthetic 640x480 frame, in ns/pixel
+//            and ms/frame, checked against the scalar reference
+//   hands    the hand state classifier has to see one grip and one release
+//            of a synthetic hand; with a recording of 01_KinectInteractionCpp
+//            the hand events and their latency of the recording, on the
+//            depth and skeleton frames the synchronizer matches
+//   sync     the frame synchronizer on synthetic streams with missing,
+//            late and bunched up frames: bundles, drops and the error of
+//            the interpolated accelerometer have to be exact
+//   tracking the camera tracking has to reject the wrong poses of frames
+//            after a gap and find the camera again after the view was
+//            blocked (relocalization)
+//   loops    the pose graph has to take out the drift of a closed loop,
+//            frames taken out of a volume have to leave it as it was,
+//            and the reconstruction has to close loops on the synthetic
+//            room without losing the camera
+//   meshes   the mesh kept up to date block by block has to match one
+//            extracted at once, for every kind of volume, and the STL,
+//            PLY and OBJ files written of it have to be complete
+//   fusion   the fusion pipeline on N frames (default 30, 0 skips it) of a
+//            synthetic room seen by a moving camera and by a moving rig of
+//            three cameras, once for every volume configuration: frame rate,
+//            p50/p99/max of every stage, drift of the camera from the true
+//            trajectory and memory; with a recording also the depth frames
+//            of the recording, and with --freenect N frames captured live
+//            from a Kinect through libfreenect. Snapshots of the volume are taken while it
+//            runs, and the last one is loaded back and compared; the final
+//            volume is raycast from a new pose at full and half resolution,
+//            and the point cloud of the last pose is shaded in every mode by
+//            the SIMD shader and by its scalar reference. On synthetic
+//            frames the last frame is integrated again with a registered
+//            color image, without and with the color, and the fused colors
+//            of the point cloud are compared with the scene's. On synthetic
+//            frames there must be no tracking error and the camera must
+//            stay within 5mm of the trajectory; the snapshot has to load
+//            back identical and the SIMD shading match its reference
+//
+// Returns 1 when any suite fails, a recording cannot be read or an
+// argument is unknown, so it can run in a build.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif
+
+#include "../common/SimdConfig.h"
+#include "../common/ThreadPool.h"
+#include "../common/FramePlayer.h"
+#include "../common/FrameSynchronizer.h"
+#include "../common/Profiler.h"
+#include "../common/RecordedFrameSource.h"
+#ifdef KB_HAVE_FREENECT
+#include "../common/FreenectFrameSource.h"
+#endif
+#include "../01_KinectInteractionCpp/HandStateClassifier.h"
+#include "../02_KinectFusionBasicCpp/DepthProcessor.h"
+#include "../02_KinectFusionBasicCpp/FusionPipeline.h"
+#include "../02_KinectFusionBasicCpp/MeshExtractor.h"
+#include "../02_KinectFusionBasicCpp/MeshWriter.h"
+#include "../02_KinectFusionBasicCpp/MultiSensorFusion.h"
+#include "../02_KinectFusionBasicCpp/PointCloudShader.h"
+#include "SyntheticFrameSource.h"
+#include "SyntheticScene.h"
+
+namespace {
+
+const UINT WIDTH = 640;
+const UINT HEIGHT = 480;
+
+// Sensors of the synthetic rig of the fusion suite
+const UINT RIG_SENSORS = 3;
+
+// What the fusion suite accepts on synthetic frames: the camera no further
+// than this from the true trajectory (m), and fused colors off by no more
+// than this on average (of 255) on at least this share of the points
+const float MAX_SYNTHETIC_DRIFT = 0.005f;
+const double MAX_COLOR_ERROR = 4.0;
+const double MIN_COLORED_POINTS = 0.95;
+
+// A wall, a floor and a sphere with a bit of noise, some holes and player indices
+std::vector<NUI_DEPTH_IMAGE_PIXEL> makeDepthFrame()
+{
+    std::vector<NUI_DEPTH_IMAGE_PIXEL> frame( WIDTH * HEIGHT );
+    unsigned int seed = 12345;
+    for ( UINT y = 0; y < HEIGHT; ++y ) {
+        for ( UINT x = 0; x < WIDTH; ++x ) {
+            seed = seed * 1103515245 + 12345;
+            float noise = ((seed >> 16) & 0xFF) / 255.0f - 0.5f;
+
+            float depth = 2500.0f;
+            if ( y > HEIGHT * 2 / 3 ) {
+                depth = 1200.0f + 4000.0f / (y - HEIGHT * 2 / 3 + 2);
+            }
+            float dx = x - 320.0f, dy = y - 220.0f;
+            if ( dx * dx + dy * dy < 100.0f * 100.0f ) {
+                depth = 1400.0f - std::sqrt( 100.0f * 100.0f - dx * dx - dy * dy ) * 2.0f;
+            }
+
+            NUI_DEPTH_IMAGE_PIXEL& pixel = frame[y * WIDTH + x];
+            pixel.depth = (((seed >> 8) & 0x3F) == 0) ? 0 : (USHORT)(depth + noise * 8.0f);
+            pixel.playerIndex = (dx * dx + dy * dy < 100.0f * 100.0f) ? 1 : 0;
+        }
+    }
+    return frame;
+}
+
+// Hand events and latency of a recording
+void replayHands( const char* path )
+{
+    using namespace kinectbook;
+
+    RecordedFrameSource source( path );
+    Profiler profiler;
+    FrameSynchronizerOptions options;
+    options.profiler = &profiler;
+    FrameSynchronizer synchronizer( options );
+    HandStateClassifier classifier;
+    HandFrame frame;
+    int frames = 0, events = 0;
+    double totalLatency = 0, maxLatency = 0;
+    int handsSeen = 0;
+
+    std::printf( "hand states of %s, %u depth frames\n", path, (UINT)source.recording().depthFrameCount() );
+    FrameRef chunk;
+    FrameBundle bundle;
+    bool ended = false;
+    for ( ;; ) {
+        if ( source.tryGetNextFrame( chunk ) ) {
+            synchronizer.push( chunk );
+            chunk.reset();
+        }
+        else if ( source.finished() ) {
+            synchronizer.flush();
+            ended = true;
+        }
+        if ( !synchronizer.tryPop( bundle ) ) {
+            if ( ended ) {
+                break;
+            }
+            continue;
+        }
+
+        const PooledFrame& depth = *bundle.depth;
+        classifier.ProcessSkeleton( NUI_SKELETON_COUNT, bundle.skeleton->skeletonFrame()->SkeletonData, bundle.timestamp );
+        classifier.ProcessDepth( depth.depthPixels(), depth.width, depth.height, bundle.timestamp );
+        classifier.GetNextFrame( &frame );
+        ++frames;
+        for ( int i = 0; i < NUI_SKELETON_COUNT; ++i ) {
+            for ( int h = 0; h < HAND_COUNT; ++h ) {
+                const HandState& hand = frame.hands[i][h];
+                if ( !hand.tracked ) {
+                    continue;
+                }
+                ++handsSeen;
+                totalLatency += hand.latency;
+                maxLatency = std::max( maxLatency, hand.latency );
+                if ( hand.handEvent != HAND_EVENT_NONE ) {
+                    ++events;
+                    std::printf( "  %8lld ms id=%u %s hand %s\n", (long long)frame.timestamp, hand.trackingId,
+                                 h == HAND_LEFT ? "left " : "right", hand.handEvent == HAND_EVENT_GRIP ? "Grip" : "GripRelease" );
+                }
+            }
+        }
+    }
+
+    const FrameSynchronizerStatistics& stats = synchronizer.statistics();
+    std::printf( "  %d frames, %d hands, %d events, latency per hand %.3f ms mean %.3f ms max\n",
+                 frames, handsSeen, events, handsSeen ? totalLatency / handsSeen : 0.0, maxLatency );
+    std::printf( "  synchronized: %u bundles, %u depth and %u skeleton frames dropped, %u late\n",
+                 stats.bundles, stats.droppedDepth, stats.droppedSkeleton, stats.lateFrames );
+}
+
+// Frames of the synthetic streams of the sync suite, in the order they arrive
+struct SyncEvent
+{
+    LONGLONG arrival;
+    kinectbook::FrameChunkType type;
+    LONGLONG timestamp;
+
+    bool operator<( const SyncEvent& other ) const { return arrival < other.arrival; }
+};
+
+// 300 depth frames at 30Hz; skeletons come in bunches of three after their depth frames and
+// every tenth one is missing; the accelerometer reads 5ms after each skeleton, x growing with
+// the time so the interpolation is exact; every fiftieth skeleton comes once more, late
+bool checkSynchronizer( int iterations )
+{
+    using namespace kinectbook;
+    typedef std::chrono::high_resolution_clock Clock;
+
+    const int FRAMES = 300;
+    const LONGLONG INTERVAL = 33;
+    std::vector<SyncEvent> events;
+    int expectedLate = 0;
+    for ( int i = -1; i < FRAMES; ++i ) {
+        const LONGLONG timestamp = i * INTERVAL;
+        const LONGLONG bunch = (i / 3 * 3 + 2) * INTERVAL;
+        const SyncEvent reading = { bunch + 2, FRAME_CHUNK_ACCELEROMETER, timestamp + 5 };
+        events.push_back( reading );
+        if ( i < 0 ) {
+            continue;
+        }
+        const SyncEvent depth = { timestamp, FRAME_CHUNK_DEPTH, timestamp };
+        events.push_back( depth );
+        if ( i % 10 != 7 ) {
+            const SyncEvent skeleton = { bunch + 1, FRAME_CHUNK_SKELETON, timestamp };
+            events.push_back( skeleton );
+        }
+        if ( i % 50 == 25 ) {
+            const SyncEvent late = { bunch + 3, FRAME_CHUNK_SKELETON, timestamp };
+            events.push_back( late );
+            ++expectedLate;
+        }
+    }
+    std::stable_sort( events.begin(), events.end() );
+
+    FramePool pool( 16, sizeof(Vector4) );
+    FrameSynchronizerStatistics stats;
+    int mismatched = 0;
+    double accelerometerError = 0;
+    double ns = 0;
+    for ( int run = 0; run < std::max( iterations, 1 ); ++run ) {
+        Profiler profiler;
+        FrameSynchronizerOptions options;
+        options.bufferSize = 4;
+        options.profiler = &profiler;
+        FrameSynchronizer synchronizer( options );
+        FrameBundle bundle;
+
+        Clock::time_point start = Clock::now();
+        for ( size_t e = 0; e < events.size(); ++e ) {
+            FrameRef frame = pool.allocate( events[e].type, sizeof(Vector4), events[e].timestamp );
+            Vector4& reading = *(Vector4*)frame.storage();
+            reading.x = (FLOAT)events[e].timestamp / 1000;
+            reading.y = -1;
+            reading.z = reading.w = 0;
+            synchronizer.push( frame );
+            frame.reset();
+
+            if ( e + 1 == events.size() ) {
+                synchronizer.flush();
+            }
+            while ( synchronizer.tryPop( bundle ) ) {
+                if ( run == 0 ) {
+                    mismatched += (bundle.skeleton->timestamp != bundle.timestamp) ? 1 : 0;
+                    accelerometerError = std::max( accelerometerError,
+                                                   std::fabs( bundle.accelerometer.x - bundle.timestamp / 1000.0 ) );
+                }
+            }
+        }
+        ns += (double)std::chrono::duration_cast<std::chrono::nanoseconds>( Clock::now() - start ).count();
+        stats = synchronizer.statistics();
+    }
+
+    const int missing = FRAMES / 10;
+    std::printf( "synchronizer: %u bundles of %d depth frames, %u depth and %u skeleton frames dropped, %u late, "
+                 "accelerometer error %g g, %.3f us per depth frame\n",
+                 stats.bundles, FRAMES, stats.droppedDepth, stats.droppedSkeleton, stats.lateFrames,
+                 accelerometerError, ns / std::max( iterations, 1 ) / FRAMES / 1000 );
+    return stats.bundles == (unsigned int)(FRAMES - missing) && stats.droppedDepth == (unsigned int)missing &&
+           stats.droppedSkeleton == 0 && stats.lateFrames == (unsigned int)expectedLate &&
+           mismatched == 0 && accelerometerError < 1e-4;
+}
+
+struct Result
+{
+    double nsPerPixel;
+    double msPerFrame;
+};
+
+Result measure( int iterations, const std::function<void ()>& body )
+{
+    typedef std::chrono::high_resolution_clock Clock;
+
+    // Warm up the caches and the thread pool
+    body();
+
+    double best = 1e30;
+    double total = 0;
+    for ( int i = 0; i < iterations; ++i ) {
+        Clock::time_point start = Clock::now();
+        body();
+        double ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>( Clock::now() - start ).count();
+        best = std::min( best, ns );
+        total += ns;
+    }
+
+    Result result = { best / (WIDTH * HEIGHT), total / iterations / 1e6 };
+    return result;
+}
+
+void print( const char* name, const Result& result )
+{
+    std::printf( "  %-44s %8.3f ns/pixel %8.3f ms/frame\n", name, result.nsPerPixel, result.msPerFrame );
+}
+
+float maxDifference( const kinectbook::DepthFloatFrame& a, const kinectbook::DepthFloatFrame& b )
+{
+    float diff = 0;
+    for ( size_t i = 0; i < a.pixels.size(); ++i ) {
+        diff = std::max( diff, std::fabs( a.pixels[i] - b.pixels[i] ) );
+    }
+    return diff;
+}
+
+const char* simdName()
+{
+#if defined(KB_AVX2)
+    return "AVX2";
+#elif defined(KB_SSE2)
+    return "SSE2";
+#elif defined(KB_NEON)
+    return "NEON";
+#else
+    return "none";
+#endif
+}
+
+// Volumes of the fusion suite, from fast and coarse to fine and large
+struct VolumeConfig
+{
+    const char* name;
+    kinectbook::TsdfVolumeType type;
+    UINT voxelsPerMeter;
+    UINT voxelCountX;
+    UINT voxelCountY;
+    UINT voxelCountZ;
+};
+
+const VolumeConfig VOLUME_CONFIGS[] = {
+    { "dense 256^3, 7.8mm", kinectbook::TSDF_VOLUME_DENSE, 128, 256, 256, 256 },
+    { "dense 384^3, 5.2mm", kinectbook::TSDF_VOLUME_DENSE, 192, 384, 384, 384 },
+    { "hashed 512^3, 3.9mm", kinectbook::TSDF_VOLUME_HASHED, 256, 512, 512, 512 },
+    { "hashed 1024^3, 2.0mm", kinectbook::TSDF_VOLUME_HASHED, 512, 1024, 1024, 1024 },
+    { "multi-scale 1024^3, 2.0-16mm", kinectbook::TSDF_VOLUME_MULTISCALE, 512, 1024, 1024, 1024 },
+};
+
+// Depth frames of one sensor
+struct DepthStream
+{
+    std::vector<std::vector<NUI_DEPTH_IMAGE_PIXEL> > frames;
+    std::vector<LONGLONG> timestamps;
+    Matrix4 referenceToCamera;  // pose in the rig, see MultiSensorFusionOptions
+};
+
+// Depth frames of the fusion suite, mirrored like the sensor's
+struct DepthSequence
+{
+    std::string name;
+    UINT width;
+    UINT height;
+    std::vector<DepthStream> sensors;
+    bool synthetic;             // sensor 0 follows SyntheticScene::trajectory()
+
+    size_t frameCount() const { return sensors.empty() ? 0 : sensors[0].frames.size(); }
+};
+
+// Copy the depth frames of a source as they come, up to frameCount; frames of another size are skipped
+void readDepthStream( kinectbook::IFrameSource& source, int frameCount, DepthSequence& sequence, DepthStream& stream )
+{
+    kinectbook::FrameRef frame;
+    while ( stream.frames.size() < (size_t)frameCount ) {
+        if ( !source.tryGetNextFrame( frame ) ) {
+            if ( source.finished() ) {
+                break;
+            }
+            source.wait( 100 );
+            continue;
+        }
+
+        const NUI_DEPTH_IMAGE_PIXEL* pixels = frame->depthPixels();
+        if ( pixels == 0 ) {
+            continue;
+        }
+        if ( sequence.width != 0 && (frame->width != sequence.width || frame->height != sequence.height) ) {
+            continue;
+        }
+        sequence.width = frame->width;
+        sequence.height = frame->height;
+        stream.frames.push_back( std::vector<NUI_DEPTH_IMAGE_PIXEL>( pixels, pixels + frame->width * frame->height ) );
+        stream.timestamps.push_back( frame->timestamp );
+    }
+}
+
+// A rig of sensors turned 25 degrees to alternating sides of sensor 0, 10cm apart,
+// with timestamps a few milliseconds apart like free running sensors
+DepthSequence syntheticSequence( int frameCount, UINT sensorCount )
+{
+    using namespace kinectbook;
+
+    DepthSequence sequence;
+    std::ostringstream name;
+    name << "synthetic room";
+    if ( sensorCount > 1 ) {
+        name << ", rig of " << sensorCount << " sensors";
+    }
+    sequence.name = name.str();
+    sequence.width = WIDTH;
+    sequence.height = HEIGHT;
+    sequence.synthetic = true;
+    sequence.sensors.resize( sensorCount );
+
+    for ( UINT s = 0; s < sensorCount; ++s ) {
+        float side = (s == 0) ? 0.0f : ((s % 2) ? 1.0f : -1.0f) * ((s + 1) / 2);
+        float twist[6] = { 0, side * 0.436f, 0, side * 0.1f, 0, 0 };
+        RigidTransform referenceToCamera = RigidTransform::fromTwist( twist );
+
+        DepthStream& stream = sequence.sensors[s];
+        stream.referenceToCamera = referenceToCamera.toMatrix4();
+        SyntheticFrameSource source( WIDTH, HEIGHT, frameCount, false, referenceToCamera, s * 4 );
+        readDepthStream( source, frameCount, sequence, stream );
+    }
+    return sequence;
+}
+
+DepthSequence recordedSequence( const char* path, int frameCount )
+{
+    using namespace kinectbook;
+
+    DepthSequence sequence;
+    sequence.name = path;
+    sequence.width = 0;
+    sequence.height = 0;
+    sequence.synthetic = false;
+    sequence.sensors.resize( 1 );
+    sequence.sensors[0].referenceToCamera = RigidTransform().toMatrix4();
+
+    RecordedFrameSource source( path );
+    readDepthStream( source, frameCount, sequence, sequence.sensors[0] );
+    return sequence;
+}
+
+#ifdef KB_HAVE_FREENECT
+// Frames of the first Kinect libfreenect finds, as they come at 30Hz
+DepthSequence freenectSequence( int frameCount )
+{
+    using namespace kinectbook;
+
+    DepthSequence sequence;
+    sequence.name = "libfreenect device";
+    sequence.width = 0;
+    sequence.height = 0;
+    sequence.synthetic = false;
+    sequence.sensors.resize( 1 );
+    sequence.sensors[0].referenceToCamera = RigidTransform().toMatrix4();
+
+    FreenectFrameSource source;
+    readDepthStream( source, frameCount, sequence, sequence.sensors[0] );
+    std::printf( "captured %u frames, %u dropped\n", (UINT)sequence.frameCount(), source.droppedFrames() );
+    return sequence;
+}
+#endif
+
+// Largest working set of the process so far (bytes)
+size_t peakMemory()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if ( ::GetProcessMemoryInfo( ::GetCurrentProcess(), &counters, sizeof(counters) ) ) {
+        return counters.PeakWorkingSetSize;
+    }
+    return 0;
+#else
+    struct rusage usage;
+    if ( ::getrusage( RUSAGE_SELF, &usage ) == 0 ) {
+        return (size_t)usage.ru_maxrss * 1024;
+    }
+    return 0;
+#endif
+}
+
+void printStage( const kinectbook::ProfilerSnapshot& snapshot, const char* name )
+{
+    const kinectbook::StageStatistics* stage = snapshot.stage( name );
+    if ( stage != 0 && stage->count != 0 ) {
+        std::printf( "    %-22s %5llu x  p50 %8.2f  p99 %8.2f  max %8.2f ms\n", name + 7, stage->count,
+                     stage->p50, stage->p99, stage->max );
+    }
+}
+
+// Distance between the camera centers of two poses (m)
+float cameraDistance( const kinectbook::RigidTransform& a, const kinectbook::RigidTransform& b )
+{
+    kinectbook::Float3 d = a.inverse().t - b.inverse().t;
+    return std::sqrt( kinectbook::dot( d, d ) );
+}
+
+// Tracking has to notice when it lost the camera and find it again, on the
+// synthetic room at 320x240: frames 70 to 99 go missing, so ICP from the
+// last pose would slide into one 10-20cm off; then the view is blocked for
+// 10 frames and the camera shows up where it was at frame 40, 19cm away,
+// which only the relocalizer can find. No pose accepted may be off by more
+// than 2cm, and the last frame has to be relocalized
+bool checkRelocalization()
+{
+    using namespace kinectbook;
+
+    const UINT width = 320, height = 240;
+    const int BLOCKED = -1;
+    std::vector<int> frames;
+    for ( int i = 0; i < 120; ++i ) {
+        if ( i < 70 || i >= 100 ) {
+            frames.push_back( i );
+        }
+    }
+    frames.insert( frames.end(), 10, BLOCKED );
+    frames.push_back( 40 );
+
+    NUI_FUSION_RECONSTRUCTION_PARAMETERS params;
+    params.voxelsPerMeter = 128;
+    params.voxelCountX = params.voxelCountY = params.voxelCountZ = 256;
+    CpuReconstruction reconstruction( params, RigidTransform().toMatrix4() );
+    SyntheticScene scene;
+    std::vector<NUI_DEPTH_IMAGE_PIXEL> pixels;
+    DepthFloatFrame depthFloat;
+    int trackingErrors = 0;
+    float maxError = 0;
+    bool found = false;
+    for ( size_t i = 0; i < frames.size(); ++i ) {
+        if ( frames[i] == BLOCKED ) {
+            NUI_DEPTH_IMAGE_PIXEL nothing = { 0, 0 };
+            pixels.assign( width * height, nothing );
+        }
+        else {
+            scene.render( SyntheticScene::trajectory( frames[i] ), frames[i], width, height, true, pixels );
+        }
+        DepthToDepthFloatFrame( &pixels[0], width, height, &depthFloat, NUI_FUSION_DEFAULT_MINIMUM_DEPTH,
+                                NUI_FUSION_DEFAULT_MAXIMUM_DEPTH, TRUE );
+        if ( FAILED( reconstruction.ProcessFrame( &depthFloat, NUI_FUSION_DEFAULT_ALIGN_ITERATION_COUNT,
+                                                  NUI_FUSION_DEFAULT_INTEGRATION_WEIGHT, nullptr ) ) ) {
+            ++trackingErrors;
+            continue;
+        }
+
+        Matrix4 worldToCamera;
+        reconstruction.GetCurrentWorldToCameraTransform( &worldToCamera );
+        float error = (frames[i] == BLOCKED) ? 1.0f :
+            cameraDistance( RigidTransform::fromMatrix4( worldToCamera ), SyntheticScene::trajectory( frames[i] ) );
+        maxError = std::max( maxError, error );
+        found = (i + 1 == frames.size()) && reconstruction.trackingStatistics().relocalized;
+    }
+
+    std::printf( "relocalization: %u frames with 30 missing and 10 blocked, %d tracking errors, "
+                 "poses off by %.2f mm max, %s\n", (UINT)frames.size(), trackingErrors, maxError * 1000.0f,
+                 found ? "found again" : "NOT FOUND AGAIN" );
+    return maxError < 0.02f && found;
+}
+
+// Depth of the synthetic room at frame i of the trajectory, at the size of the checks below
+void renderSyntheticFrame( const kinectbook::SyntheticScene& scene, const kinectbook::RigidTransform& worldToCamera,
+                           int frame, UINT width, UINT height, std::vector<NUI_DEPTH_IMAGE_PIXEL>& pixels,
+                           kinectbook::DepthFloatFrame& depthFloat )
+{
+    scene.render( worldToCamera, frame, width, height, true, pixels );
+    kinectbook::DepthToDepthFloatFrame( &pixels[0], width, height, &depthFloat, NUI_FUSION_DEFAULT_MINIMUM_DEPTH,
+                                        NUI_FUSION_DEFAULT_MAXIMUM_DEPTH, TRUE );
+}
+
+void renderSyntheticFrame( const kinectbook::SyntheticScene& scene, int frame, UINT width, UINT height,
+                           std::vector<NUI_DEPTH_IMAGE_PIXEL>& pixels, kinectbook::DepthFloatFrame& depthFloat )
+{
+    renderSyntheticFrame( scene, kinectbook::SyntheticScene::trajectory( frame ), frame, width, height, pixels,
+                          depthFloat );
+}
+
+// Loop closure in four steps: a PoseGraph of 40 keyframes around a circle
+// whose odometry turns a little too far at every step has to bring the
+// drift down once the loop is closed; a frame taken out of the dense and
+// the hashed volume again with deintegrate() has to leave the voxels of the
+// frame before it as they were, up to the rounding of the 16 bit distances
+// (the multi-scale volume is only close, by design); the frames of a rig
+// of two kept with one graph frame have to move together when the graph
+// moves it, into the voxels they give at the corrected poses; and the
+// reconstruction of the synthetic room with loop closure has to close
+// loops without losing the camera
+bool checkLoopClosure()
+{
+    using namespace kinectbook;
+
+    const int KEYFRAMES = 40;
+    const float stepTwist[6] = { 0, 6.2831853f / KEYFRAMES, 0, 0.15f, 0, 0 };
+    const float driftTwist[6] = { 0.002f, 0.004f, 0, 0.003f, 0.002f, 0 };
+    const RigidTransform step = RigidTransform::fromTwist( stepTwist );
+    const RigidTransform drift = RigidTransform::fromTwist( driftTwist );
+    std::vector<RigidTransform> truth( 1 );
+    PoseGraph graph;
+    graph.addKeyframe( truth[0] );
+    RigidTransform estimate = truth[0];
+    for ( int i = 1; i < KEYFRAMES; ++i ) {
+        truth.push_back( step * truth.back() );
+        estimate = drift * step * estimate;
+        graph.addKeyframe( estimate );
+    }
+    graph.addLoopClosure( 0, KEYFRAMES - 1, truth[KEYFRAMES - 1] * truth[0].inverse() );
+    float before = 0, after = 0;
+    for ( int i = 0; i < KEYFRAMES; ++i ) {
+        before += cameraDistance( graph.keyframePose( i ), truth[i] ) / KEYFRAMES;
+    }
+    const bool optimized = graph.optimize( LoopClosureOptions().optimizationIterations );
+    for ( int i = 0; i < KEYFRAMES; ++i ) {
+        after += cameraDistance( graph.keyframePose( i ), truth[i] ) / KEYFRAMES;
+    }
+    const float lastError = cameraDistance( graph.keyframePose( KEYFRAMES - 1 ), truth[KEYFRAMES - 1] );
+    std::printf( "pose graph: %d keyframes, drift %.1f mm mean before closing the loop, %.1f mm after, "
+                 "%.2f mm at the last keyframe\n", KEYFRAMES, before * 1000.0f, after * 1000.0f, lastError * 1000.0f );
+    bool passed = optimized && after < before * 0.5f && lastError < 0.005f;
+
+    const UINT width = 320, height = 240;
+    NUI_FUSION_RECONSTRUCTION_PARAMETERS params;
+    params.voxelsPerMeter = 128;
+    params.voxelCountX = params.voxelCountY = params.voxelCountZ = 256;
+    const CameraIntrinsics intrinsics = CameraIntrinsics::depthCamera( width, height );
+    SyntheticScene scene;
+    std::vector<NUI_DEPTH_IMAGE_PIXEL> pixels;
+    DepthFloatFrame first, second;
+    renderSyntheticFrame( scene, 0, width, height, pixels, first );
+    renderSyntheticFrame( scene, 20, width, height, pixels, second );
+    const TsdfVolumeType types[] = { TSDF_VOLUME_DENSE, TSDF_VOLUME_HASHED };
+    const char* const names[] = { "dense", "hashed" };
+    for ( int t = 0; t < 2; ++t ) {
+        std::unique_ptr<ITsdfVolume> volume( ITsdfVolume::create( types[t], params, ThreadPool::shared() ) );
+        const unsigned short weight = NUI_FUSION_DEFAULT_INTEGRATION_WEIGHT;
+        volume->integrate( first, nullptr, intrinsics, SyntheticScene::trajectory( 0 ), weight );
+        std::vector<VoxelBlockIndex> blocks;
+        volume->changedBlocks( 0, blocks );
+        std::vector<TsdfVoxel> expected( blocks.size() * VOXELS_PER_BLOCK ), voxels( VOXELS_PER_BLOCK );
+        for ( size_t b = 0; b < blocks.size(); ++b ) {
+            volume->readVoxels( blocks[b].x * VOXEL_BLOCK_SIZE, blocks[b].y * VOXEL_BLOCK_SIZE,
+                                blocks[b].z * VOXEL_BLOCK_SIZE, VOXEL_BLOCK_SIZE, &expected[b * VOXELS_PER_BLOCK] );
+        }
+
+        volume->integrate( second, nullptr, intrinsics, SyntheticScene::trajectory( 20 ), weight );
+        volume->deintegrate( second, intrinsics, SyntheticScene::trajectory( 20 ), weight );
+        int maxDiff = 0;
+        size_t weightDiffs = 0;
+        for ( size_t b = 0; b < blocks.size(); ++b ) {
+            volume->readVoxels( blocks[b].x * VOXEL_BLOCK_SIZE, blocks[b].y * VOXEL_BLOCK_SIZE,
+                                blocks[b].z * VOXEL_BLOCK_SIZE, VOXEL_BLOCK_SIZE, &voxels[0] );
+            for ( int v = 0; v < VOXELS_PER_BLOCK; ++v ) {
+                const TsdfVoxel& e = expected[b * VOXELS_PER_BLOCK + v];
+                maxDiff = std::max( maxDiff, std::abs( (int)voxels[v].tsdf - (int)e.tsdf ) );
+                weightDiffs += (voxels[v].weight != e.weight) ? 1 : 0;
+            }
+        }
+        std::printf( "deintegrate, %s: %u blocks, %u weights and tsdf by up to %d differ from before the frame\n",
+                     names[t], (UINT)blocks.size(), (UINT)weightDiffs, maxDiff );
+        passed = passed && !blocks.empty() && weightDiffs == 0 && maxDiff <= 2;
+    }
+
+    // The tracked frame is 3cm off; a loop closure to the first keyframe pulls it towards the truth
+    {
+        const float offsetTwist[6] = { 0, 0.436f, 0, 0.1f, 0, 0 };
+        const float errorTwist[6] = { 0.01f, -0.02f, 0, 0.03f, 0.01f, 0 };
+        const RigidTransform referenceToSensor = RigidTransform::fromTwist( offsetTwist );
+        const RigidTransform tracked = RigidTransform::fromTwist( errorTwist ) * SyntheticScene::trajectory( 20 );
+        DepthFloatFrame sensorFrame;
+        renderSyntheticFrame( scene, referenceToSensor * SyntheticScene::trajectory( 20 ), 20, width, height, pixels,
+                              sensorFrame );
+
+        PoseGraph rigGraph;
+        rigGraph.addKeyframe( SyntheticScene::trajectory( 0 ) );
+        rigGraph.addKeyframe( tracked );
+        rigGraph.addFrame( 20, tracked );
+        const unsigned short weight = NUI_FUSION_DEFAULT_INTEGRATION_WEIGHT;
+        std::unique_ptr<ITsdfVolume> moved( ITsdfVolume::create( TSDF_VOLUME_DENSE, params, ThreadPool::shared() ) );
+        IntegratedFrames stored;
+        moved->integrate( second, nullptr, intrinsics, tracked, weight );
+        stored.store( 0, RigidTransform(), second, intrinsics, tracked, weight );
+        moved->integrate( sensorFrame, nullptr, intrinsics, referenceToSensor * tracked, weight );
+        stored.store( 0, referenceToSensor, sensorFrame, intrinsics, referenceToSensor * tracked, weight );
+
+        rigGraph.addLoopClosure( 0, 1, SyntheticScene::trajectory( 20 ) * SyntheticScene::trajectory( 0 ).inverse() );
+        rigGraph.optimize( LoopClosureOptions().optimizationIterations );
+        const RigidTransform corrected = rigGraph.framePose( 0 );
+        const unsigned int reintegrated = stored.reintegrate( *moved, rigGraph );
+
+        std::unique_ptr<ITsdfVolume> expected( ITsdfVolume::create( TSDF_VOLUME_DENSE, params, ThreadPool::shared() ) );
+        expected->integrate( second, nullptr, intrinsics, corrected, weight );
+        expected->integrate( sensorFrame, nullptr, intrinsics, referenceToSensor * corrected, weight );
+
+        // The blocks either volume ever touched
+        std::vector<VoxelBlockIndex> blocks, expectedBlocks;
+        moved->changedBlocks( 0, blocks );
+        expected->changedBlocks( 0, expectedBlocks );
+        blocks.insert( blocks.end(), expectedBlocks.begin(), expectedBlocks.end() );
+        std::vector<TsdfVoxel> a( VOXELS_PER_BLOCK ), b( VOXELS_PER_BLOCK );
+        int maxDiff = 0;
+        size_t weightDiffs = 0;
+        for ( size_t i = 0; i < blocks.size(); ++i ) {
+            const int x = blocks[i].x * VOXEL_BLOCK_SIZE, y = blocks[i].y * VOXEL_BLOCK_SIZE, z = blocks[i].z * VOXEL_BLOCK_SIZE;
+            moved->readVoxels( x, y, z, VOXEL_BLOCK_SIZE, &a[0] );
+            expected->readVoxels( x, y, z, VOXEL_BLOCK_SIZE, &b[0] );
+            for ( int v = 0; v < VOXELS_PER_BLOCK; ++v ) {
+                weightDiffs += (a[v].weight != b[v].weight) ? 1 : 0;
+                if ( b[v].weight != 0 ) {
+                    maxDiff = std::max( maxDiff, std::abs( (int)a[v].tsdf - (int)b[v].tsdf ) );
+                }
+            }
+        }
+        std::printf( "rig loop closure: %u of 2 frames moved by %.1f mm, %u weights and tsdf by up to %d differ from "
+                     "the frames integrated at the corrected poses\n", reintegrated,
+                     cameraDistance( corrected, tracked ) * 1000.0f, (UINT)weightDiffs, maxDiff );
+        passed = passed && reintegrated == 2 && weightDiffs == 0 && maxDiff <= 2;
+    }
+
+    // Loops are tried every third frame against any older keyframe, and closed however small the drift
+    CpuReconstruction reconstruction( params, RigidTransform().toMatrix4() );
+    LoopClosureOptions options;
+    options.minKeyframeGap = 1;
+    options.detectionInterval = 3;
+    options.minCorrection = 0;
+    reconstruction.enableLoopClosure( options );
+    const int FRAMES = 60;
+    int trackingErrors = 0;
+    float maxDrift = 0;
+    DepthFloatFrame depthFloat;
+    for ( int i = 0; i < FRAMES; ++i ) {
+        renderSyntheticFrame( scene, i, width, height, pixels, depthFloat );
+        if ( FAILED( reconstruction.ProcessFrame( &depthFloat, NUI_FUSION_DEFAULT_ALIGN_ITERATION_COUNT,
+                                                  NUI_FUSION_DEFAULT_INTEGRATION_WEIGHT, nullptr ) ) ) {
+            ++trackingErrors;
+            continue;
+        }
+        Matrix4 worldToCamera;
+        reconstruction.GetCurrentWorldToCameraTransform( &worldToCamera );
+        maxDrift = std::max( maxDrift, cameraDistance( RigidTransform::fromMatrix4( worldToCamera ),
+                                                       SyntheticScene::trajectory( i ) ) );
+    }
+    const PoseGraph& poses = reconstruction.poseGraph();
+    const LoopClosureStatistics& loops = reconstruction.loopClosureStatistics();
+    float trajectoryDrift = 0;
+    for ( size_t f = 0; f < poses.frameCount(); ++f ) {
+        trajectoryDrift = std::max( trajectoryDrift, cameraDistance( poses.framePose( f ),
+                                                                     SyntheticScene::trajectory( poses.frameSequence( f ) ) ) );
+    }
+    std::printf( "loop closure: %d frames, %d tracking errors, %u keyframes, %u of %u loops closed, "
+                 "%u frames moved in %.1f ms, drift %.2f mm max, %.2f mm max along the trajectory\n",
+                 FRAMES, trackingErrors, (UINT)poses.keyframeCount(), loops.closures, loops.attempts,
+                 loops.reintegratedFrames, loops.reintegrationTime, maxDrift * 1000.0f, trajectoryDrift * 1000.0f );
+    passed = passed && trackingErrors == 0 && loops.closures > 0 && poses.frameCount() == (size_t)FRAMES &&
+             maxDrift <= MAX_SYNTHETIC_DRIFT && trajectoryDrift <= MAX_SYNTHETIC_DRIFT;
+    return passed;
+}
+
+// Triangles of a mesh as their corners, starting at the smallest, in order; free slots are an error
+bool meshTriangles( const kinectbook::MeshExtractor& mesh, std::vector<std::vector<float> >& triangles )
+{
+    triangles.clear();
+    const std::vector<kinectbook::MeshVertex>& vertices = mesh.vertices();
+    const std::vector<unsigned int>& indices = mesh.indices();
+    for ( size_t t = 0; t < indices.size(); t += 3 ) {
+        std::vector<float> corners;
+        for ( int k = 0; k < 3; ++k ) {
+            const kinectbook::MeshVertex& vertex = vertices[indices[t + k]];
+            if ( vertex.normal.x == 0 && vertex.normal.y == 0 && vertex.normal.z == 0 ) {
+                return false;
+            }
+            corners.push_back( vertex.position.x );
+            corners.push_back( vertex.position.y );
+            corners.push_back( vertex.position.z );
+        }
+        int smallest = 0;
+        for ( int k = 1; k < 3; ++k ) {
+            if ( std::lexicographical_compare( corners.begin() + k * 3, corners.begin() + k * 3 + 3,
+                                               corners.begin() + smallest * 3, corners.begin() + smallest * 3 + 3 ) ) {
+                smallest = k;
+            }
+        }
+        std::rotate( corners.begin(), corners.begin() + smallest * 3, corners.end() );
+        triangles.push_back( corners );
+    }
+    std::sort( triangles.begin(), triangles.end() );
+    return true;
+}
+
+bool readFile( const char* path, std::vector<char>& data )
+{
+    data.clear();
+    std::FILE* file = std::fopen( path, "rb" );
+    if ( file == 0 ) {
+        return false;
+    }
+    char buffer[65536];
+    size_t read;
+    while ( (read = std::fread( buffer, 1, sizeof(buffer), file )) != 0 ) {
+        data.insert( data.end(), buffer, buffer + read );
+    }
+    std::fclose( file );
+    return true;
+}
+
+// Write a mesh in every format and read it back: the counts, the sizes and the PLY faces have to match
+bool checkMeshFiles( const kinectbook::MeshExtractor& mesh )
+{
+    using namespace kinectbook;
+
+    const std::vector<MeshVertex>& vertices = mesh.vertices();
+    const std::vector<unsigned int>& indices = mesh.indices();
+    const size_t triangles = mesh.triangleCount();
+    const char* const paths[] = { "KinectBenchmark.stl", "KinectBenchmark.ply", "KinectBenchmark.obj" };
+    bool passed = true;
+    for ( int f = MESH_FILE_STL; f <= MESH_FILE_OBJ; ++f ) {
+        std::vector<char> data;
+        try {
+            MeshWriter writer( paths[f], (MeshFileFormat)f, f != MESH_FILE_STL );
+            writer.write( &vertices[0], vertices.size(), &indices[0], triangles );
+            writer.close();
+        }
+        catch ( const std::runtime_error& e ) {
+            std::printf( "mesh file: %s\n", e.what() );
+            std::remove( paths[f] );
+            passed = false;
+            continue;
+        }
+        readFile( paths[f], data );
+        std::remove( paths[f] );
+
+        bool matches = false;
+        if ( f == MESH_FILE_STL ) {
+            UINT count = 0;
+            if ( data.size() >= 84 ) {
+                std::memcpy( &count, &data[80], sizeof(count) );
+            }
+            matches = count == triangles && data.size() == 84 + 50 * triangles;
+        }
+        else if ( f == MESH_FILE_PLY ) {
+            // Positions, normals and colors per vertex, a count and three indices per face
+            const std::string text( data.begin(), data.end() );
+            const size_t end = text.find( "end_header\n" );
+            unsigned long vertexCount = 0, faceCount = 0;
+            const size_t vertexElement = text.find( "element vertex " ), faceElement = text.find( "element face " );
+            if ( end != std::string::npos && vertexElement < end && faceElement < end ) {
+                vertexCount = std::strtoul( text.c_str() + vertexElement + 15, 0, 10 );
+                faceCount = std::strtoul( text.c_str() + faceElement + 13, 0, 10 );
+                const size_t faces = end + 11 + vertexCount * 27;
+                matches = vertexCount == vertices.size() && faceCount == triangles &&
+                          data.size() == faces + faceCount * 13;
+                for ( size_t t = 0; t < faceCount && matches; ++t ) {
+                    unsigned int face[3];
+                    std::memcpy( face, &data[faces + t * 13 + 1], sizeof(face) );
+                    matches = data[faces + t * 13] == 3 && face[0] == indices[t * 3] &&
+                              face[1] == indices[t * 3 + 1] && face[2] == indices[t * 3 + 2];
+                }
+            }
+        }
+        else {
+            size_t vertexLines = 0, faceLines = 0;
+            for ( size_t i = 0; i + 1 < data.size(); ++i ) {
+                if ( i == 0 || data[i - 1] == '\n' ) {
+                    vertexLines += (data[i] == 'v' && data[i + 1] == ' ') ? 1 : 0;
+                    faceLines += (data[i] == 'f' && data[i + 1] == ' ') ? 1 : 0;
+                }
+            }
+            matches = vertexLines == vertices.size() && faceLines == triangles;
+        }
+        std::printf( "mesh file %s: %.1f MB, %s\n", paths[f] + 16, data.size() / 1048576.0, matches ? "complete" : "WRONG" );
+        passed = passed && matches;
+    }
+    return passed;
+}
+
+// The synthetic room integrated at the true poses into every kind of volume:
+// the mesh kept up to date after every frame has to have exactly the
+// triangles of one extracted from scratch at the end, and the files written
+// of it have to hold them all
+bool checkMeshes()
+{
+    using namespace kinectbook;
+
+    const UINT width = 320, height = 240;
+    NUI_FUSION_RECONSTRUCTION_PARAMETERS params;
+    params.voxelsPerMeter = 128;
+    params.voxelCountX = params.voxelCountY = params.voxelCountZ = 256;
+    const TsdfVolumeType types[] = { TSDF_VOLUME_DENSE, TSDF_VOLUME_HASHED, TSDF_VOLUME_MULTISCALE };
+    const char* const names[] = { "dense", "hashed", "multi-scale" };
+    SyntheticScene scene;
+    std::vector<NUI_DEPTH_IMAGE_PIXEL> pixels;
+    DepthFloatFrame depthFloat;
+    bool passed = true;
+    for ( int t = 0; t < 3; ++t ) {
+        CpuReconstruction reconstruction( params, RigidTransform().toMatrix4(), types[t] );
+        MeshExtractor incremental( reconstruction.volume() );
+        for ( int i = 0; i < 60; i += 3 ) {
+            renderSyntheticFrame( scene, i, width, height, pixels, depthFloat );
+            const Matrix4 worldToCamera = SyntheticScene::trajectory( i ).toMatrix4();
+            reconstruction.IntegrateFrame( &depthFloat, NUI_FUSION_DEFAULT_INTEGRATION_WEIGHT, &worldToCamera );
+            incremental.update();
+        }
+        MeshExtractor full( reconstruction.volume() );
+        full.update();
+
+        std::vector<std::vector<float> > a, b;
+        const bool slotsUsed = meshTriangles( incremental, a ) && meshTriangles( full, b );
+        const bool same = slotsUsed && a == b;
+        std::printf( "mesh, %s: %u triangles kept up to date, %u extracted at once, %s\n", names[t],
+                     (UINT)incremental.triangleCount(), (UINT)full.triangleCount(),
+                     !slotsUsed ? "FREE SLOTS USED" : (same ? "identical" : "DIFFERENT") );
+        passed = passed && same && !a.empty();
+        if ( t == 0 ) {
+            passed = checkMeshFiles( full ) && passed;
+        }
+    }
+    return passed;
+}
+
+// Feed every sensor from a thread of its own and take the results on this one
+template <class Fusion>
+void play( Fusion& fusion, size_t sensorCount, const std::function<void ( size_t sensor )>& submit,
+           const std::function<void ( const kinectbook::FusionPipelineFrame& frame )>& present )
+{
+    std::atomic<size_t> running( sensorCount );
+    std::vector<std::thread> acquisition;
+    for ( size_t s = 0; s < sensorCount; ++s ) {
+        acquisition.push_back( std::thread( [&, s]() {
+            submit( s );
+            --running;
+        } ) );
+    }
+    while ( running.load() != 0 ) {
+        if ( kinectbook::FusionPipelineFrame* frame = fusion.receive( 10 ) ) {
+            present( *frame );
+            fusion.release( frame );
+        }
+    }
+    for ( size_t s = 0; s < sensorCount; ++s ) {
+        acquisition[s].join();
+    }
+    fusion.flush();
+    while ( kinectbook::FusionPipelineFrame* frame = fusion.receive( 0 ) ) {
+        present( *frame );
+        fusion.release( frame );
+    }
+}
+
+// Snapshot the volume as it is and load it into a new one, which has to be the same
+bool snapshotRoundTrip( kinectbook::CpuReconstruction& reconstruction, kinectbook::TsdfVolumeType type )
+{
+    using namespace kinectbook;
+    typedef std::chrono::steady_clock Clock;
+
+    const char* path = "KinectBenchmark.kbvol";
+    while ( reconstruction.SaveSnapshotAsync( path ) != S_OK ) {
+        std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+    }
+    while ( reconstruction.snapshotBusy() ) {
+        std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+    }
+    VolumeSnapshotResult written = reconstruction.snapshotResult();
+    if ( !written.succeeded ) {
+        std::printf( "    snapshot failed: %s\n", written.error.c_str() );
+        return false;
+    }
+
+    const ITsdfVolume& volume = reconstruction.volume();
+    CpuReconstruction loaded( volume.parameters(), RigidTransform().toMatrix4(), type );
+    Clock::time_point start = Clock::now();
+    HRESULT hr = loaded.LoadSnapshot( path );
+    double loadTime = std::chrono::duration<double, std::milli>( Clock::now() - start ).count();
+    std::remove( path );
+
+    std::vector<VoxelBlockIndex> blocks;
+    volume.changedBlocks( 0, blocks );
+    std::vector<TsdfVoxel> a( VOXELS_PER_BLOCK ), b( VOXELS_PER_BLOCK );
+    size_t differentBlocks = 0;
+    for ( size_t i = 0; i < blocks.size() && SUCCEEDED( hr ); ++i ) {
+        const VoxelBlockIndex& block = blocks[i];
+        volume.readVoxels( block.x * VOXEL_BLOCK_SIZE, block.y * VOXEL_BLOCK_SIZE, block.z * VOXEL_BLOCK_SIZE,
+                           VOXEL_BLOCK_SIZE, &a[0] );
+        loaded.volume().readVoxels( block.x * VOXEL_BLOCK_SIZE, block.y * VOXEL_BLOCK_SIZE, block.z * VOXEL_BLOCK_SIZE,
+                                    VOXEL_BLOCK_SIZE, &b[0] );
+        if ( std::memcmp( &a[0], &b[0], VOXELS_PER_BLOCK * sizeof(TsdfVoxel) ) != 0 ) {
+            ++differentBlocks;
+        }
+    }
+    std::printf( "    snapshot: %u blocks, %.1f MB, written in %.1f ms (%u blocks packed), loaded in %.1f ms, %s\n",
+                 (UINT)written.blockCount, written.fileSize / 1048576.0, written.milliseconds,
+                 (UINT)written.packedBlockCount, loadTime,
+                 FAILED( hr ) ? "load failed" : (differentBlocks == 0 ? "identical" : "DIFFERENT") );
+    return SUCCEEDED( hr ) && differentBlocks == 0;
+}
+
+// Raycast the volume from beside the last pose, where the tracking raycast cannot be reused
+void measureRaycast( kinectbook::CpuReconstruction& reconstruction, UINT width, UINT height )
+{
+    using namespace kinectbook;
+    typedef std::chrono::steady_clock Clock;
+
+    Matrix4 current;
+    reconstruction.GetCurrentWorldToCameraTransform( &current );
+    RigidTransform pose = RigidTransform::fromMatrix4( current );
+    pose.t = pose.t + Float3( 0.01f, 0, 0 );
+    Matrix4 worldToCamera = pose.toMatrix4();
+
+    double milliseconds[2];
+    for ( int level = 0; level < 2; ++level ) {
+        PointCloudFrame pointCloud;
+        pointCloud.resize( width >> level, height >> level );
+        Clock::time_point start = Clock::now();
+        reconstruction.CalculatePointCloud( &pointCloud, &worldToCamera );
+        milliseconds[level] = std::chrono::duration<double, std::milli>( Clock::now() - start ).count();
+    }
+    std::printf( "    raycast from a new pose: %.1f ms, %.1f ms at half resolution\n", milliseconds[0], milliseconds[1] );
+}
+
+// Integrate the last synthetic frame again at its true pose, best of a few runs
+// without and with its color; then how well the point cloud colors match the scene
+bool measureColorIntegration( kinectbook::CpuReconstruction& reconstruction, const DepthSequence& sequence )
+{
+    using namespace kinectbook;
+    typedef std::chrono::steady_clock Clock;
+
+    const int last = (int)sequence.frameCount() - 1;
+    const RigidTransform pose = SyntheticScene::trajectory( last );
+    const Matrix4 worldToCamera = pose.toMatrix4();
+
+    DepthFloatFrame depthFloat;
+    DepthToDepthFloatFrame( &sequence.sensors[0].frames[last][0], sequence.width, sequence.height, &depthFloat,
+                            NUI_FUSION_DEFAULT_MINIMUM_DEPTH, NUI_FUSION_DEFAULT_MAXIMUM_DEPTH, TRUE );
+
+    // The color camera sits at the depth camera, every depth pixel maps to the same color pixel
+    std::vector<BYTE> colorImage;
+    SyntheticScene().renderColor( pose, sequence.width, sequence.height, true, colorImage );
+    std::vector<NUI_COLOR_IMAGE_POINT> coordinates( (size_t)sequence.width * sequence.height );
+    for ( size_t i = 0; i < coordinates.size(); ++i ) {
+        coordinates[i].x = (LONG)(i % sequence.width);
+        coordinates[i].y = (LONG)(i / sequence.width);
+    }
+    ColorFrame color;
+    Clock::time_point registerStart = Clock::now();
+    RegisterColorFrame( &colorImage[0], sequence.width, sequence.height, &coordinates[0], sequence.width, sequence.height,
+                        &color, TRUE );
+    double registerTime = std::chrono::duration<double, std::milli>( Clock::now() - registerStart ).count();
+
+    // The first colored frame allocates the colors, it is not timed
+    const size_t memoryBefore = reconstruction.volume().memoryUsage();
+    reconstruction.IntegrateFrame( &depthFloat, &color, NUI_FUSION_DEFAULT_INTEGRATION_WEIGHT, &worldToCamera );
+    const size_t colorMemory = reconstruction.volume().memoryUsage() - memoryBefore;
+
+    double milliseconds[2] = { 1e30, 1e30 };
+    for ( int i = 0; i < 3; ++i ) {
+        for ( int colored = 0; colored < 2; ++colored ) {
+            Clock::time_point start = Clock::now();
+            reconstruction.IntegrateFrame( &depthFloat, colored ? &color : nullptr, NUI_FUSION_DEFAULT_INTEGRATION_WEIGHT,
+                                           &worldToCamera );
+            milliseconds[colored] = std::min( milliseconds[colored],
+                                              std::chrono::duration<double, std::milli>( Clock::now() - start ).count() );
+        }
+    }
+
+    PointCloudFrame pointCloud;
+    ColorFrame pointColors;
+    pointCloud.resize( sequence.width, sequence.height );
+    Clock::time_point start = Clock::now();
+    reconstruction.CalculatePointCloud( &pointCloud, &pointColors, &worldToCamera );
+    double pointCloudTime = std::chrono::duration<double, std::milli>( Clock::now() - start ).count();
+
+    size_t points = 0, coloredPoints = 0;
+    double error = 0;
+    for ( int v = 0; v < pointCloud.height; ++v ) {
+        for ( int u = 0; u < pointCloud.width; ++u ) {
+            const float* p = pointCloud.pixel( u, v );
+            if ( !PointCloudFrame::isValid( p ) ) {
+                continue;
+            }
+            ++points;
+            UINT fused = pointColors.row( v )[u];
+            if ( !ColorFrame::isValid( fused ) ) {
+                continue;
+            }
+            ++coloredPoints;
+            UINT truth = SyntheticScene::colorAt( Float3( p[0], p[1], p[2] ) );
+            for ( int shift = 0; shift < 24; shift += 8 ) {
+                error += std::abs( (int)((fused >> shift) & 0xFF) - (int)((truth >> shift) & 0xFF) );
+            }
+        }
+    }
+    std::printf( "    color: registered in %.2f ms, integrate %.1f ms, %.1f ms with color, colors %.1f MB\n",
+                 registerTime, milliseconds[0], milliseconds[1], colorMemory / 1048576.0 );
+    const double coloredShare = points ? (double)coloredPoints / points : 0.0;
+    const double meanError = coloredPoints ? error / (coloredPoints * 3.0) : 0.0;
+    std::printf( "    colored point cloud: %.1f ms, %.1f%% of the points colored, mean error %.1f of 255\n",
+                 pointCloudTime, coloredShare * 100.0, meanError );
+    return coloredShare >= MIN_COLORED_POINTS && meanError <= MAX_COLOR_ERROR;
+}
+
+// Shade the point cloud of the last pose, best of a few runs of the SIMD shader and the reference,
+// which have to agree exactly
+bool measureShading( kinectbook::CpuReconstruction& reconstruction, UINT width, UINT height )
+{
+    using namespace kinectbook;
+    typedef std::chrono::steady_clock Clock;
+    static const char* const names[] = { "surface", "normals", "depth", "color" };
+
+    Matrix4 worldToCamera;
+    reconstruction.GetCurrentWorldToCameraTransform( &worldToCamera );
+    PointCloudFrame pointCloud;
+    ColorFrame colors;
+    pointCloud.resize( width, height );
+    reconstruction.CalculatePointCloud( &pointCloud, &colors, &worldToCamera );
+
+    std::vector<BYTE> reference( width * height * 4 ), shaded( width * height * 4 );
+    int maxDiff = 0;
+    for ( int mode = POINT_CLOUD_SHADING_SURFACE; mode <= POINT_CLOUD_SHADING_COLOR; ++mode ) {
+        PointCloudShadingParameters parameters;
+        parameters.shading = (PointCloudShading)mode;
+        double milliseconds[2] = { 1e30, 1e30 };
+        for ( int i = 0; i < 5; ++i ) {
+            Clock::time_point start = Clock::now();
+            ShadePointCloudReference( &pointCloud, &colors, &worldToCamera, parameters, &reference[0], width * 4 );
+            Clock::time_point middle = Clock::now();
+            ShadePointCloud( &pointCloud, &colors, &worldToCamera, parameters, &shaded[0], width * 4 );
+            milliseconds[0] = std::min( milliseconds[0], std::chrono::duration<double, std::milli>( middle - start ).count() );
+            milliseconds[1] = std::min( milliseconds[1], std::chrono::duration<double, std::milli>( Clock::now() - middle ).count() );
+        }
+
+        int diff = 0;
+        for ( size_t i = 0; i < shaded.size(); ++i ) {
+            diff = std::max( diff, std::abs( (int)shaded[i] - (int)reference[i] ) );
+        }
+        std::printf( "    shading %-8s %6.2f ms, reference %6.2f ms, max difference %d\n",
+                     names[mode], milliseconds[1], milliseconds[0], diff );
+        maxDiff = std::max( maxDiff, diff );
+    }
+    return maxDiff == 0;
+}
+
+// One sequence through the fusion pipeline with one volume, as fast as it goes;
+// false when a check fails: the snapshot or the shading always, and on
+// synthetic frames tracking errors, the drift and the fused colors
+bool runFusion( const DepthSequence& sequence, const VolumeConfig& config )
+{
+    using namespace kinectbook;
+    typedef std::chrono::steady_clock Clock;
+
+    Profiler profiler;
+    NUI_FUSION_RECONSTRUCTION_PARAMETERS params;
+    params.voxelsPerMeter = (FLOAT)config.voxelsPerMeter;
+    params.voxelCountX = config.voxelCountX;
+    params.voxelCountY = config.voxelCountY;
+    params.voxelCountZ = config.voxelCountZ;
+    CpuReconstruction reconstruction( params, RigidTransform().toMatrix4(), config.type );
+
+    FusionPipelineOptions options;
+    options.dropStaleFrames = false;
+    options.meshUpdateInterval = 10;
+    options.snapshotPath = "KinectBenchmark.kbvol";
+    options.snapshotInterval = 10;
+    options.profiler = &profiler;
+
+    const size_t frameCount = sequence.frameCount();
+    double totalDrift = 0;
+    float maxDrift = 0;
+    // Frames that fail to track never come out of the pipeline
+    auto present = [&]( const FusionPipelineFrame& frame ) {
+        if ( sequence.synthetic ) {
+            float drift = cameraDistance( RigidTransform::fromMatrix4( frame.worldToCamera ),
+                                          SyntheticScene::trajectory( (int)frame.sequence ) );
+            totalDrift += drift;
+            maxDrift = std::max( maxDrift, drift );
+        }
+    };
+
+    Clock::time_point start = Clock::now();
+    if ( sequence.sensors.size() == 1 ) {
+        FusionPipeline pipeline( reconstruction, options, FusionPipeline::ShadeFunction() );
+        const DepthStream& stream = sequence.sensors[0];
+        play( pipeline, 1, [&]( size_t ) {
+            for ( size_t i = 0; i < frameCount; ++i ) {
+                pipeline.submit( &stream.frames[i][0], sequence.width, sequence.height, stream.timestamps[i] );
+            }
+        }, present );
+    }
+    else {
+        MultiSensorFusionOptions multiOptions;
+        multiOptions.pipeline = options;
+        multiOptions.sharedClock = true;
+        for ( size_t s = 0; s < sequence.sensors.size(); ++s ) {
+            multiOptions.referenceToCamera.push_back( sequence.sensors[s].referenceToCamera );
+        }
+        MultiSensorFusion fusion( reconstruction, multiOptions, MultiSensorFusion::ShadeFunction() );
+        play( fusion, sequence.sensors.size(), [&]( size_t s ) {
+            const DepthStream& stream = sequence.sensors[s];
+            for ( size_t i = 0; i < frameCount; ++i ) {
+                fusion.submit( (UINT)s, &stream.frames[i][0], sequence.width, sequence.height, stream.timestamps[i] );
+            }
+        }, present );
+    }
+    double seconds = std::chrono::duration<double>( Clock::now() - start ).count();
+
+    ProfilerSnapshot snapshot = profiler.snapshot();
+    unsigned long long trackingErrors = snapshot.counter( "fusion.tracking_errors" );
+    std::printf( "  %s: %.2f fps, %llu tracking errors, volume %.1f MB, peak memory %.1f MB\n", config.name,
+                 frameCount / seconds, trackingErrors, reconstruction.volume().memoryUsage() / 1048576.0,
+                 peakMemory() / 1048576.0 );
+    printStage( snapshot, "fusion.depth_float" );
+    printStage( snapshot, "fusion.process_frame" );
+    printStage( snapshot, "fusion.integrate" );
+    printStage( snapshot, "fusion.point_cloud" );
+    printStage( snapshot, "fusion.mesh_update" );
+    printStage( snapshot, "fusion.snapshot" );
+    printStage( snapshot, "fusion.latency" );
+    if ( sequence.sensors.size() > 1 ) {
+        std::printf( "    frames of other sensors: %llu without a match, %llu too late\n",
+                     snapshot.counter( "fusion.unmatched_frames" ), snapshot.counter( "fusion.stale_frames" ) );
+    }
+
+    bool passed = !sequence.synthetic || trackingErrors == 0;
+    if ( sequence.synthetic && frameCount > trackingErrors ) {
+        Matrix4 worldToCamera;
+        reconstruction.GetCurrentWorldToCameraTransform( &worldToCamera );
+        float finalDrift = cameraDistance( RigidTransform::fromMatrix4( worldToCamera ),
+                                           SyntheticScene::trajectory( (int)frameCount - 1 ) );
+        std::printf( "    drift from the true camera: %.2f mm mean, %.2f mm max, %.2f mm at the end\n",
+                     totalDrift / (frameCount - trackingErrors) * 1000.0, maxDrift * 1000.0f, finalDrift * 1000.0f );
+        passed = passed && maxDrift <= MAX_SYNTHETIC_DRIFT && finalDrift <= MAX_SYNTHETIC_DRIFT;
+    }
+
+    measureRaycast( reconstruction, sequence.width, sequence.height );
+    if ( sequence.synthetic ) {
+        passed = measureColorIntegration( reconstruction, sequence ) && passed;
+    }
+    passed = measureShading( reconstruction, sequence.width, sequence.height ) && passed;
+    passed = snapshotRoundTrip( reconstruction, config.type ) && passed;
+    if ( !passed ) {
+        std::printf( "    FAILED\n" );
+    }
+    return passed;
+}
+
+bool runFusionSuite( const DepthSequence& sequence )
+{
+    if ( sequence.frameCount() == 0 ) {
+        std::printf( "fusion of %s: no frames\n", sequence.name.c_str() );
+        return false;
+    }
+    std::printf( "fusion of %s, %u frames of %ux%u\n", sequence.name.c_str(), (UINT)sequence.frameCount(),
+                 sequence.width, sequence.height );
+    bool passed = true;
+    for ( size_t i = 0; i < sizeof(VOLUME_CONFIGS) / sizeof(VOLUME_CONFIGS[0]); ++i ) {
+        passed = runFusion( sequence, VOLUME_CONFIGS[i] ) && passed;
+    }
+    return passed;
+}
+
+// Options of the command line
+struct BenchmarkOptions
+{
+    int iterations;
+    int fusionFrames;
+    const char* recording;
+    bool freenect;
+};
+
+void printUsage()
+{
+    std::printf( "usage: 04_KinectBenchmarkCpp [--frames N] [--freenect] [iterations] [recording.kbrec]\n" );
+}
+
+bool parseArguments( int argc, char* argv[], BenchmarkOptions& options )
+{
+    options.iterations = 200;
+    options.fusionFrames = 30;
+    options.recording = 0;
+    options.freenect = false;
+    for ( int i = 1; i < argc; ++i ) {
+        const char* arg = argv[i];
+        if ( std::strcmp( arg, "--frames" ) == 0 && i + 1 < argc ) {
+            options.fusionFrames = std::max( std::atoi( argv[++i] ), 0 );
+        }
+        else if ( std::strcmp( arg, "--freenect" ) == 0 ) {
+#ifdef KB_HAVE_FREENECT
+            options.freenect = true;
+#else
+            std::printf( "--freenect: built without libfreenect\n" );
+            return false;
+#endif
+        }
+        else if ( arg[0] == '-' ) {
+            return false;
+        }
+        else if ( arg[0] >= '0' && arg[0] <= '9' ) {
+            options.iterations = std::max( std::atoi( arg ), 1 );
+        }
+        else if ( options.recording == 0 ) {
+            options.recording = arg;
+        }
+        else {
+            return false;
+        }
+    }
+    return true;
+}
+
+// All suites; throws when a recording cannot be read
+bool runBenchmark( const BenchmarkOptions& options )
+{
+    using namespace kinectbook;
+
+    ThreadPool single( 1 );
+    ThreadPool& all = ThreadPool::shared();
+
+    const std::vector<NUI_DEPTH_IMAGE_PIXEL> depth = makeDepthFrame();
+    const NUI_DEPTH_IMAGE_PIXEL* pixels = &depth[0];
+    const float minDepth = NUI_FUSION_DEFAULT_MINIMUM_DEPTH;
+    const float maxDepth = NUI_FUSION_DEFAULT_MAXIMUM_DEPTH;
+    BilateralFilterParameters filter;
+
+    DepthFloatFrame reference, simd, filteredReference, filtered;
+    std::vector<DepthFloatFrame> pyramid( 1 );
+
+    std::printf( "depth processing %ux%u, %d iterations, SIMD: %s, threads: %u\n",
+                 WIDTH, HEIGHT, options.iterations, simdName(), all.threadCount() );
+
+    print( "depth to float, reference, 1 thread", measure( options.iterations, [&]() {
+        DepthToDepthFloatFrameReference( pixels, WIDTH, HEIGHT, &reference, minDepth, maxDepth, TRUE, single );
+    } ) );
+    print( "depth to float, SIMD, 1 thread", measure( options.iterations, [&]() {
+        DepthToDepthFloatFrame( pixels, WIDTH, HEIGHT, &simd, minDepth, maxDepth, TRUE, single );
+    } ) );
+    print( "depth to float, SIMD, all threads", measure( options.iterations, [&]() {
+        DepthToDepthFloatFrame( pixels, WIDTH, HEIGHT, &simd, minDepth, maxDepth, TRUE, all );
+    } ) );
+
+    print( "bilateral filter, reference, 1 thread", measure( options.iterations, [&]() {
+        FilterDepthFloatFrameReference( &reference, &filteredReference, filter, single );
+    } ) );
+    print( "depth to float + bilateral, SIMD, 1 thread", measure( options.iterations, [&]() {
+        DepthToFilteredDepthFloatFrame( pixels, WIDTH, HEIGHT, &filtered, minDepth, maxDepth, TRUE, filter, single );
+    } ) );
+    print( "depth to float + bilateral, SIMD, all", measure( options.iterations, [&]() {
+        DepthToFilteredDepthFloatFrame( pixels, WIDTH, HEIGHT, &filtered, minDepth, maxDepth, TRUE, filter, all );
+    } ) );
+
+    pyramid[0] = filtered;
+    print( "pyramid, 3 levels, all threads", measure( options.iterations, [&]() {
+        BuildDepthFloatPyramid( &pyramid, 3, 3 * filter.sigmaDepth, all );
+    } ) );
+
+    // Open, closed and open again has to be one grip and one release
+    std::vector<NUI_DEPTH_IMAGE_PIXEL> openHand, fist;
+    NUI_SKELETON_DATA skeletons[NUI_SKELETON_COUNT] = {};
+    renderHandFrame( true, WIDTH, HEIGHT, fist, skeletons[0] );
+    renderHandFrame( false, WIDTH, HEIGHT, openHand, skeletons[0] );
+    HandStateClassifier classifier;
+    HandFrame hands;
+    print( "hand states, 1 user", measure( options.iterations, [&]() {
+        classifier.ProcessSkeleton( NUI_SKELETON_COUNT, skeletons, 0 );
+        classifier.ProcessDepth( &openHand[0], WIDTH, HEIGHT, 0 );
+        classifier.GetNextFrame( &hands );
+    } ) );
+    int grips = 0, releases = 0;
+    for ( int i = 0; i < 30; ++i ) {
+        classifier.ProcessSkeleton( NUI_SKELETON_COUNT, skeletons, i );
+        classifier.ProcessDepth( (i >= 10 && i < 20) ? &fist[0] : &openHand[0], WIDTH, HEIGHT, i );
+        classifier.GetNextFrame( &hands );
+        const HandState& right = hands.hands[0][HAND_RIGHT];
+        grips += (right.handEvent == HAND_EVENT_GRIP) ? 1 : 0;
+        releases += (right.handEvent == HAND_EVENT_GRIP_RELEASE) ? 1 : 0;
+    }
+    const HandState& right = hands.hands[0][HAND_RIGHT];
+    std::printf( "hand: %u pixels, %.4f m^2, openness %.2f, %d grips, %d releases, latency %.3f ms\n",
+                 right.features.pixelCount, right.features.area, right.openness, grips, releases, right.latency );
+
+    if ( options.recording != 0 ) {
+        replayHands( options.recording );
+    }
+
+    // The SIMD kernels have to match the reference
+    float convertError = maxDifference( reference, simd );
+    float filterError = maxDifference( filteredReference, filtered );
+    std::printf( "max difference to reference: depth to float %g m, bilateral %g m\n", convertError, filterError );
+
+    bool synchronized = checkSynchronizer( options.iterations );
+    bool relocalized = checkRelocalization();
+    bool loopsClosed = checkLoopClosure();
+    bool meshed = checkMeshes();
+
+    bool fused = true;
+    if ( options.fusionFrames > 0 ) {
+        fused = runFusionSuite( syntheticSequence( options.fusionFrames, 1 ) ) && fused;
+        fused = runFusionSuite( syntheticSequence( options.fusionFrames, RIG_SENSORS ) ) && fused;
+        if ( options.recording != 0 ) {
+            fused = runFusionSuite( recordedSequence( options.recording, options.fusionFrames ) ) && fused;
+        }
+#ifdef KB_HAVE_FREENECT
+        if ( options.freenect ) {
+            fused = runFusionSuite( freenectSequence( options.fusionFrames ) ) && fused;
+        }
+#endif
+    }
+
+    const bool passed = convertError == 0 && filterError < 1e-5f && grips == 1 && releases == 1 && synchronized &&
+                        relocalized && loopsClosed && meshed && fused;
+    return passed;
+}
+
+}
+
+int main( int argc, char* argv[] )
+{
+    BenchmarkOptions options;
+    if ( !parseArguments( argc, argv, options ) ) {
+        printUsage();
+        return 1;
+    }
+
+    bool passed = false;
+    try {
+        passed = runBenchmark( options );
+    }
+    catch ( const std::exception& e ) {
+        std::printf( "%s\n", e.what() );
+    }
+    std::printf( "%s\n", passed ? "passed" : "FAILED" );
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,393 @@
+// Offline reconstruction of recorded depth sequences
+//
+//   05_KinectFusionBatchCpp [options] capture.kbrec...
+//
+//   --voxels-per-meter a,b,...   resolutions to reconstruct at (default 256)
+//   --weight a,b,...             maximum integration weights (default 200)
+//   --volume dense|hashed|multiscale                 (default hashed)
+//   --size X Y Z                 volume size in meters (default 2 2 2)
+//   --align N                    alignment iterations (default 7)
+//   --jobs N                     reconstructions run at once (default: one per 2 cores)
+//   --loop-closure               correct the drift where the camera comes back
+//   --out dir                    where the results go (default .)
+//
+// Every capture is reconstructed once for every combination of resolution
+// and weight, a job. No window and no waiting: the depth frames of a capture
+// are converted and tracked as fast as the CPU goes, on the thread of the
+// job and a thread pool of its own, so jobs run side by side on the cores
+// without sharing anything but the memory bus. Per job it writes
+//
+//   <out>/<capture>_v<voxels per meter>_w<weight>.kbvol       volume snapshot
+//   <out>/<capture>_v<voxels per meter>_w<weight>.ply         mesh
+//   <out>/<capture>_v<voxels per meter>_w<weight>.poses.txt   camera poses
+//
+// The poses are camera to world, one line per tracked frame in the TUM RGB-D
+// format "timestamp tx ty tz qx qy qz qw" (timestamp in seconds), after the
+// loops closed; frames that failed to track have no line. Frames per second,
+// per second and core, and tracking errors are printed per job and in total.
+//
+// Returns 1 when a capture can't be read or a result can't be written.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../common/RecordedFrameSource.h"
+#include "../common/ThreadPool.h"
+#include "../02_KinectFusionBasicCpp/CpuReconstruction.h"
+#include "../02_KinectFusionBasicCpp/DepthProcessor.h"
+#include "../02_KinectFusionBasicCpp/MeshExtractor.h"
+#include "../02_KinectFusionBasicCpp/MeshWriter.h"
+
+namespace {
+
+// How long a source that has nothing ready is waited for at a time (ms)
+const unsigned int SOURCE_WAIT = 100;
+
+// Tracking errors in a row after which the volume is cleared, like FusionPipelineOptions::resetAfterTrackingErrors
+const unsigned int RESET_AFTER_TRACKING_ERRORS = 300;
+
+// Cores given to every job by default; tracking and integration scale to about this many
+const unsigned int CORES_PER_JOB = 2;
+
+// Voxel counts are rounded up to whole blocks
+const UINT VOXEL_BLOCK = 8;
+
+struct BatchOptions
+{
+    std::vector<std::string> captures;
+    std::vector<UINT> voxelsPerMeter;
+    std::vector<UINT> weights;
+    kinectbook::TsdfVolumeType volumeType;
+    float size[3];
+    UINT alignIterations;
+    unsigned int jobs;          // 0 = one per CORES_PER_JOB cores
+    bool loopClosure;
+    std::string outputDirectory;
+
+    BatchOptions()
+        : volumeType( kinectbook::TSDF_VOLUME_HASHED )
+        , alignIterations( NUI_FUSION_DEFAULT_ALIGN_ITERATION_COUNT )
+        , jobs( 0 )
+        , loopClosure( false )
+        , outputDirectory( "." )
+    {
+        size[0] = size[1] = size[2] = 2.0f;
+    }
+};
+
+// One capture at one resolution and weight
+struct Job
+{
+    std::string capture;
+    UINT voxelsPerMeter;
+    UINT weight;
+    std::string output;         // path without the extension
+
+    // Results
+    bool succeeded;
+    std::string error;
+    unsigned int frames;
+    unsigned int trackingErrors;
+    unsigned int resets;
+    unsigned int loopClosures;
+    size_t triangles;
+    double seconds;
+    unsigned int threads;
+};
+
+std::vector<UINT> parseList( const char* text )
+{
+    std::vector<UINT> values;
+    for ( const char* p = text; *p != 0; ) {
+        char* end;
+        unsigned long value = std::strtoul( p, &end, 10 );
+        if ( end == p || value == 0 ) {
+            throw std::runtime_error( std::string( "not a list of positive numbers: " ) + text );
+        }
+        values.push_back( (UINT)value );
+        p = (*end == ',') ? end + 1 : end;
+        if ( *end != ',' && *end != 0 ) {
+            throw std::runtime_error( std::string( "not a list of positive numbers: " ) + text );
+        }
+    }
+    return values;
+}
+
+// File name of a path without the directory and the extension
+std::string stem( const std::string& path )
+{
+    size_t slash = path.find_last_of( "/\\" );
+    std::string name = (slash == std::string::npos) ? path : path.substr( slash + 1 );
+    size_t dot = name.rfind( '.' );
+    return (dot == std::string::npos || dot == 0) ? name : name.substr( 0, dot );
+}
+
+// Reconstruct the capture of a job with the threads of pool
+void runJob( const BatchOptions& options, Job& job, kinectbook::ThreadPool& pool )
+{
+    using namespace kinectbook;
+    typedef std::chrono::steady_clock Clock;
+
+    NUI_FUSION_RECONSTRUCTION_PARAMETERS params;
+    params.voxelsPerMeter = (FLOAT)job.voxelsPerMeter;
+    UINT* counts[3] = { &params.voxelCountX, &params.voxelCountY, &params.voxelCountZ };
+    for ( int i = 0; i < 3; ++i ) {
+        UINT voxels = (UINT)std::ceil( options.size[i] * job.voxelsPerMeter );
+        *counts[i] = (voxels + VOXEL_BLOCK - 1) / VOXEL_BLOCK * VOXEL_BLOCK;
+    }
+
+    RecordedFrameSource source( job.capture );
+    Matrix4 identity = RigidTransform().toMatrix4();
+    CpuReconstruction reconstruction( params, identity, options.volumeType, pool );
+    if ( options.loopClosure ) {
+        reconstruction.enableLoopClosure();
+    }
+
+    // The poses are final once no loop can close any more, so they are written per graph
+    TrajectoryWriter trajectory( job.output + ".poses.txt", job.capture + ", " + std::to_string( job.voxelsPerMeter ) +
+                                 " voxels/m, weight " + std::to_string( job.weight ) );
+
+    DepthFloatFrame depthFloat;
+    FrameRef frame;
+    unsigned int errorsInRow = 0;
+    Clock::time_point start = Clock::now();
+    while ( true ) {
+        if ( !source.tryGetNextFrame( frame ) ) {
+            if ( source.finished() ) {
+                break;
+            }
+            source.wait( SOURCE_WAIT );
+            continue;
+        }
+        const NUI_DEPTH_IMAGE_PIXEL* pixels = frame->depthPixels();
+        if ( pixels == 0 ) {
+            continue;
+        }
+        const LONGLONG timestamp = frame->timestamp;
+        DepthToDepthFloatFrame( pixels, frame->width, frame->height, &depthFloat,
+                                NUI_FUSION_DEFAULT_MINIMUM_DEPTH, NUI_FUSION_DEFAULT_MAXIMUM_DEPTH, TRUE, pool );
+        frame.reset();
+        ++job.frames;
+
+        Matrix4 worldToCamera;
+        reconstruction.GetCurrentWorldToCameraTransform( &worldToCamera );
+        trajectory.addFrame( timestamp );
+        if ( FAILED( reconstruction.ProcessFrame( &depthFloat, options.alignIterations, job.weight, &worldToCamera ) ) ) {
+            ++job.trackingErrors;
+            if ( ++errorsInRow >= RESET_AFTER_TRACKING_ERRORS ) {
+                errorsInRow = 0;
+                ++job.resets;
+                char note[64];
+                std::sprintf( note, "reset at %.3f", timestamp / 1000.0 );
+                job.loopClosures += reconstruction.loopClosureStatistics().closures;
+                trajectory.write( reconstruction.poseGraph(), note );
+                reconstruction.ResetReconstruction( &identity, nullptr );
+            }
+            continue;
+        }
+        errorsInRow = 0;
+    }
+    job.seconds = std::chrono::duration<double>( Clock::now() - start ).count();
+    job.loopClosures += reconstruction.loopClosureStatistics().closures;
+    if ( !trajectory.write( reconstruction.poseGraph() ) ) {
+        throw std::runtime_error( "can't write " + trajectory.path() );
+    }
+
+    // The snapshot is written in the background while the mesh is extracted
+    reconstruction.SaveSnapshotAsync( job.output + ".kbvol" );
+
+    MeshExtractor mesh( reconstruction.volume(), pool );
+    mesh.update();
+    MeshWriter writer( job.output + ".ply", MESH_FILE_PLY, reconstruction.volume().hasColor() );
+    if ( !mesh.indices().empty() ) {
+        writer.write( &mesh.vertices()[0], mesh.vertices().size(), &mesh.indices()[0], mesh.triangleCount() );
+    }
+    writer.close();
+    job.triangles = mesh.triangleCount();
+
+    while ( reconstruction.snapshotBusy() ) {
+        std::this_thread::sleep_for( std::chrono::milliseconds( 10 ) );
+    }
+    VolumeSnapshotResult snapshot = reconstruction.snapshotResult();
+    if ( !snapshot.succeeded ) {
+        throw std::runtime_error( snapshot.error );
+    }
+}
+
+void printUsage()
+{
+    std::printf( "usage: 05_KinectFusionBatchCpp [--voxels-per-meter a,b,...] [--weight a,b,...]\n"
+                 "                               [--volume dense|hashed|multiscale] [--size X Y Z]\n"
+                 "                               [--align N] [--jobs N] [--loop-closure] [--out dir]\n"
+                 "                               capture.kbrec...\n" );
+}
+
+bool parseArguments( int argc, char* argv[], BatchOptions& options )
+{
+    for ( int i = 1; i < argc; ++i ) {
+        const char* arg = argv[i];
+        const bool hasValue = i + 1 < argc;
+        if ( std::strcmp( arg, "--voxels-per-meter" ) == 0 && hasValue ) {
+            options.voxelsPerMeter = parseList( argv[++i] );
+        }
+        else if ( std::strcmp( arg, "--weight" ) == 0 && hasValue ) {
+            options.weights = parseList( argv[++i] );
+        }
+        else if ( std::strcmp( arg, "--volume" ) == 0 && hasValue ) {
+            const char* type = argv[++i];
+            if ( std::strcmp( type, "dense" ) == 0 ) {
+                options.volumeType = kinectbook::TSDF_VOLUME_DENSE;
+            }
+            else if ( std::strcmp( type, "hashed" ) == 0 ) {
+                options.volumeType = kinectbook::TSDF_VOLUME_HASHED;
+            }
+            else if ( std::strcmp( type, "multiscale" ) == 0 ) {
+                options.volumeType = kinectbook::TSDF_VOLUME_MULTISCALE;
+            }
+            else {
+                throw std::runtime_error( std::string( "unknown volume: " ) + type );
+            }
+        }
+        else if ( std::strcmp( arg, "--size" ) == 0 && i + 3 < argc ) {
+            for ( int a = 0; a < 3; ++a ) {
+                options.size[a] = (float)std::atof( argv[++i] );
+                if ( !(options.size[a] > 0) ) {
+                    throw std::runtime_error( "the volume size has to be positive" );
+                }
+            }
+        }
+        else if ( std::strcmp( arg, "--align" ) == 0 && hasValue ) {
+            options.alignIterations = (UINT)std::max( std::atoi( argv[++i] ), 1 );
+        }
+        else if ( std::strcmp( arg, "--jobs" ) == 0 && hasValue ) {
+            options.jobs = (unsigned int)std::max( std::atoi( argv[++i] ), 1 );
+        }
+        else if ( std::strcmp( arg, "--loop-closure" ) == 0 ) {
+            options.loopClosure = true;
+        }
+        else if ( std::strcmp( arg, "--out" ) == 0 && hasValue ) {
+            options.outputDirectory = argv[++i];
+        }
+        else if ( arg[0] == '-' ) {
+            return false;
+        }
+        else {
+            options.captures.push_back( arg );
+        }
+    }
+    if ( options.voxelsPerMeter.empty() ) {
+        options.voxelsPerMeter.push_back( 256 );
+    }
+    if ( options.weights.empty() ) {
+        options.weights.push_back( NUI_FUSION_DEFAULT_INTEGRATION_WEIGHT );
+    }
+    return !options.captures.empty();
+}
+
+}
+
+int main( int argc, char* argv[] )
+{
+    using namespace kinectbook;
+    typedef std::chrono::steady_clock Clock;
+
+    BatchOptions options;
+    try {
+        if ( !parseArguments( argc, argv, options ) ) {
+            printUsage();
+            return 1;
+        }
+    }
+    catch ( const std::exception& e ) {
+        std::printf( "%s\n", e.what() );
+        printUsage();
+        return 1;
+    }
+
+    std::vector<Job> jobs;
+    for ( size_t c = 0; c < options.captures.size(); ++c ) {
+        for ( size_t v = 0; v < options.voxelsPerMeter.size(); ++v ) {
+            for ( size_t w = 0; w < options.weights.size(); ++w ) {
+                Job job = Job();
+                job.capture = options.captures[c];
+                job.voxelsPerMeter = options.voxelsPerMeter[v];
+                job.weight = options.weights[w];
+                job.output = options.outputDirectory + "/" + stem( job.capture ) +
+                             "_v" + std::to_string( job.voxelsPerMeter ) + "_w" + std::to_string( job.weight );
+                jobs.push_back( job );
+            }
+        }
+    }
+
+    // The cores are split evenly; a job keeps its share until the jobs run out
+    const unsigned int cores = std::max( 1u, std::thread::hardware_concurrency() );
+    unsigned int parallelJobs = (options.jobs != 0) ? options.jobs : std::max( 1u, cores / CORES_PER_JOB );
+    parallelJobs = std::min( parallelJobs, (unsigned int)jobs.size() );
+    const unsigned int threadsPerJob = std::max( 1u, cores / parallelJobs );
+
+    std::printf( "%u jobs, %u at a time with %u threads each, %u cores\n",
+                 (UINT)jobs.size(), parallelJobs, threadsPerJob, cores );
+
+    std::atomic<size_t> next( 0 );
+    std::mutex printMutex;
+    auto worker = [&]() {
+        ThreadPool pool( threadsPerJob );
+        for ( size_t i = next++; i < jobs.size(); i = next++ ) {
+            Job& job = jobs[i];
+            job.threads = pool.threadCount();
+            try {
+                runJob( options, job, pool );
+                job.succeeded = true;
+            }
+            catch ( const std::exception& e ) {
+                job.error = e.what();
+            }
+
+            std::lock_guard<std::mutex> lock( printMutex );
+            if ( job.succeeded ) {
+                const double fps = job.frames / std::max( job.seconds, 1e-9 );
+                std::printf( "%s: %u frames, %.2f fps, %.2f fps/core, %u tracking errors, %u resets, %u loops closed, "
+                             "%u triangles\n", job.output.c_str(), job.frames, fps, fps / job.threads, job.trackingErrors,
+                             job.resets, job.loopClosures, (UINT)job.triangles );
+            }
+            else {
+                std::printf( "%s: failed: %s\n", job.output.c_str(), job.error.c_str() );
+            }
+            std::fflush( stdout );
+        }
+    };
+
+    Clock::time_point start = Clock::now();
+    std::vector<std::thread> workers;
+    for ( unsigned int i = 1; i < parallelJobs; ++i ) {
+        workers.push_back( std::thread( worker ) );
+    }
+    worker();
+    for ( size_t i = 0; i < workers.size(); ++i ) {
+        workers[i].join();
+    }
+    const double seconds = std::chrono::duration<double>( Clock::now() - start ).count();
+
+    unsigned int frames = 0, trackingErrors = 0, failed = 0;
+    for ( size_t i = 0; i < jobs.size(); ++i ) {
+        frames += jobs[i].frames;
+        trackingErrors += jobs[i].trackingErrors;
+        failed += jobs[i].succeeded ? 0 : 1;
+    }
+    // More jobs than cores share them
+    const unsigned int used = std::min( parallelJobs * threadsPerJob, cores );
+    std::printf( "total: %u frames in %.2f s, %.2f fps, %.2f fps/core on %u cores, %u tracking errors, %u failed\n",
+                 frames, seconds, frames / seconds, frames / seconds / used, used, trackingErrors, failed );
+
+    return (failed == 0) ? 0 : 1;
+}
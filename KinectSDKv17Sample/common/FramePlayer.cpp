@@ -0,0 +1,100 @@
+#include "FramePlayer.h"
+
+#include <cstring>
+#include <stdexcept>
+
+namespace kinectbook {
+
+FramePlayer::FramePlayer( const std::string& path )
+    : file( path )
+    , data( file.data() )
+    , size( file.size() )
+    , position( 0 )
+    , depthFrames( 0 )
+{
+    const FrameFileHeader* header = (const FrameFileHeader*)data;
+    if ( size < sizeof(FrameFileHeader) || std::memcmp( header->magic, FRAME_FILE_MAGIC, sizeof(header->magic) ) != 0 ) {
+        throw std::runtime_error( "FramePlayer: not a recording " + path );
+    }
+    if ( header->version != FRAME_FILE_VERSION || header->headerSize < sizeof(FrameFileHeader) ) {
+        throw std::runtime_error( "FramePlayer: unsupported version " + path );
+    }
+
+    buildIndex();
+}
+
+void FramePlayer::buildIndex()
+{
+    size_t offset = ((const FrameFileHeader*)data)->headerSize;
+
+    while ( offset + sizeof(FrameChunkHeader) <= size ) {
+        const FrameChunkHeader* header = (const FrameChunkHeader*)(data + offset);
+        size_t payloadOffset = offset + sizeof(FrameChunkHeader);
+        if ( header->payloadSize > size - payloadOffset ) {
+            break;
+        }
+
+        RecordedChunk chunk;
+        chunk.type = (FrameChunkType)header->type;
+        chunk.timestamp = header->timestamp;
+        chunk.payload = data + payloadOffset;
+        chunk.payloadSize = header->payloadSize;
+
+        // Sizes are checked here once so the typed accessors can trust them
+        bool valid = true;
+        switch ( chunk.type ) {
+        case FRAME_CHUNK_DEPTH:
+            if ( chunk.payloadSize < sizeof(DepthChunkInfo) ) {
+                valid = false;
+            }
+            else {
+                const DepthChunkInfo* info = chunk.depthInfo();
+                valid = chunk.payloadSize == sizeof(DepthChunkInfo) +
+                        (size_t)info->width * info->height * sizeof(NUI_DEPTH_IMAGE_PIXEL);
+            }
+            break;
+        case FRAME_CHUNK_SKELETON:
+            valid = chunk.payloadSize == sizeof(NUI_SKELETON_FRAME);
+            break;
+        case FRAME_CHUNK_ACCELEROMETER:
+            valid = chunk.payloadSize == sizeof(Vector4);
+            break;
+        default:
+            // Unknown chunks from newer recorders are skipped
+            offset = payloadOffset + alignFrameChunk( header->payloadSize );
+            continue;
+        }
+        if ( !valid ) {
+            break;
+        }
+
+        if ( chunk.type == FRAME_CHUNK_DEPTH ) {
+            ++depthFrames;
+        }
+        chunks.push_back( chunk );
+        offset = payloadOffset + alignFrameChunk( header->payloadSize );
+    }
+}
+
+const RecordedChunk* FramePlayer::next()
+{
+    return (position < chunks.size()) ? &chunks[position++] : 0;
+}
+
+const RecordedChunk* FramePlayer::next( FrameChunkType type )
+{
+    while ( position < chunks.size() ) {
+        const RecordedChunk* chunk = &chunks[position++];
+        if ( chunk->type == type ) {
+            return chunk;
+        }
+    }
+    return 0;
+}
+
+LONGLONG FramePlayer::duration() const
+{
+    return chunks.empty() ? 0 : (chunks.back().timestamp - chunks.front().timestamp);
+}
+
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "FrameRecord.h"
+#include "MappedFile.h"
+
+namespace kinectbook {
+
+/// <summary>
+/// One chunk of a recording; the payload points into the mapped file
+/// </summary>
+struct RecordedChunk
+{
+    FrameChunkType type;
+    LONGLONG timestamp;
+    const BYTE* payload;
+    UINT payloadSize;
+
+    const DepthChunkInfo* depthInfo() const
+    {
+        return (type == FRAME_CHUNK_DEPTH) ? (const DepthChunkInfo*)payload : 0;
+    }
+
+    const NUI_DEPTH_IMAGE_PIXEL* depthPixels() const
+    {
+        return (type == FRAME_CHUNK_DEPTH) ? (const NUI_DEPTH_IMAGE_PIXEL*)(payload + sizeof(DepthChunkInfo)) : 0;
+    }
+
+    const NUI_SKELETON_FRAME* skeletonFrame() const
+    {
+        return (type == FRAME_CHUNK_SKELETON) ? (const NUI_SKELETON_FRAME*)payload : 0;
+    }
+
+    const Vector4* accelerometer() const
+    {
+        return (type == FRAME_CHUNK_ACCELEROMETER) ? (const Vector4*)payload : 0;
+    }
+};
+
+/// <summary>
+/// Plays a .kbrec file back without copying frames
+/// </summary>
+/// <remarks>
+/// The file is memory mapped and indexed once when it is opened. Pointers
+/// handed out stay valid as long as the player lives, and frames come as
+/// fast as the caller asks for them, so captures can be replayed far above
+/// 30Hz. Chunks with an inconsistent size end the index, which makes the
+/// readable part of a truncated capture playable.
+/// </remarks>
+class FramePlayer
+{
+public:
+
+    explicit FramePlayer( const std::string& path );
+
+    /// <summary>
+    /// Next chunk in file order
+    /// </summary>
+    /// <returns>nullptr at the end of the recording</returns>
+    const RecordedChunk* next();
+
+    /// <summary>
+    /// Next chunk of the given type, skipping the others
+    /// </summary>
+    const RecordedChunk* next( FrameChunkType type );
+
+    void rewind() { position = 0; }
+
+    size_t chunkCount() const { return chunks.size(); }
+
+    const RecordedChunk& chunk( size_t index ) const { return chunks[index]; }
+
+    size_t depthFrameCount() const { return depthFrames; }
+
+    /// <summary>
+    /// Timestamp span of the recording in milliseconds
+    /// </summary>
+    LONGLONG duration() const;
+
+private:
+
+    FramePlayer( const FramePlayer& );
+    FramePlayer& operator=( const FramePlayer& );
+
+    void buildIndex();
+
+    MappedFile file;
+    const BYTE* data;
+    size_t size;
+
+    std::vector<RecordedChunk> chunks;
+    size_t position;
+    size_t depthFrames;
+};
+
+}
@@ -0,0 +1,151 @@
+#include "FramePool.h"
+
+#include <stdexcept>
+#include <thread>
+#include <utility>
+
+#include "FramePlayer.h"
+
+namespace kinectbook {
+
+namespace {
+
+// Storage of every frame starts on its own 16 byte boundary for SIMD loads
+const UINT STORAGE_ALIGNMENT = 16;
+
+}
+
+FrameRef::FrameRef( const FrameRef& other )
+    : pool( other.pool )
+    , frame( other.frame )
+{
+    if ( frame != 0 ) {
+        frame->references.fetch_add( 1, std::memory_order_relaxed );
+    }
+}
+
+FrameRef& FrameRef::operator=( const FrameRef& other )
+{
+    FrameRef copy( other );
+    swap( copy );
+    return *this;
+}
+
+void FrameRef::reset()
+{
+    if ( frame != 0 && frame->references.fetch_sub( 1, std::memory_order_acq_rel ) == 1 ) {
+        pool->recycle( frame );
+    }
+    pool = 0;
+    frame = 0;
+}
+
+void FrameRef::swap( FrameRef& other )
+{
+    std::swap( pool, other.pool );
+    std::swap( frame, other.frame );
+}
+
+FramePool::FramePool( UINT capacity, UINT storageSize )
+    : frameCount( capacity )
+    , frameStorageSize( (storageSize + STORAGE_ALIGNMENT - 1) & ~(STORAGE_ALIGNMENT - 1) )
+    , frames( new PooledFrame[capacity] )
+    , freeFrames( capacity )
+    , exhausted( 0 )
+{
+    if ( capacity == 0 ) {
+        throw std::runtime_error( "FramePool: capacity must not be 0" );
+    }
+
+    if ( frameStorageSize != 0 ) {
+        storage.reset( new BYTE[(size_t)frameStorageSize * capacity + STORAGE_ALIGNMENT] );
+    }
+    BYTE* aligned = (BYTE*)(((size_t)storage.get() + STORAGE_ALIGNMENT - 1) & ~(size_t)(STORAGE_ALIGNMENT - 1));
+
+    for ( UINT i = 0; i < capacity; ++i ) {
+        PooledFrame& frame = frames[i];
+        frame.index = i;
+        frame.storage = storage ? aligned + (size_t)frameStorageSize * i : 0;
+        frame.references.store( 0, std::memory_order_relaxed );
+        freeFrames.tryPush( &frame );
+    }
+}
+
+FrameRef FramePool::wrapDepth( const NUI_DEPTH_IMAGE_PIXEL* pixels, UINT width, UINT height, LONGLONG timestamp,
+                               PooledFrame::ReleaseFunction release, void* owner )
+{
+    FrameRef ref = acquire( FRAME_CHUNK_DEPTH, (const BYTE*)pixels,
+                            width * height * sizeof(NUI_DEPTH_IMAGE_PIXEL), timestamp, release, owner );
+    if ( !ref.empty() ) {
+        ref.frame->width = width;
+        ref.frame->height = height;
+    }
+    return ref;
+}
+
+FrameRef FramePool::wrap( const RecordedChunk& chunk )
+{
+    const DepthChunkInfo* info = chunk.depthInfo();
+    if ( info == 0 ) {
+        return acquire( chunk.type, chunk.payload, chunk.payloadSize, chunk.timestamp, 0, 0 );
+    }
+
+    return wrapDepth( chunk.depthPixels(), info->width, info->height, chunk.timestamp, 0, 0 );
+}
+
+FrameRef FramePool::allocate( FrameChunkType type, UINT size, LONGLONG timestamp )
+{
+    if ( size > frameStorageSize ) {
+        throw std::runtime_error( "FramePool: frame larger than the storage of the pool" );
+    }
+
+    // The data pointer is filled in by acquire() from the frame's own storage
+    return acquire( type, 0, size, timestamp, 0, 0 );
+}
+
+FrameRef FramePool::allocateDepth( UINT width, UINT height, LONGLONG timestamp )
+{
+    FrameRef ref = allocate( FRAME_CHUNK_DEPTH, width * height * sizeof(NUI_DEPTH_IMAGE_PIXEL), timestamp );
+    if ( !ref.empty() ) {
+        ref.frame->width = width;
+        ref.frame->height = height;
+    }
+    return ref;
+}
+
+FrameRef FramePool::acquire( FrameChunkType type, const BYTE* data, UINT size, LONGLONG timestamp,
+                             PooledFrame::ReleaseFunction release, void* owner )
+{
+    PooledFrame* frame = 0;
+    if ( !freeFrames.tryPop( frame ) ) {
+        exhausted.fetch_add( 1, std::memory_order_relaxed );
+        return FrameRef();
+    }
+
+    frame->type = type;
+    frame->timestamp = timestamp;
+    frame->width = 0;
+    frame->height = 0;
+    frame->data = (data != 0) ? data : frame->storage;
+    frame->size = size;
+    frame->release = release;
+    frame->owner = owner;
+    frame->references.store( 1, std::memory_order_relaxed );
+    return FrameRef( this, frame );
+}
+
+void FramePool::recycle( PooledFrame* frame )
+{
+    if ( frame->release != 0 ) {
+        frame->release( frame->owner, *frame );
+    }
+    frame->data = 0;
+
+    // The ring holds every frame, but with several threads taking frames a
+    // push can find its cell still claimed by a pop that has not finished
+    while ( !freeFrames.tryPush( frame ) ) {
+        std::this_thread::yield();
+    }
+}
+
+}
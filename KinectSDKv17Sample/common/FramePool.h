@@ -0,0 +1,182 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+
+#include "FrameRecord.h"
+#include "RingBuffer.h"
+
+namespace kinectbook {
+
+struct RecordedChunk;
+class FramePool;
+
+/// <summary>
+/// Sensor frame handed to its consumers without copying
+/// </summary>
+/// <remarks>
+/// The data belongs either to whoever wrapped it (a locked texture, a
+/// mapped recording) or to the pool. Frames are read only once shared.
+/// </remarks>
+struct PooledFrame
+{
+    /// <summary>
+    /// Hands wrapped data back to its owner, e.g. unlocks the texture and
+    /// releases the SDK frame; called when the last reference goes away
+    /// </summary>
+    typedef void (*ReleaseFunction)( void* owner, const PooledFrame& frame );
+
+    FrameChunkType type;
+    LONGLONG timestamp;     // liTimeStamp of the frame (milliseconds)
+    UINT width;             // depth frames only
+    UINT height;
+    const BYTE* data;
+    UINT size;
+
+    // Position in the pool, for owners that keep state per frame
+    UINT index;
+
+    const NUI_DEPTH_IMAGE_PIXEL* depthPixels() const
+    {
+        return (type == FRAME_CHUNK_DEPTH) ? (const NUI_DEPTH_IMAGE_PIXEL*)data : 0;
+    }
+
+    const NUI_SKELETON_FRAME* skeletonFrame() const
+    {
+        return (type == FRAME_CHUNK_SKELETON) ? (const NUI_SKELETON_FRAME*)data : 0;
+    }
+
+    const Vector4* accelerometer() const
+    {
+        return (type == FRAME_CHUNK_ACCELEROMETER) ? (const Vector4*)data : 0;
+    }
+
+private:
+
+    friend class FramePool;
+    friend class FrameRef;
+
+    ReleaseFunction release;
+    void* owner;
+    BYTE* storage;
+    std::atomic<int> references;
+};
+
+/// <summary>
+/// Counted reference to a PooledFrame; the frame goes back to its pool
+/// when the last reference is reset or destroyed
+/// </summary>
+class FrameRef
+{
+public:
+
+    FrameRef() : pool( 0 ), frame( 0 ) {}
+    FrameRef( const FrameRef& other );
+    FrameRef& operator=( const FrameRef& other );
+    ~FrameRef() { reset(); }
+
+    void reset();
+    void swap( FrameRef& other );
+
+    bool empty() const { return frame == 0; }
+
+    const PooledFrame* operator->() const { return frame; }
+    const PooledFrame& operator*() const { return *frame; }
+    const PooledFrame* get() const { return frame; }
+
+    /// <summary>
+    /// Storage of a frame from FramePool::allocate(); fill it before the frame is shared
+    /// </summary>
+    BYTE* storage() const { return frame->storage; }
+
+    void setTimestamp( LONGLONG timestamp ) { frame->timestamp = timestamp; }
+
+private:
+
+    friend class FramePool;
+
+    // Takes over the reference the pool handed out
+    FrameRef( FramePool* pool, PooledFrame* frame ) : pool( pool ), frame( frame ) {}
+
+    FramePool* pool;
+    PooledFrame* frame;
+};
+
+/// <summary>
+/// Fixed number of frames shared by reference count
+/// </summary>
+/// <remarks>
+/// Nothing is allocated after construction: handing out a frame and taking
+/// it back are a pop and a push on a lock-free ring, so any thread may
+/// wrap, share and drop frames. When every frame is out, wrap() and
+/// allocate() return an empty reference and the caller drops the data;
+/// the pool never waits. Every frame must be back before the pool is
+/// destroyed.
+/// </remarks>
+class FramePool
+{
+public:
+
+    /// <param name="capacity">Frames that can be out at once</param>
+    /// <param name="storageSize">Bytes of storage per frame for allocate(); 0 when the pool only wraps</param>
+    FramePool( UINT capacity, UINT storageSize );
+
+    /// <summary>
+    /// Share depth pixels someone else owns; release( owner, frame ) is
+    /// called by the thread dropping the last reference
+    /// </summary>
+    /// <returns>empty when every frame is out</returns>
+    FrameRef wrapDepth( const NUI_DEPTH_IMAGE_PIXEL* pixels, UINT width, UINT height, LONGLONG timestamp,
+                        PooledFrame::ReleaseFunction release, void* owner );
+
+    /// <summary>
+    /// Share a chunk of a recording; it stays in the mapped file, which has
+    /// to outlive the frame
+    /// </summary>
+    FrameRef wrap( const RecordedChunk& chunk );
+
+    /// <summary>
+    /// Frame backed by the storage of the pool, filled through FrameRef::storage()
+    /// </summary>
+    /// <param name="size">At most the storageSize of the pool</param>
+    FrameRef allocate( FrameChunkType type, UINT size, LONGLONG timestamp );
+
+    /// <summary>
+    /// Depth frame of width x height pixels backed by the storage of the pool
+    /// </summary>
+    FrameRef allocateDepth( UINT width, UINT height, LONGLONG timestamp );
+
+    UINT capacity() const { return frameCount; }
+
+    UINT storageSize() const { return frameStorageSize; }
+
+    /// <summary>
+    /// Frames not handed out; only a hint while other threads share frames
+    /// </summary>
+    UINT freeCount() const { return (UINT)freeFrames.sizeApprox(); }
+
+    /// <summary>
+    /// Times a frame was asked for while every frame was out
+    /// </summary>
+    unsigned int exhaustedCount() const { return exhausted.load(); }
+
+private:
+
+    FramePool( const FramePool& );
+    FramePool& operator=( const FramePool& );
+
+    friend class FrameRef;
+
+    FrameRef acquire( FrameChunkType type, const BYTE* data, UINT size, LONGLONG timestamp,
+                      PooledFrame::ReleaseFunction release, void* owner );
+    void recycle( PooledFrame* frame );
+
+    UINT frameCount;
+    UINT frameStorageSize;
+    std::unique_ptr<PooledFrame[]> frames;
+    std::unique_ptr<BYTE[]> storage;
+    RingBuffer<PooledFrame*> freeFrames;
+    std::atomic<unsigned int> exhausted;
+};
+
+}
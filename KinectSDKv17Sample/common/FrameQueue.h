@@ -0,0 +1,126 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "RingBuffer.h"
+
+namespace kinectbook {
+
+/// <summary>
+/// RingBuffer that a consumer can wait on
+/// </summary>
+/// <remarks>
+/// A consumer polls briefly and then sleeps until a producer wakes it, the
+/// timeout runs out or the queue is closed, so a stage waiting for the
+/// next frame wakes once per frame and a busy stage never touches the
+/// mutex. A producer only takes the mutex when a consumer announced that it
+/// is going to sleep; a fence on either side makes sure that one of them
+/// sees the other, so no wake up is lost.
+/// </remarks>
+template <class T>
+class FrameQueue
+{
+public:
+
+    static const unsigned int WAIT_FOREVER = ~0u;
+
+    /// <param name="capacity">Rounded up to a power of two</param>
+    explicit FrameQueue( size_t capacity )
+        : values( capacity )
+        , sleepers( 0 )
+        , closed( false )
+    {
+    }
+
+    /// <returns>false when the queue is full</returns>
+    bool push( const T& value )
+    {
+        if ( !values.tryPush( value ) ) {
+            return false;
+        }
+
+        // Pairs with the fence in pop(): either the consumer sees the value or this sees the consumer
+        std::atomic_thread_fence( std::memory_order_seq_cst );
+        if ( sleepers.load() != 0 ) {
+            std::lock_guard<std::mutex> lock( mutex );
+            wakeUp.notify_all();
+        }
+        return true;
+    }
+
+    /// <returns>false when the queue is empty</returns>
+    bool tryPop( T& value )
+    {
+        return values.tryPop( value );
+    }
+
+    /// <summary>
+    /// Wait for a value
+    /// </summary>
+    /// <param name="timeoutMilliseconds">0 to poll, WAIT_FOREVER</param>
+    /// <returns>false when nothing arrived in time or the queue was closed</returns>
+    bool pop( T& value, unsigned int timeoutMilliseconds )
+    {
+        typedef std::chrono::steady_clock Clock;
+        const Clock::time_point deadline = Clock::now() + std::chrono::milliseconds( timeoutMilliseconds );
+
+        for ( int spin = 0; !values.tryPop( value ); ++spin ) {
+            if ( closed ) {
+                return false;
+            }
+            if ( timeoutMilliseconds != WAIT_FOREVER && Clock::now() >= deadline ) {
+                return false;
+            }
+            if ( spin < SPIN_COUNT ) {
+                std::this_thread::yield();
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock( mutex );
+            ++sleepers;
+            std::atomic_thread_fence( std::memory_order_seq_cst );
+            if ( values.sizeApprox() == 0 && !closed ) {
+                if ( timeoutMilliseconds == WAIT_FOREVER ) {
+                    wakeUp.wait( lock );
+                }
+                else {
+                    wakeUp.wait_until( lock, deadline );
+                }
+            }
+            --sleepers;
+        }
+        return true;
+    }
+
+    /// <summary>
+    /// Wake every waiting consumer; pop() fails from now on once the queue is empty
+    /// </summary>
+    void close()
+    {
+        closed = true;
+        std::lock_guard<std::mutex> lock( mutex );
+        wakeUp.notify_all();
+    }
+
+    size_t sizeApprox() const { return values.sizeApprox(); }
+
+private:
+
+    FrameQueue( const FrameQueue& );
+    FrameQueue& operator=( const FrameQueue& );
+
+    // Polls before a consumer goes to sleep; a frame every 33ms makes sleeping the common case
+    static const int SPIN_COUNT = 64;
+
+    RingBuffer<T> values;
+    std::mutex mutex;
+    std::condition_variable wakeUp;
+    std::atomic<int> sleepers;
+    std::atomic<bool> closed;
+};
+
+}
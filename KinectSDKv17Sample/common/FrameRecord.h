@@ -0,0 +1,59 @@
+#pragma once
+
+#include "NuiCompat.h"
+
+namespace kinectbook {
+
+// Recorded sensor stream (.kbrec)
+//
+//   file  : FrameFileHeader, then chunks up to the end of the file
+//   chunk : FrameChunkHeader, payload, zero padding to a multiple of 8 bytes
+//
+// Payloads are the SDK structures as they are in memory (little endian),
+// so a player can hand out pointers into the mapped file without copying:
+//
+//   FRAME_CHUNK_DEPTH          DepthChunkInfo + NUI_DEPTH_IMAGE_PIXEL[width * height]
+//   FRAME_CHUNK_SKELETON       NUI_SKELETON_FRAME
+//   FRAME_CHUNK_ACCELEROMETER  Vector4
+//
+// Chunks are written as they arrive, so a capture cut short by a crash is
+// still readable up to the last complete chunk.
+
+const char FRAME_FILE_MAGIC[4] = { 'K', 'B', 'R', 'C' };
+const UINT FRAME_FILE_VERSION = 1;
+const UINT FRAME_CHUNK_ALIGNMENT = 8;
+
+enum FrameChunkType
+{
+    FRAME_CHUNK_DEPTH = 1,
+    FRAME_CHUNK_SKELETON = 2,
+    FRAME_CHUNK_ACCELEROMETER = 3,
+};
+
+struct FrameFileHeader
+{
+    char magic[4];
+    UINT version;
+    UINT headerSize;        // sizeof(FrameFileHeader), chunks start here
+    UINT reserved;
+};
+
+struct FrameChunkHeader
+{
+    UINT type;              // FrameChunkType
+    UINT payloadSize;       // without the padding
+    LONGLONG timestamp;     // liTimeStamp of the frame (milliseconds)
+};
+
+struct DepthChunkInfo
+{
+    UINT width;
+    UINT height;
+};
+
+inline UINT alignFrameChunk( UINT size )
+{
+    return (size + FRAME_CHUNK_ALIGNMENT - 1) & ~(FRAME_CHUNK_ALIGNMENT - 1);
+}
+
+}
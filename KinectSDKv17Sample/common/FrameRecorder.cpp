@@ -0,0 +1,103 @@
+#include "FrameRecorder.h"
+
+#include <cstring>
+#include <stdexcept>
+
+namespace kinectbook {
+
+namespace {
+
+// About 8 depth frames at 640x480
+const size_t WRITE_BUFFER_SIZE = 10 * 1024 * 1024;
+
+}
+
+FrameRecorder::FrameRecorder( const std::string& path )
+    : file( 0 )
+    , chunks( 0 )
+{
+    file = std::fopen( path.c_str(), "wb" );
+    if ( file == 0 ) {
+        throw std::runtime_error( "FrameRecorder: can't create " + path );
+    }
+    std::setvbuf( file, 0, _IOFBF, WRITE_BUFFER_SIZE );
+
+    FrameFileHeader header = { { 0 } };
+    std::memcpy( header.magic, FRAME_FILE_MAGIC, sizeof(header.magic) );
+    header.version = FRAME_FILE_VERSION;
+    header.headerSize = sizeof(FrameFileHeader);
+    if ( std::fwrite( &header, sizeof(header), 1, file ) != 1 ) {
+        std::fclose( file );
+        throw std::runtime_error( "FrameRecorder: can't write " + path );
+    }
+}
+
+FrameRecorder::~FrameRecorder()
+{
+    if ( file != 0 ) {
+        std::fclose( file );
+    }
+}
+
+void FrameRecorder::close()
+{
+    if ( file == 0 ) {
+        return;
+    }
+
+    int ret = std::fclose( file );
+    file = 0;
+    if ( ret != 0 ) {
+        throw std::runtime_error( "FrameRecorder: close failed" );
+    }
+}
+
+void FrameRecorder::writeDepth( const NUI_DEPTH_IMAGE_PIXEL* pixels, UINT width, UINT height, LONGLONG timestamp )
+{
+    DepthChunkInfo info = { width, height };
+    writeChunk( FRAME_CHUNK_DEPTH, timestamp, &info, sizeof(info), pixels, width * height * sizeof(NUI_DEPTH_IMAGE_PIXEL) );
+}
+
+void FrameRecorder::writeSkeleton( const NUI_SKELETON_FRAME& skeletonFrame )
+{
+    writeChunk( FRAME_CHUNK_SKELETON, skeletonFrame.liTimeStamp.QuadPart, 0, 0, &skeletonFrame, sizeof(skeletonFrame) );
+}
+
+void FrameRecorder::writeAccelerometer( const Vector4& reading, LONGLONG timestamp )
+{
+    writeChunk( FRAME_CHUNK_ACCELEROMETER, timestamp, 0, 0, &reading, sizeof(reading) );
+}
+
+void FrameRecorder::writeChunk( FrameChunkType type, LONGLONG timestamp,
+                                const void* header, UINT headerSize, const void* payload, UINT payloadSize )
+{
+    if ( file == 0 ) {
+        throw std::runtime_error( "FrameRecorder: already closed" );
+    }
+
+    FrameChunkHeader chunk = { 0 };
+    chunk.type = type;
+    chunk.payloadSize = headerSize + payloadSize;
+    chunk.timestamp = timestamp;
+
+    static const char padding[FRAME_CHUNK_ALIGNMENT] = { 0 };
+    UINT paddingSize = alignFrameChunk( chunk.payloadSize ) - chunk.payloadSize;
+
+    bool ok = std::fwrite( &chunk, sizeof(chunk), 1, file ) == 1;
+    if ( ok && headerSize != 0 ) {
+        ok = std::fwrite( header, headerSize, 1, file ) == 1;
+    }
+    if ( ok && payloadSize != 0 ) {
+        ok = std::fwrite( payload, payloadSize, 1, file ) == 1;
+    }
+    if ( ok && paddingSize != 0 ) {
+        ok = std::fwrite( padding, paddingSize, 1, file ) == 1;
+    }
+    if ( !ok ) {
+        throw std::runtime_error( "FrameRecorder: write failed" );
+    }
+
+    ++chunks;
+}
+
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+
+#include "FrameRecord.h"
+
+namespace kinectbook {
+
+/// <summary>
+/// Writes depth, skeleton and accelerometer frames to a .kbrec file
+/// </summary>
+/// <remarks>
+/// Writes go through a large stdio buffer, so recording costs one memcpy
+/// per frame on the sensor thread. Errors are reported with std::runtime_error.
+/// </remarks>
+class FrameRecorder
+{
+public:
+
+    explicit FrameRecorder( const std::string& path );
+    ~FrameRecorder();
+
+    void writeDepth( const NUI_DEPTH_IMAGE_PIXEL* pixels, UINT width, UINT height, LONGLONG timestamp );
+
+    void writeSkeleton( const NUI_SKELETON_FRAME& skeletonFrame );
+
+    void writeAccelerometer( const Vector4& reading, LONGLONG timestamp );
+
+    /// <summary>
+    /// Flush and close the file; called by the destructor too
+    /// </summary>
+    void close();
+
+    size_t chunkCount() const { return chunks; }
+
+private:
+
+    FrameRecorder( const FrameRecorder& );
+    FrameRecorder& operator=( const FrameRecorder& );
+
+    void writeChunk( FrameChunkType type, LONGLONG timestamp,
+                     const void* header, UINT headerSize, const void* payload, UINT payloadSize );
+
+    FILE* file;
+    size_t chunks;
+};
+
+}
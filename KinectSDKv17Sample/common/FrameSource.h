@@ -0,0 +1,57 @@
+#pragma once
+
+#include "FramePool.h"
+
+namespace kinectbook {
+
+/// <summary>
+/// Where sensor frames come from: a Kinect, a recording or a generator
+/// </summary>
+/// <remarks>
+/// Frames of every stream come out of tryGetNextFrame() in the order they
+/// are ready, as references into a FramePool owned by the source, so
+/// consumers share them without copying and the source gets its buffers
+/// back when the last reference goes away. tryGetNextFrame() never waits:
+/// with nothing new, or with every frame of the pool still held by the
+/// consumers, it returns false and the caller decides whether to wait(),
+/// do other work or poll again. Each source is read from one thread; the
+/// frames it hands out may go anywhere. Every frame has to be released
+/// before the source is destroyed.
+/// </remarks>
+class IFrameSource
+{
+public:
+
+    virtual ~IFrameSource() {}
+
+    /// <summary>
+    /// Take the next ready frame of any stream
+    /// </summary>
+    /// <returns>false when no frame is ready; frame is left as it was</returns>
+    virtual bool tryGetNextFrame( FrameRef& frame ) = 0;
+
+    /// <summary>
+    /// Sleep until tryGetNextFrame() may have a frame
+    /// </summary>
+    /// <returns>false when the time ran out first</returns>
+    virtual bool wait( unsigned int timeoutMilliseconds ) = 0;
+
+    /// <summary>
+    /// No frame is going to come anymore, e.g. at the end of a recording
+    /// </summary>
+    virtual bool finished() const = 0;
+
+    /// <summary>
+    /// Size of the depth frames; 0 until it is known
+    /// </summary>
+    virtual UINT depthWidth() const = 0;
+
+    virtual UINT depthHeight() const = 0;
+
+    /// <summary>
+    /// Frames the source had to drop because the consumers held every frame of its pool
+    /// </summary>
+    virtual unsigned int droppedFrames() const = 0;
+};
+
+}
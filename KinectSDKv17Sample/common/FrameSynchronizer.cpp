@@ -0,0 +1,232 @@
+#include "FrameSynchronizer.h"
+
+#include <algorithm>
+
+namespace kinectbook {
+
+namespace {
+
+// Accelerometer readings kept per buffered depth frame, so the readings around the oldest one are still there
+const UINT READINGS_PER_FRAME = 2;
+
+LONGLONG distance( LONGLONG a, LONGLONG b )
+{
+    return (a > b) ? (a - b) : (b - a);
+}
+
+}
+
+void FrameSynchronizer::FrameBuffer::push( const FrameRef& frame )
+{
+    frames[(first + count) % frames.size()] = frame;
+    ++count;
+}
+
+void FrameSynchronizer::FrameBuffer::popFront()
+{
+    frames[first].reset();
+    first = (first + 1) % (UINT)frames.size();
+    --count;
+}
+
+FrameSynchronizer::FrameSynchronizer( const FrameSynchronizerOptions& options_ )
+    : options( options_ )
+    , profiler( options_.profiler != 0 ? *options_.profiler : Profiler::shared() )
+    , firstReading( 0 )
+    , readingCount( 0 )
+    , newest( -1 )
+    , lastBundle( -1 )
+    , flushing( false )
+{
+    const UINT size = std::max( options.bufferSize, 1u );
+    depth.frames.resize( size );
+    skeletons.frames.resize( size );
+    readings.resize( std::max( size, 2u ) * READINGS_PER_FRAME );
+
+    ids.bundles = profiler.counter( "sync.bundles" );
+    ids.droppedDepth = profiler.counter( "sync.dropped_depth" );
+    ids.droppedSkeleton = profiler.counter( "sync.dropped_skeleton" );
+    ids.lateFrames = profiler.counter( "sync.late_frames" );
+}
+
+void FrameSynchronizer::push( const FrameRef& frame )
+{
+    if ( frame.empty() ) {
+        return;
+    }
+    flushing = false;
+
+    switch ( frame->type ) {
+    case FRAME_CHUNK_DEPTH:
+        pushFrame( depth, frame, stats.droppedDepth, ids.droppedDepth );
+        break;
+    case FRAME_CHUNK_SKELETON:
+        if ( options.skeleton ) {
+            pushFrame( skeletons, frame, stats.droppedSkeleton, ids.droppedSkeleton );
+        }
+        break;
+    case FRAME_CHUNK_ACCELEROMETER:
+        if ( options.accelerometer ) {
+            pushReading( frame );
+        }
+        break;
+    }
+    newest = std::max( newest, frame->timestamp );
+}
+
+void FrameSynchronizer::pushFrame( FrameBuffer& buffer, const FrameRef& frame, unsigned int& dropped, unsigned int droppedCounter )
+{
+    // Its bundle is out already, or the stream went back in time
+    if ( frame->timestamp <= lastBundle || (buffer.count != 0 && frame->timestamp <= buffer.back()->timestamp) ) {
+        late();
+        return;
+    }
+
+    if ( buffer.count == buffer.frames.size() ) {
+        buffer.popFront();
+        ++dropped;
+        profiler.add( droppedCounter );
+    }
+    buffer.push( frame );
+}
+
+void FrameSynchronizer::pushReading( const FrameRef& frame )
+{
+    const LONGLONG timestamp = frame->timestamp;
+    if ( readingCount != 0 && timestamp <= readings[(firstReading + readingCount - 1) % readings.size()].timestamp ) {
+        late();
+        return;
+    }
+
+    // Readings are samples of a slow signal; the oldest one simply makes room
+    if ( readingCount == readings.size() ) {
+        firstReading = (firstReading + 1) % (UINT)readings.size();
+        --readingCount;
+    }
+    Reading& reading = readings[(firstReading + readingCount) % readings.size()];
+    reading.timestamp = timestamp;
+    reading.value = *frame->accelerometer();
+    ++readingCount;
+}
+
+bool FrameSynchronizer::tryPop( FrameBundle& bundle )
+{
+    while ( depth.count != 0 ) {
+        const LONGLONG timestamp = depth.at( 0 )->timestamp;
+        const bool waited = flushing || newest - timestamp > options.maxWait;
+
+        // The skeleton frame closest to the depth frame within the tolerance; frames
+        // too old for it are too old for every depth frame after it as well
+        UINT match = 0;
+        if ( options.skeleton ) {
+            while ( skeletons.count != 0 && skeletons.at( 0 )->timestamp < timestamp - options.tolerance ) {
+                skeletons.popFront();
+                ++stats.droppedSkeleton;
+                profiler.add( ids.droppedSkeleton );
+            }
+
+            if ( skeletons.count == 0 || skeletons.at( 0 )->timestamp > timestamp + options.tolerance ) {
+                // The skeleton stream has gone past the depth frame, or gave up on it
+                if ( skeletons.count != 0 || waited ) {
+                    dropDepth();
+                    continue;
+                }
+                return false;
+            }
+
+            for ( UINT i = 1; i < skeletons.count && skeletons.at( i )->timestamp <= timestamp + options.tolerance; ++i ) {
+                if ( distance( skeletons.at( i )->timestamp, timestamp ) < distance( skeletons.at( match )->timestamp, timestamp ) ) {
+                    match = i;
+                }
+            }
+
+            // A closer frame can only come while the match is older than the depth frame and the last one buffered
+            const LONGLONG matched = skeletons.at( match )->timestamp;
+            if ( matched < timestamp && match + 1 == skeletons.count && !waited ) {
+                return false;
+            }
+        }
+
+        Vector4 reading = { 0 };
+        if ( options.accelerometer && !interpolateAccelerometer( timestamp, waited, reading ) ) {
+            if ( waited ) {
+                dropDepth();
+                continue;
+            }
+            return false;
+        }
+
+        bundle.timestamp = timestamp;
+        bundle.depth = depth.at( 0 );
+        depth.popFront();
+        if ( options.skeleton ) {
+            for ( UINT i = 0; i < match; ++i ) {
+                skeletons.popFront();
+                ++stats.droppedSkeleton;
+                profiler.add( ids.droppedSkeleton );
+            }
+            bundle.skeleton = skeletons.at( 0 );
+            skeletons.popFront();
+        }
+        else {
+            bundle.skeleton.reset();
+        }
+        bundle.accelerometer = reading;
+
+        lastBundle = timestamp;
+        ++stats.bundles;
+        profiler.add( ids.bundles );
+        return true;
+    }
+    return false;
+}
+
+bool FrameSynchronizer::interpolateAccelerometer( LONGLONG timestamp, bool waited, Vector4& reading )
+{
+    // Later depth frames only need the readings from the last one at or before this one on
+    while ( readingCount > 1 && readings[(firstReading + 1) % readings.size()].timestamp <= timestamp ) {
+        firstReading = (firstReading + 1) % (UINT)readings.size();
+        --readingCount;
+    }
+    if ( readingCount == 0 ) {
+        return false;
+    }
+
+    const Reading& before = readings[firstReading];
+    if ( before.timestamp == timestamp ) {
+        reading = before.value;
+        return true;
+    }
+    if ( before.timestamp < timestamp && readingCount > 1 ) {
+        const Reading& after = readings[(firstReading + 1) % readings.size()];
+        const float t = (float)(timestamp - before.timestamp) / (float)(after.timestamp - before.timestamp);
+        reading.x = before.value.x + (after.value.x - before.value.x) * t;
+        reading.y = before.value.y + (after.value.y - before.value.y) * t;
+        reading.z = before.value.z + (after.value.z - before.value.z) * t;
+        reading.w = before.value.w + (after.value.w - before.value.w) * t;
+        return true;
+    }
+
+    // Only readings on one side: the nearest one will do when no better one is coming
+    // (before the depth frame and waited, or after it and the earlier ones are gone)
+    if ( (before.timestamp > timestamp || waited) && distance( before.timestamp, timestamp ) <= options.maxWait ) {
+        reading = before.value;
+        return true;
+    }
+    return false;
+}
+
+void FrameSynchronizer::dropDepth()
+{
+    depth.popFront();
+    ++stats.droppedDepth;
+    profiler.add( ids.droppedDepth );
+}
+
+void FrameSynchronizer::late()
+{
+    ++stats.lateFrames;
+    profiler.add( ids.lateFrames );
+}
+
+}
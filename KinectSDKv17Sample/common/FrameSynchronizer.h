@@ -0,0 +1,200 @@
+#pragma once
+
+#include <vector>
+
+#include "FramePool.h"
+#include "Profiler.h"
+
+namespace kinectbook {
+
+/// <summary>
+/// Settings of a FrameSynchronizer
+/// </summary>
+struct FrameSynchronizerOptions
+{
+    /// <summary>
+    /// Largest difference of the timestamps of a depth and a skeleton frame that belong together (ms)
+    /// </summary>
+    /// <remarks>
+    /// The SDK stamps a skeleton frame with the time of the depth frame it
+    /// was tracked in, so they are equal; sources with a clock per stream
+    /// need up to half a frame, 16ms at 30Hz.
+    /// </remarks>
+    LONGLONG tolerance;
+
+    /// <summary>
+    /// How far the streams may run ahead of a depth frame still waiting for its partners (ms)
+    /// </summary>
+    /// <remarks>
+    /// Time is the newest timestamp pushed, so a paused recording waits
+    /// as long as it likes; flush() decides at once.
+    /// </remarks>
+    LONGLONG maxWait;
+
+    /// <summary>
+    /// Every bundle has the skeleton frame of its depth frame; depth frames
+    /// without one are dropped. false: skeleton frames are ignored
+    /// </summary>
+    bool skeleton;
+
+    /// <summary>
+    /// Every bundle has the accelerometer interpolated at its timestamp;
+    /// depth frames with no reading within maxWait are dropped. false: readings are ignored
+    /// </summary>
+    bool accelerometer;
+
+    /// <summary>
+    /// Frames buffered per stream; depth and skeleton frames stay referenced
+    /// while they are buffered, so keep it within the pools of the source
+    /// </summary>
+    UINT bufferSize;
+
+    /// <summary>
+    /// Where the drops are counted, nullptr = Profiler::shared()
+    /// </summary>
+    /// <remarks>
+    /// Counters "sync.bundles", "sync.dropped_depth", "sync.dropped_skeleton" and "sync.late_frames".
+    /// </remarks>
+    Profiler* profiler;
+
+    FrameSynchronizerOptions()
+        : tolerance( 16 )
+        , maxWait( 100 )
+        , skeleton( true )
+        , accelerometer( true )
+        , bufferSize( 2 )
+        , profiler( 0 )
+    {
+    }
+};
+
+/// <summary>
+/// Depth frame with the skeleton and accelerometer of the same moment
+/// </summary>
+struct FrameBundle
+{
+    LONGLONG timestamp;         // of the depth frame (milliseconds)
+    FrameRef depth;
+    FrameRef skeleton;          // empty unless FrameSynchronizerOptions::skeleton
+    Vector4 accelerometer;      // in g; zero unless FrameSynchronizerOptions::accelerometer
+
+    FrameBundle() : timestamp( 0 )
+    {
+        accelerometer.x = accelerometer.y = accelerometer.z = accelerometer.w = 0;
+    }
+};
+
+/// <summary>
+/// What a FrameSynchronizer did with the frames pushed so far
+/// </summary>
+struct FrameSynchronizerStatistics
+{
+    unsigned int bundles;
+    unsigned int droppedDepth;      // no partner within maxWait, or pushed out of a full buffer
+    unsigned int droppedSkeleton;   // no depth frame matched it, or pushed out of a full buffer
+    unsigned int lateFrames;        // older than the newest of their stream or than the last bundle
+
+    FrameSynchronizerStatistics() : bundles( 0 ), droppedDepth( 0 ), droppedSkeleton( 0 ), lateFrames( 0 ) {}
+};
+
+/// <summary>
+/// Matches the depth, skeleton and accelerometer frames of a source by
+/// their timestamps
+/// </summary>
+/// <remarks>
+/// Frames of every stream are pushed as they come out of an IFrameSource,
+/// in any interleaving, into a short buffer per stream. A depth frame
+/// becomes a bundle once the skeleton frame within the tolerance of its
+/// timestamp has come and the accelerometer has a reading at or after it;
+/// the reading is interpolated between the two around the depth frame, or
+/// the nearest one is used once maxWait has passed. A depth frame whose
+/// skeleton the stream has already gone past, or that waited longer than
+/// maxWait, is dropped, so only coherent bundles reach the processing.
+/// Every drop is counted. Accelerometer readings are copied and their
+/// frames released at once; depth and skeleton frames stay referenced
+/// until their bundle is released. Not thread safe: push and pop from the
+/// thread that reads the source.
+/// </remarks>
+class FrameSynchronizer
+{
+public:
+
+    explicit FrameSynchronizer( const FrameSynchronizerOptions& options = FrameSynchronizerOptions() );
+
+    /// <summary>
+    /// Take a frame of any stream; frames of streams that are not synchronized are ignored
+    /// </summary>
+    void push( const FrameRef& frame );
+
+    /// <summary>
+    /// Take the oldest bundle that is complete
+    /// </summary>
+    /// <returns>false when every buffered depth frame still waits for its partners</returns>
+    bool tryPop( FrameBundle& bundle );
+
+    /// <summary>
+    /// No more frames for now (end of a recording, a source that went
+    /// quiet): the next tryPop() calls bundle what can be bundled and drop
+    /// the depth frames that still wait, instead of waiting for maxWait
+    /// </summary>
+    void flush() { flushing = true; }
+
+    const FrameSynchronizerStatistics& statistics() const { return stats; }
+
+private:
+
+    FrameSynchronizer( const FrameSynchronizer& );
+    FrameSynchronizer& operator=( const FrameSynchronizer& );
+
+    // Frames of one stream by ascending timestamp, oldest at first
+    struct FrameBuffer
+    {
+        std::vector<FrameRef> frames;
+        UINT first;
+        UINT count;
+
+        FrameBuffer() : first( 0 ), count( 0 ) {}
+
+        const FrameRef& at( UINT i ) const { return frames[(first + i) % frames.size()]; }
+        const FrameRef& back() const { return at( count - 1 ); }
+        void push( const FrameRef& frame );
+        void popFront();
+    };
+
+    struct Reading
+    {
+        LONGLONG timestamp;
+        Vector4 value;
+    };
+
+    void pushFrame( FrameBuffer& buffer, const FrameRef& frame, unsigned int& dropped, unsigned int droppedCounter );
+    void pushReading( const FrameRef& frame );
+    bool interpolateAccelerometer( LONGLONG timestamp, bool waited, Vector4& reading );
+    void dropDepth();
+    void late();
+
+    FrameSynchronizerOptions options;
+    Profiler& profiler;
+    struct ProfilerIds
+    {
+        unsigned int bundles;
+        unsigned int droppedDepth;
+        unsigned int droppedSkeleton;
+        unsigned int lateFrames;
+    } ids;
+
+    FrameBuffer depth;
+    FrameBuffer skeletons;
+
+    // Accelerometer readings by ascending timestamp, oldest at firstReading
+    std::vector<Reading> readings;
+    UINT firstReading;
+    UINT readingCount;
+
+    LONGLONG newest;            // newest timestamp of any stream
+    LONGLONG lastBundle;        // timestamp of the last bundle, -1 before the first
+    bool flushing;
+    FrameSynchronizerStatistics stats;
+};
+
+}
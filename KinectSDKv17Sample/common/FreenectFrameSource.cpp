@@ -0,0 +1,194 @@
+#include "FreenectFrameSource.h"
+
+#include <chrono>
+#include <stdexcept>
+
+#include <sys/time.h>
+#include <libfreenect.h>
+
+namespace kinectbook {
+
+namespace {
+
+// Longest a round of the event loop blocks, so the source stops quickly (us)
+const long EVENT_TIMEOUT = 100000;
+
+// Depth frames that can be out at once
+const UINT DEPTH_POOL_SIZE = 6;
+
+// libfreenect's accelerometer in m/s^2 to the SDK's in g
+const double STANDARD_GRAVITY = 9.80665;
+
+LONGLONG hostMilliseconds()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+}
+
+FreenectFrameSource::FreenectFrameSource( int index )
+    : context( 0 )
+    , device( 0 )
+    , depthPool( DEPTH_POOL_SIZE, WIDTH * HEIGHT * sizeof(NUI_DEPTH_IMAGE_PIXEL) )
+    , accelerometerPool( DEPTH_POOL_SIZE, sizeof(Vector4) )
+    , first( 0 )
+    , count( 0 )
+    , stop( false )
+    , failed( false )
+    , dropped( 0 )
+    , pendingTimestamp( -1 )
+{
+    if ( freenect_init( &context, 0 ) < 0 ) {
+        throw std::runtime_error( "FreenectFrameSource: freenect_init failed" );
+    }
+    freenect_select_subdevices( context, (freenect_device_flags)(FREENECT_DEVICE_MOTOR | FREENECT_DEVICE_CAMERA) );
+
+    if ( freenect_open_device( context, &device, index ) < 0 ) {
+        device = 0;
+        shutdown();
+        throw std::runtime_error( "FreenectFrameSource: can't open the Kinect" );
+    }
+    freenect_set_user( device, this );
+    freenect_set_depth_callback( device, &FreenectFrameSource::depthCallback );
+
+    if ( freenect_set_depth_mode( device, freenect_find_depth_mode( FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_MM ) ) < 0 ||
+         freenect_start_depth( device ) < 0 ) {
+        shutdown();
+        throw std::runtime_error( "FreenectFrameSource: can't start the depth stream" );
+    }
+
+    events = std::thread( [this]() { eventLoop(); } );
+}
+
+FreenectFrameSource::~FreenectFrameSource()
+{
+    stop = true;
+    if ( events.joinable() ) {
+        events.join();
+    }
+    shutdown();
+}
+
+void FreenectFrameSource::shutdown()
+{
+    if ( device != 0 ) {
+        freenect_stop_depth( device );
+        freenect_close_device( device );
+        device = 0;
+    }
+    if ( context != 0 ) {
+        freenect_shutdown( context );
+        context = 0;
+    }
+}
+
+bool FreenectFrameSource::tryGetNextFrame( FrameRef& frame )
+{
+    std::lock_guard<std::mutex> lock( mutex );
+    if ( count == 0 ) {
+        return false;
+    }
+
+    frame.swap( ready[first] );
+    ready[first].reset();
+    first = (first + 1) % READY_FRAMES;
+    --count;
+    return true;
+}
+
+bool FreenectFrameSource::wait( unsigned int timeoutMilliseconds )
+{
+    std::unique_lock<std::mutex> lock( mutex );
+    frameReady.wait_for( lock, std::chrono::milliseconds( timeoutMilliseconds ),
+                         [this]() { return count != 0 || failed.load(); } );
+    return count != 0;
+}
+
+void FreenectFrameSource::eventLoop()
+{
+    while ( !stop ) {
+        timeval timeout = { 0, EVENT_TIMEOUT };
+        if ( freenect_process_events_timeout( context, &timeout ) < 0 ) {
+            std::lock_guard<std::mutex> lock( mutex );
+            failed = true;
+            frameReady.notify_all();
+            return;
+        }
+
+        // The tilt state is a control transfer of its own, not made from inside the callback
+        if ( pendingTimestamp >= 0 ) {
+            readAccelerometer( pendingTimestamp );
+            pendingTimestamp = -1;
+        }
+    }
+}
+
+void FreenectFrameSource::depthCallback( _freenect_device* device, void* depth, unsigned int )
+{
+    ((FreenectFrameSource*)freenect_get_user( device ))->receiveDepth( (const unsigned short*)depth );
+}
+
+void FreenectFrameSource::receiveDepth( const unsigned short* depth )
+{
+    const LONGLONG timestamp = hostMilliseconds();
+    FrameRef frame = depthPool.allocateDepth( WIDTH, HEIGHT, timestamp );
+    if ( frame.empty() ) {
+        ++dropped;
+        return;
+    }
+
+    // libfreenect's buffer is reused for the next frame, so it is converted right here
+    NUI_DEPTH_IMAGE_PIXEL* pixels = (NUI_DEPTH_IMAGE_PIXEL*)frame.storage();
+    for ( UINT y = 0; y < HEIGHT; ++y ) {
+        const unsigned short* row = depth + y * WIDTH;
+        NUI_DEPTH_IMAGE_PIXEL* mirrored = pixels + y * WIDTH + WIDTH - 1;
+        for ( UINT x = 0; x < WIDTH; ++x ) {
+            mirrored[-(int)x].playerIndex = 0;
+            mirrored[-(int)x].depth = row[x];
+        }
+    }
+
+    push( frame );
+    pendingTimestamp = timestamp;
+}
+
+void FreenectFrameSource::readAccelerometer( LONGLONG timestamp )
+{
+    if ( freenect_update_tilt_state( device ) < 0 ) {
+        return;
+    }
+
+    FrameRef frame = accelerometerPool.allocate( FRAME_CHUNK_ACCELEROMETER, sizeof(Vector4), timestamp );
+    if ( frame.empty() ) {
+        ++dropped;
+        return;
+    }
+
+    // The accelerometer feels the floor pushing up, the SDK reports the direction of gravity
+    double x, y, z;
+    freenect_get_mks_accel( freenect_get_tilt_state( device ), &x, &y, &z );
+    Vector4& reading = *(Vector4*)frame.storage();
+    reading.x = (FLOAT)(-x / STANDARD_GRAVITY);
+    reading.y = (FLOAT)(-y / STANDARD_GRAVITY);
+    reading.z = (FLOAT)(-z / STANDARD_GRAVITY);
+    reading.w = 0;
+
+    push( frame );
+}
+
+void FreenectFrameSource::push( FrameRef& frame )
+{
+    std::lock_guard<std::mutex> lock( mutex );
+    if ( count == READY_FRAMES ) {
+        ready[first].reset();
+        first = (first + 1) % READY_FRAMES;
+        --count;
+        ++dropped;
+    }
+    ready[(first + count) % READY_FRAMES].swap( frame );
+    ++count;
+    frameReady.notify_one();
+}
+
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "FrameSource.h"
+
+struct _freenect_context;
+struct _freenect_device;
+
+namespace kinectbook {
+
+/// <summary>
+/// Depth and accelerometer frames of a Kinect through libfreenect (Linux, macOS)
+/// </summary>
+/// <remarks>
+/// A thread of the source runs the libfreenect event loop. Every 640x480
+/// depth frame (FREENECT_DEPTH_MM) is mirrored and converted into the
+/// storage of the pool as NUI_DEPTH_IMAGE_PIXEL with player index 0, so
+/// it reads like the SDK's, and is followed by the tilt motor's
+/// accelerometer in g, (0, -1, 0) for a level sensor like the SDK. There
+/// is no skeleton. Timestamps are milliseconds of the host clock when the
+/// frame arrived; the device has a clock of its own. Frames wait in
+/// a short queue for tryGetNextFrame(); when the consumers fall behind the
+/// oldest one is dropped, so latency stays bounded.
+/// Only built when CMake finds libfreenect (KB_HAVE_FREENECT).
+/// </remarks>
+class FreenectFrameSource : public IFrameSource
+{
+public:
+
+    /// <param name="index">freenect_open_device</param>
+    explicit FreenectFrameSource( int index = 0 );
+    ~FreenectFrameSource();
+
+    virtual bool tryGetNextFrame( FrameRef& frame );
+
+    virtual bool wait( unsigned int timeoutMilliseconds );
+
+    virtual bool finished() const { return failed; }
+
+    virtual UINT depthWidth() const { return WIDTH; }
+
+    virtual UINT depthHeight() const { return HEIGHT; }
+
+    virtual unsigned int droppedFrames() const { return dropped.load(); }
+
+private:
+
+    FreenectFrameSource( const FreenectFrameSource& );
+    FreenectFrameSource& operator=( const FreenectFrameSource& );
+
+    static const UINT WIDTH = 640;
+    static const UINT HEIGHT = 480;
+
+    // Frames waiting for tryGetNextFrame()
+    static const UINT READY_FRAMES = 4;
+
+    static void depthCallback( _freenect_device* device, void* depth, unsigned int timestamp );
+
+    void eventLoop();
+    void receiveDepth( const unsigned short* depth );
+    void readAccelerometer( LONGLONG timestamp );
+    void push( FrameRef& frame );
+    void shutdown();
+
+    _freenect_context* context;
+    _freenect_device* device;
+    FramePool depthPool;
+    FramePool accelerometerPool;
+
+    // Queue of frames from the event thread, oldest at first
+    std::mutex mutex;
+    std::condition_variable frameReady;
+    FrameRef ready[READY_FRAMES];
+    UINT first;
+    UINT count;
+
+    std::atomic<bool> stop;
+    std::atomic<bool> failed;       // the event loop ended, e.g. the device was unplugged
+    std::atomic<unsigned int> dropped;
+
+    // Timestamp of the depth frame whose accelerometer reading is due, -1 for none; event thread only
+    LONGLONG pendingTimestamp;
+    std::thread events;
+};
+
+}
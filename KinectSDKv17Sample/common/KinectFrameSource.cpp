@@ -0,0 +1,229 @@
+#include "KinectFrameSource.h"
+
+#include <stdexcept>
+
+namespace kinectbook {
+
+namespace {
+
+// Skeleton frames and accelerometer readings that can be out at once
+const UINT SKELETON_POOL_SIZE = 4;
+
+}
+
+KinectFrameSource::KinectFrameSource( const KinectFrameSourceOptions& options )
+    : kinect( 0 )
+    , depthStreamHandle( 0 )
+    , colorStreamHandle( 0 )
+    , depthEvent( 0 )
+    , skeletonEvent( 0 )
+    , width( 0 )
+    , height( 0 )
+    , depthPool( DEPTH_BUFFER_COUNT, 0 )
+    , skeletonPool( SKELETON_POOL_SIZE, sizeof(NUI_SKELETON_FRAME) )
+    , skeletonFirst( false )
+    , dropped( 0 )
+    , emptyFrames( 0 )
+{
+    for ( UINT i = 0; i < DEPTH_BUFFER_COUNT; ++i ) {
+        lockedDepthFrames[i].owner = this;
+    }
+
+    createInstance( options.sensorIndex );
+
+    DWORD flags = options.playerIndex ? NUI_INITIALIZE_FLAG_USES_DEPTH_AND_PLAYER_INDEX : NUI_INITIALIZE_FLAG_USES_DEPTH;
+    if ( options.skeleton ) {
+        flags |= NUI_INITIALIZE_FLAG_USES_SKELETON;
+    }
+    if ( options.color ) {
+        flags |= NUI_INITIALIZE_FLAG_USES_COLOR;
+    }
+    if ( kinect->NuiInitialize( flags ) != S_OK ) {
+        throw std::runtime_error( "KinectFrameSource: NuiInitialize failed" );
+    }
+
+    depthEvent = ::CreateEvent( 0, TRUE, FALSE, 0 );
+    NUI_IMAGE_TYPE depthType = options.playerIndex ? NUI_IMAGE_TYPE_DEPTH_AND_PLAYER_INDEX : NUI_IMAGE_TYPE_DEPTH;
+    if ( kinect->NuiImageStreamOpen( depthType, options.resolution, 0,
+                                     DEPTH_BUFFER_COUNT, depthEvent, &depthStreamHandle ) != S_OK ) {
+        throw std::runtime_error( "KinectFrameSource: can't open the depth stream" );
+    }
+    if ( options.nearMode ) {
+        kinect->NuiImageStreamSetImageFrameFlags( depthStreamHandle, NUI_IMAGE_STREAM_FLAG_ENABLE_NEAR_MODE );
+    }
+    ::NuiImageResolutionToSize( options.resolution, width, height );
+
+    if ( options.color &&
+         kinect->NuiImageStreamOpen( NUI_IMAGE_TYPE_COLOR, options.resolution, 0, 2, 0, &colorStreamHandle ) != S_OK ) {
+        throw std::runtime_error( "KinectFrameSource: can't open the color stream" );
+    }
+
+    if ( options.skeleton ) {
+        skeletonEvent = ::CreateEvent( 0, TRUE, FALSE, 0 );
+        if ( kinect->NuiSkeletonTrackingEnable( skeletonEvent, options.skeletonTrackingFlags ) != S_OK ) {
+            throw std::runtime_error( "KinectFrameSource: can't enable skeleton tracking" );
+        }
+    }
+}
+
+KinectFrameSource::~KinectFrameSource()
+{
+    pendingAccelerometer.reset();
+    if ( kinect != 0 ) {
+        kinect->NuiShutdown();
+        kinect->Release();
+    }
+    if ( depthEvent != 0 ) {
+        ::CloseHandle( depthEvent );
+    }
+    if ( skeletonEvent != 0 ) {
+        ::CloseHandle( skeletonEvent );
+    }
+}
+
+void KinectFrameSource::createInstance( int index )
+{
+    int count = 0;
+    if ( ::NuiGetSensorCount( &count ) != S_OK || count == 0 ) {
+        throw std::runtime_error( "KinectFrameSource: no Kinect connected" );
+    }
+
+    for ( int i = (index < 0) ? 0 : index; i < count; ++i ) {
+        INuiSensor* sensor = 0;
+        if ( ::NuiCreateSensorByIndex( i, &sensor ) != S_OK ) {
+            continue;
+        }
+        if ( sensor->NuiStatus() == S_OK ) {
+            kinect = sensor;
+            return;
+        }
+        sensor->Release();
+
+        if ( index >= 0 ) {
+            break;
+        }
+    }
+    throw std::runtime_error( "KinectFrameSource: no Kinect ready" );
+}
+
+bool KinectFrameSource::tryGetNextFrame( FrameRef& frame )
+{
+    if ( !pendingAccelerometer.empty() ) {
+        frame.swap( pendingAccelerometer );
+        pendingAccelerometer.reset();
+        return true;
+    }
+
+    // Taking turns keeps a stream that is always ready from hiding the other one
+    skeletonFirst = !skeletonFirst;
+    if ( skeletonFirst ) {
+        return tryGetSkeleton( frame ) || tryGetDepth( frame );
+    }
+    return tryGetDepth( frame ) || tryGetSkeleton( frame );
+}
+
+bool KinectFrameSource::wait( unsigned int timeoutMilliseconds )
+{
+    if ( !pendingAccelerometer.empty() ) {
+        return true;
+    }
+
+    HANDLE events[2] = { depthEvent, skeletonEvent };
+    DWORD count = (skeletonEvent != 0) ? 2 : 1;
+    DWORD result = ::WaitForMultipleObjects( count, events, FALSE, timeoutMilliseconds );
+    if ( result >= WAIT_OBJECT_0 + count ) {
+        return false;
+    }
+
+    // Every stream is polled by tryGetNextFrame(); a frame arriving from now on signals again
+    for ( DWORD i = 0; i < count; ++i ) {
+        ::ResetEvent( events[i] );
+    }
+    return true;
+}
+
+bool KinectFrameSource::tryGetDepth( FrameRef& frame )
+{
+    // With both buffers out the SDK has no frame to give until one is back
+    if ( depthPool.freeCount() == 0 ) {
+        return false;
+    }
+
+    NUI_IMAGE_FRAME imageFrame = { 0 };
+    if ( kinect->NuiImageStreamGetNextFrame( depthStreamHandle, 0, &imageFrame ) != S_OK ) {
+        return false;
+    }
+
+    BOOL nearMode = FALSE;
+    INuiFrameTexture* texture = 0;
+    NUI_LOCKED_RECT depthData = { 0 };
+    if ( kinect->NuiImageFrameGetDepthImagePixelFrameTexture( depthStreamHandle, &imageFrame, &nearMode, &texture ) == S_OK ) {
+        texture->LockRect( 0, &depthData, 0, 0 );
+    }
+
+    FrameRef depth;
+    if ( depthData.Pitch == 0 ) {
+        ++emptyFrames;
+    }
+    else {
+        depth = depthPool.wrapDepth( (const NUI_DEPTH_IMAGE_PIXEL*)depthData.pBits, width, height,
+                                     imageFrame.liTimeStamp.QuadPart, &KinectFrameSource::releaseDepth, lockedDepthFrames );
+        if ( depth.empty() ) {
+            ++dropped;
+        }
+    }
+    if ( depth.empty() ) {
+        if ( texture != 0 ) {
+            texture->UnlockRect( 0 );
+            texture->Release();
+        }
+        kinect->NuiImageStreamReleaseFrame( depthStreamHandle, &imageFrame );
+        return false;
+    }
+
+    lockedDepthFrames[depth->index].imageFrame = imageFrame;
+    lockedDepthFrames[depth->index].texture = texture;
+    frame.swap( depth );
+    return true;
+}
+
+bool KinectFrameSource::tryGetSkeleton( FrameRef& frame )
+{
+    if ( skeletonEvent == 0 ) {
+        return false;
+    }
+
+    // A frame the pool has no room for is still taken, or its event would stay signaled
+    FrameRef skeleton = skeletonPool.allocate( FRAME_CHUNK_SKELETON, sizeof(NUI_SKELETON_FRAME), 0 );
+    NUI_SKELETON_FRAME* skeletonFrame = skeleton.empty() ? &droppedSkeleton : (NUI_SKELETON_FRAME*)skeleton.storage();
+    if ( kinect->NuiSkeletonGetNextFrame( 0, skeletonFrame ) != S_OK ) {
+        return false;
+    }
+    if ( skeleton.empty() ) {
+        ++dropped;
+        return false;
+    }
+    const LONGLONG timestamp = skeletonFrame->liTimeStamp.QuadPart;
+    skeleton.setTimestamp( timestamp );
+
+    FrameRef reading = skeletonPool.allocate( FRAME_CHUNK_ACCELEROMETER, sizeof(Vector4), timestamp );
+    if ( reading.empty() ) {
+        ++dropped;
+    }
+    else if ( kinect->NuiAccelerometerGetCurrentReading( (Vector4*)reading.storage() ) == S_OK ) {
+        pendingAccelerometer.swap( reading );
+    }
+
+    frame.swap( skeleton );
+    return true;
+}
+
+void KinectFrameSource::releaseDepth( void* owner, const PooledFrame& frame )
+{
+    LockedDepthFrame& locked = ((LockedDepthFrame*)owner)[frame.index];
+    locked.texture->UnlockRect( 0 );
+    locked.texture->Release();
+    locked.owner->kinect->NuiImageStreamReleaseFrame( locked.owner->depthStreamHandle, &locked.imageFrame );
+}
+
+}
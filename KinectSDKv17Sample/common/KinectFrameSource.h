@@ -0,0 +1,120 @@
+#pragma once
+
+#include "FrameSource.h"
+
+namespace kinectbook {
+
+/// <summary>
+/// Settings of KinectFrameSource
+/// </summary>
+struct KinectFrameSourceOptions
+{
+    int sensorIndex;                        // NuiCreateSensorByIndex; -1 takes the first sensor that is ready
+    NUI_IMAGE_RESOLUTION resolution;        // of the depth stream
+    bool nearMode;                          // NUI_IMAGE_STREAM_FLAG_ENABLE_NEAR_MODE
+    bool playerIndex;                       // depth with player index; only one sensor can find players
+    bool skeleton;                          // skeleton frames, each followed by an accelerometer reading
+    DWORD skeletonTrackingFlags;            // NuiSkeletonTrackingEnable
+    bool color;                             // open the color stream as well, read by the application through colorStream()
+
+    KinectFrameSourceOptions()
+        : sensorIndex( -1 )
+        , resolution( NUI_IMAGE_RESOLUTION_640x480 )
+        , nearMode( false )
+        , playerIndex( true )
+        , skeleton( true )
+        , skeletonTrackingFlags( 0 )
+        , color( false )
+    {
+    }
+};
+
+/// <summary>
+/// Depth, skeleton and accelerometer frames of a Kinect for Windows sensor
+/// </summary>
+/// <remarks>
+/// Depth frames are the locked textures of the SDK, shared without copying
+/// and handed back to the SDK with their last reference, so no more than
+/// the two buffers of the stream are out at once; frames without data
+/// (Pitch 0) go straight back and are counted. Skeleton frames are written
+/// by the SDK into the storage of the pool. The accelerometer has no
+/// stream of its own and is read after every skeleton frame, with its
+/// timestamp. wait() sleeps on the frame events of the streams.
+/// Only built with the Kinect SDK.
+/// </remarks>
+class KinectFrameSource : public IFrameSource
+{
+public:
+
+    explicit KinectFrameSource( const KinectFrameSourceOptions& options = KinectFrameSourceOptions() );
+    ~KinectFrameSource();
+
+    virtual bool tryGetNextFrame( FrameRef& frame );
+
+    virtual bool wait( unsigned int timeoutMilliseconds );
+
+    virtual bool finished() const { return false; }
+
+    virtual UINT depthWidth() const { return width; }
+
+    virtual UINT depthHeight() const { return height; }
+
+    virtual unsigned int droppedFrames() const { return dropped; }
+
+    /// <summary>
+    /// Depth frames that came without data
+    /// </summary>
+    unsigned int emptyDepthFrames() const { return emptyFrames; }
+
+    /// <summary>
+    /// The sensor, for what frames do not carry: interaction streams, coordinate mapping, smoothing
+    /// </summary>
+    INuiSensor* sensor() const { return kinect; }
+
+    /// <summary>
+    /// Color stream at the resolution of the depth stream, 0 unless KinectFrameSourceOptions::color
+    /// </summary>
+    HANDLE colorStream() const { return colorStreamHandle; }
+
+private:
+
+    KinectFrameSource( const KinectFrameSource& );
+    KinectFrameSource& operator=( const KinectFrameSource& );
+
+    // Buffers of the depth stream (NuiImageStreamOpen), all of which the consumers may hold
+    static const UINT DEPTH_BUFFER_COUNT = 2;
+
+    void createInstance( int index );
+    bool tryGetDepth( FrameRef& frame );
+    bool tryGetSkeleton( FrameRef& frame );
+
+    static void releaseDepth( void* owner, const PooledFrame& frame );
+
+    // What is needed to give a depth frame back to the SDK, per frame of the pool
+    struct LockedDepthFrame
+    {
+        KinectFrameSource* owner;
+        NUI_IMAGE_FRAME imageFrame;
+        INuiFrameTexture* texture;
+    };
+
+    INuiSensor* kinect;
+    HANDLE depthStreamHandle;
+    HANDLE colorStreamHandle;
+    HANDLE depthEvent;
+    HANDLE skeletonEvent;
+    DWORD width;
+    DWORD height;
+
+    LockedDepthFrame lockedDepthFrames[DEPTH_BUFFER_COUNT];
+    FramePool depthPool;
+    FramePool skeletonPool;
+    FrameRef pendingAccelerometer;      // reading of the skeleton frame handed out last
+    NUI_SKELETON_FRAME droppedSkeleton; // skeleton frames the pool has no room for are read into this
+
+    bool skeletonFirst;                 // the streams take turns to be polled first
+    unsigned int dropped;
+    unsigned int emptyFrames;
+};
+
+}
@@ -0,0 +1,105 @@
+#include "MappedFile.h"
+
+#include <stdexcept>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace kinectbook {
+
+#ifdef _WIN32
+
+MappedFile::MappedFile( const std::string& path, AccessPattern access )
+    : bytes( 0 )
+    , byteCount( 0 )
+    , fileHandle( INVALID_HANDLE_VALUE )
+    , mappingHandle( 0 )
+{
+    fileHandle = ::CreateFileA( path.c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING,
+                                (access == ACCESS_SEQUENTIAL) ? FILE_FLAG_SEQUENTIAL_SCAN : FILE_FLAG_RANDOM_ACCESS, 0 );
+    if ( fileHandle == INVALID_HANDLE_VALUE ) {
+        throw std::runtime_error( "MappedFile: can't open " + path );
+    }
+
+    LARGE_INTEGER fileSize;
+    if ( !::GetFileSizeEx( fileHandle, &fileSize ) || fileSize.QuadPart == 0 ) {
+        unmap();
+        throw std::runtime_error( "MappedFile: empty file " + path );
+    }
+
+    mappingHandle = ::CreateFileMappingA( fileHandle, 0, PAGE_READONLY, 0, 0, 0 );
+    bytes = (mappingHandle != 0) ? (const BYTE*)::MapViewOfFile( mappingHandle, FILE_MAP_READ, 0, 0, 0 ) : 0;
+    if ( bytes == 0 ) {
+        unmap();
+        throw std::runtime_error( "MappedFile: can't map " + path );
+    }
+    byteCount = (size_t)fileSize.QuadPart;
+}
+
+void MappedFile::unmap()
+{
+    if ( bytes != 0 ) {
+        ::UnmapViewOfFile( bytes );
+        bytes = 0;
+    }
+    if ( mappingHandle != 0 ) {
+        ::CloseHandle( mappingHandle );
+        mappingHandle = 0;
+    }
+    if ( fileHandle != INVALID_HANDLE_VALUE ) {
+        ::CloseHandle( fileHandle );
+        fileHandle = INVALID_HANDLE_VALUE;
+    }
+    byteCount = 0;
+}
+
+#else
+
+MappedFile::MappedFile( const std::string& path, AccessPattern access )
+    : bytes( 0 )
+    , byteCount( 0 )
+{
+    int fd = ::open( path.c_str(), O_RDONLY );
+    if ( fd < 0 ) {
+        throw std::runtime_error( "MappedFile: can't open " + path );
+    }
+
+    struct stat st;
+    if ( ::fstat( fd, &st ) != 0 || st.st_size == 0 ) {
+        ::close( fd );
+        throw std::runtime_error( "MappedFile: empty file " + path );
+    }
+
+    // The mapping keeps its own reference to the file
+    void* p = ::mmap( 0, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    ::close( fd );
+    if ( p == MAP_FAILED ) {
+        throw std::runtime_error( "MappedFile: can't map " + path );
+    }
+    ::madvise( p, (size_t)st.st_size, (access == ACCESS_SEQUENTIAL) ? MADV_SEQUENTIAL : MADV_WILLNEED );
+
+    bytes = (const BYTE*)p;
+    byteCount = (size_t)st.st_size;
+}
+
+void MappedFile::unmap()
+{
+    if ( bytes != 0 ) {
+        ::munmap( (void*)bytes, byteCount );
+        bytes = 0;
+    }
+    byteCount = 0;
+}
+
+#endif
+
+MappedFile::~MappedFile()
+{
+    unmap();
+}
+
+}
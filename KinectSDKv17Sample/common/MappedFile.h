@@ -0,0 +1,53 @@
+#pragma once
+
+#include <string>
+
+#include "NuiCompat.h"
+
+namespace kinectbook {
+
+/// <summary>
+/// Whole file mapped read only into memory
+/// </summary>
+/// <remarks>
+/// Pages are read by the OS as they are touched, so opening a large file
+/// costs nothing up front and several threads can read different parts
+/// of it at once. Errors are reported with std::runtime_error.
+/// </remarks>
+class MappedFile
+{
+public:
+
+    /// <summary>
+    /// How the file is going to be read, a hint for the read ahead of the OS
+    /// </summary>
+    enum AccessPattern
+    {
+        ACCESS_SEQUENTIAL,
+        ACCESS_RANDOM,
+    };
+
+    explicit MappedFile( const std::string& path, AccessPattern access = ACCESS_SEQUENTIAL );
+    ~MappedFile();
+
+    const BYTE* data() const { return bytes; }
+
+    size_t size() const { return byteCount; }
+
+private:
+
+    MappedFile( const MappedFile& );
+    MappedFile& operator=( const MappedFile& );
+
+    void unmap();
+
+    const BYTE* bytes;
+    size_t byteCount;
+
+#ifdef _WIN32
+    HANDLE fileHandle;
+    HANDLE mappingHandle;
+#endif
+};
+
+}
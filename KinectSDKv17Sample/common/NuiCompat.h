@@ -0,0 +1,161 @@
+#pragma once
+
+// Kinect SDK types for builds without the SDK (Linux)
+//
+// On Windows this simply pulls in NuiApi.h / NuiKinectFusionApi.h.
+// Elsewhere it provides the minimal subset of the SDK definitions used by the
+// samples, with the same names and the same memory layout, so recorded frames
+// can be exchanged between platforms.
+
+#ifdef _WIN32
+
+// std::min / std::max are used all over the engine
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#include <NuiApi.h>
+#include <NuiKinectFusionApi.h>
+
+#else
+
+#include <stdint.h>
+
+typedef int32_t         HRESULT;
+typedef int32_t         BOOL;
+typedef int32_t         LONG;
+typedef uint8_t         BYTE;
+typedef uint16_t        USHORT;
+typedef uint32_t        UINT;
+typedef uint32_t        DWORD;
+typedef float           FLOAT;
+typedef int64_t         LONGLONG;
+
+#ifndef TRUE
+#define TRUE    1
+#define FALSE   0
+#endif
+
+#define S_OK            ((HRESULT)0x00000000L)
+#define S_FALSE         ((HRESULT)0x00000001L)
+#define E_FAIL          ((HRESULT)0x80004005L)
+#define E_POINTER       ((HRESULT)0x80004003L)
+#define E_INVALIDARG    ((HRESULT)0x80070057L)
+#define E_OUTOFMEMORY   ((HRESULT)0x8007000EL)
+
+#define SUCCEEDED(hr)   (((HRESULT)(hr)) >= 0)
+#define FAILED(hr)      (((HRESULT)(hr)) < 0)
+
+typedef union _LARGE_INTEGER {
+    struct {
+        DWORD LowPart;
+        LONG HighPart;
+    } u;
+    LONGLONG QuadPart;
+} LARGE_INTEGER;
+
+typedef struct _Vector4 {
+    FLOAT x;
+    FLOAT y;
+    FLOAT z;
+    FLOAT w;
+} Vector4;
+
+typedef struct _Matrix4 {
+    FLOAT M11, M12, M13, M14;
+    FLOAT M21, M22, M23, M24;
+    FLOAT M31, M32, M33, M34;
+    FLOAT M41, M42, M43, M44;
+} Matrix4;
+
+// Extended depth data of NUI_IMAGE_TYPE_DEPTH_AND_PLAYER_INDEX
+typedef struct _NUI_DEPTH_IMAGE_PIXEL {
+    USHORT playerIndex;
+    USHORT depth;
+} NUI_DEPTH_IMAGE_PIXEL;
+
+// Color pixel of a depth pixel (INuiCoordinateMapper::MapDepthFrameToColorFrame)
+typedef struct _NUI_COLOR_IMAGE_POINT {
+    LONG x;
+    LONG y;
+} NUI_COLOR_IMAGE_POINT;
+
+#define NUI_SKELETON_COUNT  6
+
+typedef enum _NUI_SKELETON_POSITION_INDEX {
+    NUI_SKELETON_POSITION_HIP_CENTER = 0,
+    NUI_SKELETON_POSITION_SPINE,
+    NUI_SKELETON_POSITION_SHOULDER_CENTER,
+    NUI_SKELETON_POSITION_HEAD,
+    NUI_SKELETON_POSITION_SHOULDER_LEFT,
+    NUI_SKELETON_POSITION_ELBOW_LEFT,
+    NUI_SKELETON_POSITION_WRIST_LEFT,
+    NUI_SKELETON_POSITION_HAND_LEFT,
+    NUI_SKELETON_POSITION_SHOULDER_RIGHT,
+    NUI_SKELETON_POSITION_ELBOW_RIGHT,
+    NUI_SKELETON_POSITION_WRIST_RIGHT,
+    NUI_SKELETON_POSITION_HAND_RIGHT,
+    NUI_SKELETON_POSITION_HIP_LEFT,
+    NUI_SKELETON_POSITION_KNEE_LEFT,
+    NUI_SKELETON_POSITION_ANKLE_LEFT,
+    NUI_SKELETON_POSITION_FOOT_LEFT,
+    NUI_SKELETON_POSITION_HIP_RIGHT,
+    NUI_SKELETON_POSITION_KNEE_RIGHT,
+    NUI_SKELETON_POSITION_ANKLE_RIGHT,
+    NUI_SKELETON_POSITION_FOOT_RIGHT,
+    NUI_SKELETON_POSITION_COUNT
+} NUI_SKELETON_POSITION_INDEX;
+
+typedef enum _NUI_SKELETON_TRACKING_STATE {
+    NUI_SKELETON_NOT_TRACKED = 0,
+    NUI_SKELETON_POSITION_ONLY,
+    NUI_SKELETON_TRACKED
+} NUI_SKELETON_TRACKING_STATE;
+
+typedef enum _NUI_SKELETON_POSITION_TRACKING_STATE {
+    NUI_SKELETON_POSITION_NOT_TRACKED = 0,
+    NUI_SKELETON_POSITION_INFERRED,
+    NUI_SKELETON_POSITION_TRACKED
+} NUI_SKELETON_POSITION_TRACKING_STATE;
+
+typedef struct _NUI_SKELETON_DATA {
+    NUI_SKELETON_TRACKING_STATE eTrackingState;
+    DWORD dwTrackingID;
+    DWORD dwEnrollmentIndex_NotUsed;
+    DWORD dwUserIndex;
+    Vector4 Position;
+    Vector4 SkeletonPositions[NUI_SKELETON_POSITION_COUNT];
+    NUI_SKELETON_POSITION_TRACKING_STATE eSkeletonPositionTrackingState[NUI_SKELETON_POSITION_COUNT];
+    DWORD dwQualityFlags;
+} NUI_SKELETON_DATA;
+
+typedef struct _NUI_SKELETON_FRAME {
+    LARGE_INTEGER liTimeStamp;
+    DWORD dwFrameNumber;
+    DWORD dwFlags;
+    Vector4 vFloorClipPlane;
+    Vector4 vNormalToGravity;
+    NUI_SKELETON_DATA SkeletonData[NUI_SKELETON_COUNT];
+} NUI_SKELETON_FRAME;
+
+// Nominal focal lengths at 320x240 (depth) and 640x480 (color)
+#define NUI_CAMERA_DEPTH_NOMINAL_FOCAL_LENGTH_IN_PIXELS         (285.63f)
+#define NUI_CAMERA_COLOR_NOMINAL_FOCAL_LENGTH_IN_PIXELS         (531.15f)
+
+// Kinect Fusion
+typedef struct _NUI_FUSION_RECONSTRUCTION_PARAMETERS {
+    FLOAT voxelsPerMeter;
+    UINT voxelCountX;
+    UINT voxelCountY;
+    UINT voxelCountZ;
+} NUI_FUSION_RECONSTRUCTION_PARAMETERS;
+
+#define NUI_FUSION_DEFAULT_ALIGN_ITERATION_COUNT    7
+#define NUI_FUSION_DEFAULT_INTEGRATION_WEIGHT       200
+#define NUI_FUSION_DEFAULT_MINIMUM_DEPTH            0.35f
+#define NUI_FUSION_DEFAULT_MAXIMUM_DEPTH            8.0f
+
+// Not the SDK value; only used where the SDK is not available
+#define E_NUI_FUSION_TRACKING_ERROR     ((HRESULT)0x83010100L)
+
+#endif
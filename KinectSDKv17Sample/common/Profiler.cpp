@@ -0,0 +1,560 @@
+#include "Profiler.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+// Per thread variables; VS2012 has no thread_local
+#if defined(_MSC_VER) && _MSC_VER < 1900
+#define KB_THREAD_LOCAL __declspec(thread)
+#else
+#define KB_THREAD_LOCAL thread_local
+#endif
+
+namespace kinectbook {
+
+namespace {
+
+// Buckets per power of two are 1 << SUB_BUCKET_BITS; durations up to 2^MAX_EXPONENT ns (36 minutes)
+const unsigned int SUB_BUCKET_BITS = 3;
+const unsigned int MAX_EXPONENT = 41;
+
+// Trace events a thread can hold until the export thread collects them
+const size_t TRACE_CAPACITY = 4096;
+
+// How often the export thread collects trace events
+const std::chrono::milliseconds TRACE_INTERVAL( 20 );
+
+std::atomic<unsigned int> nextProfilerId( 1 );
+
+// Data of the profiler this thread recorded into last
+struct ThreadCache
+{
+    unsigned int profiler;
+    void* data;
+};
+
+KB_THREAD_LOCAL ThreadCache threadCache = { 0, 0 };
+
+unsigned int highestBit( unsigned long long value )
+{
+    unsigned int bit = 0;
+    if ( value >> 32 ) { value >>= 32; bit += 32; }
+    if ( value >> 16 ) { value >>= 16; bit += 16; }
+    if ( value >> 8 ) { value >>= 8; bit += 8; }
+    if ( value >> 4 ) { value >>= 4; bit += 4; }
+    if ( value >> 2 ) { value >>= 2; bit += 2; }
+    if ( value >> 1 ) { bit += 1; }
+    return bit;
+}
+
+// Small values have a bucket each, larger ones eight buckets per power of two
+unsigned int bucketIndex( unsigned long long nanoseconds )
+{
+    const unsigned int subBuckets = 1 << SUB_BUCKET_BITS;
+    if ( nanoseconds < subBuckets ) {
+        return (unsigned int)nanoseconds;
+    }
+
+    unsigned int exponent = std::min( highestBit( nanoseconds ), MAX_EXPONENT );
+    unsigned int shift = exponent - SUB_BUCKET_BITS;
+    unsigned int sub = (unsigned int)(nanoseconds >> shift) & (subBuckets - 1);
+    if ( highestBit( nanoseconds ) > MAX_EXPONENT ) {
+        sub = subBuckets - 1;
+    }
+    return (shift + 1) * subBuckets + sub;
+}
+
+// Range of durations in a bucket
+void bucketRange( unsigned int bucket, double& lower, double& upper )
+{
+    const unsigned int subBuckets = 1 << SUB_BUCKET_BITS;
+    if ( bucket < subBuckets ) {
+        lower = upper = bucket;
+        return;
+    }
+
+    unsigned int shift = bucket / subBuckets - 1;
+    unsigned int sub = bucket % subBuckets;
+    lower = (double)((unsigned long long)(subBuckets + sub) << shift);
+    upper = lower + (double)(1ull << shift);
+}
+
+// Owner thread only, so a plain load and store is enough
+inline void increase( std::atomic<unsigned long long>& value, unsigned long long amount )
+{
+    value.store( value.load( std::memory_order_relaxed ) + amount, std::memory_order_relaxed );
+}
+
+void writeJsonString( FILE* file, const std::string& text )
+{
+    std::fputc( '"', file );
+    for ( size_t i = 0; i < text.size(); ++i ) {
+        if ( text[i] == '"' || text[i] == '\\' ) {
+            std::fputc( '\\', file );
+        }
+        std::fputc( text[i], file );
+    }
+    std::fputc( '"', file );
+}
+
+}
+
+const StageStatistics* ProfilerSnapshot::stage( const std::string& name ) const
+{
+    for ( size_t i = 0; i < stages.size(); ++i ) {
+        if ( stages[i].name == name ) {
+            return &stages[i];
+        }
+    }
+    return 0;
+}
+
+unsigned long long ProfilerSnapshot::counter( const std::string& name ) const
+{
+    for ( size_t i = 0; i < counters.size(); ++i ) {
+        if ( counters[i].first == name ) {
+            return counters[i].second;
+        }
+    }
+    return 0;
+}
+
+Profiler::Histogram::Histogram()
+    : count( 0 )
+    , totalNanoseconds( 0 )
+    , maxNanoseconds( 0 )
+{
+    for ( unsigned int i = 0; i < BUCKET_COUNT; ++i ) {
+        buckets[i].store( 0, std::memory_order_relaxed );
+    }
+}
+
+Profiler::ThreadData::ThreadData( std::thread::id thread_, unsigned int index_ )
+    : thread( thread_ )
+    , index( index_ )
+    , trace( TRACE_CAPACITY )
+{
+    for ( unsigned int i = 0; i < MAX_STAGES; ++i ) {
+        histograms[i].store( 0, std::memory_order_relaxed );
+    }
+}
+
+Profiler::ThreadData::~ThreadData()
+{
+    for ( unsigned int i = 0; i < MAX_STAGES; ++i ) {
+        delete histograms[i].load();
+    }
+}
+
+Profiler::Profiler()
+    : id( nextProfilerId++ )
+    , startTime( Clock::now() )
+    , stageCount( 0 )
+    , exportStopping( false )
+    , statisticsFile( 0 )
+    , statisticsInterval( 1000 )
+    , lastStatisticsTime( 0 )
+    , traceFile( 0 )
+    , traceEnabled( false )
+    , traceEmpty( true )
+{
+    for ( unsigned int i = 0; i < MAX_COUNTERS; ++i ) {
+        counters[i].store( 0, std::memory_order_relaxed );
+    }
+    traceOverflow = counter( "profiler.trace_overflow" );
+}
+
+Profiler::~Profiler()
+{
+    try {
+        stopTrace();
+        stopExport();
+    }
+    catch ( ... ) {
+    }
+}
+
+Profiler& Profiler::shared()
+{
+    static Profiler profiler;
+    return profiler;
+}
+
+unsigned int Profiler::stage( const std::string& name )
+{
+    std::lock_guard<std::mutex> lock( registryMutex );
+    std::vector<std::string>::iterator it = std::find( stageNames.begin(), stageNames.end(), name );
+    if ( it != stageNames.end() ) {
+        return (unsigned int)(it - stageNames.begin());
+    }
+    if ( stageNames.size() >= MAX_STAGES ) {
+        throw std::runtime_error( "Profiler: too many stages" );
+    }
+
+    stageNames.push_back( name );
+    stageCount.store( (unsigned int)stageNames.size(), std::memory_order_release );
+    return (unsigned int)stageNames.size() - 1;
+}
+
+unsigned int Profiler::counter( const std::string& name )
+{
+    std::lock_guard<std::mutex> lock( registryMutex );
+    std::vector<std::string>::iterator it = std::find( counterNames.begin(), counterNames.end(), name );
+    if ( it != counterNames.end() ) {
+        return (unsigned int)(it - counterNames.begin());
+    }
+    if ( counterNames.size() >= MAX_COUNTERS ) {
+        throw std::runtime_error( "Profiler: too many counters" );
+    }
+
+    counterNames.push_back( name );
+    return (unsigned int)counterNames.size() - 1;
+}
+
+Profiler::ThreadData& Profiler::threadData()
+{
+    if ( threadCache.profiler == id ) {
+        return *(ThreadData*)threadCache.data;
+    }
+
+    // First record of this thread into this profiler, or another profiler in between
+    std::lock_guard<std::mutex> lock( registryMutex );
+    std::thread::id thread = std::this_thread::get_id();
+    ThreadData* data = 0;
+    for ( size_t i = 0; i < threads.size() && data == 0; ++i ) {
+        if ( threads[i]->thread == thread ) {
+            data = threads[i].get();
+        }
+    }
+    if ( data == 0 ) {
+        threads.push_back( std::unique_ptr<ThreadData>( new ThreadData( thread, (unsigned int)threads.size() + 1 ) ) );
+        data = threads.back().get();
+    }
+
+    threadCache.profiler = id;
+    threadCache.data = data;
+    return *data;
+}
+
+void Profiler::record( unsigned int stage, Clock::time_point start, Clock::time_point end )
+{
+    ThreadData& data = threadData();
+    Histogram* histogram = data.histograms[stage].load( std::memory_order_relaxed );
+    if ( histogram == 0 ) {
+        histogram = new Histogram();
+        data.histograms[stage].store( histogram, std::memory_order_release );
+    }
+
+    long long duration = std::chrono::duration_cast<std::chrono::nanoseconds>( end - start ).count();
+    unsigned long long nanoseconds = (duration > 0) ? (unsigned long long)duration : 0;
+    increase( histogram->count, 1 );
+    increase( histogram->totalNanoseconds, nanoseconds );
+    if ( nanoseconds > histogram->maxNanoseconds.load( std::memory_order_relaxed ) ) {
+        histogram->maxNanoseconds.store( nanoseconds, std::memory_order_relaxed );
+    }
+    std::atomic<unsigned int>& bucket = histogram->buckets[bucketIndex( nanoseconds )];
+    bucket.store( bucket.load( std::memory_order_relaxed ) + 1, std::memory_order_relaxed );
+
+    if ( traceEnabled.load( std::memory_order_relaxed ) ) {
+        long long offset = std::chrono::duration_cast<std::chrono::nanoseconds>( start - startTime ).count();
+        TraceEvent event = { stage, (offset > 0) ? (unsigned long long)offset : 0, nanoseconds };
+        if ( !data.trace.tryPush( event ) ) {
+            add( traceOverflow );
+        }
+    }
+}
+
+void Profiler::merge( std::vector<Merged>& merged, size_t count )
+{
+    merged.resize( count );
+    for ( size_t s = 0; s < count; ++s ) {
+        merged[s].count = 0;
+        merged[s].totalNanoseconds = 0;
+        merged[s].maxNanoseconds = 0;
+        merged[s].buckets.assign( BUCKET_COUNT, 0 );
+    }
+
+    std::lock_guard<std::mutex> lock( registryMutex );
+    for ( size_t t = 0; t < threads.size(); ++t ) {
+        for ( size_t s = 0; s < count; ++s ) {
+            const Histogram* histogram = threads[t]->histograms[s].load( std::memory_order_acquire );
+            if ( histogram == 0 ) {
+                continue;
+            }
+
+            Merged& m = merged[s];
+            m.count += histogram->count.load( std::memory_order_relaxed );
+            m.totalNanoseconds += histogram->totalNanoseconds.load( std::memory_order_relaxed );
+            m.maxNanoseconds = std::max( m.maxNanoseconds, histogram->maxNanoseconds.load( std::memory_order_relaxed ) );
+            for ( unsigned int b = 0; b < BUCKET_COUNT; ++b ) {
+                m.buckets[b] += histogram->buckets[b].load( std::memory_order_relaxed );
+            }
+        }
+    }
+}
+
+namespace {
+
+// Milliseconds below which the given fraction of the samples lie
+double percentile( const std::vector<unsigned long long>& buckets, unsigned long long count,
+                   unsigned long long maxNanoseconds, double fraction )
+{
+    if ( count == 0 ) {
+        return 0;
+    }
+
+    unsigned long long target = std::max( (unsigned long long)(count * fraction + 0.5), 1ull );
+    unsigned long long seen = 0;
+    for ( size_t b = 0; b < buckets.size(); ++b ) {
+        seen += buckets[b];
+        if ( seen >= target ) {
+            double lower, upper;
+            bucketRange( (unsigned int)b, lower, upper );
+            return std::min( (lower + upper) * 0.5, (double)maxNanoseconds ) / 1e6;
+        }
+    }
+    return maxNanoseconds / 1e6;
+}
+
+}
+
+ProfilerSnapshot Profiler::snapshot()
+{
+    std::vector<Merged> merged;
+    merge( merged, stageCount.load( std::memory_order_acquire ) );
+
+    ProfilerSnapshot snapshot;
+    snapshot.time = secondsSinceStart();
+
+    std::lock_guard<std::mutex> lock( registryMutex );
+    for ( size_t s = 0; s < merged.size(); ++s ) {
+        const Merged& m = merged[s];
+        StageStatistics stage;
+        stage.name = stageNames[s];
+        stage.count = m.count;
+        stage.total = m.totalNanoseconds / 1e6;
+        stage.p50 = percentile( m.buckets, m.count, m.maxNanoseconds, 0.5 );
+        stage.p99 = percentile( m.buckets, m.count, m.maxNanoseconds, 0.99 );
+        stage.max = m.maxNanoseconds / 1e6;
+        snapshot.stages.push_back( stage );
+    }
+    for ( size_t c = 0; c < counterNames.size(); ++c ) {
+        snapshot.counters.push_back( std::make_pair( counterNames[c], counters[c].load() ) );
+    }
+    return snapshot;
+}
+
+double Profiler::secondsSinceStart() const
+{
+    return std::chrono::duration<double>( Clock::now() - startTime ).count();
+}
+
+void Profiler::startExport( const std::string& path, unsigned int intervalMilliseconds )
+{
+    stopExport();
+
+    std::lock_guard<std::mutex> lock( exportMutex );
+    statisticsFile = std::fopen( path.c_str(), "a" );
+    if ( statisticsFile == 0 ) {
+        throw std::runtime_error( "Profiler: can't open " + path );
+    }
+
+    statisticsInterval = std::chrono::milliseconds( std::max( intervalMilliseconds, 1u ) );
+    nextStatistics = Clock::now() + statisticsInterval;
+    merge( lastStatistics, stageCount.load( std::memory_order_acquire ) );
+    lastStatisticsTime = secondsSinceStart();
+    startExportThread();
+}
+
+void Profiler::stopExport()
+{
+    {
+        std::lock_guard<std::mutex> lock( exportMutex );
+        if ( statisticsFile == 0 ) {
+            return;
+        }
+
+        // The last, partial interval
+        writeStatistics();
+        std::fclose( statisticsFile );
+        statisticsFile = 0;
+    }
+    stopExportThreadIfIdle();
+}
+
+void Profiler::startTrace( const std::string& path )
+{
+    stopTrace();
+
+    std::lock_guard<std::mutex> lock( exportMutex );
+    traceFile = std::fopen( path.c_str(), "w" );
+    if ( traceFile == 0 ) {
+        throw std::runtime_error( "Profiler: can't create " + path );
+    }
+
+    std::fputs( "[\n", traceFile );
+    traceEmpty = true;
+    traceCounters.clear();
+    traceEnabled = true;
+    startExportThread();
+}
+
+void Profiler::stopTrace()
+{
+    {
+        std::lock_guard<std::mutex> lock( exportMutex );
+        if ( traceFile == 0 ) {
+            return;
+        }
+
+        traceEnabled = false;
+        drainTrace();
+        std::fputs( "\n]\n", traceFile );
+        std::fclose( traceFile );
+        traceFile = 0;
+    }
+    stopExportThreadIfIdle();
+}
+
+void Profiler::startExportThread()
+{
+    if ( !exportThread.joinable() ) {
+        exportStopping = false;
+        exportThread = std::thread( &Profiler::exportMain, this );
+    }
+}
+
+void Profiler::stopExportThreadIfIdle()
+{
+    {
+        std::lock_guard<std::mutex> lock( exportMutex );
+        if ( statisticsFile != 0 || traceFile != 0 || !exportThread.joinable() ) {
+            return;
+        }
+        exportStopping = true;
+        exportWakeUp.notify_all();
+    }
+    exportThread.join();
+}
+
+void Profiler::exportMain()
+{
+    std::unique_lock<std::mutex> lock( exportMutex );
+    while ( !exportStopping ) {
+        exportWakeUp.wait_for( lock, TRACE_INTERVAL );
+
+        if ( traceFile != 0 ) {
+            drainTrace();
+        }
+
+        Clock::time_point now = Clock::now();
+        if ( statisticsFile != 0 && now >= nextStatistics ) {
+            writeStatistics();
+            nextStatistics += statisticsInterval;
+            if ( nextStatistics < now ) {
+                nextStatistics = now + statisticsInterval;
+            }
+        }
+    }
+}
+
+void Profiler::writeStatistics()
+{
+    std::vector<Merged> current;
+    merge( current, stageCount.load( std::memory_order_acquire ) );
+    lastStatistics.resize( current.size() );
+
+    double time = secondsSinceStart();
+    double interval = time - lastStatisticsTime;
+
+    std::vector<std::string> names, counterNameList;
+    {
+        std::lock_guard<std::mutex> lock( registryMutex );
+        names = stageNames;
+        counterNameList = counterNames;
+    }
+
+    std::fprintf( statisticsFile, "{\"time\":%.3f,\"interval\":%.3f,\"stages\":{", time, interval );
+    for ( size_t s = 0; s < current.size(); ++s ) {
+        // Samples of this interval only
+        const Merged& now = current[s];
+        Merged& last = lastStatistics[s];
+        last.buckets.resize( BUCKET_COUNT );
+        unsigned long long count = now.count - last.count;
+        double total = (now.totalNanoseconds - last.totalNanoseconds) / 1e6;
+        std::vector<unsigned long long> buckets( BUCKET_COUNT );
+        unsigned long long maxNanoseconds = 0;
+        for ( unsigned int b = 0; b < BUCKET_COUNT; ++b ) {
+            buckets[b] = now.buckets[b] - last.buckets[b];
+            if ( buckets[b] != 0 ) {
+                double lower, upper;
+                bucketRange( b, lower, upper );
+                maxNanoseconds = std::min( (unsigned long long)upper, now.maxNanoseconds );
+            }
+        }
+
+        std::fputs( s == 0 ? "" : ",", statisticsFile );
+        writeJsonString( statisticsFile, names[s] );
+        std::fprintf( statisticsFile, ":{\"count\":%llu,\"rate\":%.2f,\"mean\":%.4f,\"p50\":%.4f,\"p99\":%.4f,\"max\":%.4f}",
+                      count, interval > 0 ? count / interval : 0.0, count != 0 ? total / count : 0.0,
+                      percentile( buckets, count, maxNanoseconds, 0.5 ),
+                      percentile( buckets, count, maxNanoseconds, 0.99 ), maxNanoseconds / 1e6 );
+    }
+    std::fputs( "},\"counters\":{", statisticsFile );
+    for ( size_t c = 0; c < counterNameList.size(); ++c ) {
+        std::fputs( c == 0 ? "" : ",", statisticsFile );
+        writeJsonString( statisticsFile, counterNameList[c] );
+        std::fprintf( statisticsFile, ":%llu", counters[c].load() );
+    }
+    std::fputs( "}}\n", statisticsFile );
+    std::fflush( statisticsFile );
+
+    lastStatistics.swap( current );
+    lastStatisticsTime = time;
+}
+
+void Profiler::drainTrace()
+{
+    std::vector<std::string> names, counterNameList;
+    std::vector<ThreadData*> threadList;
+    {
+        std::lock_guard<std::mutex> lock( registryMutex );
+        names = stageNames;
+        counterNameList = counterNames;
+        for ( size_t i = 0; i < threads.size(); ++i ) {
+            threadList.push_back( threads[i].get() );
+        }
+    }
+
+    // Complete events in microseconds, one row per thread
+    for ( size_t t = 0; t < threadList.size(); ++t ) {
+        TraceEvent event;
+        while ( threadList[t]->trace.tryPop( event ) ) {
+            std::fputs( traceEmpty ? "" : ",\n", traceFile );
+            traceEmpty = false;
+            std::fputs( "{\"name\":", traceFile );
+            writeJsonString( traceFile, names[event.stage] );
+            std::fprintf( traceFile, ",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u}",
+                          event.start / 1e3, event.duration / 1e3, threadList[t]->index );
+        }
+    }
+
+    // Counters as they change
+    double timestamp = secondsSinceStart() * 1e6;
+    traceCounters.resize( counterNameList.size(), 0 );
+    for ( size_t c = 0; c < counterNameList.size(); ++c ) {
+        unsigned long long value = counters[c].load();
+        if ( value == traceCounters[c] ) {
+            continue;
+        }
+        traceCounters[c] = value;
+        std::fputs( traceEmpty ? "" : ",\n", traceFile );
+        traceEmpty = false;
+        std::fputs( "{\"name\":", traceFile );
+        writeJsonString( traceFile, counterNameList[c] );
+        std::fprintf( traceFile, ",\"ph\":\"C\",\"ts\":%.3f,\"pid\":1,\"args\":{\"value\":%llu}}", timestamp, value );
+    }
+    std::fflush( traceFile );
+}
+
+}
@@ -0,0 +1,244 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "RingBuffer.h"
+
+namespace kinectbook {
+
+/// <summary>
+/// Latency distribution of one stage, in milliseconds
+/// </summary>
+struct StageStatistics
+{
+    std::string name;
+    unsigned long long count;
+    double total;
+    double p50;
+    double p99;
+    double max;
+
+    double mean() const { return count != 0 ? total / count : 0.0; }
+};
+
+/// <summary>
+/// Everything a Profiler measured since it was created
+/// </summary>
+struct ProfilerSnapshot
+{
+    double time;            // seconds since the profiler was created
+    std::vector<StageStatistics> stages;
+    std::vector<std::pair<std::string, unsigned long long> > counters;
+
+    /// <returns>nullptr if there is no stage of that name</returns>
+    const StageStatistics* stage( const std::string& name ) const;
+
+    unsigned long long counter( const std::string& name ) const;
+};
+
+/// <summary>
+/// Low overhead timing of pipeline stages and counting of events
+/// </summary>
+/// <remarks>
+/// Stages and counters are registered by name once, typically into a
+/// constant at startup, and referred to by id afterwards. Every thread
+/// records durations into histograms of its own that only it writes, so
+/// recording is a clock read and a few relaxed atomic stores without
+/// locks; the histograms have eight buckets per power of two (percentiles
+/// within 6%), the maximum is exact. Counters are shared atomics for rare
+/// events such as dropped frames.
+///
+/// A background thread exports the statistics of every interval as one
+/// JSON object per line and, while a trace is open, every timed scope to
+/// a Chrome trace file (chrome://tracing, Perfetto). Threads hand trace
+/// events over through a lock-free ring of their own; events that do not
+/// fit are counted as "profiler.trace_overflow".
+///
+/// stage(), counter(), record() and add() may be called from any thread;
+/// the export functions from one thread at a time.
+/// </remarks>
+class Profiler
+{
+public:
+
+    typedef std::chrono::steady_clock Clock;
+
+    /// <summary>
+    /// Most stages and counters a profiler can hold
+    /// </summary>
+    static const unsigned int MAX_STAGES = 64;
+    static const unsigned int MAX_COUNTERS = 64;
+
+    Profiler();
+    ~Profiler();
+
+    /// <summary>
+    /// Profiler shared by the samples
+    /// </summary>
+    static Profiler& shared();
+
+    /// <summary>
+    /// Id of a stage; the same name gives the same id
+    /// </summary>
+    unsigned int stage( const std::string& name );
+
+    /// <summary>
+    /// Id of a counter; the same name gives the same id
+    /// </summary>
+    unsigned int counter( const std::string& name );
+
+    void record( unsigned int stage, Clock::time_point start, Clock::time_point end );
+
+    void add( unsigned int counter, unsigned long long amount = 1 )
+    {
+        counters[counter].fetch_add( amount, std::memory_order_relaxed );
+    }
+
+    ProfilerSnapshot snapshot();
+
+    /// <summary>
+    /// Append the statistics of every interval to a file, one JSON object per line
+    /// </summary>
+    /// <remarks>
+    /// {"time":s,"interval":s,"stages":{"name":{"count","rate","mean","p50","p99","max"}},"counters":{"name":n}}
+    /// Stages give the frames of the interval, rate per second and
+    /// milliseconds; counters are totals since the start.
+    /// </remarks>
+    void startExport( const std::string& path, unsigned int intervalMilliseconds = 1000 );
+
+    void stopExport();
+
+    /// <summary>
+    /// Write every timed scope to a Chrome trace file until stopTrace()
+    /// </summary>
+    void startTrace( const std::string& path );
+
+    void stopTrace();
+
+    bool tracing() const { return traceEnabled.load(); }
+
+private:
+
+    Profiler( const Profiler& );
+    Profiler& operator=( const Profiler& );
+
+    static const unsigned int BUCKET_COUNT = 320;
+
+    struct Histogram
+    {
+        std::atomic<unsigned long long> count;
+        std::atomic<unsigned long long> totalNanoseconds;
+        std::atomic<unsigned long long> maxNanoseconds;
+        std::atomic<unsigned int> buckets[BUCKET_COUNT];
+
+        Histogram();
+    };
+
+    struct TraceEvent
+    {
+        unsigned int stage;
+        unsigned long long start;       // nanoseconds since the profiler was created
+        unsigned long long duration;
+    };
+
+    /// <summary>
+    /// What one thread recorded; written by that thread only
+    /// </summary>
+    struct ThreadData
+    {
+        std::thread::id thread;
+        unsigned int index;             // trace thread id
+        std::atomic<Histogram*> histograms[MAX_STAGES];
+        RingBuffer<TraceEvent> trace;
+
+        ThreadData( std::thread::id thread, unsigned int index );
+        ~ThreadData();
+    };
+
+    /// <summary>
+    /// Stage histograms merged over the threads
+    /// </summary>
+    struct Merged
+    {
+        unsigned long long count;
+        unsigned long long totalNanoseconds;
+        unsigned long long maxNanoseconds;
+        std::vector<unsigned long long> buckets;
+    };
+
+    ThreadData& threadData();
+    void merge( std::vector<Merged>& merged, size_t stageCount );
+    void exportMain();
+    void startExportThread();
+    void stopExportThreadIfIdle();
+    void writeStatistics();
+    void drainTrace();
+    double secondsSinceStart() const;
+
+    const unsigned int id;              // tells profilers apart in the per thread cache
+    const Clock::time_point startTime;
+
+    std::mutex registryMutex;           // names and threads
+    std::vector<std::string> stageNames;
+    std::vector<std::string> counterNames;
+    std::vector<std::unique_ptr<ThreadData> > threads;
+    std::atomic<unsigned int> stageCount;
+
+    std::atomic<unsigned long long> counters[MAX_COUNTERS];
+    unsigned int traceOverflow;         // counter id
+
+    // Export, guarded by exportMutex
+    std::mutex exportMutex;
+    std::condition_variable exportWakeUp;
+    std::thread exportThread;
+    bool exportStopping;
+    FILE* statisticsFile;
+    std::chrono::milliseconds statisticsInterval;
+    Clock::time_point nextStatistics;
+    double lastStatisticsTime;
+    std::vector<Merged> lastStatistics;
+    FILE* traceFile;
+    std::atomic<bool> traceEnabled;
+    bool traceEmpty;
+    std::vector<unsigned long long> traceCounters;     // values last written to the trace
+};
+
+/// <summary>
+/// Records the time from construction to destruction as one sample of a stage
+/// </summary>
+class ScopedTimer
+{
+public:
+
+    explicit ScopedTimer( unsigned int stage_, Profiler& profiler_ = Profiler::shared() )
+        : profiler( profiler_ )
+        , stage( stage_ )
+        , start( Profiler::Clock::now() )
+    {
+    }
+
+    ~ScopedTimer()
+    {
+        profiler.record( stage, start, Profiler::Clock::now() );
+    }
+
+private:
+
+    ScopedTimer( const ScopedTimer& );
+    ScopedTimer& operator=( const ScopedTimer& );
+
+    Profiler& profiler;
+    unsigned int stage;
+    Profiler::Clock::time_point start;
+};
+
+}
@@ -0,0 +1,120 @@
+#include "RecordedFrameSource.h"
+
+#include <thread>
+
+namespace kinectbook {
+
+namespace {
+
+// Frames that can be out at once; they only point into the mapped file
+const UINT POOL_SIZE = 8;
+
+// From the last chunk of a lap to the first of the next one, a frame at 30Hz (ms)
+const LONGLONG LAP_GAP = 33;
+
+// Sleep of wait() while the consumers hold every frame (ms)
+const unsigned int POOL_POLL_INTERVAL = 1;
+
+}
+
+RecordedFrameSource::RecordedFrameSource( const std::string& path, bool realTime, bool loop )
+    : player( path )
+    , pool( POOL_SIZE, 0 )
+    , realTime( realTime )
+    , loop( loop && player.chunkCount() != 0 )
+    , position( 0 )
+    , lapOffset( 0 )
+    , started( false )
+    , width( 0 )
+    , height( 0 )
+    , dropped( 0 )
+{
+    for ( size_t i = 0; i < player.chunkCount(); ++i ) {
+        if ( const DepthChunkInfo* info = player.chunk( i ).depthInfo() ) {
+            width = info->width;
+            height = info->height;
+            break;
+        }
+    }
+}
+
+bool RecordedFrameSource::tryGetNextFrame( FrameRef& frame )
+{
+    if ( position == player.chunkCount() ) {
+        return false;
+    }
+
+    if ( realTime ) {
+        if ( !started ) {
+            start = Clock::now();
+            started = true;
+        }
+        else if ( Clock::now() < dueTime() ) {
+            return false;
+        }
+    }
+
+    FrameRef next = pool.wrap( player.chunk( position ) );
+    if ( next.empty() ) {
+        // In real time the recording goes on without the consumers, as the sensor would
+        if ( realTime ) {
+            ++dropped;
+            advance();
+        }
+        return false;
+    }
+    next.setTimestamp( nextTimestamp() );
+    advance();
+
+    frame.swap( next );
+    return true;
+}
+
+bool RecordedFrameSource::wait( unsigned int timeoutMilliseconds )
+{
+    if ( finished() ) {
+        return false;
+    }
+
+    const Clock::time_point deadline = Clock::now() + std::chrono::milliseconds( timeoutMilliseconds );
+    if ( realTime ) {
+        if ( started ) {
+            const Clock::time_point due = dueTime();
+            if ( due > deadline ) {
+                std::this_thread::sleep_until( deadline );
+                return false;
+            }
+            std::this_thread::sleep_until( due );
+        }
+        return true;
+    }
+
+    while ( pool.freeCount() == 0 ) {
+        if ( Clock::now() >= deadline ) {
+            return false;
+        }
+        std::this_thread::sleep_for( std::chrono::milliseconds( POOL_POLL_INTERVAL ) );
+    }
+    return true;
+}
+
+LONGLONG RecordedFrameSource::nextTimestamp() const
+{
+    return player.chunk( position ).timestamp + lapOffset;
+}
+
+RecordedFrameSource::Clock::time_point RecordedFrameSource::dueTime() const
+{
+    return start + std::chrono::milliseconds( nextTimestamp() - player.chunk( 0 ).timestamp );
+}
+
+void RecordedFrameSource::advance()
+{
+    ++position;
+    if ( position == player.chunkCount() && loop ) {
+        position = 0;
+        lapOffset += player.duration() + LAP_GAP;
+    }
+}
+
+}
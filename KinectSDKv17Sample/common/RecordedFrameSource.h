@@ -0,0 +1,78 @@
+#pragma once
+
+#include <chrono>
+#include <string>
+
+#include "FramePlayer.h"
+#include "FrameSource.h"
+
+namespace kinectbook {
+
+/// <summary>
+/// Frames of a .kbrec recording, without copying them out of the mapped file
+/// </summary>
+/// <remarks>
+/// By default every frame is ready at once and a consumer holding the
+/// whole pool only holds the playback up, so a recording replays as fast
+/// as it is processed and no frame is lost. In real time frames become
+/// ready at the pace they were recorded and, like a sensor, a frame that
+/// finds the pool exhausted is dropped. Looping carries the timestamps on
+/// so they keep increasing.
+/// </remarks>
+class RecordedFrameSource : public IFrameSource
+{
+public:
+
+    /// <param name="realTime">Hand frames out at the recorded pace instead of as fast as they are asked for</param>
+    /// <param name="loop">Start over at the end instead of finishing</param>
+    explicit RecordedFrameSource( const std::string& path, bool realTime = false, bool loop = false );
+
+    virtual bool tryGetNextFrame( FrameRef& frame );
+
+    virtual bool wait( unsigned int timeoutMilliseconds );
+
+    virtual bool finished() const { return !loop && position == player.chunkCount(); }
+
+    virtual UINT depthWidth() const { return width; }
+
+    virtual UINT depthHeight() const { return height; }
+
+    virtual unsigned int droppedFrames() const { return dropped; }
+
+    const FramePlayer& recording() const { return player; }
+
+private:
+
+    typedef std::chrono::steady_clock Clock;
+
+    RecordedFrameSource( const RecordedFrameSource& );
+    RecordedFrameSource& operator=( const RecordedFrameSource& );
+
+    /// <summary>
+    /// Timestamp of the next chunk, including the laps played so far
+    /// </summary>
+    LONGLONG nextTimestamp() const;
+
+    /// <summary>
+    /// When the next chunk is due in real time
+    /// </summary>
+    Clock::time_point dueTime() const;
+
+    void advance();
+
+    FramePlayer player;
+    FramePool pool;
+    bool realTime;
+    bool loop;
+
+    size_t position;
+    LONGLONG lapOffset;         // added to the recorded timestamps of the current lap
+    Clock::time_point start;    // when the first chunk was handed out, real time only
+    bool started;
+
+    UINT width;
+    UINT height;
+    unsigned int dropped;
+};
+
+}
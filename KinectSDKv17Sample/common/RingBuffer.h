@@ -0,0 +1,124 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+namespace kinectbook {
+
+/// <summary>
+/// Bounded lock-free queue for several producers and consumers
+/// </summary>
+/// <remarks>
+/// Every cell carries a sequence number that tells whether it is ready to
+/// be written or read for the current lap, so push and pop are a single
+/// compare-and-swap on the position plus a store of the sequence; no locks
+/// and no allocation after construction (D. Vyukov's bounded MPMC queue).
+/// T should be cheap to copy; the pipelines pass frame pointers.
+/// </remarks>
+template <class T>
+class RingBuffer
+{
+public:
+
+    /// <param name="capacity">Rounded up to a power of two</param>
+    explicit RingBuffer( size_t capacity )
+        : enqueuePosition( 0 )
+        , dequeuePosition( 0 )
+    {
+        size_t size = 2;
+        while ( size < capacity ) {
+            size *= 2;
+        }
+        mask = size - 1;
+
+        cells.reset( new Cell[size] );
+        for ( size_t i = 0; i < size; ++i ) {
+            cells[i].sequence.store( i, std::memory_order_relaxed );
+        }
+    }
+
+    /// <returns>false when the buffer is full</returns>
+    bool tryPush( const T& value )
+    {
+        size_t position = enqueuePosition.load( std::memory_order_relaxed );
+        for ( ;; ) {
+            Cell& cell = cells[position & mask];
+            size_t sequence = cell.sequence.load( std::memory_order_acquire );
+            ptrdiff_t diff = (ptrdiff_t)sequence - (ptrdiff_t)position;
+            if ( diff == 0 ) {
+                if ( enqueuePosition.compare_exchange_weak( position, position + 1, std::memory_order_relaxed ) ) {
+                    cell.value = value;
+                    cell.sequence.store( position + 1, std::memory_order_release );
+                    return true;
+                }
+            }
+            else if ( diff < 0 ) {
+                return false;
+            }
+            else {
+                position = enqueuePosition.load( std::memory_order_relaxed );
+            }
+        }
+    }
+
+    /// <returns>false when the buffer is empty</returns>
+    bool tryPop( T& value )
+    {
+        size_t position = dequeuePosition.load( std::memory_order_relaxed );
+        for ( ;; ) {
+            Cell& cell = cells[position & mask];
+            size_t sequence = cell.sequence.load( std::memory_order_acquire );
+            ptrdiff_t diff = (ptrdiff_t)sequence - (ptrdiff_t)(position + 1);
+            if ( diff == 0 ) {
+                if ( dequeuePosition.compare_exchange_weak( position, position + 1, std::memory_order_relaxed ) ) {
+                    value = cell.value;
+                    cell.sequence.store( position + mask + 1, std::memory_order_release );
+                    return true;
+                }
+            }
+            else if ( diff < 0 ) {
+                return false;
+            }
+            else {
+                position = dequeuePosition.load( std::memory_order_relaxed );
+            }
+        }
+    }
+
+    size_t capacity() const { return mask + 1; }
+
+    /// <summary>
+    /// Number of items; only a hint while other threads push or pop
+    /// </summary>
+    size_t sizeApprox() const
+    {
+        size_t push = enqueuePosition.load( std::memory_order_relaxed );
+        size_t pop = dequeuePosition.load( std::memory_order_relaxed );
+        return (push > pop) ? (push - pop) : 0;
+    }
+
+private:
+
+    RingBuffer( const RingBuffer& );
+    RingBuffer& operator=( const RingBuffer& );
+
+    struct Cell
+    {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    // Padding keeps the two positions on their own cache lines
+    static const size_t CACHE_LINE = 64;
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+    char padding0[CACHE_LINE];
+    std::atomic<size_t> enqueuePosition;
+    char padding1[CACHE_LINE - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> dequeuePosition;
+    char padding2[CACHE_LINE - sizeof(std::atomic<size_t>)];
+};
+
+}
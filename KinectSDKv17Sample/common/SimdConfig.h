@@ -0,0 +1,30 @@
+#pragma once
+
+// Instruction sets available at compile time
+//
+// KB_SSE2 : x86 / x64 (always on x64 and with /arch:SSE2)
+// KB_AVX2 : x86 / x64 built with /arch:AVX2 or -mavx2, on top of KB_SSE2
+// KB_NEON : ARM with NEON
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define KB_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if defined(KB_SSE2) && defined(__AVX2__)
+#define KB_AVX2 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define KB_NEON 1
+#include <arm_neon.h>
+#endif
+
+#if defined(_MSC_VER)
+#define KB_ALIGN(n) __declspec(align(n))
+#define KB_FORCEINLINE __forceinline
+#else
+#define KB_ALIGN(n) __attribute__((aligned(n)))
+#define KB_FORCEINLINE inline __attribute__((always_inline))
+#endif
@@ -0,0 +1,124 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+
+namespace kinectbook {
+
+ThreadPool::ThreadPool( unsigned int threadCount )
+    : stopping( false )
+{
+    if ( threadCount == 0 ) {
+        threadCount = std::max( 1u, std::thread::hardware_concurrency() );
+    }
+
+    for ( unsigned int i = 1; i < threadCount; ++i ) {
+        workers.push_back( std::thread( &ThreadPool::workerMain, this ) );
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock( mutex );
+        stopping = true;
+    }
+    jobAvailable.notify_all();
+
+    for ( size_t i = 0; i < workers.size(); ++i ) {
+        workers[i].join();
+    }
+}
+
+ThreadPool& ThreadPool::shared()
+{
+    static ThreadPool pool;
+    return pool;
+}
+
+void ThreadPool::parallelFor( int begin, int end, const RangeFunction& body, int grain )
+{
+    if ( end <= begin ) {
+        return;
+    }
+
+    // Around four chunks per thread keeps the threads busy when chunks differ in cost
+    int count = end - begin;
+    int chunkSize = std::max( std::max( grain, 1 ), count / (int)(threadCount() * 4) );
+    int chunkCount = (count + chunkSize - 1) / chunkSize;
+    if ( workers.empty() || chunkCount <= 1 ) {
+        body( begin, end );
+        return;
+    }
+
+    Job job;
+    job.body = &body;
+    job.begin = begin;
+    job.end = end;
+    job.chunkSize = chunkSize;
+    job.chunkCount = chunkCount;
+    job.nextChunk = 0;
+    job.doneChunks = 0;
+    job.activeWorkers = 0;
+
+    {
+        std::lock_guard<std::mutex> lock( mutex );
+        jobs.push_back( &job );
+    }
+    jobAvailable.notify_all();
+
+    runChunks( job );
+
+    // Wait until no worker touches the job any more; it lives on this stack frame
+    std::unique_lock<std::mutex> lock( mutex );
+    std::deque<Job*>::iterator it = std::find( jobs.begin(), jobs.end(), &job );
+    if ( it != jobs.end() ) {
+        jobs.erase( it );
+    }
+    while ( job.doneChunks.load() < job.chunkCount || job.activeWorkers != 0 ) {
+        jobFinished.wait( lock );
+    }
+}
+
+void ThreadPool::workerMain()
+{
+    std::unique_lock<std::mutex> lock( mutex );
+    while ( true ) {
+        while ( !stopping && jobs.empty() ) {
+            jobAvailable.wait( lock );
+        }
+        if ( stopping ) {
+            return;
+        }
+
+        Job* job = jobs.front();
+        if ( job->nextChunk.load() >= job->chunkCount ) {
+            jobs.pop_front();
+            continue;
+        }
+
+        ++job->activeWorkers;
+        lock.unlock();
+        runChunks( *job );
+        lock.lock();
+        --job->activeWorkers;
+        jobFinished.notify_all();
+    }
+}
+
+void ThreadPool::runChunks( Job& job )
+{
+    while ( true ) {
+        int chunk = job.nextChunk++;
+        if ( chunk >= job.chunkCount ) {
+            break;
+        }
+
+        int chunkBegin = job.begin + chunk * job.chunkSize;
+        int chunkEnd = std::min( job.end, chunkBegin + job.chunkSize );
+        (*job.body)( chunkBegin, chunkEnd );
+
+        ++job.doneChunks;
+    }
+}
+
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace kinectbook {
+
+/// <summary>
+/// Fixed set of worker threads that execute parallelFor() ranges
+/// </summary>
+/// <remarks>
+/// Several threads may call parallelFor() at the same time (e.g. pipeline
+/// stages); the caller always works on its own range too, so a nested call
+/// from inside a body cannot dead-lock.
+/// </remarks>
+class ThreadPool
+{
+public:
+
+    /// <summary>
+    /// Body of a parallelFor(), called with a half-open range [begin, end)
+    /// </summary>
+    typedef std::function<void ( int begin, int end )> RangeFunction;
+
+    /// <param name="threadCount">Number of threads including the caller, 0 = hardware concurrency</param>
+    explicit ThreadPool( unsigned int threadCount = 0 );
+    ~ThreadPool();
+
+    /// <summary>
+    /// Split [begin, end) into chunks of at least grain items and run them on all threads
+    /// </summary>
+    void parallelFor( int begin, int end, const RangeFunction& body, int grain = 1 );
+
+    /// <summary>
+    /// Number of threads taking part in a parallelFor(), including the caller
+    /// </summary>
+    unsigned int threadCount() const
+    {
+        return (unsigned int)workers.size() + 1;
+    }
+
+    /// <summary>
+    /// Pool shared by the samples
+    /// </summary>
+    static ThreadPool& shared();
+
+private:
+
+    struct Job
+    {
+        const RangeFunction* body;
+        int begin;
+        int end;
+        int chunkSize;
+        int chunkCount;
+        std::atomic<int> nextChunk;
+        std::atomic<int> doneChunks;
+        int activeWorkers;
+    };
+
+    ThreadPool( const ThreadPool& );
+    ThreadPool& operator = ( const ThreadPool& );
+
+    void workerMain();
+    void runChunks( Job& job );
+
+    std::vector<std::thread> workers;
+    std::deque<Job*> jobs;
+    std::mutex mutex;
+    std::condition_variable jobAvailable;
+    std::condition_variable jobFinished;
+    bool stopping;
+};
+
+}
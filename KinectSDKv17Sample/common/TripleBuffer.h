@@ -0,0 +1,81 @@
+#pragma once
+
+#include <atomic>
+
+namespace kinectbook {
+
+/// <summary>
+/// Three buffers between one producer and one consumer that never wait for each other
+/// </summary>
+/// <remarks>
+/// The producer writes into back() and publishes it; the consumer takes
+/// the newest published buffer with update() and reads front() until its
+/// next update(). The third buffer sits between the two, so publishing
+/// and taking are a single atomic exchange of indices: the producer always
+/// has a buffer nobody reads, the consumer keeps what it shows, and frames
+/// published faster than they are taken are overwritten, not queued.
+/// The buffers are allocated once and reused, so T should keep its
+/// capacity (cv::Mat::create, std::vector::resize).
+/// </remarks>
+template <class T>
+class TripleBuffer
+{
+public:
+
+    TripleBuffer()
+        : middle( 1 )
+        , backIndex( 0 )
+        , frontIndex( 2 )
+    {
+    }
+
+    /// <summary>
+    /// Buffer the producer writes; the consumer sees it after publish()
+    /// </summary>
+    T& back() { return buffers[backIndex]; }
+
+    /// <summary>
+    /// Hand back() to the consumer and take the free buffer to write next
+    /// </summary>
+    void publish()
+    {
+        unsigned int previous = middle.exchange( backIndex | FRESH, std::memory_order_acq_rel );
+        backIndex = previous & INDEX_MASK;
+    }
+
+    /// <summary>
+    /// Take the newest published buffer as front()
+    /// </summary>
+    /// <returns>false when nothing was published since the last update; front() is unchanged</returns>
+    bool update()
+    {
+        if ( (middle.load( std::memory_order_relaxed ) & FRESH) == 0 ) {
+            return false;
+        }
+
+        unsigned int previous = middle.exchange( frontIndex, std::memory_order_acq_rel );
+        frontIndex = previous & INDEX_MASK;
+        return true;
+    }
+
+    /// <summary>
+    /// Buffer the consumer reads; stays valid until its next update()
+    /// </summary>
+    const T& front() const { return buffers[frontIndex]; }
+
+private:
+
+    TripleBuffer( const TripleBuffer& );
+    TripleBuffer& operator=( const TripleBuffer& );
+
+    // Index of the middle buffer and whether the consumer has not taken it yet
+    static const unsigned int INDEX_MASK = 3;
+    static const unsigned int FRESH = 4;
+
+    T buffers[3];
+    std::atomic<unsigned int> middle;
+    unsigned int backIndex;         // producer only
+    unsigned int frontIndex;        // consumer only
+};
+
+}